@@ -33,3 +33,9 @@
 #cmakedefine HAVE_LIBRT 1
 
 #cmakedefine HAVE_EXECINFO 
+#cmakedefine HAVE_PREAD 1
+#cmakedefine HAVE_PWRITE 1
+#cmakedefine HAVE_PREADV 1
+#cmakedefine HAVE_PWRITEV 1
+#cmakedefine HAVE_MMAP 1
+#cmakedefine HAVE_LINUX_IO_URING_H 1
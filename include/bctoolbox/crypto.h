@@ -1169,6 +1169,107 @@ BCTBX_PUBLIC int32_t bctbx_aes_gcm_process_chunk(bctbx_aes_gcm_context_t *contex
  */
 BCTBX_PUBLIC int32_t bctbx_aes_gcm_finish(bctbx_aes_gcm_context_t *context, uint8_t *tag, size_t tagLength);
 
+typedef struct bctbx_aes_gcm_keyed_context_struct bctbx_aes_gcm_keyed_context_t;
+/**
+ * @Brief create an AES-GCM context holding a key schedule, used for several encryptions/decryptions with the same key
+ * A context must not be used by several threads at the same time.
+ *
+ * @param[in]	key			encryption key
+ * @param[in]	keyLength	key buffer length, in bytes, must be 16,24 or 32
+ *
+ * @return a pointer to the created context, to be freed using bctbx_aes_gcm_keyed_context_free(), NULL on error
+ */
+BCTBX_PUBLIC bctbx_aes_gcm_keyed_context_t *bctbx_aes_gcm_keyed_context_new(const uint8_t *key, size_t keyLength);
+
+/**
+ * @Brief free an AES-GCM keyed context, key material is wiped
+ *
+ * @param[in]	context		the context to free, may be NULL
+ */
+BCTBX_PUBLIC void bctbx_aes_gcm_keyed_context_free(bctbx_aes_gcm_keyed_context_t *context);
+
+/**
+ * @Brief AES-GCM encrypt and tag buffer using the key held by the context
+ * Parameters are the same as bctbx_aes_gcm_encrypt_and_tag ones
+ *
+ * @return 0 on success, crypto library error code otherwise
+ */
+BCTBX_PUBLIC int32_t bctbx_aes_gcm_keyed_encrypt_and_tag(bctbx_aes_gcm_keyed_context_t *context,
+                                                         const uint8_t *plainText,
+                                                         size_t plainTextLength,
+                                                         const uint8_t *authenticatedData,
+                                                         size_t authenticatedDataLength,
+                                                         const uint8_t *initializationVector,
+                                                         size_t initializationVectorLength,
+                                                         uint8_t *tag,
+                                                         size_t tagLength,
+                                                         uint8_t *output);
+
+/**
+ * @Brief AES-GCM decrypt and check the authentication tag using the key held by the context
+ * Parameters are the same as bctbx_aes_gcm_decrypt_and_auth ones
+ *
+ * @return 0 on succes, BCTBX_ERROR_AUTHENTICATION_FAILED if tag doesn't match or crypto library error code
+ */
+BCTBX_PUBLIC int32_t bctbx_aes_gcm_keyed_decrypt_and_auth(bctbx_aes_gcm_keyed_context_t *context,
+                                                          const uint8_t *cipherText,
+                                                          size_t cipherTextLength,
+                                                          const uint8_t *authenticatedData,
+                                                          size_t authenticatedDataLength,
+                                                          const uint8_t *initializationVector,
+                                                          size_t initializationVectorLength,
+                                                          const uint8_t *tag,
+                                                          size_t tagLength,
+                                                          uint8_t *output);
+
+/**
+ * @Brief ChaCha20-Poly1305 (RFC 8439) encrypt and tag buffer
+ * Key is 32 bytes, nonce 12 bytes and tag 16 bytes long
+ *
+ * @param[in]	key							Encryption key, 32 bytes
+ * @param[in]	plainText					buffer to be encrypted
+ * @param[in]	plainTextLength				Length in bytes of buffer to be encrypted
+ * @param[in]	authenticatedData			Buffer holding additional data to be used in tag computation
+ * @param[in]	authenticatedDataLength		Additional data length in bytes
+ * @param[in]	nonce						Buffer holding the nonce, 12 bytes
+ * @param[out]	tag							Buffer holding the generated tag, 16 bytes
+ * @param[out]	output						Buffer holding the output, shall be at least the length of plainText buffer
+ *
+ * @return 0 on success, crypto library error code otherwise
+ */
+BCTBX_PUBLIC int32_t bctbx_chacha20_poly1305_encrypt_and_tag(const uint8_t *key,
+                                                             const uint8_t *plainText,
+                                                             size_t plainTextLength,
+                                                             const uint8_t *authenticatedData,
+                                                             size_t authenticatedDataLength,
+                                                             const uint8_t *nonce,
+                                                             uint8_t *tag,
+                                                             uint8_t *output);
+
+/**
+ * @Brief ChaCha20-Poly1305 (RFC 8439) decrypt, compute authentication tag and compare it to the one provided
+ * Key is 32 bytes, nonce 12 bytes and tag 16 bytes long
+ *
+ * @param[in]	key							Encryption key, 32 bytes
+ * @param[in]	cipherText					Buffer to be decrypted
+ * @param[in]	cipherTextLength			Length in bytes of buffer to be decrypted
+ * @param[in]	authenticatedData			Buffer holding additional data to be used in auth tag computation
+ * @param[in]	authenticatedDataLength		Additional data length in bytes
+ * @param[in]	nonce						Buffer holding the nonce, 12 bytes
+ * @param[in]	tag							Buffer holding the authentication tag, 16 bytes
+ * @param[out]	output						Buffer holding the output, shall be at least the length of cipherText buffer
+ *
+ * @return 0 on succes, BCTBX_ERROR_AUTHENTICATION_FAILED if tag doesn't match or crypto library error code
+ */
+BCTBX_PUBLIC int32_t bctbx_chacha20_poly1305_decrypt_and_auth(const uint8_t *key,
+                                                              const uint8_t *cipherText,
+                                                              size_t cipherTextLength,
+                                                              const uint8_t *authenticatedData,
+                                                              size_t authenticatedDataLength,
+                                                              const uint8_t *nonce,
+                                                              const uint8_t *tag,
+                                                              uint8_t *output);
+
 /**
  * @brief Wrapper for AES-128 in CFB128 mode encryption
  * Both key and IV must be 16 bytes long
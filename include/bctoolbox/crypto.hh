@@ -226,6 +226,15 @@ std::vector<uint8_t> HKDF<SHA256>(const std::vector<uint8_t> &salt,
                                   const std::string &info,
                                   size_t outputSize);
 template <>
+void HKDF<SHA256>(const uint8_t *salt,
+                  const size_t saltSize,
+                  const uint8_t *ikm,
+                  const size_t ikmSize,
+                  const char *info,
+                  const size_t infoSize,
+                  uint8_t *okm,
+                  size_t okmSize);
+template <>
 std::vector<uint8_t> HKDF<SHA384>(const std::vector<uint8_t> &salt,
                                   const std::vector<uint8_t> &ikm,
                                   const std::vector<uint8_t> &info,
@@ -271,6 +280,24 @@ struct AES256GCM128 {
 	};
 };
 
+/**
+ * @brief ChaCha20-Poly1305 buffers size definition
+ */
+struct CHACHA20POLY1305 {
+	/// key size is 32 bytes
+	static constexpr size_t keySize(void) {
+		return 32;
+	};
+	/// tag size is 16 bytes
+	static constexpr size_t tagSize(void) {
+		return 16;
+	};
+	/// nonce size is 12 bytes
+	static constexpr size_t nonceSize(void) {
+		return 12;
+	};
+};
+
 /**
  * @brief Encrypt and tag using scheme given as template parameter
  *
@@ -324,6 +351,22 @@ bool AEADDecrypt<AES256GCM128>(const std::vector<uint8_t> &key,
                                const std::vector<uint8_t> &tag,
                                std::vector<uint8_t> &plain);
 
+/* declare AEAD template specialisations : ChaCha20-Poly1305 */
+template <>
+std::vector<uint8_t> AEADEncrypt<CHACHA20POLY1305>(const std::vector<uint8_t> &key,
+                                                   const std::vector<uint8_t> &IV,
+                                                   const std::vector<uint8_t> &plain,
+                                                   const std::vector<uint8_t> &AD,
+                                                   std::vector<uint8_t> &tag);
+
+template <>
+bool AEADDecrypt<CHACHA20POLY1305>(const std::vector<uint8_t> &key,
+                                   const std::vector<uint8_t> &IV,
+                                   const std::vector<uint8_t> &cipher,
+                                   const std::vector<uint8_t> &AD,
+                                   const std::vector<uint8_t> &tag,
+                                   std::vector<uint8_t> &plain);
+
 /************************** AES Key Wrap Algorithm ***************************/
 enum class AesId { AES128, AES192, AES256 };
 
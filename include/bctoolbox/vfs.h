@@ -64,6 +64,15 @@ extern "C" {
  */
 typedef struct bctbx_io_methods_t bctbx_io_methods_t;
 
+/**
+ * One buffer of a vectored read or write, as the POSIX struct iovec.
+ */
+typedef struct bctbx_vfs_iovec_t bctbx_vfs_iovec_t;
+struct bctbx_vfs_iovec_t {
+	void *base; /* Start of the buffer */
+	size_t len; /* Size of the buffer in bytes */
+};
+
 /**
  * VFS file handle.
  */
@@ -97,6 +106,10 @@ struct bctbx_io_methods_t {
 	int (*pFuncSync)(bctbx_vfs_file_t *pFile);
 	int (*pFuncGetLineFromFd)(bctbx_vfs_file_t *pFile, char *s, int count);
 	bool_t (*pFuncIsEncrypted)(bctbx_vfs_file_t *pFile);
+	/* optional vectored read and write: when NULL, bctbx_file_readv and bctbx_file_writev call pFuncRead and
+	 * pFuncWrite once per buffer */
+	ssize_t (*pFuncReadv)(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset);
+	ssize_t (*pFuncWritev)(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset);
 };
 
 /**
@@ -116,6 +129,11 @@ struct bctbx_vfs_t {
  * @param  count  Number of bytes to read.
  * @param  offset Where to start reading in the file (in bytes).
  * @return        Number of bytes read on success, BCTBX_VFS_ERROR otherwise.
+ *
+ * The standard VFS reads and writes at explicit offsets without using the file offset: bctbx_file_read and
+ * bctbx_file_write can be called concurrently on the same handle as long as no bctbx_file_fprintf output is pending.
+ * The functions using the file offset (bctbx_file_read2, bctbx_file_write2, bctbx_file_fprintf,
+ * bctbx_file_get_nxtline and bctbx_file_seek) are not thread safe, nor is the encrypted VFS.
  */
 BCTBX_PUBLIC ssize_t bctbx_file_read(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t offset);
 
@@ -130,6 +148,18 @@ BCTBX_PUBLIC ssize_t bctbx_file_read(bctbx_vfs_file_t *pFile, void *buf, size_t
  */
 BCTBX_PUBLIC ssize_t bctbx_file_read2(bctbx_vfs_file_t *pFile, void *buf, size_t count);
 
+/**
+ * Reads from the open file given by pFile, starting at offset, into several buffers: the first one is filled, then the
+ * second one and so on. Uses the VFS pFuncReadv when it has one, a single system call with the standard VFS.
+ * @param  pFile  bctbx_vfs_file_t File handle pointer.
+ * @param  iov    Buffers holding the read bytes.
+ * @param  iovcnt Number of buffers.
+ * @param  offset Where to start reading in the file (in bytes).
+ * @return        Number of bytes read on success, less than the buffers total size at end of file,
+ *                BCTBX_VFS_ERROR otherwise.
+ */
+BCTBX_PUBLIC ssize_t bctbx_file_readv(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset);
+
 /**
  * Close the file from its descriptor pointed by thw bctbx_vfs_file_t handle.
  * @param  pFile File handle pointer.
@@ -181,9 +211,22 @@ BCTBX_PUBLIC int bctbx_file_truncate(bctbx_vfs_file_t *pFile, int64_t size);
  * @param  count  	Number of bytes to write to the file.
  * @param  offset 	Position in the file where to start writing.
  * @return        	Number of bytes written on success, BCTBX_VFS_ERROR if an error occurred.
+ *
+ * See bctbx_file_read about concurrent calls.
  */
 BCTBX_PUBLIC ssize_t bctbx_file_write(bctbx_vfs_file_t *pFile, const void *buf, size_t count, off_t offset);
 
+/**
+ * Writes the content of several buffers, one after the other, to the file associated with pFile at the position
+ * offset. Uses the VFS pFuncWritev when it has one, a single system call with the standard VFS.
+ * @param  pFile 	File handle pointer.
+ * @param  iov    	Buffers holding the values to write.
+ * @param  iovcnt 	Number of buffers.
+ * @param  offset 	Position in the file where to start writing.
+ * @return        	Number of bytes written on success, BCTBX_VFS_ERROR if an error occurred.
+ */
+BCTBX_PUBLIC ssize_t bctbx_file_writev(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset);
+
 /**
  * Write count bytes contained in buf to a file associated with pFile at the position starting at its
  * offset. Calls pFuncWrite (set to bc_Write by default).
@@ -259,6 +302,12 @@ BCTBX_PUBLIC bctbx_vfs_t *bctbx_vfs_get_default(void);
  */
 BCTBX_PUBLIC bctbx_vfs_t *bctbx_vfs_get_standard(void);
 
+/**
+ * Return pointer to the memory mapped VFS implementation, see vfs_mmap.h.
+ * @return  pointer to bcMmapVfs
+ */
+BCTBX_PUBLIC bctbx_vfs_t *bctbx_vfs_get_mmap(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_ASYNC_H
+#define BCTBX_VFS_ASYNC_H
+
+#include "bctoolbox/port.h"
+#include "bctoolbox/vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Queue of asynchronous reads, writes and syncs on VFS files.
+ * On Linux, the operations on files of the standard VFS are submitted to an io_uring and completed by a thread of the
+ * queue. The operations on files of other VFS, and all of them when io_uring is not available, are run by a pool of
+ * threads of the queue calling the VFS methods. Only the standard and mmap VFS support concurrent calls on one file:
+ * the operations on a file of any other VFS, the encrypted one for instance, are run one at a time.
+ * Operations submitted to a queue are not ordered: a sync only covers the writes already completed when it is
+ * submitted. Files used asynchronously must not have pending bctbx_file_fprintf output.
+ */
+typedef struct bctbx_vfs_async_queue_t bctbx_vfs_async_queue_t;
+
+/**
+ * Called when an asynchronous operation is completed, from a thread of the queue. It may submit operations to the
+ * queue, they are then accepted even beyond its depth, but must not wait for it nor destroy it.
+ * @param  userData  The pointer given when submitting the operation.
+ * @param  result    Number of bytes read or written, BCTBX_VFS_OK for a sync, BCTBX_VFS_ERROR if an error occurred.
+ */
+typedef void (*bctbx_vfs_async_callback_t)(void *userData, ssize_t result);
+
+/**
+ * Create a queue of asynchronous operations.
+ * @param  depth        Maximum number of operations in progress, submitting more blocks until one is completed,
+ *                      except from a callback. 0 for a default depth.
+ * @param  threadCount  Number of threads running the operations which cannot use io_uring, started on the first of
+ *                      them. 0 for a default count.
+ * @return the queue, to destroy with bctbx_vfs_async_queue_destroy.
+ */
+BCTBX_PUBLIC bctbx_vfs_async_queue_t *bctbx_vfs_async_queue_new(unsigned int depth, unsigned int threadCount);
+
+/**
+ * Wait for all the submitted operations to be completed, then destroy the queue.
+ * @param  queue  The queue.
+ */
+BCTBX_PUBLIC void bctbx_vfs_async_queue_destroy(bctbx_vfs_async_queue_t *queue);
+
+/**
+ * Wait for all the operations submitted so far, and the operations submitted by their callbacks, to be completed.
+ * @param  queue  The queue.
+ */
+BCTBX_PUBLIC void bctbx_vfs_async_queue_wait(bctbx_vfs_async_queue_t *queue);
+
+/**
+ * @param  queue  The queue.
+ * @return TRUE if the operations on files of the standard VFS are submitted to an io_uring.
+ */
+BCTBX_PUBLIC bool_t bctbx_vfs_async_queue_uses_io_uring(const bctbx_vfs_async_queue_t *queue);
+
+/**
+ * Submit a read of count bytes at offset, as bctbx_file_read.
+ * The buffer and the file must remain valid until the callback is called.
+ * @param  queue     The queue.
+ * @param  pFile     bctbx_vfs_file_t File handle pointer.
+ * @param  buf       Buffer holding the read bytes.
+ * @param  count     Number of bytes to read.
+ * @param  offset    Where to start reading in the file (in bytes).
+ * @param  callback  Called with the number of bytes read, can be NULL.
+ * @param  userData  Given to the callback.
+ * @return BCTBX_VFS_OK if the read was submitted, BCTBX_VFS_ERROR otherwise: the callback will not be called.
+ */
+BCTBX_PUBLIC int bctbx_file_read_async(bctbx_vfs_async_queue_t *queue,
+                                       bctbx_vfs_file_t *pFile,
+                                       void *buf,
+                                       size_t count,
+                                       off_t offset,
+                                       bctbx_vfs_async_callback_t callback,
+                                       void *userData);
+
+/**
+ * Submit a write of count bytes at offset, as bctbx_file_write.
+ * The buffer and the file must remain valid until the callback is called.
+ * @param  queue     The queue.
+ * @param  pFile     bctbx_vfs_file_t File handle pointer.
+ * @param  buf       Buffer holding the values to write.
+ * @param  count     Number of bytes to write.
+ * @param  offset    Position in the file where to start writing.
+ * @param  callback  Called with the number of bytes written, can be NULL.
+ * @param  userData  Given to the callback.
+ * @return BCTBX_VFS_OK if the write was submitted, BCTBX_VFS_ERROR otherwise: the callback will not be called.
+ */
+BCTBX_PUBLIC int bctbx_file_write_async(bctbx_vfs_async_queue_t *queue,
+                                        bctbx_vfs_file_t *pFile,
+                                        const void *buf,
+                                        size_t count,
+                                        off_t offset,
+                                        bctbx_vfs_async_callback_t callback,
+                                        void *userData);
+
+/**
+ * Submit a sync of the file, as bctbx_file_sync.
+ * @param  queue     The queue.
+ * @param  pFile     bctbx_vfs_file_t File handle pointer, must remain valid until the callback is called.
+ * @param  callback  Called with BCTBX_VFS_OK on success, can be NULL.
+ * @param  userData  Given to the callback.
+ * @return BCTBX_VFS_OK if the sync was submitted, BCTBX_VFS_ERROR otherwise: the callback will not be called.
+ */
+BCTBX_PUBLIC int bctbx_file_sync_async(bctbx_vfs_async_queue_t *queue,
+                                       bctbx_vfs_file_t *pFile,
+                                       bctbx_vfs_async_callback_t callback,
+                                       void *userData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BCTBX_VFS_ASYNC_H */
@@ -23,8 +23,11 @@
 #include "bctoolbox/exception.hh"
 #include "bctoolbox/port.h"
 #include "bctoolbox/vfs.h"
+#include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
+#include <utility>
 #include <vector>
 
 namespace bctoolbox {
@@ -66,7 +69,11 @@ enum class EncryptionSuite : uint16_t {
 	unset = 0, /**< no encryption suite selected */
 	dummy = 1, /**< a test suite, do not use other than for test */
 	aes256gcm128_sha256 =
-	    2,         /**< This module encrypts blocks with AES256GCM and authenticate header using HMAC-sha256 */
+	    2, /**< This module encrypts blocks with AES256GCM and authenticate header using HMAC-sha256 */
+	chacha20poly1305_sha256 =
+	    3, /**< This module encrypts blocks with ChaCha20-Poly1305 and authenticate header using HMAC-sha256 */
+	aes256gcm128_filekey_sha256 =
+	    4, /**< This module encrypts blocks with AES256GCM using a single file key, random IV, chunk index in AD */
 	plain = 0xFFFF /**< no encryption activated, direct use of standard file system API */
 };
 
@@ -77,6 +84,23 @@ enum class EncryptionSuite : uint16_t {
  */
 const std::string encryptionSuiteString(const EncryptionSuite suite) noexcept;
 
+/**
+ * Counters of the work done by the encrypted VFS, for one file or for all of them, see VfsEncryption::statsGet() and
+ * VfsEncryption::globalStatsGet()
+ */
+struct VfsEncryptionStats {
+	uint64_t chunksEncrypted = 0;   /**< chunks encrypted by the encryption module */
+	uint64_t chunksDecrypted = 0;   /**< chunks decrypted by the encryption module */
+	uint64_t plainBytesRead = 0;    /**< plain data requested by read calls */
+	uint64_t plainBytesWritten = 0; /**< plain data given to write calls */
+	uint64_t rawBytesRead = 0;      /**< data read from the underlying files, integrity tree file included */
+	uint64_t rawBytesWritten = 0;   /**< data written to the underlying files, integrity tree file included */
+	uint64_t headerWrites = 0;      /**< file header rewrites */
+	uint64_t keyDerivations = 0;    /**< HKDF invocations, keys found in a cache are not counted */
+	uint64_t integrityFailures = 0; /**< chunks or file headers failing authentication, integrity tree mismatches */
+	uint64_t moduleTime = 0;        /**< time spent encrypting and decrypting chunks, in nanoseconds */
+};
+
 /* complete declaration follows, we need this one to define the callback type */
 class VfsEncryption;
 
@@ -86,9 +110,34 @@ class VfsEncryption;
  */
 using EncryptedVfsOpenCb = std::function<void(VfsEncryption &settings)>;
 
+/**
+ * Define a function prototype called to report the progress of a plain file migration to an encrypted one
+ * @param[in]	filename	the migrated file
+ * @param[in]	migrated	number of plain bytes already encrypted
+ * @param[in]	total		size of the plain file
+ */
+using EncryptedVfsMigrationProgressCb =
+    std::function<void(const std::string &filename, uint64_t migrated, uint64_t total)>;
+
 // forward declare this type, store all the encryption data and functions
 class VfsEncryptionModule;
 
+// forward declare the background migration of a plain file
+class VfsMigrationTask;
+
+// forward declare the read ahead of a file accessed sequentially
+class VfsReadAhead;
+
+// forward declare the Merkle tree over the chunks of a file
+class VfsIntegrityTree;
+
+// forward declare the counters behind VfsEncryptionStats
+class VfsCounters;
+
+// forward declare the cache used to store decrypted chunks
+template <typename Key, typename Value>
+class LruCache;
+
 /** Store in the bctbx_vfs_file_t userData field an object specific to encryption */
 class VfsEncryption {
 	/* Class properties and method */
@@ -102,6 +151,62 @@ public:
 	static void openCallbackSet(const EncryptedVfsOpenCb &cb) noexcept;
 	static EncryptedVfsOpenCb openCallbackGet() noexcept;
 
+	/**
+	 * Set the number of worker threads used to encrypt and decrypt chunks of large operations: read, write, migration
+	 * of a plain file and full file integrity check. The threads are shared by all files.
+	 * Default is 0: everything is done by the calling thread.
+	 * Set it at startup or when no file is being accessed.
+	 */
+	static void workerThreadsSet(const size_t count);
+	static size_t workerThreadsGet();
+	/**
+	 * Set the minimum number of chunks an operation must process to use the worker threads. Default is 16.
+	 */
+	static void parallelChunkThresholdSet(const size_t threshold);
+	static size_t parallelChunkThresholdGet();
+	/**
+	 * Set the maximum number of file header keys kept after they were derived at file opening, so opening again a
+	 * recently opened file skips their derivation. The cache is shared by all files.
+	 * Default is 0: disabled, as the cache keeps a copy of the master key used to derive each key it holds.
+	 */
+	static void derivedKeyCacheSizeSet(const size_t size);
+	static size_t derivedKeyCacheSizeGet();
+	/**
+	 * @return the counters of all the files opened since the start or the last reset, closed ones included
+	 */
+	static VfsEncryptionStats globalStatsGet() noexcept;
+	static void globalStatsReset() noexcept;
+
+	/**
+	 * Wait for the background migration of a plain file to be completed.
+	 * The migrated file replaces the plain one at its next opening, once no other handle on it is open.
+	 * @param[in]	filename	the file name as given to the open function
+	 * @return true if the migration is completed, false if there is no background migration running for this file or
+	 * it failed
+	 */
+	static bool migrationWait(const std::string &filename);
+	/**
+	 * Stop all the background migrations, to be called before the application exits.
+	 * The migrations are resumed where they stopped at next opening of the files.
+	 */
+	static void migrationStopAll();
+
+	/**
+	 * Remove an encrypted file, and its integrity tree file if any, see integrityTreeSet(). The file must be closed.
+	 * @param[in]	filename	the file name as given to the open function
+	 * @return 0 on success, -1 if the file cannot be removed, as std::remove
+	 */
+	static int fileRemove(const std::string &filename);
+	/**
+	 * Rename an encrypted file, then its integrity tree file if any, see integrityTreeSet(). The file must be closed.
+	 * An integrity tree file at the destination is removed: it belonged to the replaced file. If the tree cannot be
+	 * renamed, the renamed file opens with an invalid tree which must be rebuilt.
+	 * @param[in]	from	the current file name
+	 * @param[in]	to		the new file name, replaced if it exists
+	 * @return 0 on success, -1 if the file cannot be renamed, as std::rename
+	 */
+	static int fileRename(const std::string &from, const std::string &to);
+
 	/* Object properties and methods */
 private:
 	uint16_t mVersionNumber; /**< version number of the encryption vfs */
@@ -123,9 +228,143 @@ private:
 	/** flags use to communicate during differents functions involved at file opening **/
 	bool mEncryptExistingPlainFile; /**< when opening a plain file, if the callback set an encryption suite and key
 	                                   material : migrate the file */
-	bool mIntegrityFullCheck;       /**< if the file size given in the header metadata is incorrect, full check the file
-	                                   integrity and revrite header */
+	bool mIntegrityFullCheck;       /**< if the file size given in the header metadata is incorrect, check the file
+	                                   integrity, or only the chunks in the size journal, and revrite header */
 	int mAccessMode;                /**< the flags used to open the file, filtered on the access mode */
+	size_t mChunkKeyCacheSize;      /**< maximum number of derived chunk keys kept in memory by the encryption module */
+	std::unique_ptr<LruCache<uint32_t, std::vector<uint8_t>>>
+	    mPlainChunkCache; /**< decrypted chunks cache, indexed by chunk index, cost is the chunk size in bytes */
+	size_t mHeaderUpdateInterval; /**< number of file size updates before the header is actually written, 0: only on
+	                                 sync or close */
+	size_t mPendingHeaderUpdates; /**< number of file size updates not yet written in the file header */
+	std::map<uint32_t, std::vector<uint8_t>>
+	    mDirtyChunks;            /**< modified plain chunks not written yet, indexed by chunk index */
+	size_t mDirtyBytes;          /**< total size of the plain chunks in mDirtyChunks */
+	size_t mWriteBackBufferSize; /**< maximum size of the dirty chunks kept in memory, 0: write back disabled */
+	bool mSparseExtension;       /**< file extensions leave holes, on files with a header extension */
+	std::vector<std::pair<uint32_t, uint32_t>>
+	    mHoleRanges;             /**< chunks never written since a sparse extension, recorded in the header: first and
+	                                last chunk index of each range, sorted. Raw chunks of zeros in them read as zeros */
+	bool mSizeJournal;           /**< the header holds a size journal, or one is added at file creation */
+	bool mJournalWidened;        /**< the size journal was written with a range wider than the one following the
+	                                last header update */
+	uint32_t mJournalFirstChunk; /**< chunks possibly written since the file size was written in the header, the range
+	                                is empty if first > last */
+	uint32_t mJournalLastChunk;
+	uint64_t mHeaderFileSize; /**< the file size written in the header */
+	bool mIntegrityTree;      /**< the header holds an integrity tree root, or one is added at file creation */
+	std::vector<uint8_t> mIntegrityTreeRecord; /**< the integrity tree record read from the header, empty if none */
+	std::unique_ptr<VfsIntegrityTree> mTree;   /**< the integrity tree of this file, nullptr if it has none */
+	std::shared_ptr<VfsEncryptionModule>
+	    mRekeyModule; /**< encrypts the chunks already re-keyed, nullptr if the file is not being re-keyed */
+	std::vector<uint8_t> mRekeyModuleHeader; /**< the module file header of mRekeyModule, empty if not re-keying */
+	uint32_t mRekeyNextChunk;                /**< chunks with a lower index are encrypted by mRekeyModule */
+	uint32_t mRekeyPendingEnd; /**< chunks in [mRekeyNextChunk, mRekeyPendingEnd[ may be encrypted by either module:
+	                              a re-keying step was interrupted */
+	size_t mRekeyRate;         /**< maximum number of raw bytes re-encrypted per second, 0: unlimited */
+	std::chrono::steady_clock::time_point mRekeyNextStep; /**< earliest start of the next re-keying step */
+	std::vector<uint8_t> mLineChunk; /**< the plain chunk where getLine stopped, empty if there is none */
+	uint64_t mLineChunkIndex;        /**< index of mLineChunk */
+	std::unique_ptr<VfsReadAhead> mReadAhead; /**< chunks following a sequential read, decrypted in background */
+	std::shared_ptr<VfsCounters> mCounters;   /**< counters of this file, shared with its encryption modules */
+	friend class VfsReadAhead;
+	/** a chunk to encrypt or decrypt, possibly on a worker thread */
+	struct ChunkJob {
+		uint32_t chunkIndex;
+		uint8_t *rawChunk;
+		size_t rawChunkSize;    /**< size of the existing raw chunk, 0 when encrypting a new chunk */
+		const uint8_t *plainIn; /**< plain data to encrypt */
+		uint8_t *plainOut;      /**< where to decrypt, nullptr when encrypting */
+		size_t plainSize;
+	};
+	mutable std::vector<ChunkJob> mChunkJobs; /**< chunks collected by the current operation */
+	/**
+	 * Process all the chunks jobs collected in mChunkJobs, contiguous ones by batch, on worker threads if there are
+	 * enough of them
+	 */
+	void runChunkJobs() const;
+
+	/**
+	 * Read from or write to the underlying file, as bctbx_file_read, bctbx_file_write and bctbx_file_writev, and
+	 * count the raw bytes
+	 * @param[in]	fp	the file to write to, nullptr for pFileStd
+	 */
+	ssize_t rawRead(void *buffer, size_t size, uint64_t offset) const;
+	ssize_t rawWrite(const void *buffer, size_t size, uint64_t offset, bctbx_vfs_file_t *fp = nullptr) const;
+	ssize_t rawWritev(const bctbx_vfs_iovec_t *iov, int iovcnt, uint64_t offset, bctbx_vfs_file_t *fp = nullptr) const;
+
+	/* buffers are kept to avoid reallocation on each access */
+	mutable std::vector<uint8_t> mRawBuffer;        /**< raw data read from or written to disk */
+	mutable std::vector<uint8_t> mPlainChunkBuffer; /**< a chunk size buffer used on partially accessed chunks */
+
+	/* plain file migration */
+	EncryptedVfsMigrationProgressCb mMigrationProgressCb; /**< report the migration progress, may be nullptr */
+	bool mMigrationInBackground;                          /**< migrate the plain file without blocking the opening */
+	std::vector<uint8_t> mSecretMaterial; /**< a copy of the secret material, kept only for a background migration */
+	std::shared_ptr<VfsMigrationTask>
+	    mMigrationTask; /**< the background migration of this plain file, nullptr if there is none */
+	friend class VfsMigrationTask;
+
+	/**
+	 * Build the encrypted image of a plain file migrated in background, see VfsMigrationTask.
+	 * No open callback is called, the encryption settings are given by the caller.
+	 */
+	VfsEncryption(bctbx_vfs_file_t *stdFp,
+	              const std::string &filename,
+	              const std::shared_ptr<VfsEncryptionModule> &module,
+	              size_t chunkSize);
+
+	/**
+	 * Encrypt plain data into this file, from the given chunk until the end of the plain data.
+	 * Reading, encrypting and writing are overlapped: while a batch of chunks is encrypted, the next one is read and
+	 * the previous one is written.
+	 *
+	 * @param[in]	firstChunk	index of the first chunk to encrypt
+	 * @param[in]	readPlain	read plain data (buffer, size, offset), return the size read - less than asked only at
+	 * 							the end of the plain data - or a negative value on error
+	 * @param[in]	writeRaw	write a batch of encrypted chunks (buffer, size, index of the first chunk), return
+	 * 							false to stop the migration
+	 * @param[in]	progress	called after each batch written with the size of plain data migrated so far, may
+	 * 							be nullptr
+	 * @return true when the end of the plain data was reached, false if writeRaw stopped the migration
+	 *
+	 * @throw a EvfsException if something goes wrong
+	 */
+	bool migrateChunks(uint32_t firstChunk,
+	                   const std::function<ssize_t(uint8_t *, size_t, uint64_t)> &readPlain,
+	                   const std::function<bool(const uint8_t *, size_t, uint32_t)> &writeRaw,
+	                   const std::function<void(uint64_t)> &progress);
+
+	/**
+	 * Parse the header, run the open callback, migrate and check the file at opening
+	 * @throw a EvfsException if something goes wrong
+	 */
+	void openSetup(int openFlags);
+
+	/**
+	 * Migrate the plain file at opening: encrypt it in a temporary file which then replaces it
+	 */
+	void migrate(int openFlags);
+
+	/**
+	 * Start or resume the background migration of the plain file, or commit it when completed
+	 * @return true if the migrated file replaced the plain one, false if the file is still plain
+	 */
+	bool migrateInBackground(int openFlags);
+
+	/**
+	 * Replace the plain file by the encrypted temporary one and reopen it
+	 * @throw a EvfsException if the file cannot be replaced or reopened, pFileStd is then null
+	 */
+	void migrationReplace(const std::string &tmpFilename, int openFlags);
+
+	/**
+	 * On the encrypted image of a migrated plain file, check what was already migrated by a previous background
+	 * migration. If the file holds nothing valid, restart it: it then holds only the header.
+	 * @param[in]	secretMaterial	the secret material to use with the encryption module found in the file header
+	 * @return the index of the chunk where to resume the migration
+	 */
+	uint32_t migrationResume(const std::vector<uint8_t> &secretMaterial);
 
 	/**
 	 * Parse the header of an encrypted file, check everything seems correct
@@ -142,10 +381,176 @@ private:
 	 * @throw a EvfsException if something goes wrong
 	 **/
 	void writeHeader(bctbx_vfs_file_t *fp = nullptr);
+	/**
+	 * Write the file header holding the given file size, without resetting the size journal
+	 */
+	void writeHeader(bctbx_vfs_file_t *fp, uint64_t fileSize);
+	/**
+	 * Parse the records of the header extension
+	 */
+	void parseHeaderExtension(const uint8_t *extension, size_t size);
+	/**
+	 * @return the header extension holding the records, padded to the header extension size
+	 */
+	std::vector<uint8_t> headerExtensionBuild() const;
+	/**
+	 * Reserve the header extension of a file created or migrated if any record needs it
+	 */
+	void headerExtensionReserve() noexcept;
+
+	/**
+	 * @return true if the size journal is enabled and the header holds it
+	 */
+	bool sizeJournalActive() const noexcept;
+	/**
+	 * Called before writing chunks: if they are not in the size journal, widen it and write the header
+	 */
+	void journalChunks(uint32_t firstChunk, uint32_t lastChunk);
+	/**
+	 * Check only the chunks of the size journal, used at opening when the file size in the header is wrong
+	 * @return false if the size journal cannot be used: the whole file must be checked
+	 *
+	 * @throw a EvfsException if a chunk is corrupted or missing
+	 */
+	bool journaledChunksCheck();
+
+	/**
+	 * Open the integrity tree at file opening, build it if the header holds none
+	 * @return true if the tree was built or updated: the header must be written
+	 *
+	 * @throw a EvfsException if a chunk of the size journal fails its integrity check
+	 */
+	bool integrityTreeOpen();
+	/**
+	 * Update the integrity tree leaves of the chunks in the size journal if they do not match, once the chunks are
+	 * checked
+	 * @return true if the tree was updated, the header must be written
+	 *
+	 * @throw a EvfsException if one of these chunks fails its integrity check
+	 */
+	bool integrityTreeJournalRefresh();
+	/**
+	 * Replace the integrity tree by one built from the chunks in the file
+	 */
+	void integrityTreeBuild();
+	/**
+	 * @return the integrity tree leaves of the chunks in the file with index in [firstChunk, lastChunk]
+	 */
+	std::vector<uint8_t> integrityTreeLeaves(uint32_t firstChunk, uint32_t lastChunk);
+	/**
+	 * Update the integrity tree after chunks were written or removed
+	 * @param[in]	firstChunk	index of the first chunk
+	 * @param[in]	chunkCount	number of chunks
+	 * @param[in]	rawChunks	the chunks as written, one every raw chunk size bytes, nullptr for removed chunks
+	 */
+	void integrityTreeUpdate(uint32_t firstChunk, size_t chunkCount, const uint8_t *rawChunks);
+
+	/**
+	 * @return the module encrypting the given chunk: the re-keying one if the chunk was already re-keyed
+	 */
+	VfsEncryptionModule &chunkModule(uint32_t chunkIndex) const noexcept;
+	/**
+	 * @return true if the given chunk belongs to an interrupted re-keying step left as is by the read only opening of
+	 * the file: it may be encrypted with either secret material
+	 */
+	bool rekeyPending(uint32_t chunkIndex) const noexcept;
+	/**
+	 * Decrypt a chunk of an interrupted re-keying step with the current module or, if it fails, the re-keying one
+	 */
+	void
+	rekeyPendingDecrypt(uint32_t chunkIndex, const uint8_t *rawChunk, size_t rawChunkSize, uint8_t *plainChunk) const;
+	/**
+	 * Called at opening of a file being re-keyed: complete an interrupted step
+	 */
+	void rekeyResume();
+	/**
+	 * The re-keying module file header authenticates only the part of the file header which does not change until the
+	 * re-keying completes, so it checks the new secret material each time the re-keying resumes.
+	 * @return the file header of the given re-keying module
+	 */
+	std::vector<uint8_t> rekeyModuleHeaderGet(const VfsEncryptionModule &module);
+	/**
+	 * @return true if the given re-keying module, keyed with the new secret material, authenticates its file header
+	 */
+	bool rekeyModuleHeaderCheck(VfsEncryptionModule &module);
+
+	/**
+	 * Check the integrity of the chunks in the file, all of them by default
+	 * @param[in]	firstChunk	index of the first chunk to check
+	 * @param[in]	lastChunk	index of the last chunk to check, the ones after the end of file are ignored
+	 *
+	 * @throw a EvfsException if a chunk is corrupted or missing
+	 */
+	void checkChunksIntegrity(uint32_t firstChunk = 0, uint32_t lastChunk = UINT32_MAX);
+
+	/**
+	 * Called when the file size is modified: write the header or postpone it according to the header update interval
+	 */
+	void headerUpdate();
+
+	/**
+	 * Remove from the plain chunk cache the chunks with index in [firstChunk, lastChunk]
+	 */
+	void plainChunkCacheErase(uint32_t firstChunk, uint32_t lastChunk) const;
+
+	/**
+	 * Extend the file with zeros up to the given size, by batches of chunks or leaving holes if sparse extension is
+	 * enabled
+	 */
+	void extend(uint64_t newSize);
+	/**
+	 * @return true if the given raw chunk is a hole: the file header records it in a hole range and it holds only zeros
+	 */
+	bool isHole(uint32_t chunkIndex, const uint8_t *rawChunk, size_t rawChunkSize) const noexcept;
+	/**
+	 * @return the number of hole ranges the header extension can hold, leaving room for all the other records
+	 */
+	size_t holeRangesMax() const noexcept;
+	/**
+	 * Remove the written chunks from the hole ranges. A range split in two when there is no room left for another
+	 * one gets its smaller side filled
+	 * @return true if the hole ranges were modified, the header must be updated
+	 */
+	bool holesWritten(uint32_t firstChunk, uint32_t lastChunk);
+	/**
+	 * Encrypt and write the zeros of the hole chunks in [firstChunk, lastChunk], by batches
+	 */
+	void holesFill(uint32_t firstChunk, uint32_t lastChunk);
+	/**
+	 * Decrypt a chunk with the encryption module, a hole gives zeros
+	 */
+	void chunkDecrypt(uint32_t chunkIndex, const uint8_t *rawChunk, size_t rawChunkSize, uint8_t *plainChunk) const;
+
+	/**
+	 * Make the given chunk the current line chunk, used by getLine
+	 * @return false if the chunk is after the end of file
+	 */
+	bool lineChunkLoad(uint64_t chunkIndex);
+	/**
+	 * Wipe the current line chunk, called when the file is modified
+	 */
+	void lineChunkDrop() noexcept;
+
+	/**
+	 * Write in the write back buffer: the modified chunks are kept in memory as dirty chunks, they are encrypted and
+	 * written when the buffer is flushed
+	 */
+	void writeBack(const uint8_t *plainData, size_t count, size_t offset);
+	/**
+	 * Encrypt and write all the dirty chunks, contiguous ones with one read and one write
+	 *
+	 * @throw a EvfsException if something goes wrong, the chunks not written are kept dirty
+	 */
+	void dirtyChunksFlush();
 
 public:
 	bctbx_vfs_file_t *pFileStd; /**< The encrypted vfs encapsulate a standard one */
 
+	/**
+	 * Open an encrypted file
+	 * @param[in]	stdFp	the standard file, owned by the object from now on: it is closed even when the
+	 * construction throws, the migration may replace it by another handle
+	 */
 	VfsEncryption(bctbx_vfs_file_t *stdFp, const std::string &filename, int openFlags, int accessMode);
 	~VfsEncryption();
 
@@ -160,12 +565,46 @@ public:
 	/* Read from file at given offset the requested size */
 	std::vector<uint8_t> read(size_t offset, size_t count) const;
 
+	/**
+	 * Read from file at given offset the requested size into a caller provided buffer
+	 * Chunks fully covered by the request are decrypted directly in the given buffer
+	 * @param[out]	plainData	buffer to store the plain data, must be at least count bytes
+	 * @param[in]	count		number of bytes to read
+	 * @param[in]	offset		offset in the plain file where to start reading
+	 * @return the number of bytes actually read, can be less than count when reaching the end of file
+	 */
+	size_t read(uint8_t *plainData, size_t count, size_t offset) const;
+
 	/* write to file at given offset the requested size */
 	size_t write(const std::vector<uint8_t> &plainData, size_t offset);
 
+	/**
+	 * Write to file at given offset the given buffer
+	 * Chunks fully covered by the buffer are encrypted directly from it, only partially overwritten chunks are
+	 * decrypted
+	 * @param[in]	plainData	the plain data to write
+	 * @param[in]	count		size of plainData
+	 * @param[in]	offset		offset in the plain file where to start writing. If it is after the end of file,
+	 * 							the gap is filled with zeros
+	 * @return the number of bytes written
+	 */
+	size_t write(const uint8_t *plainData, size_t count, size_t offset);
+
 	/* Truncate the file to the given size, if given size is greater than current, pad with 0 */
 	void truncate(const uint64_t size);
 
+	/**
+	 * Read the line starting at the given offset, scanning the file chunk by chunk. The chunk holding the end of the
+	 * line is kept decrypted for the next call so a sequential scan decrypts each chunk only once.
+	 * A line ends with \r, \n or \r\n, the end of line is not copied.
+	 * @param[out]		line	buffer receiving the null terminated line
+	 * @param[in]		maxLen	size of the line buffer, longer lines are returned in several parts
+	 * @param[in,out]	offset	offset of the line in the plain file, set to the beginning of the next line
+	 * @return the size of the line including the end of line (so 1 for an empty line), the size of the line only if
+	 * the end of file is reached before an end of line, 0 at end of file
+	 */
+	size_t getLine(char *line, size_t maxLen, uint64_t &offset);
+
 	/**
 	 *  Get the filename
 	 *  @return a string with the filename as given to the open function
@@ -209,9 +648,226 @@ public:
 	 */
 	void chunkSizeSet(const size_t size);
 
+	/**
+	 * Set the maximum number of derived chunk keys the encryption module keeps in memory for this file.
+	 * Keys are wiped from memory when evicted from the cache. 0 disables the cache, default is 64.
+	 * Can be set from the open callback or at any time after.
+	 */
+	void chunkKeyCacheSizeSet(const size_t size);
+	/**
+	 * Returns the maximum number of derived chunk keys kept in memory for this file
+	 */
+	size_t chunkKeyCacheSizeGet() const noexcept;
+
+	/**
+	 * Set the size, in bytes, of the cache of decrypted chunks kept in memory for this file.
+	 * Repeated reads in the same chunks are then served without reading and decrypting them again.
+	 * Chunks are wiped from memory when evicted from the cache and at file closing.
+	 * 0 disables the cache, this is the default.
+	 */
+	void plainChunkCacheSizeSet(const size_t size);
+	/**
+	 * Returns the size in bytes of the cache of decrypted chunks
+	 */
+	size_t plainChunkCacheSizeGet() const noexcept;
+
+	/**
+	 * Set how often the file header, holding the plain file size and its authentication tag, is written.
+	 * With the default value 1 it is written after each write or truncate modifying the file size. With a value N it is
+	 * written at most every N file size modifications and 0 delays it until the file is synced or closed.
+	 * While the write back buffer holds modified chunks, the header update waits for them to be written, see
+	 * writeBackBufferSizeSet().
+	 * If the process stops before a pending header update is written, the file size is recovered at next opening after
+	 * a full integrity check of the file.
+	 */
+	void headerUpdateIntervalSet(const size_t interval);
+	/**
+	 * Returns the header update interval
+	 */
+	size_t headerUpdateIntervalGet() const noexcept;
+	/**
+	 * Write the dirty chunks of the write back buffer, then the file header if an update is pending
+	 *
+	 * @throw a EvfsException if something goes wrong
+	 */
+	void headerFlush();
+
+	/**
+	 * Set the number of chunks read ahead when the file is read sequentially.
+	 * After a few reads each starting where the previous one ended, the chunks following the last read are read and
+	 * decrypted in background, so the next read finds them ready. A read elsewhere in the file cancels the read ahead.
+	 * The background reads run on the worker threads, see workerThreadsSet(). Without worker threads, the next read
+	 * reads and decrypts the whole window at once.
+	 * 0 disables the read ahead, this is the default.
+	 */
+	void readAheadWindowSet(const size_t chunks);
+	/**
+	 * Returns the number of chunks read ahead
+	 */
+	size_t readAheadWindowGet() const noexcept;
+
+	/**
+	 * Set the size, in bytes, of the write back buffer of this file.
+	 * Chunks modified by writes are then kept in memory and encrypted and written only once when the file is synced or
+	 * closed, when the header is written or when their total size exceeds the buffer size. Many small writes in the
+	 * same chunks then cost one encryption instead of one per write.
+	 * The file header is written after the chunks it accounts for: a file size modification leaves the header update
+	 * pending until the buffer is flushed, whatever the header update interval, see headerUpdateIntervalSet(). If the
+	 * process stops, data not flushed is lost and the file size is recovered as for any pending header update.
+	 * 0 disables the buffer and flushes it, this is the default.
+	 *
+	 * @throw a EvfsException if the flush fails
+	 */
+	void writeBackBufferSizeSet(const size_t size);
+	/**
+	 * Returns the size in bytes of the write back buffer
+	 */
+	size_t writeBackBufferSizeGet() const noexcept;
+
+	/**
+	 * When enabled, growing the file by truncate or by writing after its end leaves holes instead of encrypting the
+	 * zeros: the raw file is extended with zeros, sparse on most file systems. They are encrypted when first written.
+	 * Files created with this setting get a header extension, holes can only be left in files having one.
+	 * The holes are recorded as ranges of chunks in the authenticated header, a chunk leaves its range when first
+	 * written. Whatever this setting, chunks holding only zeros are read as plain zeros without any decryption when
+	 * in a recorded range, anywhere else a chunk of zeros fails the authentication.
+	 * The header holds a few ranges only, depending on the encryption suite: once they are all used, extensions not
+	 * contiguous to the last range encrypt their zeros, and a write in the middle of a range encrypts the zeros of its
+	 * smaller side.
+	 * Default is false. Must be called from the open callback.
+	 */
+	void sparseExtensionSet(const bool sparse) noexcept;
+	bool sparseExtensionGet() const noexcept;
+
+	/**
+	 * When enabled, files created, or migrated from plain ones, get a size journal in their header: before chunks are
+	 * written, the range of chunks modified since the file size was last written in the header is recorded in the
+	 * header, authenticated with it. When the file size in the header is found wrong at opening, after an unclean
+	 * shutdown, only the chunks in this range are checked instead of the whole file.
+	 * The range is recorded ahead of the end of file so appending seldom requires an additional header write.
+	 * Files created without it never get one. Disabling it on a file holding one drops the journal from the header at
+	 * the next header write, the room reserved for it in the header is kept.
+	 * Default is false. Must be called from the open callback.
+	 */
+	void sizeJournalSet(const bool journal) noexcept;
+	bool sizeJournalGet() const noexcept;
+
+	/**
+	 * When enabled, files created, or migrated from plain ones, get an integrity tree: a Merkle tree over the chunk
+	 * authentication tags. Its root is kept in the file header, authenticated with it, and its nodes in the file
+	 * suffixed by .evfs_tree. A chunk replaced by an older version of itself, which decrypts correctly, is then
+	 * detected by integrityTreeVerify().
+	 * The root is written with the file size, see headerUpdateIntervalSet(). The tree nodes overwritten since are kept
+	 * in an undo log, suffixed by .evfs_tree_undo: if the process stops before the header is written, they are
+	 * restored at next opening. The leaves of the chunks written meanwhile are then updated if the file has a size
+	 * journal, once these chunks are checked, otherwise the tree does not match them and must be rebuilt. The tree is
+	 * not valid either when its file is missing: use fileRemove() and fileRename() to keep it along with the encrypted
+	 * file.
+	 * The updated tree nodes are written to their file with the header, each run of consecutive nodes at once.
+	 * Files created without it never get one, disabling it on a file holding one removes it at next header write.
+	 * Default is false. Must be called from the open callback.
+	 */
+	void integrityTreeSet(const bool tree) noexcept;
+	bool integrityTreeGet() const noexcept;
+	/**
+	 * Check chunks against the integrity tree, the chunks in the written back buffer are not checked
+	 * @param[in]	offset	plain offset of the first byte to check
+	 * @param[in]	size	size of the plain data to check
+	 * @return true if the chunks holding the given range are the ones last written
+	 *
+	 * @throw a EvfsException if the file has no integrity tree
+	 */
+	bool integrityTreeVerify(uint64_t offset, uint64_t size);
+	/**
+	 * Check the whole file against the integrity tree, including that no chunk was removed
+	 *
+	 * @throw a EvfsException if the file has no integrity tree
+	 */
+	bool integrityTreeVerify();
+	/**
+	 * Rebuild the integrity tree from the current chunks, after it was found not matching the header.
+	 * Whatever the file holds is then considered valid: check it by other means first.
+	 *
+	 * @throw a EvfsException if the file has no integrity tree or is opened in read only mode
+	 */
+	void integrityTreeRebuild();
+	/**
+	 * @return the root of the integrity tree, empty if the file has none
+	 */
+	std::vector<uint8_t> integrityTreeRootGet() const;
+	/**
+	 * Sync the file holding the integrity tree nodes
+	 * @return 0 on success, as bctbx_file_sync
+	 */
+	int integrityTreeSync();
+
+	/**
+	 * Start re-keying the file: its chunks are re-encrypted in place with the given secret material, range by range,
+	 * by rekeyStep(). The file stays readable and writable meanwhile, chunks already re-keyed use the new secret
+	 * material, the others the current one. The progress is kept in the file header so re-keying resumes after the
+	 * file is closed: the open callback gives the current secret material with secretMaterialSet() and the new one
+	 * with rekeySecretMaterialSet(). Once all the chunks are re-keyed the header is authenticated with the new secret
+	 * material, the only one needed from then on.
+	 * The file must have a header extension, see sizeJournalSet() and integrityTreeSet().
+	 *
+	 * @throw a EvfsException if the file is already being re-keyed, is opened in read only mode or has no room in its
+	 * header extension
+	 */
+	void rekeyStart(const std::vector<uint8_t> &newSecretMaterial);
+	/**
+	 * Set the new secret material of a file being re-keyed, see rekeyStart(). Must be called from the open callback.
+	 * @throw a EvfsException if the file is not being re-keyed or if this is not the secret material given to
+	 * rekeyStart()
+	 */
+	void rekeySecretMaterialSet(const std::vector<uint8_t> &newSecretMaterial);
+	/**
+	 * @return true if the file is being re-keyed, can be called from the open callback
+	 */
+	bool rekeyInProgressGet() const noexcept;
+	/**
+	 * Re-encrypt the next range of chunks with the new secret material. The header is written before and after the
+	 * range is, so an interrupted step is completed at next opening for writing. Opened in read only mode, the file
+	 * is readable as its chunks are decrypted with either secret material.
+	 * If a rate is set, wait as long as needed to stay under it.
+	 * @param[in]	maxChunks	maximum number of chunks re-encrypted, 0 for a batch of about 1MB
+	 * @return true if the file is not being re-keyed anymore: all chunks use the new secret material
+	 *
+	 * @throw a EvfsException if something goes wrong, re-keying then resumes from where it stopped
+	 */
+	bool rekeyStep(size_t maxChunks = 0);
+	/**
+	 * @return the size of the plain data already re-keyed
+	 */
+	uint64_t rekeyProgressGet() const noexcept;
+	/**
+	 * Set the maximum number of raw bytes re-encrypted per second by rekeyStep(), 0 means no limit, this is the default
+	 */
+	void rekeyRateSet(const size_t bytesPerSecond) noexcept;
+	size_t rekeyRateGet() const noexcept;
+
+	/**
+	 * Set a callback reporting the progress of the migration when opening a plain file to encrypt it.
+	 * Must be called from the open callback.
+	 */
+	void migrationProgressCallbackSet(const EncryptedVfsMigrationProgressCb &cb) noexcept;
+	/**
+	 * When opening a plain file to encrypt it, migrate it in background instead of blocking the opening.
+	 * The file is accessed as plain until the migration completes and it is replaced by the encrypted one, at a later
+	 * opening, once no other handle on it is open. The encrypted image is built in the file suffixed by .evfs_tmp and
+	 * the migration is resumed from it if it is interrupted. Default is false. Must be called from the open callback.
+	 */
+	void migrationInBackgroundSet(const bool background) noexcept;
+	bool migrationInBackgroundGet() const noexcept;
+
+	/**
+	 * @return the counters of this file since its opening or the last reset
+	 */
+	VfsEncryptionStats statsGet() const noexcept;
+	void statsReset() noexcept;
+
 	/**
 	 * Get raw header: encryption module might check integrity on header
-	 * This function returns the raw header, without the encryption module part
+	 * This function returns the raw header, header extension included, without the encryption module part
 	 */
 	const std::vector<uint8_t> &rawHeaderGet() const noexcept;
 };
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_MMAP_H
+#define BCTBX_VFS_MMAP_H
+
+#include "bctoolbox/port.h"
+#include "bctoolbox/vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Virtual File system mapping in memory the files opened read only, reads are then copies from the mapping.
+ * Files opened for writing, and all files on platforms without mmap, are handled by the standard VFS.
+ * A mapped file must not be truncated while it is open: only its growth is supported, the mapping is replaced on the
+ * first access after the end of the previous one.
+ */
+extern BCTBX_PUBLIC bctbx_vfs_t bcMmapVfs;
+
+/**
+ * Borrow a direct view on the content of a file mapped by the mmap VFS, without copy.
+ * The mapping is not replaced while views are borrowed: when the file grows, reads after the end of the mapping are
+ * then served from the file and views cannot extend beyond it.
+ * @param  pFile  bctbx_vfs_file_t File handle pointer, opened read only by the mmap VFS.
+ * @param  offset Where the view starts in the file (in bytes).
+ * @param  count  Number of bytes wanted in the view.
+ * @param  view   Set to the start of the view, NULL if it is empty.
+ * @return        Number of bytes in the view, less than count at end of file, 0 if the view is empty: it must not be
+ *                released. BCTBX_VFS_ERROR if the file is not mapped.
+ */
+BCTBX_PUBLIC ssize_t bctbx_file_view_borrow(bctbx_vfs_file_t *pFile, off_t offset, size_t count, const void **view);
+
+/**
+ * Give back a view borrowed with bctbx_file_view_borrow. It must not be accessed anymore.
+ * @param  pFile  bctbx_vfs_file_t File handle pointer.
+ * @param  view   The view given by bctbx_file_view_borrow.
+ */
+BCTBX_PUBLIC void bctbx_file_view_release(bctbx_vfs_file_t *pFile, const void *view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BCTBX_VFS_MMAP_H */
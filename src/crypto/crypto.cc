@@ -184,6 +184,65 @@ bool AEADDecrypt<AES256GCM128>(const std::vector<uint8_t> &key,
 	throw BCTBX_EXCEPTION << "Error during AES_GCM decryption : return value " << ret;
 }
 
+/* declare AEAD template specialisations : ChaCha20-Poly1305 */
+template <>
+std::vector<uint8_t> AEADEncrypt<CHACHA20POLY1305>(const std::vector<uint8_t> &key,
+                                                   const std::vector<uint8_t> &IV,
+                                                   const std::vector<uint8_t> &plain,
+                                                   const std::vector<uint8_t> &AD,
+                                                   std::vector<uint8_t> &tag) {
+	if (key.size() != CHACHA20POLY1305::keySize()) {
+		throw BCTBX_EXCEPTION << "AEADEncrypt: Bad input parameter, key is expected to be "
+		                      << CHACHA20POLY1305::keySize() << " bytes but " << key.size() << " provided";
+	}
+	if (IV.size() != CHACHA20POLY1305::nonceSize()) {
+		throw BCTBX_EXCEPTION << "AEADEncrypt: Bad input parameter, nonce is expected to be "
+		                      << CHACHA20POLY1305::nonceSize() << " bytes but " << IV.size() << " provided";
+	}
+	tag.resize(CHACHA20POLY1305::tagSize());
+
+	std::vector<uint8_t> cipher(plain.size());
+	int ret = bctbx_chacha20_poly1305_encrypt_and_tag(key.data(), plain.data(), plain.size(), AD.data(), AD.size(),
+	                                                  IV.data(), tag.data(), cipher.data());
+
+	if (ret != 0) {
+		throw BCTBX_EXCEPTION << "Error during ChaCha20-Poly1305 encryption : return value " << ret;
+	}
+	return cipher;
+}
+
+template <>
+bool AEADDecrypt<CHACHA20POLY1305>(const std::vector<uint8_t> &key,
+                                   const std::vector<uint8_t> &IV,
+                                   const std::vector<uint8_t> &cipher,
+                                   const std::vector<uint8_t> &AD,
+                                   const std::vector<uint8_t> &tag,
+                                   std::vector<uint8_t> &plain) {
+	if (key.size() != CHACHA20POLY1305::keySize()) {
+		throw BCTBX_EXCEPTION << "AEADDecrypt: Bad input parameter, key is expected to be "
+		                      << CHACHA20POLY1305::keySize() << " bytes but " << key.size() << " provided";
+	}
+	if (IV.size() != CHACHA20POLY1305::nonceSize()) {
+		throw BCTBX_EXCEPTION << "AEADDecrypt: Bad input parameter, nonce is expected to be "
+		                      << CHACHA20POLY1305::nonceSize() << " bytes but " << IV.size() << " provided";
+	}
+	if (tag.size() != CHACHA20POLY1305::tagSize()) {
+		throw BCTBX_EXCEPTION << "AEADDecrypt: Bad input parameter, tag is expected to be "
+		                      << CHACHA20POLY1305::tagSize() << " bytes but " << tag.size() << " provided";
+	}
+
+	plain.resize(cipher.size()); // plain is the same size than cipher
+	int ret = bctbx_chacha20_poly1305_decrypt_and_auth(key.data(), cipher.data(), cipher.size(), AD.data(), AD.size(),
+	                                                   IV.data(), tag.data(), plain.data());
+
+	if (ret == 0) {
+		return true;
+	} else if (ret == BCTBX_ERROR_AUTHENTICATION_FAILED) {
+		throw BCTBX_EXCEPTION << "Error during ChaCha20-Poly1305 decryption : authentication failed";
+	}
+	throw BCTBX_EXCEPTION << "Error during ChaCha20-Poly1305 decryption : return value " << ret;
+}
+
 } // namespace bctoolbox
 
 /*****************************************************************************/
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include <mbedtls/base64.h>
+#include <mbedtls/chachapoly.h>
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/error.h>
@@ -1914,6 +1915,120 @@ int32_t bctbx_aes_gcm_finish(bctbx_aes_gcm_context_t *context, uint8_t *tag, siz
 	return ret;
 }
 
+/***** ChaCha20-Poly1305 *****/
+/***** GCM with a long lived key schedule *****/
+struct bctbx_aes_gcm_keyed_context_struct {
+	mbedtls_gcm_context gcm_ctx;
+};
+
+bctbx_aes_gcm_keyed_context_t *bctbx_aes_gcm_keyed_context_new(const uint8_t *key, size_t keyLength) {
+	bctbx_aes_gcm_keyed_context_t *ctx = bctbx_malloc0(sizeof(bctbx_aes_gcm_keyed_context_t));
+	mbedtls_gcm_init(&ctx->gcm_ctx);
+	if (mbedtls_gcm_setkey(&ctx->gcm_ctx, MBEDTLS_CIPHER_ID_AES, key, (unsigned int)keyLength * 8) != 0) {
+		bctbx_aes_gcm_keyed_context_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void bctbx_aes_gcm_keyed_context_free(bctbx_aes_gcm_keyed_context_t *context) {
+	if (context) {
+		mbedtls_gcm_free(&context->gcm_ctx); // wipes the key schedule
+		bctbx_free(context);
+	}
+}
+
+int32_t bctbx_aes_gcm_keyed_encrypt_and_tag(bctbx_aes_gcm_keyed_context_t *context,
+                                            const uint8_t *plainText,
+                                            size_t plainTextLength,
+                                            const uint8_t *authenticatedData,
+                                            size_t authenticatedDataLength,
+                                            const uint8_t *initializationVector,
+                                            size_t initializationVectorLength,
+                                            uint8_t *tag,
+                                            size_t tagLength,
+                                            uint8_t *output) {
+	return mbedtls_gcm_crypt_and_tag(&context->gcm_ctx, MBEDTLS_GCM_ENCRYPT, plainTextLength, initializationVector,
+	                                 initializationVectorLength, authenticatedData, authenticatedDataLength, plainText,
+	                                 output, tagLength, tag);
+}
+
+int32_t bctbx_aes_gcm_keyed_decrypt_and_auth(bctbx_aes_gcm_keyed_context_t *context,
+                                             const uint8_t *cipherText,
+                                             size_t cipherTextLength,
+                                             const uint8_t *authenticatedData,
+                                             size_t authenticatedDataLength,
+                                             const uint8_t *initializationVector,
+                                             size_t initializationVectorLength,
+                                             const uint8_t *tag,
+                                             size_t tagLength,
+                                             uint8_t *output) {
+	int ret = mbedtls_gcm_auth_decrypt(&context->gcm_ctx, cipherTextLength, initializationVector,
+	                                   initializationVectorLength, authenticatedData, authenticatedDataLength, tag,
+	                                   tagLength, cipherText, output);
+	if (ret == MBEDTLS_ERR_GCM_AUTH_FAILED) {
+		return BCTBX_ERROR_AUTHENTICATION_FAILED;
+	}
+	return ret;
+}
+
+/**
+ * @Brief ChaCha20-Poly1305 encrypt and tag buffer, key is 32 bytes, nonce 12 bytes and tag 16 bytes long
+ */
+int32_t bctbx_chacha20_poly1305_encrypt_and_tag(const uint8_t *key,
+                                                const uint8_t *plainText,
+                                                size_t plainTextLength,
+                                                const uint8_t *authenticatedData,
+                                                size_t authenticatedDataLength,
+                                                const uint8_t *nonce,
+                                                uint8_t *tag,
+                                                uint8_t *output) {
+	mbedtls_chachapoly_context chachapolyContext;
+	int ret;
+
+	mbedtls_chachapoly_init(&chachapolyContext);
+	ret = mbedtls_chachapoly_setkey(&chachapolyContext, key);
+	if (ret == 0) {
+		ret = mbedtls_chachapoly_encrypt_and_tag(&chachapolyContext, plainTextLength, nonce, authenticatedData,
+		                                         authenticatedDataLength, plainText, output, tag);
+	}
+	mbedtls_chachapoly_free(&chachapolyContext);
+
+	return ret;
+}
+
+/**
+ * @Brief ChaCha20-Poly1305 decrypt and check the authentication tag, key is 32 bytes, nonce 12 bytes and tag 16 bytes
+ * long
+ *
+ * @return 0 on succes, BCTBX_ERROR_AUTHENTICATION_FAILED if tag doesn't match or mbedtls error code
+ */
+int32_t bctbx_chacha20_poly1305_decrypt_and_auth(const uint8_t *key,
+                                                 const uint8_t *cipherText,
+                                                 size_t cipherTextLength,
+                                                 const uint8_t *authenticatedData,
+                                                 size_t authenticatedDataLength,
+                                                 const uint8_t *nonce,
+                                                 const uint8_t *tag,
+                                                 uint8_t *output) {
+	mbedtls_chachapoly_context chachapolyContext;
+	int ret;
+
+	mbedtls_chachapoly_init(&chachapolyContext);
+	ret = mbedtls_chachapoly_setkey(&chachapolyContext, key);
+	if (ret == 0) {
+		ret = mbedtls_chachapoly_auth_decrypt(&chachapolyContext, cipherTextLength, nonce, authenticatedData,
+		                                      authenticatedDataLength, tag, cipherText, output);
+	}
+	mbedtls_chachapoly_free(&chachapolyContext);
+
+	if (ret == MBEDTLS_ERR_CHACHAPOLY_AUTH_FAILED) {
+		return BCTBX_ERROR_AUTHENTICATION_FAILED;
+	}
+
+	return ret;
+}
+
 /*
  * @brief Wrapper for AES-128 in CFB128 mode encryption
  * Both key and IV must be 16 bytes long, IV is not updated
@@ -207,6 +207,21 @@ std::vector<uint8_t> HKDF<SHA256>(const std::vector<uint8_t> &salt,
 	return okm;
 };
 
+template <>
+void HKDF<SHA256>(const uint8_t *salt,
+                  const size_t saltSize,
+                  const uint8_t *ikm,
+                  const size_t ikmSize,
+                  const char *info,
+                  const size_t infoSize,
+                  uint8_t *okm,
+                  size_t okmSize) {
+	if (mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), salt, saltSize, ikm, ikmSize,
+	                 reinterpret_cast<const unsigned char *>(info), infoSize, okm, okmSize) != 0) {
+		throw BCTBX_EXCEPTION << "HKDF-SHA256 error";
+	}
+};
+
 /* HKDF specialized template for SHA384 */
 template <>
 std::vector<uint8_t> HKDF<SHA384>(const std::vector<uint8_t> &salt,
@@ -1767,6 +1767,147 @@ int32_t bctbx_aes_gcm_finish(bctbx_aes_gcm_context_t *context, uint8_t *tag, siz
 	return ret == 1 ? 0 : BCTBX_ERROR_UNSPECIFIED_ERROR;
 }
 
+/***** GCM with a long lived key schedule *****/
+struct bctbx_aes_gcm_keyed_context_struct {
+	EVP_CIPHER_CTX *encrypt_ctx;
+	EVP_CIPHER_CTX *decrypt_ctx;
+};
+
+bctbx_aes_gcm_keyed_context_t *bctbx_aes_gcm_keyed_context_new(const uint8_t *key, size_t keyLength) {
+	const EVP_CIPHER *cipher = get_evp_aes_gcm(keyLength);
+	if (cipher == NULL) {
+		return NULL;
+	}
+
+	bctbx_aes_gcm_keyed_context_t *ctx = bctbx_malloc0(sizeof(bctbx_aes_gcm_keyed_context_t));
+	ctx->encrypt_ctx = EVP_CIPHER_CTX_new();
+	ctx->decrypt_ctx = EVP_CIPHER_CTX_new();
+	/* set the key only: the key schedule is kept, IV is given for each operation */
+	if (ctx->encrypt_ctx == NULL || ctx->decrypt_ctx == NULL ||
+	    1 != EVP_CipherInit_ex(ctx->encrypt_ctx, cipher, NULL, key, NULL, 1) ||
+	    1 != EVP_CipherInit_ex(ctx->decrypt_ctx, cipher, NULL, key, NULL, 0)) {
+		bctbx_aes_gcm_keyed_context_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void bctbx_aes_gcm_keyed_context_free(bctbx_aes_gcm_keyed_context_t *context) {
+	if (context) {
+		EVP_CIPHER_CTX_free(context->encrypt_ctx); // wipes the key schedule
+		EVP_CIPHER_CTX_free(context->decrypt_ctx);
+		bctbx_free(context);
+	}
+}
+
+int32_t bctbx_aes_gcm_keyed_encrypt_and_tag(bctbx_aes_gcm_keyed_context_t *context,
+                                            const uint8_t *plainText,
+                                            size_t plainTextLength,
+                                            const uint8_t *authenticatedData,
+                                            size_t authenticatedDataLength,
+                                            const uint8_t *initializationVector,
+                                            size_t initializationVectorLength,
+                                            uint8_t *tag,
+                                            size_t tagLength,
+                                            uint8_t *output) {
+	int len;
+	EVP_CIPHER_CTX *ctx = context->encrypt_ctx;
+
+	if (1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, (int)initializationVectorLength, NULL) &&
+	    1 == EVP_CipherInit_ex(ctx, NULL, NULL, NULL, initializationVector, 1) &&
+	    1 == EVP_CipherUpdate(ctx, NULL, &len, authenticatedData, (int)authenticatedDataLength) &&
+	    1 == EVP_CipherUpdate(ctx, output, &len, plainText, (int)plainTextLength) &&
+	    1 == EVP_CipherFinal_ex(ctx, output + len, &len) &&
+	    1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int)tagLength, tag)) {
+		return 0;
+	}
+	return BCTBX_ERROR_UNSPECIFIED_ERROR;
+}
+
+int32_t bctbx_aes_gcm_keyed_decrypt_and_auth(bctbx_aes_gcm_keyed_context_t *context,
+                                             const uint8_t *cipherText,
+                                             size_t cipherTextLength,
+                                             const uint8_t *authenticatedData,
+                                             size_t authenticatedDataLength,
+                                             const uint8_t *initializationVector,
+                                             size_t initializationVectorLength,
+                                             const uint8_t *tag,
+                                             size_t tagLength,
+                                             uint8_t *output) {
+	int len;
+	EVP_CIPHER_CTX *ctx = context->decrypt_ctx;
+
+	if (1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, (int)initializationVectorLength, NULL) &&
+	    1 == EVP_CipherInit_ex(ctx, NULL, NULL, NULL, initializationVector, 0) &&
+	    1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int)tagLength, (void *)tag) &&
+	    1 == EVP_CipherUpdate(ctx, NULL, &len, authenticatedData, (int)authenticatedDataLength) &&
+	    1 == EVP_CipherUpdate(ctx, output, &len, cipherText, (int)cipherTextLength)) {
+		/* tag is checked by the final call */
+		return (1 == EVP_CipherFinal_ex(ctx, output + len, &len)) ? 0 : BCTBX_ERROR_AUTHENTICATION_FAILED;
+	}
+	return BCTBX_ERROR_UNSPECIFIED_ERROR;
+}
+
+/***** ChaCha20-Poly1305 *****/
+int32_t bctbx_chacha20_poly1305_encrypt_and_tag(const uint8_t *key,
+                                                const uint8_t *plainText,
+                                                size_t plainTextLength,
+                                                const uint8_t *authenticatedData,
+                                                size_t authenticatedDataLength,
+                                                const uint8_t *nonce,
+                                                uint8_t *tag,
+                                                uint8_t *output) {
+	int len;
+	int ret = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		return BCTBX_ERROR_UNSPECIFIED_ERROR;
+	}
+
+	/* nonce length default to 12 bytes, tag length to 16 bytes */
+	if (1 == EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) &&
+	    1 == EVP_EncryptUpdate(ctx, NULL, &len, authenticatedData, (int)authenticatedDataLength) &&
+	    1 == EVP_EncryptUpdate(ctx, output, &len, plainText, (int)plainTextLength) &&
+	    1 == EVP_EncryptFinal_ex(ctx, output + len, &len) &&
+	    1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, tag)) {
+		ret = 0;
+	} else {
+		ret = BCTBX_ERROR_UNSPECIFIED_ERROR;
+	}
+
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
+int32_t bctbx_chacha20_poly1305_decrypt_and_auth(const uint8_t *key,
+                                                 const uint8_t *cipherText,
+                                                 size_t cipherTextLength,
+                                                 const uint8_t *authenticatedData,
+                                                 size_t authenticatedDataLength,
+                                                 const uint8_t *nonce,
+                                                 const uint8_t *tag,
+                                                 uint8_t *output) {
+	int len;
+	int ret = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		return BCTBX_ERROR_UNSPECIFIED_ERROR;
+	}
+
+	if (1 == EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) &&
+	    1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, (void *)tag) &&
+	    1 == EVP_DecryptUpdate(ctx, NULL, &len, authenticatedData, (int)authenticatedDataLength) &&
+	    1 == EVP_DecryptUpdate(ctx, output, &len, cipherText, (int)cipherTextLength)) {
+		/* tag is checked by the final call */
+		ret = (1 == EVP_DecryptFinal_ex(ctx, output + len, &len)) ? 0 : BCTBX_ERROR_AUTHENTICATION_FAILED;
+	} else {
+		ret = BCTBX_ERROR_UNSPECIFIED_ERROR;
+	}
+
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
 static void bctbx_evp_cipher_init_update_final(const EVP_CIPHER *cipher,
                                                int mode,
                                                const uint8_t *key,
@@ -185,6 +185,18 @@ std::vector<uint8_t> HKDF<SHA256>(const std::vector<uint8_t> &salt,
 	return HMAC_KDF<std::string>(SN_sha256, salt, ikm, info, outputSize);
 };
 
+template <>
+void HKDF<SHA256>(const uint8_t *salt,
+                  const size_t saltSize,
+                  const uint8_t *ikm,
+                  const size_t ikmSize,
+                  const char *info,
+                  const size_t infoSize,
+                  uint8_t *okm,
+                  size_t okmSize) {
+	HMAC_KDF(SN_sha256, salt, saltSize, ikm, ikmSize, info, infoSize, okm, okmSize);
+};
+
 /* HKDF specialized template for SHA384 */
 template <>
 std::vector<uint8_t> HKDF<SHA384>(const std::vector<uint8_t> &salt,
@@ -25,6 +25,7 @@
 #include "bctoolbox/logging.h"
 #include "bctoolbox/port.h"
 #include "bctoolbox/vfs.h"
+#include "bctoolbox/vfs_mmap.h"
 #include "bctoolbox/vfs_standard.h"
 #include <errno.h>
 #include <stdarg.h>
@@ -95,6 +96,49 @@ ssize_t bctbx_file_write(bctbx_vfs_file_t *pFile, const void *buf, size_t count,
 	return BCTBX_VFS_ERROR;
 }
 
+/* vectored write for the VFS without pFuncWritev: one write per buffer, stop at the first short one */
+static ssize_t file_writev_emulated(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	ssize_t total = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t ret = pFile->pMethods->pFuncWrite(pFile, iov[i].base, iov[i].len, offset + (off_t)total);
+		if (ret < 0) {
+			return (total > 0) ? total : ret;
+		}
+		total += ret;
+		if ((size_t)ret < iov[i].len) {
+			break;
+		}
+	}
+	return total;
+}
+
+ssize_t bctbx_file_writev(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	ssize_t ret;
+
+	if (pFile != NULL && (iov != NULL || iovcnt == 0)) {
+		if (bctbx_file_flush(pFile) < 0) { // make sure our write is not overwritten by a page flush
+			return BCTBX_VFS_ERROR;
+		}
+
+		if (pFile->pMethods->pFuncWritev != NULL) {
+			ret = pFile->pMethods->pFuncWritev(pFile, iov, iovcnt, offset);
+		} else {
+			ret = file_writev_emulated(pFile, iov, iovcnt, offset);
+		}
+		if (ret == BCTBX_VFS_ERROR) {
+			bctbx_error("bctbx_file_writev file error");
+			return BCTBX_VFS_ERROR;
+		} else if (ret < 0) {
+			bctbx_error("bctbx_file_writev error %s", strerror((int)-ret));
+			return BCTBX_VFS_ERROR;
+		}
+		pFile->gSize = 0; // cancel get cache, as it might be dirty now
+		return ret;
+	}
+	return BCTBX_VFS_ERROR;
+}
+
 ssize_t bctbx_file_write2(bctbx_vfs_file_t *pFile, const void *buf, size_t count) {
 	ssize_t ret = bctbx_file_write(pFile, buf, count, pFile->offset);
 	if (ret != BCTBX_VFS_ERROR) {
@@ -178,6 +222,45 @@ ssize_t bctbx_file_read(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t
 	return ret;
 }
 
+/* vectored read for the VFS without pFuncReadv: one read per buffer, stop at the first short one */
+static ssize_t file_readv_emulated(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	ssize_t total = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t ret = pFile->pMethods->pFuncRead(pFile, iov[i].base, iov[i].len, offset + (off_t)total);
+		if (ret < 0) {
+			return (total > 0) ? total : ret;
+		}
+		total += ret;
+		if ((size_t)ret < iov[i].len) {
+			break;
+		}
+	}
+	return total;
+}
+
+ssize_t bctbx_file_readv(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	ssize_t ret = BCTBX_VFS_ERROR;
+	if (pFile && (iov != NULL || iovcnt == 0)) {
+		if (bctbx_file_flush(pFile) < 0) {
+			return BCTBX_VFS_ERROR;
+		}
+
+		if (pFile->pMethods->pFuncReadv != NULL) {
+			ret = pFile->pMethods->pFuncReadv(pFile, iov, iovcnt, offset);
+		} else {
+			ret = file_readv_emulated(pFile, iov, iovcnt, offset);
+		}
+		if (ret == BCTBX_VFS_ERROR) {
+			bctbx_error("bctbx_file_readv: error bctbx_vfs_file_t");
+		} else if (ret < 0) {
+			bctbx_error("bctbx_file_readv: Error read %s", strerror((int)-ret));
+			ret = BCTBX_VFS_ERROR;
+		}
+	}
+	return ret;
+}
+
 ssize_t bctbx_file_read2(bctbx_vfs_file_t *pFile, void *buf, size_t count) {
 	ssize_t ret = bctbx_file_read(pFile, buf, count, pFile->offset);
 	if (ret != BCTBX_VFS_ERROR) {
@@ -491,3 +574,7 @@ bctbx_vfs_t *bctbx_vfs_get_default(void) {
 bctbx_vfs_t *bctbx_vfs_get_standard(void) {
 	return &bcStandardVfs;
 }
+
+bctbx_vfs_t *bctbx_vfs_get_mmap(void) {
+	return &bcMmapVfs;
+}
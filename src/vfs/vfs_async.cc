@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bctoolbox/vfs_async.h"
+#include "bctoolbox/logging.h"
+#include "vfs_mmap_private.h"
+#include "vfs_standard_private.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+namespace {
+
+constexpr unsigned int defaultDepth = 64;
+constexpr unsigned int defaultThreadCount = 4;
+
+struct AsyncRequest {
+	enum class Type { read, write, sync };
+	Type type;
+	bctbx_vfs_file_t *file;
+	void *buffer;
+	size_t count;
+	off_t offset;
+	bctbx_vfs_async_callback_t callback;
+	void *userData;
+	bool serialized; /**< run one at a time with the other serialized requests on its file */
+#ifdef HAVE_LINUX_IO_URING_H
+	struct iovec iov; /**< the buffer, as given to the io_uring */
+#endif
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * Minimal io_uring over the raw system calls: one submitter at a time, one thread reaping the completions.
+ */
+class IoUring {
+public:
+	/**
+	 * @param[in]	entries	number of submission queue entries
+	 * @return the ring, nullptr if the kernel does not support io_uring or forbids it
+	 */
+	static std::unique_ptr<IoUring> create(unsigned int entries) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (fd < 0) {
+			BCTBX_SLOGI << "VFS async: io_uring not available (" << strerror(errno) << "), using threads";
+			return nullptr;
+		}
+		std::unique_ptr<IoUring> ring{new IoUring(fd)};
+		if (!ring->map(params)) {
+			return nullptr;
+		}
+		return ring;
+	}
+
+	~IoUring() {
+		if (mSqes != nullptr) munmap(mSqes, mSqesSize);
+		if (mCqRing != nullptr && mCqRing != mSqRing) munmap(mCqRing, mCqRingSize);
+		if (mSqRing != nullptr) munmap(mSqRing, mSqRingSize);
+		close(mFd);
+	}
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	/**
+	 * Submit a request, the caller serializes the submissions
+	 * @param[in]	fd		the file to operate on
+	 * @param[in]	request	the request, nullptr for the request stopping the reaper
+	 * @return 0 if the request was submitted, -EAGAIN if the ring is full, -errno if the kernel refused it
+	 */
+	int submit(int fd, AsyncRequest *request) {
+		unsigned int tail = *mSqTail; // only the submitter writes it
+		if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries) {
+			return -EAGAIN;
+		}
+		unsigned int index = tail & *mSqMask;
+		struct io_uring_sqe *sqe = &mSqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = fd;
+		if (request == nullptr) {
+			sqe->opcode = IORING_OP_NOP;
+		} else if (request->type == AsyncRequest::Type::sync) {
+			sqe->opcode = IORING_OP_FSYNC;
+		} else {
+			request->iov.iov_base = request->buffer;
+			request->iov.iov_len = request->count;
+			sqe->opcode = (request->type == AsyncRequest::Type::read) ? IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = reinterpret_cast<uint64_t>(&request->iov);
+			sqe->len = 1;
+			sqe->off = static_cast<uint64_t>(request->offset);
+		}
+		sqe->user_data = reinterpret_cast<uint64_t>(request);
+		mSqArray[index] = index;
+		__atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+
+		while (syscall(__NR_io_uring_enter, mFd, 1, 0, 0, nullptr, 0) < 0) {
+			int err = errno;
+			if (err != EINTR && err != EAGAIN && err != EBUSY) {
+				BCTBX_SLOGE << "VFS async: io_uring submission failed: " << strerror(err);
+				// the kernel reads the entries only during enter, which the caller serializes: if it did not take
+				// this one, take it back so it is never completed
+				if (__atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) == tail) {
+					__atomic_store_n(mSqTail, tail, __ATOMIC_RELEASE);
+					return -err;
+				}
+				break;
+			}
+			std::this_thread::yield();
+		}
+		return 0;
+	}
+
+	/**
+	 * Wait for the next completion
+	 * @param[out]	result	the result of the request, bytes or -errno
+	 * @return the completed request, nullptr for the request stopping the reaper
+	 */
+	AsyncRequest *reap(ssize_t &result) {
+		for (;;) {
+			unsigned int head = *mCqHead; // only the reaper writes it
+			if (head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &mCqes[head & *mCqMask];
+				auto request = reinterpret_cast<AsyncRequest *>(cqe->user_data);
+				result = cqe->res;
+				__atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+				return request;
+			}
+			if (syscall(__NR_io_uring_enter, mFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+				BCTBX_SLOGE << "VFS async: io_uring wait failed: " << strerror(errno);
+				std::this_thread::yield();
+			}
+		}
+	}
+
+private:
+	int mFd;
+	void *mSqRing = nullptr;
+	void *mCqRing = nullptr;
+	size_t mSqRingSize = 0;
+	size_t mCqRingSize = 0;
+	struct io_uring_sqe *mSqes = nullptr;
+	size_t mSqesSize = 0;
+	unsigned int mSqEntries = 0;
+	unsigned int *mSqHead = nullptr;
+	unsigned int *mSqTail = nullptr;
+	unsigned int *mSqMask = nullptr;
+	unsigned int *mSqArray = nullptr;
+	unsigned int *mCqHead = nullptr;
+	unsigned int *mCqTail = nullptr;
+	unsigned int *mCqMask = nullptr;
+	struct io_uring_cqe *mCqes = nullptr;
+
+	explicit IoUring(int fd) : mFd(fd) {
+	}
+
+	bool map(const struct io_uring_params &params) {
+		mSqEntries = params.sq_entries;
+		mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMmap) {
+			mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+		}
+		void *sqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+		                    IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED) {
+			BCTBX_SLOGE << "VFS async: cannot map the io_uring submission queue: " << strerror(errno);
+			return false;
+		}
+		mSqRing = sqRing;
+		if (singleMmap) {
+			mCqRing = mSqRing;
+		} else {
+			void *cqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+			                    IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED) {
+				BCTBX_SLOGE << "VFS async: cannot map the io_uring completion queue: " << strerror(errno);
+				return false;
+			}
+			mCqRing = cqRing;
+		}
+		mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		void *sqes =
+		    mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			BCTBX_SLOGE << "VFS async: cannot map the io_uring submission entries: " << strerror(errno);
+			return false;
+		}
+		mSqes = static_cast<struct io_uring_sqe *>(sqes);
+
+		auto sq = static_cast<uint8_t *>(mSqRing);
+		mSqHead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+		mSqTail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+		mSqMask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+		mSqArray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+		auto cq = static_cast<uint8_t *>(mCqRing);
+		mCqHead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+		mCqTail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+		mCqMask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+		mCqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+		return true;
+	}
+};
+#endif // HAVE_LINUX_IO_URING_H
+
+} // namespace
+
+struct bctbx_vfs_async_queue_t {
+	bctbx_vfs_async_queue_t(unsigned int depth, unsigned int threadCount)
+	    : mDepth(depth == 0 ? defaultDepth : depth), mThreadCount(threadCount == 0 ? defaultThreadCount : threadCount) {
+#ifdef HAVE_LINUX_IO_URING_H
+		// one more entry for the request stopping the reaper
+		mRing = IoUring::create(mDepth + 1);
+		if (mRing != nullptr) {
+			mReaper = std::thread(&bctbx_vfs_async_queue_t::reaperLoop, this);
+		}
+#endif
+	}
+
+	~bctbx_vfs_async_queue_t() {
+		wait();
+#ifdef HAVE_LINUX_IO_URING_H
+		if (mRing != nullptr) {
+			{
+				std::lock_guard<std::mutex> lock(mSubmitMutex);
+				mRing->submit(-1, nullptr);
+			}
+			mReaper.join();
+		}
+#endif
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mJobCondition.notify_all();
+		for (auto &worker : mWorkers) {
+			worker.join();
+		}
+	}
+
+	int submit(const AsyncRequest &request) {
+		// io_uring reads a negative offset as the current file position
+		if (request.file == nullptr || request.file->pMethods == nullptr || request.offset < 0) {
+			return BCTBX_VFS_ERROR;
+		}
+		if (request.file->fSize != 0) {
+			bctbx_error("bctbx_vfs_async: file has pending fprintf output");
+			return BCTBX_VFS_ERROR;
+		}
+		if (request.type == AsyncRequest::Type::write) {
+			request.file->gSize = 0; // cancel get cache, as it might be dirty now
+		}
+		// a callback does not wait for a slot: its thread may be the one completing the requests in progress
+		bool overDepth = false;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (sQueueThread != this) {
+				mSlotCondition.wait(lock, [this]() { return mInProgress < mDepth; });
+			}
+			overDepth = (mInProgress >= mDepth);
+			mInProgress++;
+			mPending++;
+		}
+		auto pending = new AsyncRequest(request);
+		int fd = bctbx_vfs_standard_fd_get(request.file);
+		// only the standard and mmap VFS support concurrent calls on a file
+		pending->serialized = (fd < 0 && !bctbx_vfs_mmap_is_mapped(request.file));
+
+#ifdef HAVE_LINUX_IO_URING_H
+		// the ring holds mDepth requests, the workers run the ones submitted over it by callbacks
+		if (mRing != nullptr && fd >= 0 && !overDepth) {
+			int ret = 0;
+			{
+				std::lock_guard<std::mutex> lock(mSubmitMutex);
+				ret = mRing->submit(fd, pending);
+			}
+			if (ret == 0) {
+				return BCTBX_VFS_OK;
+			}
+			if (ret != -EAGAIN) { // refused by the kernel
+				delete pending;
+				release();
+				return BCTBX_VFS_ERROR;
+			}
+		}
+#else
+		(void)overDepth;
+#endif
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mWorkers.empty()) {
+				for (unsigned int i = 0; i < mThreadCount; i++) {
+					mWorkers.emplace_back(&bctbx_vfs_async_queue_t::workerLoop, this);
+				}
+			}
+			mJobs.push_back(pending);
+		}
+		mJobCondition.notify_one();
+		return BCTBX_VFS_OK;
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDoneCondition.wait(lock, [this]() { return mPending == 0; });
+	}
+
+	bool usesIoUring() const {
+#ifdef HAVE_LINUX_IO_URING_H
+		return mRing != nullptr;
+#else
+		return false;
+#endif
+	}
+
+private:
+	const unsigned int mDepth;
+	const unsigned int mThreadCount;
+	std::mutex mMutex;
+	std::condition_variable mSlotCondition; /**< notified when a request is completed */
+	std::condition_variable mJobCondition;  /**< notified when a job is queued for the workers */
+	std::condition_variable mDoneCondition; /**< notified when no request is pending */
+	unsigned int mInProgress = 0;           /**< requests submitted and not completed yet, up to mDepth */
+	unsigned int mPending = 0;              /**< requests submitted and whose callback did not return yet */
+	std::deque<AsyncRequest *> mJobs;
+	std::set<bctbx_vfs_file_t *> mBusyFiles; /**< files with a serialized request run by a worker */
+	std::vector<std::thread> mWorkers;
+	bool mStopping = false;
+	static thread_local const bctbx_vfs_async_queue_t *sQueueThread; /**< the queue of the current thread, if any */
+#ifdef HAVE_LINUX_IO_URING_H
+	std::unique_ptr<IoUring> mRing;
+	std::mutex mSubmitMutex;
+	std::thread mReaper;
+
+	void reaperLoop() {
+		sQueueThread = this;
+		ssize_t result = 0;
+		while (AsyncRequest *request = mRing->reap(result)) {
+			complete(request, result);
+		}
+	}
+#endif
+
+	void workerLoop() {
+		sQueueThread = this;
+		for (;;) {
+			AsyncRequest *request = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				// the first job which is not serialized on a file busy with another one
+				auto job = mJobs.end();
+				mJobCondition.wait(lock, [this, &job]() {
+					job = std::find_if(mJobs.begin(), mJobs.end(), [this](const AsyncRequest *candidate) {
+						return !candidate->serialized || mBusyFiles.count(candidate->file) == 0;
+					});
+					return mStopping || job != mJobs.end();
+				});
+				if (job == mJobs.end()) {
+					return;
+				}
+				request = *job;
+				mJobs.erase(job);
+				if (request->serialized) {
+					mBusyFiles.insert(request->file);
+				}
+			}
+			// call the methods directly: bctbx_file_read and bctbx_file_write modify the file caches
+			const bctbx_io_methods_t *methods = request->file->pMethods;
+			ssize_t result = BCTBX_VFS_ERROR;
+			switch (request->type) {
+				case AsyncRequest::Type::read:
+					result = methods->pFuncRead(request->file, request->buffer, request->count, request->offset);
+					break;
+				case AsyncRequest::Type::write:
+					result = methods->pFuncWrite(request->file, request->buffer, request->count, request->offset);
+					break;
+				case AsyncRequest::Type::sync:
+					result = (methods->pFuncSync != nullptr) ? methods->pFuncSync(request->file) : BCTBX_VFS_OK;
+					break;
+			}
+			if (request->serialized) {
+				{
+					std::lock_guard<std::mutex> lock(mMutex);
+					mBusyFiles.erase(request->file);
+				}
+				mJobCondition.notify_all(); // the next job on this file may be waiting
+			}
+			complete(request, result);
+		}
+	}
+
+	void complete(AsyncRequest *request, ssize_t result) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mInProgress--; // free the slot before the callback so it can submit a request
+		}
+		mSlotCondition.notify_one();
+
+		if (result == BCTBX_VFS_ERROR) {
+			bctbx_error("bctbx_vfs_async: error bctbx_vfs_file_t");
+		} else if (result < 0) {
+			bctbx_error("bctbx_vfs_async: error %s", strerror((int)-result));
+			result = BCTBX_VFS_ERROR;
+		} else if (request->type == AsyncRequest::Type::sync) {
+			result = BCTBX_VFS_OK;
+		}
+		if (request->callback != nullptr) {
+			request->callback(request->userData, result);
+		}
+		delete request;
+
+		bool done = false;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			done = (--mPending == 0);
+		}
+		if (done) {
+			mDoneCondition.notify_all();
+		}
+	}
+
+	/**
+	 * Give back the slot of a request which could not be submitted
+	 */
+	void release() {
+		bool done = false;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mInProgress--;
+			done = (--mPending == 0);
+		}
+		mSlotCondition.notify_one();
+		if (done) {
+			mDoneCondition.notify_all();
+		}
+	}
+};
+
+thread_local const bctbx_vfs_async_queue_t *bctbx_vfs_async_queue_t::sQueueThread = nullptr;
+
+bctbx_vfs_async_queue_t *bctbx_vfs_async_queue_new(unsigned int depth, unsigned int threadCount) {
+	return new bctbx_vfs_async_queue_t(depth, threadCount);
+}
+
+void bctbx_vfs_async_queue_destroy(bctbx_vfs_async_queue_t *queue) {
+	delete queue;
+}
+
+void bctbx_vfs_async_queue_wait(bctbx_vfs_async_queue_t *queue) {
+	if (queue != nullptr) {
+		queue->wait();
+	}
+}
+
+bool_t bctbx_vfs_async_queue_uses_io_uring(const bctbx_vfs_async_queue_t *queue) {
+	return (queue != nullptr && queue->usesIoUring()) ? TRUE : FALSE;
+}
+
+int bctbx_file_read_async(bctbx_vfs_async_queue_t *queue,
+                          bctbx_vfs_file_t *pFile,
+                          void *buf,
+                          size_t count,
+                          off_t offset,
+                          bctbx_vfs_async_callback_t callback,
+                          void *userData) {
+	if (queue == nullptr) {
+		return BCTBX_VFS_ERROR;
+	}
+	AsyncRequest request{};
+	request.type = AsyncRequest::Type::read;
+	request.file = pFile;
+	request.buffer = buf;
+	request.count = count;
+	request.offset = offset;
+	request.callback = callback;
+	request.userData = userData;
+	return queue->submit(request);
+}
+
+int bctbx_file_write_async(bctbx_vfs_async_queue_t *queue,
+                           bctbx_vfs_file_t *pFile,
+                           const void *buf,
+                           size_t count,
+                           off_t offset,
+                           bctbx_vfs_async_callback_t callback,
+                           void *userData) {
+	if (queue == nullptr) {
+		return BCTBX_VFS_ERROR;
+	}
+	AsyncRequest request{};
+	request.type = AsyncRequest::Type::write;
+	request.file = pFile;
+	request.buffer = const_cast<void *>(buf); // only read by the write
+	request.count = count;
+	request.offset = offset;
+	request.callback = callback;
+	request.userData = userData;
+	return queue->submit(request);
+}
+
+int bctbx_file_sync_async(bctbx_vfs_async_queue_t *queue,
+                          bctbx_vfs_file_t *pFile,
+                          bctbx_vfs_async_callback_t callback,
+                          void *userData) {
+	if (queue == nullptr) {
+		return BCTBX_VFS_ERROR;
+	}
+	AsyncRequest request{};
+	request.type = AsyncRequest::Type::sync;
+	request.file = pFile;
+	request.callback = callback;
+	request.userData = userData;
+	return queue->submit(request);
+}
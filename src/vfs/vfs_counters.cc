@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_counters.hh"
+#include <mutex>
+#include <set>
+
+using namespace bctoolbox;
+
+namespace {
+/**
+ * The counters of all the files: the live ones are summed when read, the closed ones are kept as a sum
+ */
+struct GlobalCounters {
+	std::mutex mutex;
+	std::set<const VfsCounters *> live;
+	std::array<uint64_t, VfsCounters::counterCount> closed{}; /**< sum of the counters of the files closed */
+	std::array<uint64_t, VfsCounters::counterCount> reset{};  /**< sum of the counters of all files at globalReset() */
+};
+
+GlobalCounters &globalCounters() noexcept {
+	static GlobalCounters counters;
+	return counters;
+}
+} // namespace
+
+VfsCounters::VfsCounters() {
+	auto &global = globalCounters();
+	std::lock_guard<std::mutex> lock(global.mutex);
+	global.live.insert(this);
+}
+
+VfsCounters::~VfsCounters() {
+	auto &global = globalCounters();
+	auto totals = totalsGet();
+	std::lock_guard<std::mutex> lock(global.mutex);
+	global.live.erase(this);
+	for (size_t i = 0; i < counterCount; i++) {
+		global.closed[i] += totals[i];
+	}
+}
+
+void VfsCounters::add(Counter counter, uint64_t value) noexcept {
+	mValues[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+VfsCounters::Values VfsCounters::totalsGet() const noexcept {
+	Values totals{};
+	for (size_t i = 0; i < counterCount; i++) {
+		totals[i] = mValues[i].load(std::memory_order_relaxed);
+	}
+	return totals;
+}
+
+VfsEncryptionStats VfsCounters::toStats(const Values &values) noexcept {
+	VfsEncryptionStats stats{};
+	stats.chunksEncrypted = values[chunksEncrypted];
+	stats.chunksDecrypted = values[chunksDecrypted];
+	stats.plainBytesRead = values[plainBytesRead];
+	stats.plainBytesWritten = values[plainBytesWritten];
+	stats.rawBytesRead = values[rawBytesRead];
+	stats.rawBytesWritten = values[rawBytesWritten];
+	stats.headerWrites = values[headerWrites];
+	stats.keyDerivations = values[keyDerivations];
+	stats.integrityFailures = values[integrityFailures];
+	stats.moduleTime = values[moduleTime];
+	return stats;
+}
+
+VfsEncryptionStats VfsCounters::get() const noexcept {
+	auto values = totalsGet();
+	for (size_t i = 0; i < counterCount; i++) {
+		values[i] -= mResetValues[i].load(std::memory_order_relaxed);
+	}
+	return toStats(values);
+}
+
+void VfsCounters::reset() noexcept {
+	for (size_t i = 0; i < counterCount; i++) {
+		mResetValues[i].store(mValues[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+/**
+ * A file reset() does not change the global counters: they sum the totals of the files
+ */
+VfsEncryptionStats VfsCounters::globalGet() noexcept {
+	auto &global = globalCounters();
+	std::lock_guard<std::mutex> lock(global.mutex);
+	auto values = global.closed;
+	for (const auto *counters : global.live) {
+		auto totals = counters->totalsGet();
+		for (size_t i = 0; i < counterCount; i++) {
+			values[i] += totals[i];
+		}
+	}
+	for (size_t i = 0; i < counterCount; i++) {
+		values[i] -= global.reset[i];
+	}
+	return toStats(values);
+}
+
+void VfsCounters::globalReset() noexcept {
+	auto &global = globalCounters();
+	std::lock_guard<std::mutex> lock(global.mutex);
+	global.reset = global.closed;
+	for (const auto *counters : global.live) {
+		auto totals = counters->totalsGet();
+		for (size_t i = 0; i < counterCount; i++) {
+			global.reset[i] += totals[i];
+		}
+	}
+}
+
+VfsCounters::ModuleCall::ModuleCall(VfsCounters *counters, Counter counter, uint64_t chunkCount) noexcept
+    : mCounters(counters) {
+	if (mCounters != nullptr) {
+		mCounters->add(counter, chunkCount);
+		mStart = std::chrono::steady_clock::now();
+	}
+}
+
+VfsCounters::ModuleCall::~ModuleCall() {
+	if (mCounters != nullptr) {
+		auto elapsed = std::chrono::steady_clock::now() - mStart;
+		mCounters->add(moduleTime, static_cast<uint64_t>(
+		                               std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_COUNTERS_HH
+#define BCTBX_VFS_COUNTERS_HH
+
+#include "bctoolbox/vfs_encrypted.hh"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace bctoolbox {
+
+/**
+ * Counters of the work done on an encrypted file, read through VfsEncryptionStats.
+ * Updates are relaxed atomic additions to the counters of the file only: they can be done from any thread, worker
+ * threads included, and cost no lock. The counters of all the files are summed only when read, see globalGet().
+ */
+class VfsCounters {
+public:
+	enum Counter : size_t {
+		chunksEncrypted,
+		chunksDecrypted,
+		plainBytesRead,
+		plainBytesWritten,
+		rawBytesRead,
+		rawBytesWritten,
+		headerWrites,
+		keyDerivations,
+		integrityFailures,
+		moduleTime,
+		counterCount
+	};
+
+	VfsCounters();
+	~VfsCounters();
+	VfsCounters(const VfsCounters &) = delete;
+	VfsCounters &operator=(const VfsCounters &) = delete;
+
+	/**
+	 * Add to a counter of this file
+	 */
+	void add(Counter counter, uint64_t value) noexcept;
+	VfsEncryptionStats get() const noexcept;
+	void reset() noexcept;
+
+	/**
+	 * @return the sum of the counters of all the files, closed ones included, since the last globalReset()
+	 */
+	static VfsEncryptionStats globalGet() noexcept;
+	static void globalReset() noexcept;
+
+	/**
+	 * Count chunks processed by an encryption module and the time spent from its construction to its destruction
+	 */
+	class ModuleCall {
+	public:
+		/**
+		 * @param[in]	counters	the counters to update, may be nullptr
+		 * @param[in]	counter		chunksEncrypted or chunksDecrypted
+		 * @param[in]	chunkCount	number of chunks processed
+		 */
+		ModuleCall(VfsCounters *counters, Counter counter, uint64_t chunkCount) noexcept;
+		~ModuleCall();
+		ModuleCall(const ModuleCall &) = delete;
+		ModuleCall &operator=(const ModuleCall &) = delete;
+
+	private:
+		VfsCounters *mCounters;
+		std::chrono::steady_clock::time_point mStart;
+	};
+
+private:
+	using Values = std::array<uint64_t, counterCount>;
+	static VfsEncryptionStats toStats(const Values &values) noexcept;
+	Values totalsGet() const noexcept;
+
+	std::array<std::atomic<uint64_t>, counterCount> mValues{}; /**< never reset: the totals since the construction */
+	std::array<std::atomic<uint64_t>, counterCount> mResetValues{}; /**< the totals when reset() was last called */
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_COUNTERS_HH
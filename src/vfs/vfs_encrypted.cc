@@ -18,15 +18,30 @@
  */
 
 #include "bctoolbox/vfs_encrypted.hh"
+#include "bctoolbox/crypto.h"
 #include "bctoolbox/defs.h"
 #include "bctoolbox/logging.h"
 #include "bctoolbox/vfs.h"
 #include "bctoolbox/vfs_standard.h"
+#include "vfs_counters.hh"
 #include "vfs_encryption_module.hh"
+#include "vfs_encryption_module_aes256gcm_filekey_sha256.hh"
 #include "vfs_encryption_module_aes256gcm_sha256.hh"
+#include "vfs_encryption_module_chacha20poly1305_sha256.hh"
 #include "vfs_encryption_module_dummy.hh"
+#include "vfs_integrity_tree.hh"
+#include "vfs_lru_cache.hh"
+#include "vfs_migration_task.hh"
+#include "vfs_read_ahead.hh"
+#include "vfs_shared_crypto.hh"
+#include "vfs_worker_pool.hh"
 #include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <future>
+#include <thread>
 
 // MSVC does not define O_ACCMODE...
 #ifndef O_ACCMODE
@@ -46,6 +61,10 @@ static size_t moduleFileHeaderSize(const uint16_t suite) {
 			return VfsEncryptionModuleDummy::moduleFileHeaderSize();
 		case static_cast<uint16_t>(EncryptionSuite::aes256gcm128_sha256):
 			return VfsEM_AES256GCM_SHA256::moduleFileHeaderSize();
+		case static_cast<uint16_t>(EncryptionSuite::chacha20poly1305_sha256):
+			return VfsEM_CHACHA20POLY1305_SHA256::moduleFileHeaderSize();
+		case static_cast<uint16_t>(EncryptionSuite::aes256gcm128_filekey_sha256):
+			return VfsEM_AES256GCM_FileKey_SHA256::moduleFileHeaderSize();
 		case static_cast<uint16_t>(EncryptionSuite::unset):
 		case static_cast<uint16_t>(EncryptionSuite::plain):
 		default:
@@ -60,6 +79,10 @@ static std::shared_ptr<VfsEncryptionModule> make_VfsEncryptionModule(const Encry
 			return std::make_shared<VfsEncryptionModuleDummy>();
 		case EncryptionSuite::aes256gcm128_sha256:
 			return std::make_shared<VfsEM_AES256GCM_SHA256>();
+		case EncryptionSuite::chacha20poly1305_sha256:
+			return std::make_shared<VfsEM_CHACHA20POLY1305_SHA256>();
+		case EncryptionSuite::aes256gcm128_filekey_sha256:
+			return std::make_shared<VfsEM_AES256GCM_FileKey_SHA256>();
 		case EncryptionSuite::plain:
 			return nullptr;
 		case EncryptionSuite::unset:
@@ -76,6 +99,10 @@ static std::shared_ptr<VfsEncryptionModule> make_VfsEncryptionModule(const uint1
 			return std::make_shared<VfsEncryptionModuleDummy>(moduleFileHeader);
 		case static_cast<uint16_t>(EncryptionSuite::aes256gcm128_sha256):
 			return std::make_shared<VfsEM_AES256GCM_SHA256>(moduleFileHeader);
+		case static_cast<uint16_t>(EncryptionSuite::chacha20poly1305_sha256):
+			return std::make_shared<VfsEM_CHACHA20POLY1305_SHA256>(moduleFileHeader);
+		case static_cast<uint16_t>(EncryptionSuite::aes256gcm128_filekey_sha256):
+			return std::make_shared<VfsEM_AES256GCM_FileKey_SHA256>(moduleFileHeader);
 		case static_cast<uint16_t>(EncryptionSuite::unset):
 		case static_cast<uint16_t>(EncryptionSuite::plain):
 		default:
@@ -89,6 +116,10 @@ const std::string bctoolbox::encryptionSuiteString(const EncryptionSuite suite)
 			return "dummy";
 		case EncryptionSuite::aes256gcm128_sha256:
 			return "AES256GCM_SHA256";
+		case EncryptionSuite::chacha20poly1305_sha256:
+			return "CHACHA20POLY1305_SHA256";
+		case EncryptionSuite::aes256gcm128_filekey_sha256:
+			return "AES256GCM_FILEKEY_SHA256";
 		case EncryptionSuite::plain:
 			return "plain";
 		case EncryptionSuite::unset:
@@ -111,144 +142,1585 @@ const std::string bctoolbox::encryptionSuiteString(const EncryptionSuite suite)
  *    - [Optionnal Encryption module data - size is given by the encryption suite selected]
  *
  * base header size is 29 bytes
+ *
+ * Version 1.01 files have a header extension, authenticated with the base header. It holds records:
+ *    - type: 2 bytes, 0 ends the records, the rest of the extension is padding
+ *    - length: 2 bytes
+ *    - value: length bytes
+ * Records of unknown type are skipped.
  */
 static const std::array BCENCRYPTEDFS = {0x62, 0x63, 0x45, 0x6e, 0x63, 0x72, 0x79, 0x70, 0x74, 0x65, 0x64, 0x46, 0x73};
 static constexpr uint16_t BcEncFS_v0100 = 0x0100;
+static constexpr uint16_t BcEncFS_v0101 = 0x0101;
 /* header cannot be less than this size, even for an empty file */
 static constexpr int64_t baseFileHeaderSize = 29;
+/* header extension size reserved at file creation, the chunks follow it so records cannot be added afterward */
+static constexpr size_t headerExtensionSize = 128;
+static constexpr uint16_t headerRecordEnd = 0x0000;
+/* size journal: first and last chunk index, 4 bytes each */
+static constexpr uint16_t headerRecordSizeJournal = 0x0001;
+static constexpr uint16_t sizeJournalRecordLength = 8;
+/* number of chunks the size journal covers after the end of file, so appending seldom widens it */
+static constexpr uint32_t sizeJournalWindowChunks = 64;
+/* integrity tree: depth on 1 byte, then the root */
+static constexpr uint16_t headerRecordIntegrityTree = 0x0002;
+static constexpr uint16_t integrityTreeRecordLength = 1 + VfsIntegrityTree::hashSize;
+/* re-keying: next chunk to re-key and end of the step in progress, 4 bytes each, then the new module file header */
+static constexpr uint16_t headerRecordRekey = 0x0003;
+static constexpr uint16_t rekeyRecordBaseLength = 8;
+/* the new module file header authenticates the magic number, version, suite, chunk size and header extension size */
+static constexpr size_t rekeyAuthenticatedHeaderSize = 21;
+/* holes: ranges of chunks of zeros left by sparse extensions, first and last chunk index, 4 bytes each */
+static constexpr uint16_t headerRecordHoles = 0x0004;
+static constexpr size_t holeRangeLength = 8;
+/* type and length of a record */
+static constexpr size_t headerRecordBaseLength = 4;
+/* the integrity tree nodes are stored in a file named after the encrypted one */
+static constexpr const char *integrityTreeSuffix = ".evfs_tree";
 
 static constexpr size_t defaultChunkSize = 4096; // default chunk size in bytes
+static constexpr size_t defaultChunkKeyCacheSize = 64; // default number of derived chunk keys kept in memory
+static constexpr size_t integrityCheckBatchBytes = 1 << 20; // size of raw data checked at once by the integrity check
+static constexpr size_t migrationBatchBytes = 1 << 20; // size of the plain data processed at once by the migration
+static constexpr size_t extensionBatchBytes = 1 << 20; // size of the zeros encrypted at once when extending a file
+static constexpr size_t rekeyBatchBytes = 1 << 20;     // size of the raw data re-keyed by default by one step
+
+/**
+ * Append to a buffer the given number of bytes of a value, big endian
+ */
+static void appendBigEndian(std::vector<uint8_t> &buffer, uint64_t value, size_t bytes) {
+	for (size_t i = bytes; i > 0; i--) {
+		buffer.push_back(static_cast<uint8_t>((value >> (8 * (i - 1))) & 0xFF));
+	}
+}
+
+/**
+ * Read a value stored big endian on the given number of bytes
+ */
+static uint64_t readBigEndian(const uint8_t *buffer, size_t bytes) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		value = (value << 8) | buffer[i];
+	}
+	return value;
+}
+
+/**
+ * Number of chunks processed at once by the migration of a plain file
+ */
+static size_t migrationBatchChunks(size_t chunkSize) {
+	return std::max(migrationBatchBytes / chunkSize, size_t(1));
+}
+
+/**
+ * Wipe a plain chunk leaving the plain chunk cache
+ */
+static void cleanPlainChunk(std::vector<uint8_t> &chunk) {
+	bctbx_clean(chunk.data(), chunk.size());
+}
 
 /**
  * Initialiase the static callback property
  */
 EncryptedVfsOpenCb VfsEncryption::s_openCallback = nullptr;
 
-VfsEncryption::VfsEncryption(bctbx_vfs_file_t *stdFp, const std::string &filename, int openFlags, int accessMode)
-    : mVersionNumber(BcEncFS_v0100), // default version number is the current one
-      mChunkSize(0), // set to 0 at creation, is will be populated by parseHeader if there is one. If we are creating a
-                     // file, let a chance to the callback to set the chunk size.
-      m_module(nullptr), // encryption module is set by callback or when parsing the header
-      mHeaderExtensionSize(0), mFilename(filename), mFileSize(0), mEncryptExistingPlainFile(false),
-      mIntegrityFullCheck(false), mAccessMode(accessMode), pFileStd(stdFp) {
+VfsEncryption::VfsEncryption(bctbx_vfs_file_t *stdFp, const std::string &filename, int openFlags, int accessMode)
+    : mVersionNumber(BcEncFS_v0100), // default version number is the current one
+      mChunkSize(0), // set to 0 at creation, is will be populated by parseHeader if there is one. If we are creating a
+                     // file, let a chance to the callback to set the chunk size.
+      m_module(nullptr), // encryption module is set by callback or when parsing the header
+      mHeaderExtensionSize(0), mFilename(filename), mFileSize(0), mEncryptExistingPlainFile(false),
+      mIntegrityFullCheck(false), mAccessMode(accessMode), mChunkKeyCacheSize(defaultChunkKeyCacheSize),
+      mPlainChunkCache(std::make_unique<LruCache<uint32_t, std::vector<uint8_t>>>(0, cleanPlainChunk)),
+      mHeaderUpdateInterval(1), mPendingHeaderUpdates(0), mDirtyBytes(0), mWriteBackBufferSize(0),
+      mSparseExtension(false), mSizeJournal(false), mJournalWidened(false), mJournalFirstChunk(1),
+      mJournalLastChunk(0), mHeaderFileSize(0), mIntegrityTree(false), mRekeyNextChunk(0), mRekeyPendingEnd(0),
+      mRekeyRate(0), mLineChunkIndex(0), mReadAhead(std::make_unique<VfsReadAhead>(*this)),
+      mCounters(std::make_shared<VfsCounters>()), mMigrationProgressCb(nullptr), mMigrationInBackground(false),
+      pFileStd(stdFp) {
+
+	if (stdFp == NULL) throw EVFS_EXCEPTION << "Cannot create a vfs encrytion object, vfs pointer is null";
+
+	try {
+		openSetup(openFlags);
+	} catch (...) {
+		// the destructor does not run: close the file here, it may be a migrated one replacing stdFp
+		if (mMigrationTask != nullptr) {
+			mMigrationTask->release();
+		}
+		bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+		if (pFileStd != nullptr) {
+			bctbx_file_close(pFileStd);
+			pFileStd = nullptr;
+		}
+		throw;
+	}
+}
+
+void VfsEncryption::openSetup(int openFlags) {
+	// If the file exists, read the header to check it is an encrypted file and gets its encrypted policy
+	// if the file is plain, set the mFileSize so then we now we already have a file but it is plain
+	bool createFile = true;
+	if (bctbx_file_size(pFileStd) > 0) {
+		parseHeader();
+		createFile = false;
+	}
+
+	/* if the static callback is set, call it */
+	if (VfsEncryption::openCallbackGet() != nullptr) {
+		(VfsEncryption::openCallbackGet())(*this);
+	} else {
+		throw EVFS_EXCEPTION << "Encrypted VFS: must provide a callback to setup key material";
+	}
+
+	if (m_module == nullptr) { // this is a plain file and we want to keep it this way
+		return;
+	}
+	m_module->chunkKeyCacheSizeSet(mChunkKeyCacheSize);
+	if (rekeyInProgressGet() && mRekeyModule == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename
+		                     << " is being re-keyed, the open callback must give the new secret material";
+	}
+
+	/* check we have a valid chunk size */
+	if (mChunkSize == 0) {             // this is a file creation and the callback didn't set it
+		mChunkSize = defaultChunkSize; // assign the default one
+	}
+
+	if (mEncryptExistingPlainFile == true && mMigrationInBackground == true) {
+		bool migrated = migrateInBackground(openFlags);
+		bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+		mSecretMaterial.clear();
+		if (!migrated) { // the file is accessed as plain until the migration is completed
+			return;
+		}
+		// the plain file was replaced by the migrated one, check it as any encrypted file
+	}
+
+	bool headerUpdateNeeded = false;
+	bool treeOpened = false;
+	if (mEncryptExistingPlainFile == true) { // we have a plain file to encrypt
+		bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+		mSecretMaterial.clear();
+		migrate(openFlags);
+		headerUpdateNeeded = integrityTreeOpen();
+	} else { // no migration but now we shall have all the material (settings and keys ) to check the file integrity
+		if (mFileSize > 0) { // this is not a file creation
+			if (m_module->checkIntegrity(*this) != true) {
+				mCounters->add(VfsCounters::integrityFailures, 1);
+				throw EVFS_EXCEPTION << "Integrity check fail while opening file " << mFilename;
+			} else { // header integrity is Ok
+				// chunks of an interrupted re-keying step may use either secret material: re-key them, and update
+				// their integrity tree, first
+				if (rekeyInProgressGet()) {
+					headerUpdateNeeded = integrityTreeOpen();
+					treeOpened = true;
+					rekeyResume();
+				}
+				if (mIntegrityFullCheck == true) { // file size in header is wrong, check the chunks and update header
+					// the tree refreshes the leaves of the journal chunks before the header update narrows it
+					if (!treeOpened) {
+						headerUpdateNeeded = integrityTreeOpen();
+						treeOpened = true;
+					}
+					if (journaledChunksCheck()) {
+						BCTBX_SLOGW << "Encrypted FS: Size journal chunks [" << mJournalFirstChunk << ", "
+						            << mJournalLastChunk << "] integrity check successfull";
+					} else {
+						checkChunksIntegrity();
+						BCTBX_SLOGW << "Encrypted FS: Whole file integrity check successfull";
+					}
+					// all clear, update header
+					writeHeader();
+					BCTBX_SLOGW << "Encrypted FS: update header with correct file size";
+				}
+			}
+		}
+		if (createFile) {
+			headerExtensionReserve();
+		}
+		if (!treeOpened) {
+			headerUpdateNeeded = integrityTreeOpen() || createFile;
+		}
+	}
+
+	if (headerUpdateNeeded) {
+		writeHeader();
+	}
+}
+
+VfsEncryption::VfsEncryption(bctbx_vfs_file_t *stdFp,
+                             const std::string &filename,
+                             const std::shared_ptr<VfsEncryptionModule> &module,
+                             size_t chunkSize)
+    : mVersionNumber(BcEncFS_v0100), mChunkSize(chunkSize), m_module(module), mHeaderExtensionSize(0),
+      mFilename(filename), mFileSize(0), mEncryptExistingPlainFile(false), mIntegrityFullCheck(false),
+      mAccessMode(O_RDWR), mChunkKeyCacheSize(defaultChunkKeyCacheSize),
+      mPlainChunkCache(std::make_unique<LruCache<uint32_t, std::vector<uint8_t>>>(0, cleanPlainChunk)),
+      mHeaderUpdateInterval(1), mPendingHeaderUpdates(0), mDirtyBytes(0), mWriteBackBufferSize(0),
+      mSparseExtension(false), mSizeJournal(false), mJournalWidened(false), mJournalFirstChunk(1),
+      mJournalLastChunk(0), mHeaderFileSize(0), mIntegrityTree(false), mRekeyNextChunk(0), mRekeyPendingEnd(0),
+      mRekeyRate(0), mLineChunkIndex(0), mReadAhead(std::make_unique<VfsReadAhead>(*this)),
+      mCounters(std::make_shared<VfsCounters>()), mMigrationProgressCb(nullptr), mMigrationInBackground(false),
+      pFileStd(stdFp) {
+}
+
+bool VfsEncryption::migrateChunks(uint32_t firstChunk,
+                                  const std::function<ssize_t(uint8_t *, size_t, uint64_t)> &readPlain,
+                                  const std::function<bool(const uint8_t *, size_t, uint32_t)> &writeRaw,
+                                  const std::function<void(uint64_t)> &progress) {
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t batchChunks = migrationBatchChunks(mChunkSize);
+	const size_t batchSize = batchChunks * mChunkSize;
+	// two sets of buffers: one is encrypted while the other one is read (plain) or written (raw)
+	std::array<std::vector<uint8_t>, 2> plainBatches{std::vector<uint8_t>(batchSize), std::vector<uint8_t>(batchSize)};
+	std::array<std::vector<uint8_t>, 2> rawBatches{std::vector<uint8_t>(batchChunks * rawChunkSize),
+	                                               std::vector<uint8_t>(batchChunks * rawChunkSize)};
+	// the worker pool futures do not wait when destroyed: every path below waits for them before leaving
+	std::future<ssize_t> pendingRead;
+	std::future<bool> pendingWrite;
+	auto startRead = [&](size_t slot, uint32_t chunkIndex) {
+		uint8_t *plain = plainBatches[slot].data();
+		uint64_t offset = static_cast<uint64_t>(chunkIndex) * mChunkSize;
+		return VfsWorkerPool::get().async([&readPlain, plain, batchSize, offset]() {
+			return readPlain(plain, batchSize, offset);
+		});
+	};
+
+	bool endReached = true;
+	uint64_t pendingWriteEnd = 0; // end of the plain data in the batch being written
+	try {
+		uint32_t chunkIndex = firstChunk;
+		size_t slot = 0;
+		pendingRead = startRead(slot, chunkIndex);
+		while (true) {
+			ssize_t readSize = pendingRead.get();
+			if (readSize < 0) {
+				throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not read file";
+			}
+			if (readSize == 0) {
+				break;
+			}
+			size_t chunkCount = (static_cast<size_t>(readSize) + mChunkSize - 1) / mChunkSize;
+			bool lastBatch = static_cast<size_t>(readSize) < batchSize;
+			if (!lastBatch) { // read the next batch while this one is encrypted
+				pendingRead = startRead(slot ^ 1, chunkIndex + static_cast<uint32_t>(chunkCount));
+			}
+
+			// encrypt
+			mChunkJobs.clear();
+			for (size_t i = 0; i < chunkCount; i++) {
+				size_t plainSize = std::min(mChunkSize, static_cast<size_t>(readSize) - i * mChunkSize);
+				mChunkJobs.push_back(ChunkJob{chunkIndex + static_cast<uint32_t>(i),
+				                              rawBatches[slot].data() + i * rawChunkSize, 0,
+				                              plainBatches[slot].data() + i * mChunkSize, nullptr, plainSize});
+			}
+			runChunkJobs();
+			size_t rawSize = (chunkCount - 1) * rawChunkSize + m_module->getChunkHeaderSize() +
+			                 mChunkJobs.back().plainSize; // last chunk may be incomplete
+
+			// the previous batch must be written before this one
+			if (pendingWrite.valid()) {
+				if (!pendingWrite.get()) {
+					endReached = false;
+					break;
+				}
+				if (progress) progress(pendingWriteEnd);
+			}
+			const uint8_t *raw = rawBatches[slot].data();
+			pendingWrite = VfsWorkerPool::get().async(
+			    [&writeRaw, raw, rawSize, chunkIndex]() { return writeRaw(raw, rawSize, chunkIndex); });
+			pendingWriteEnd = static_cast<uint64_t>(chunkIndex) * mChunkSize + static_cast<uint64_t>(readSize);
+
+			chunkIndex += static_cast<uint32_t>(chunkCount);
+			slot ^= 1;
+			if (lastBatch) {
+				break;
+			}
+		}
+		if (pendingWrite.valid()) {
+			if (pendingWrite.get()) {
+				if (progress) progress(pendingWriteEnd);
+			} else {
+				endReached = false;
+			}
+		}
+		if (pendingRead.valid()) { // stopped before reading everything
+			pendingRead.wait();
+		}
+	} catch (...) {
+		if (pendingRead.valid()) pendingRead.wait();
+		if (pendingWrite.valid()) pendingWrite.wait();
+		for (auto &plainBatch : plainBatches) {
+			bctbx_clean(plainBatch.data(), plainBatch.size());
+		}
+		throw;
+	}
+	for (auto &plainBatch : plainBatches) {
+		bctbx_clean(plainBatch.data(), plainBatch.size());
+	}
+	return endReached;
+}
+
+void VfsEncryption::migrate(int openFlags) {
+	// create a temporary file
+	std::string tmpFilename(mFilename);
+	tmpFilename.append(".evfs_tmp");
+	// make sure this file does not exists
+	std::remove(tmpFilename.data());
+	auto stdFdTmp = bctbx_file_open2(bctbx_vfs_get_standard(), tmpFilename.data(), O_WRONLY | O_CREAT);
+	if (stdFdTmp == nullptr) {
+		throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not open temporary file "
+		                     << tmpFilename;
+	}
+
+	// encrypt the whole file in the temporary one, the chunks follow the header extension
+	headerExtensionReserve();
+	const uint64_t plainSize = mFileSize;
+	try {
+		migrateChunks(
+		    0,
+		    [this](uint8_t *buffer, size_t size, uint64_t offset) {
+			    return rawRead(buffer, size, offset);
+		    },
+		    [this, stdFdTmp, &tmpFilename](const uint8_t *buffer, size_t size, uint32_t firstChunk) {
+			    if (rawWrite(buffer, size, getChunkOffset(firstChunk), stdFdTmp) - size != 0) {
+				    throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename
+				                         << ". Could not write to temporary file " << tmpFilename;
+			    }
+			    return true;
+		    },
+		    [this, plainSize](uint64_t migrated) {
+			    if (mMigrationProgressCb) mMigrationProgressCb(mFilename, migrated, plainSize);
+		    });
+
+		// write header and close
+		writeHeader(stdFdTmp);
+	} catch (...) {
+		bctbx_file_close(stdFdTmp);
+		throw;
+	}
+	bctbx_file_close(stdFdTmp);
+
+	migrationReplace(tmpFilename, openFlags);
+	mEncryptExistingPlainFile = false;
+}
+
+bool VfsEncryption::migrateInBackground(int openFlags) {
+	auto tmpFilename = VfsMigrationTask::commit(mFilename);
+	if (tmpFilename.empty()) { // start or go on with the migration, the file stays plain meanwhile
+		mMigrationTask = VfsMigrationTask::acquire(mFilename, m_module, mSecretMaterial, mChunkSize, mSizeJournal,
+		                                           mMigrationProgressCb);
+		m_module = nullptr;
+		mEncryptExistingPlainFile = false;
+		return false;
+	}
+
+	// the migration is completed: replace the plain file and parse the encrypted one
+	migrationReplace(tmpFilename, openFlags);
+	mEncryptExistingPlainFile = false;
+	m_module = nullptr;
+	mFileSize = 0;
+	parseHeader();
+	if (m_module == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: migrated file " << mFilename << " is not encrypted";
+	}
+	m_module->setModuleSecretMaterial(mSecretMaterial);
+	m_module->chunkKeyCacheSizeSet(mChunkKeyCacheSize);
+	BCTBX_SLOGI << "Encrypted FS: migrated file " << mFilename << " replaced the plain one";
+	return true;
+}
+
+void VfsEncryption::migrationReplace(const std::string &tmpFilename, int openFlags) {
+	// delete the original file
+	bctbx_file_close(pFileStd);
+	pFileStd = nullptr;
+	if (std::remove(mFilename.data()) != 0) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot remove plain file " << mFilename << ": " << strerror(errno);
+	}
+
+	// rename the temporary one
+	if (std::rename(tmpFilename.data(), mFilename.data()) != 0) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot replace plain file " << mFilename << " by its encrypted version "
+		                     << tmpFilename << ": " << strerror(errno);
+	}
+
+	// and reopen it with the standard vfs
+	pFileStd = bctbx_file_open2(bctbx_vfs_get_standard(), mFilename.data(), openFlags);
+	if (pFileStd == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot reopen migrated file " << mFilename;
+	}
+}
+
+uint32_t VfsEncryption::migrationResume(const std::vector<uint8_t> &secretMaterial) {
+	auto module = m_module;
+	const size_t chunkSize = mChunkSize;
+	const bool sizeJournal = mSizeJournal;
+	try {
+		parseHeader();
+		// the header extension, holding the size journal, cannot be added once there are chunks
+		if (m_module != nullptr && m_module->getEncryptionSuite() == module->getEncryptionSuite() &&
+		    mChunkSize == chunkSize && (mHeaderExtensionSize > 0) == sizeJournal) {
+			m_module->setModuleSecretMaterial(secretMaterial);
+			m_module->chunkKeyCacheSizeSet(mChunkKeyCacheSize);
+			if (m_module->checkIntegrity(*this)) {
+				// count the complete chunks in the file
+				uint64_t rawSize = static_cast<uint64_t>(bctbx_file_size(pFileStd));
+				uint32_t chunkCount = static_cast<uint32_t>((rawSize - getChunkOffset(0)) / rawChunkSizeGet());
+				// everything was synced before the last batch was written, it may be incomplete: check it
+				mFileSize = static_cast<uint64_t>(chunkCount) * mChunkSize;
+				uint32_t resumeChunk =
+				    chunkCount - static_cast<uint32_t>(std::min(migrationBatchChunks(mChunkSize), size_t(chunkCount)));
+				std::vector<uint8_t> plainChunk(mChunkSize);
+				try {
+					for (; resumeChunk < chunkCount; resumeChunk++) {
+						read(plainChunk.data(), mChunkSize, static_cast<size_t>(resumeChunk) * mChunkSize);
+					}
+				} catch (EvfsException const &) {
+					// resume from this chunk
+				}
+				bctbx_clean(plainChunk.data(), plainChunk.size());
+				mFileSize = static_cast<uint64_t>(resumeChunk) * mChunkSize;
+				return resumeChunk;
+			}
+		}
+	} catch (EvfsException const &e) {
+		BCTBX_SLOGW << "Encrypted FS: cannot resume migration from " << mFilename << ": " << e;
+	}
+
+	// nothing to resume from, start a new migration, with a header extension if it gets a size journal
+	m_module = module;
+	mChunkSize = chunkSize;
+	mVersionNumber = BcEncFS_v0100;
+	mHeaderExtensionSize = 0;
+	mSizeJournal = sizeJournal;
+	mIntegrityTree = false;
+	mHoleRanges.clear();
+	headerExtensionReserve();
+	mFileSize = 0;
+	mIntegrityFullCheck = false;
+	bctbx_file_truncate(pFileStd, 0);
+	writeHeader();
+	bctbx_file_sync(pFileStd);
+	return 0;
+}
+
+void VfsEncryption::migrationProgressCallbackSet(const EncryptedVfsMigrationProgressCb &cb) noexcept {
+	mMigrationProgressCb = cb;
+}
+
+void VfsEncryption::migrationInBackgroundSet(const bool background) noexcept {
+	mMigrationInBackground = background;
+}
+
+bool VfsEncryption::migrationInBackgroundGet() const noexcept {
+	return mMigrationInBackground;
+}
+
+bool VfsEncryption::migrationWait(const std::string &filename) {
+	return VfsMigrationTask::wait(filename);
+}
+
+void VfsEncryption::migrationStopAll() {
+	VfsMigrationTask::stopAll();
+}
+
+int VfsEncryption::fileRemove(const std::string &filename) {
+	int ret = std::remove(filename.data());
+	std::remove((filename + integrityTreeSuffix).data());
+	std::remove((filename + integrityTreeSuffix + VfsIntegrityTree::undoSuffix).data());
+	return ret;
+}
+
+int VfsEncryption::fileRename(const std::string &from, const std::string &to) {
+	if (std::rename(from.data(), to.data()) != 0) {
+		return -1;
+	}
+	// the tree is useless without its file: a stale one at the destination goes away, whatever the source has
+	const std::string fromTree(from + integrityTreeSuffix);
+	const std::string toTree(to + integrityTreeSuffix);
+	std::remove(toTree.data());
+	if (std::rename(fromTree.data(), toTree.data()) != 0 && errno != ENOENT) {
+		BCTBX_SLOGW << "Encrypted FS: cannot rename integrity tree of " << from << " to " << toTree
+		            << ", it must be rebuilt";
+	}
+	// its undo log exists only if the process writing it stopped before the header update
+	const std::string fromUndo(fromTree + VfsIntegrityTree::undoSuffix);
+	const std::string toUndo(toTree + VfsIntegrityTree::undoSuffix);
+	std::remove(toUndo.data());
+	if (std::rename(fromUndo.data(), toUndo.data()) != 0 && errno != ENOENT) {
+		BCTBX_SLOGW << "Encrypted FS: cannot rename integrity tree undo log of " << from << " to " << toUndo;
+	}
+	return 0;
+}
+
+/**
+ * Decrypt every chunk of the given range, by batches, so each chunk integrity is checked
+ * The next batch is read while the current one is decrypted, an exception is thrown on the first failure
+ */
+void VfsEncryption::checkChunksIntegrity(uint32_t firstChunk, uint32_t lastChunk) {
+	if (mFileSize == 0 || getChunkIndex(mFileSize - 1) < firstChunk) { // no chunk
+		return;
+	}
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	// index of the chunk following the last one checked
+	const uint64_t chunkNumber = static_cast<uint64_t>(std::min(getChunkIndex(mFileSize - 1), lastChunk)) + 1;
+	const size_t batchChunks = std::max(integrityCheckBatchBytes / rawChunkSize, size_t(1));
+	std::array<std::vector<uint8_t>, 2> rawBatches{std::vector<uint8_t>(batchChunks * rawChunkSize),
+	                                               std::vector<uint8_t>(batchChunks * rawChunkSize)};
+	std::vector<uint8_t> plainBatch(batchChunks * mChunkSize);
+	std::future<ssize_t> pendingRead; // does not wait when destroyed: every path below waits for it before leaving
+	auto startRead = [&](size_t slot, uint64_t batchChunk) {
+		size_t chunkCount = static_cast<size_t>(std::min(chunkNumber - batchChunk, static_cast<uint64_t>(batchChunks)));
+		uint8_t *raw = rawBatches[slot].data();
+		uint64_t offset = getChunkOffset(static_cast<uint32_t>(batchChunk));
+		size_t size = chunkCount * rawChunkSize;
+		return VfsWorkerPool::get().async([this, raw, size, offset]() { return rawRead(raw, size, offset); });
+	};
+
+	try {
+		size_t slot = 0;
+		pendingRead = startRead(slot, firstChunk);
+		for (uint64_t batchChunk = firstChunk; batchChunk < chunkNumber; batchChunk += batchChunks) {
+			size_t chunkCount =
+			    static_cast<size_t>(std::min(chunkNumber - batchChunk, static_cast<uint64_t>(batchChunks)));
+			ssize_t readSize = pendingRead.get();
+			if (readSize < 0) {
+				throw EVFS_EXCEPTION
+				    << "fail to read file while trying to check the full integrity, file_read returned " << readSize;
+			}
+			if (batchChunk + chunkCount < chunkNumber) {
+				pendingRead = startRead(slot ^ 1, batchChunk + chunkCount);
+			}
+			mChunkJobs.clear();
+			uint8_t *rawBatch = rawBatches[slot].data();
+			for (size_t i = 0; i < chunkCount && i * rawChunkSize + chunkHeaderSize <= static_cast<size_t>(readSize);
+			     i++) {
+				size_t chunkRawSize = std::min(rawChunkSize, static_cast<size_t>(readSize) - i * rawChunkSize);
+				mChunkJobs.push_back(ChunkJob{static_cast<uint32_t>(batchChunk + i),
+				                              rawBatch + i * rawChunkSize, chunkRawSize, nullptr,
+				                              plainBatch.data() + i * mChunkSize, chunkRawSize - chunkHeaderSize});
+			}
+			if (mChunkJobs.size() != chunkCount) {
+				throw EVFS_EXCEPTION << "Integrity check fail on file " << mFilename << ": missing chunks";
+			}
+			// decrypt the chunks, stop on the first failure and let the exception flow up
+			runChunkJobs();
+			slot ^= 1;
+		}
+	} catch (...) {
+		if (pendingRead.valid()) pendingRead.wait();
+		bctbx_clean(plainBatch.data(), plainBatch.size());
+		throw;
+	}
+	bctbx_clean(plainBatch.data(), plainBatch.size());
+}
+
+/**
+ * Encrypt or decrypt the collected chunks, spread them on the worker threads if there are enough
+ * Each job writes only in its own chunk so the result does not depend on the execution order
+ */
+void VfsEncryption::runChunkJobs() const {
+	// holes need no crypto: decrypting one gives zeros, re-encrypting one is encrypting a new chunk
+	if (!mHoleRanges.empty()) {
+		size_t kept = 0;
+		for (auto &job : mChunkJobs) {
+			if (job.rawChunkSize > 0 && isHole(job.chunkIndex, job.rawChunk, job.rawChunkSize)) {
+				if (job.plainOut != nullptr) {
+					memset(job.plainOut, 0, job.plainSize);
+					continue;
+				}
+				job.rawChunkSize = 0;
+			}
+			mChunkJobs[kept++] = job;
+		}
+		mChunkJobs.resize(kept);
+	}
+
+	// Group consecutive decryptions or new chunks encryptions in runs processed by one batch call to the module.
+	// Runs are not longer than the share of one thread, so they can still be spread on the worker pool
+	auto &pool = VfsWorkerPool::get();
+	const size_t jobCount = mChunkJobs.size();
+	const size_t concurrency = pool.concurrencyGet(jobCount);
+	const size_t maxRunLength = (jobCount + concurrency - 1) / concurrency;
+	const size_t rawChunkSize = mChunkSize + m_module->getChunkHeaderSize();
+	auto extends = [this, rawChunkSize](const ChunkJob &previous, const ChunkJob &job) {
+		if (job.chunkIndex != previous.chunkIndex + 1 || job.rawChunk != previous.rawChunk + rawChunkSize ||
+		    &chunkModule(job.chunkIndex) != &chunkModule(previous.chunkIndex)) {
+			return false;
+		}
+		// a chunk of an interrupted re-keying step is decrypted alone
+		if (rekeyPending(previous.chunkIndex) || rekeyPending(job.chunkIndex)) {
+			return false;
+		}
+		if (previous.plainOut != nullptr) { // decrypt
+			return job.plainOut == previous.plainOut + mChunkSize && previous.rawChunkSize == rawChunkSize;
+		}
+		return previous.rawChunkSize == 0 && job.plainOut == nullptr && job.rawChunkSize == 0 && // new chunks
+		       job.plainIn == previous.plainIn + mChunkSize && previous.plainSize == mChunkSize;
+	};
+	std::vector<std::pair<size_t, size_t>> runs; // first job index, job count
+	for (size_t i = 0; i < jobCount; i++) {
+		if (!runs.empty() && runs.back().second < maxRunLength && extends(mChunkJobs[i - 1], mChunkJobs[i])) {
+			runs.back().second++;
+		} else {
+			runs.emplace_back(i, 1);
+		}
+	}
+
+	pool.run(
+	    runs.size(),
+	    [this, &runs, rawChunkSize](size_t r) {
+		    const auto &job = mChunkJobs[runs[r].first];
+		    const auto &last = mChunkJobs[runs[r].first + runs[r].second - 1];
+		    const size_t chunkCount = runs[r].second;
+		    auto &module = chunkModule(job.chunkIndex);
+		    VfsCounters::ModuleCall call(mCounters.get(),
+		                                 (job.plainOut != nullptr) ? VfsCounters::chunksDecrypted
+		                                                           : VfsCounters::chunksEncrypted,
+		                                 chunkCount);
+		    if (job.plainOut != nullptr && rekeyPending(job.chunkIndex)) {
+			    rekeyPendingDecrypt(job.chunkIndex, job.rawChunk, job.rawChunkSize, job.plainOut);
+		    } else if (job.plainOut != nullptr) { // decrypt
+			    module.decryptChunks(job.chunkIndex, job.rawChunk, (chunkCount - 1) * rawChunkSize + last.rawChunkSize,
+			                         mChunkSize, job.plainOut);
+		    } else if (job.rawChunkSize > 0) { // re-encrypt
+			    module.encryptChunk(job.chunkIndex, job.rawChunk, job.rawChunkSize, job.plainIn, job.plainSize);
+		    } else { // new chunks
+			    module.encryptChunks(job.chunkIndex, job.plainIn, (chunkCount - 1) * mChunkSize + last.plainSize,
+			                         mChunkSize, job.rawChunk);
+		    }
+	    },
+	    jobCount);
+}
+
+ssize_t VfsEncryption::rawRead(void *buffer, size_t size, uint64_t offset) const {
+	ssize_t ret = bctbx_file_read(pFileStd, buffer, size, (off_t)offset);
+	if (ret > 0) {
+		mCounters->add(VfsCounters::rawBytesRead, static_cast<uint64_t>(ret));
+	}
+	return ret;
+}
+
+ssize_t VfsEncryption::rawWrite(const void *buffer, size_t size, uint64_t offset, bctbx_vfs_file_t *fp) const {
+	ssize_t ret = bctbx_file_write((fp == nullptr) ? pFileStd : fp, buffer, size, (off_t)offset);
+	if (ret > 0) {
+		mCounters->add(VfsCounters::rawBytesWritten, static_cast<uint64_t>(ret));
+	}
+	return ret;
+}
+
+ssize_t
+VfsEncryption::rawWritev(const bctbx_vfs_iovec_t *iov, int iovcnt, uint64_t offset, bctbx_vfs_file_t *fp) const {
+	ssize_t ret = bctbx_file_writev((fp == nullptr) ? pFileStd : fp, iov, iovcnt, (off_t)offset);
+	if (ret > 0) {
+		mCounters->add(VfsCounters::rawBytesWritten, static_cast<uint64_t>(ret));
+	}
+	return ret;
+}
+
+VfsEncryptionStats VfsEncryption::statsGet() const noexcept {
+	return mCounters->get();
+}
+
+void VfsEncryption::statsReset() noexcept {
+	mCounters->reset();
+}
+
+VfsEncryptionStats VfsEncryption::globalStatsGet() noexcept {
+	return VfsCounters::globalGet();
+}
+
+void VfsEncryption::globalStatsReset() noexcept {
+	VfsCounters::globalReset();
+}
+
+void VfsEncryption::workerThreadsSet(const size_t count) {
+	VfsWorkerPool::get().threadCountSet(count);
+}
+
+size_t VfsEncryption::workerThreadsGet() {
+	return VfsWorkerPool::get().threadCountGet();
+}
+
+void VfsEncryption::parallelChunkThresholdSet(const size_t threshold) {
+	VfsWorkerPool::get().thresholdSet(threshold);
+}
+
+size_t VfsEncryption::parallelChunkThresholdGet() {
+	return VfsWorkerPool::get().thresholdGet();
+}
+
+void VfsEncryption::derivedKeyCacheSizeSet(const size_t size) {
+	VfsDerivedKeyCache::capacitySet(size);
+}
+
+size_t VfsEncryption::derivedKeyCacheSizeGet() {
+	return VfsDerivedKeyCache::capacityGet();
+}
+
+/**
+ * The file header holds the plain file size: it must be written after the file size changed.
+ * Depending on the header update interval, write it now or just mark it as pending.
+ * The header is written after the chunks: while the write back buffer holds dirty chunks, the update waits for the
+ * buffer to be flushed, otherwise each write changing the file size would flush it.
+ */
+void VfsEncryption::headerUpdate() {
+	mPendingHeaderUpdates++;
+	if (mHeaderUpdateInterval != 0 && mPendingHeaderUpdates >= mHeaderUpdateInterval && mDirtyChunks.empty()) {
+		headerFlush();
+	}
+}
+
+void VfsEncryption::headerFlush() {
+	mReadAhead->cancel();
+	// the header holds the file size: the chunks must be written before it
+	dirtyChunksFlush();
+	// a widened size journal is narrowed back once the chunks are written
+	if ((mPendingHeaderUpdates > 0 || mJournalWidened) && m_module != nullptr) {
+		writeHeader();
+	}
+	mPendingHeaderUpdates = 0;
+}
+
+void VfsEncryption::headerUpdateIntervalSet(const size_t interval) {
+	mHeaderUpdateInterval = interval;
+	if (mHeaderUpdateInterval != 0 && mPendingHeaderUpdates >= mHeaderUpdateInterval) {
+		headerFlush();
+	}
+}
+
+size_t VfsEncryption::headerUpdateIntervalGet() const noexcept {
+	return mHeaderUpdateInterval;
+}
+
+void VfsEncryption::sizeJournalSet(const bool journal) noexcept {
+	mSizeJournal = journal;
+}
+
+bool VfsEncryption::sizeJournalGet() const noexcept {
+	return mSizeJournal;
+}
+
+bool VfsEncryption::sizeJournalActive() const noexcept {
+	return mSizeJournal && mHeaderExtensionSize > 0;
+}
+
+/**
+ * The size journal holds all the chunks that may have been written since the file size was written in the header:
+ * it is written before them. Widen it enough to hold the chunks about to be written and write the header, holding
+ * the file size it already has.
+ */
+void VfsEncryption::journalChunks(uint32_t firstChunk, uint32_t lastChunk) {
+	if (!sizeJournalActive()) {
+		return;
+	}
+	if (mJournalFirstChunk <= mJournalLastChunk && firstChunk >= mJournalFirstChunk &&
+	    lastChunk <= mJournalLastChunk) {
+		return;
+	}
+	if (mJournalFirstChunk <= mJournalLastChunk) {
+		mJournalFirstChunk = std::min(mJournalFirstChunk, firstChunk);
+	} else {
+		mJournalFirstChunk = firstChunk;
+	}
+	// cover the chunks following the written ones too, so the next writes are likely to be in the journal already
+	uint32_t windowEnd = (lastChunk > UINT32_MAX - sizeJournalWindowChunks) ? UINT32_MAX
+	                                                                         : lastChunk + sizeJournalWindowChunks;
+	mJournalLastChunk = std::max(mJournalLastChunk, windowEnd);
+	mJournalWidened = true;
+	writeHeader(nullptr, mHeaderFileSize);
+}
+
+bool VfsEncryption::journaledChunksCheck() {
+	if (!sizeJournalActive() || mJournalFirstChunk > mJournalLastChunk) {
+		return false;
+	}
+	// the chunks between the end of file given by the header and the actual one were written after the header: if
+	// the journal does not hold them, it does not describe what happened to the file
+	uint64_t lowSize = std::min(mHeaderFileSize, mFileSize);
+	uint64_t highSize = std::max(mHeaderFileSize, mFileSize);
+	if (getChunkIndex(lowSize) < mJournalFirstChunk ||
+	    (highSize > 0 && getChunkIndex(highSize - 1) > mJournalLastChunk)) {
+		BCTBX_SLOGW << "Encrypted FS: size journal of " << mFilename << " does not hold the modified chunks";
+		return false;
+	}
+	checkChunksIntegrity(mJournalFirstChunk, mJournalLastChunk);
+	return true;
+}
+
+void VfsEncryption::integrityTreeSet(const bool tree) noexcept {
+	mIntegrityTree = tree;
+}
+
+bool VfsEncryption::integrityTreeGet() const noexcept {
+	return mIntegrityTree;
+}
+
+/**
+ * A tree not matching the header, or which file cannot be opened, is kept but invalid: rebuilding it silently would
+ * accept a rolled back file
+ */
+bool VfsEncryption::integrityTreeOpen() {
+	if (!mIntegrityTree || mHeaderExtensionSize == 0) {
+		return false;
+	}
+	const bool readOnly = (mAccessMode == O_RDONLY);
+	if (mIntegrityTreeRecord.empty() && readOnly) {
+		BCTBX_SLOGW << "Encrypted FS: file " << mFilename << " opened in read only mode has no integrity tree";
+		return false;
+	}
+	mTree = std::make_unique<VfsIntegrityTree>(mFilename + integrityTreeSuffix, mCounters.get());
+	try {
+		if (mIntegrityTreeRecord.empty()) { // created, migrated or the tree was enabled after its creation
+			mTree->open(readOnly, 0, std::vector<uint8_t>(VfsIntegrityTree::hashSize, 0));
+			integrityTreeBuild();
+			return true;
+		}
+		if (!mTree->open(readOnly, mIntegrityTreeRecord[0],
+		                 std::vector<uint8_t>(mIntegrityTreeRecord.cbegin() + 1, mIntegrityTreeRecord.cend()))) {
+			mCounters->add(VfsCounters::integrityFailures, 1);
+			BCTBX_SLOGW << "Encrypted FS: integrity tree of " << mFilename << " does not match the file header";
+			return false;
+		}
+	} catch (EvfsException const &e) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		BCTBX_SLOGW << "Encrypted FS: integrity tree of " << mFilename << " is not available: " << e;
+		return false;
+	}
+	return integrityTreeJournalRefresh();
+}
+
+/**
+ * The chunks written after the root in the header, by a process which stopped before writing the next one, are in
+ * the size journal: their leaves are updated once the chunks are checked
+ */
+bool VfsEncryption::integrityTreeJournalRefresh() {
+	if (!sizeJournalActive() || mJournalFirstChunk > mJournalLastChunk || mAccessMode == O_RDONLY) {
+		return false;
+	}
+	// the leaves of the chunks after the end of file are zeros, up to the tree capacity
+	auto leaves = integrityTreeLeaves(mJournalFirstChunk, mJournalLastChunk);
+	const uint64_t capacity = uint64_t(1) << mTree->depthGet();
+	const uint64_t leavesEnd = std::min(static_cast<uint64_t>(mJournalLastChunk) + 1, capacity);
+	if (leavesEnd > mJournalFirstChunk) {
+		leaves.resize(std::max(leaves.size(),
+		                       static_cast<size_t>(leavesEnd - mJournalFirstChunk) * VfsIntegrityTree::hashSize),
+		              0);
+	}
+	if (mTree->verify(mJournalFirstChunk, leaves)) {
+		return false;
+	}
+	BCTBX_SLOGW << "Encrypted FS: size journal chunks [" << mJournalFirstChunk << ", " << mJournalLastChunk << "] of "
+	            << mFilename << " do not match the integrity tree, check them";
+	checkChunksIntegrity(mJournalFirstChunk, mJournalLastChunk);
+	if (!mTree->update(mJournalFirstChunk, leaves)) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		BCTBX_SLOGE << "Encrypted FS: integrity tree of " << mFilename << " is not valid, it cannot be updated";
+	}
+	return true;
+}
+
+void VfsEncryption::integrityTreeBuild() {
+	mTree->build(integrityTreeLeaves(0, UINT32_MAX));
+}
+
+std::vector<uint8_t> VfsEncryption::integrityTreeLeaves(uint32_t firstChunk, uint32_t lastChunk) {
+	if (mFileSize == 0 || getChunkIndex(mFileSize - 1) < firstChunk) { // no chunk
+		return {};
+	}
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	const uint64_t chunkNumber = static_cast<uint64_t>(std::min(getChunkIndex(mFileSize - 1), lastChunk)) + 1;
+	const size_t batchChunks = std::max(integrityCheckBatchBytes / rawChunkSize, size_t(1));
+	std::vector<uint8_t> leaves(static_cast<size_t>(chunkNumber - firstChunk) * VfsIntegrityTree::hashSize, 0);
+	std::vector<uint8_t> rawBatch(batchChunks * rawChunkSize);
+	// the chunk headers are enough but reading whole chunks is one read per batch
+	for (uint64_t batchChunk = firstChunk; batchChunk < chunkNumber; batchChunk += batchChunks) {
+		size_t chunkCount = static_cast<size_t>(std::min(chunkNumber - batchChunk, static_cast<uint64_t>(batchChunks)));
+		ssize_t readSize =
+		    rawRead(rawBatch.data(), chunkCount * rawChunkSize, getChunkOffset(static_cast<uint32_t>(batchChunk)));
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+		}
+		// missing chunks keep a zero leaf
+		for (size_t i = 0; i < chunkCount && i * rawChunkSize + chunkHeaderSize <= static_cast<size_t>(readSize);
+		     i++) {
+			VfsIntegrityTree::leafHash(static_cast<uint32_t>(batchChunk + i), rawBatch.data() + i * rawChunkSize,
+			                           chunkHeaderSize,
+			                           leaves.data() + (batchChunk + i - firstChunk) * VfsIntegrityTree::hashSize);
+		}
+	}
+	return leaves;
+}
+
+void VfsEncryption::integrityTreeUpdate(uint32_t firstChunk, size_t chunkCount, const uint8_t *rawChunks) {
+	if (mTree == nullptr || chunkCount == 0) {
+		return;
+	}
+	std::vector<uint8_t> leaves(chunkCount * VfsIntegrityTree::hashSize, 0);
+	if (rawChunks != nullptr) {
+		const size_t rawChunkSize = rawChunkSizeGet();
+		const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+		for (size_t i = 0; i < chunkCount; i++) {
+			VfsIntegrityTree::leafHash(firstChunk + static_cast<uint32_t>(i), rawChunks + i * rawChunkSize,
+			                           chunkHeaderSize, leaves.data() + i * VfsIntegrityTree::hashSize);
+		}
+	}
+	const bool wasValid = mTree->valid();
+	if (!mTree->update(firstChunk, leaves) && wasValid) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		BCTBX_SLOGE << "Encrypted FS: integrity tree of " << mFilename << " is not valid, it cannot be updated";
+	}
+}
+
+bool VfsEncryption::integrityTreeVerify(uint64_t offset, uint64_t size) {
+	if (mTree == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename << " has no integrity tree";
+	}
+	if (size == 0 || offset >= mFileSize) {
+		return mTree->valid();
+	}
+	mReadAhead->cancel();
+	uint32_t firstChunk = getChunkIndex(offset);
+	uint32_t lastChunk = getChunkIndex(std::min(offset + size, mFileSize) - 1);
+	if (!mTree->verify(firstChunk, integrityTreeLeaves(firstChunk, lastChunk))) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		return false;
+	}
+	return true;
+}
+
+bool VfsEncryption::integrityTreeVerify() {
+	if (mTree == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename << " has no integrity tree";
+	}
+	mReadAhead->cancel();
+	// the leaves after the end of file must be zeros: check them all up to the tree capacity
+	auto leaves = integrityTreeLeaves(0, UINT32_MAX);
+	leaves.resize(std::max(leaves.size(), (size_t(1) << mTree->depthGet()) * VfsIntegrityTree::hashSize), 0);
+	if (!mTree->verify(0, std::move(leaves))) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		return false;
+	}
+	return true;
+}
+
+void VfsEncryption::integrityTreeRebuild() {
+	if (!mIntegrityTree || mHeaderExtensionSize == 0) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename << " has no integrity tree";
+	}
+	if (mAccessMode == O_RDONLY) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot rebuild integrity tree of file " << mFilename
+		                     << " opened in read only mode";
+	}
+	mReadAhead->cancel();
+	dirtyChunksFlush();
+	if (mTree == nullptr) {
+		mTree = std::make_unique<VfsIntegrityTree>(mFilename + integrityTreeSuffix, mCounters.get());
+	}
+	// open it again: its file may have been missing when the file was opened
+	mTree->open(false, 0, std::vector<uint8_t>(VfsIntegrityTree::hashSize, 0));
+	integrityTreeBuild();
+	writeHeader();
+	mPendingHeaderUpdates = 0;
+}
+
+std::vector<uint8_t> VfsEncryption::integrityTreeRootGet() const {
+	return (mTree == nullptr) ? std::vector<uint8_t>{} : mTree->rootGet();
+}
+
+int VfsEncryption::integrityTreeSync() {
+	return (mTree == nullptr) ? 0 : mTree->sync();
+}
+
+void VfsEncryption::rekeyStart(const std::vector<uint8_t> &newSecretMaterial) {
+	if (m_module == nullptr) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot re-key plain file " << mFilename;
+	}
+	if (rekeyInProgressGet()) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename << " is already being re-keyed";
+	}
+	if (mAccessMode == O_RDONLY) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot re-key file " << mFilename << " opened in read only mode";
+	}
+	if (mHeaderExtensionSize == 0) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename
+		                     << " has no header extension to hold the re-keying progress";
+	}
+	auto module = make_VfsEncryptionModule(m_module->getEncryptionSuite());
+	module->countersSet(mCounters);
+	module->setModuleSecretMaterial(newSecretMaterial);
+	module->chunkKeyCacheSizeSet(mChunkKeyCacheSize);
+	mRekeyNextChunk = 0;
+	mRekeyPendingEnd = 0;
+	mRekeyModuleHeader = rekeyModuleHeaderGet(*module);
+	try {
+		writeHeader(nullptr, mHeaderFileSize);
+	} catch (EvfsException const &) {
+		mRekeyModuleHeader.clear();
+		throw;
+	}
+	mRekeyModule = module;
+}
+
+void VfsEncryption::rekeySecretMaterialSet(const std::vector<uint8_t> &newSecretMaterial) {
+	if (!rekeyInProgressGet()) {
+		throw EVFS_EXCEPTION << "Encrypted FS: file " << mFilename << " is not being re-keyed";
+	}
+	auto module = make_VfsEncryptionModule(static_cast<uint16_t>(m_module->getEncryptionSuite()), mRekeyModuleHeader);
+	module->countersSet(mCounters);
+	module->setModuleSecretMaterial(newSecretMaterial);
+	// re-keying the next chunks with a wrong secret material would make them unreadable
+	if (!rekeyModuleHeaderCheck(*module)) {
+		mCounters->add(VfsCounters::integrityFailures, 1);
+		throw EVFS_EXCEPTION << "Encrypted FS: wrong new secret material to resume re-keying of file " << mFilename;
+	}
+	module->chunkKeyCacheSizeSet(mChunkKeyCacheSize);
+	mRekeyModule = module;
+}
+
+bool VfsEncryption::rekeyInProgressGet() const noexcept {
+	return !mRekeyModuleHeader.empty();
+}
+
+uint64_t VfsEncryption::rekeyProgressGet() const noexcept {
+	if (!rekeyInProgressGet()) {
+		return 0;
+	}
+	return std::min(static_cast<uint64_t>(mRekeyNextChunk) * mChunkSize, mFileSize);
+}
+
+void VfsEncryption::rekeyRateSet(const size_t bytesPerSecond) noexcept {
+	mRekeyRate = bytesPerSecond;
+}
+
+size_t VfsEncryption::rekeyRateGet() const noexcept {
+	return mRekeyRate;
+}
+
+void VfsEncryption::rekeyResume() {
+	// complete the step interrupted while the chunks were written
+	if (mRekeyPendingEnd > mRekeyNextChunk && mAccessMode != O_RDONLY) {
+		BCTBX_SLOGW << "Encrypted FS: complete interrupted re-keying of chunks [" << mRekeyNextChunk << ", "
+		            << mRekeyPendingEnd << "[ in file " << mFilename;
+		rekeyStep(mRekeyPendingEnd - mRekeyNextChunk);
+	}
+}
+
+std::vector<uint8_t> VfsEncryption::rekeyModuleHeaderGet(const VfsEncryptionModule &module) {
+	std::vector<uint8_t> header(r_header.cbegin(), r_header.cbegin() + rekeyAuthenticatedHeaderSize);
+	std::swap(header, r_header);
+	try {
+		auto moduleHeader = module.getModuleFileHeader(*this);
+		std::swap(header, r_header);
+		return moduleHeader;
+	} catch (...) {
+		std::swap(header, r_header);
+		throw;
+	}
+}
+
+bool VfsEncryption::rekeyModuleHeaderCheck(VfsEncryptionModule &module) {
+	std::vector<uint8_t> header(r_header.cbegin(), r_header.cbegin() + rekeyAuthenticatedHeaderSize);
+	std::swap(header, r_header);
+	try {
+		bool valid = module.checkIntegrity(*this);
+		std::swap(header, r_header);
+		return valid;
+	} catch (...) {
+		std::swap(header, r_header);
+		throw;
+	}
+}
+
+/**
+ * The range re-keyed is first recorded in the header: if the step is interrupted, its chunks may be encrypted with
+ * either secret material and are decrypted with the current one or, if it fails, the new one.
+ */
+bool VfsEncryption::rekeyStep(size_t maxChunks) {
+	if (mRekeyModule == nullptr) {
+		return true;
+	}
+	if (mAccessMode == O_RDONLY) {
+		throw EVFS_EXCEPTION << "Encrypted FS: cannot re-key file " << mFilename << " opened in read only mode";
+	}
+	mReadAhead->cancel();
+	// the chunks must all be on disk
+	dirtyChunksFlush();
+	const uint32_t chunkNumber = (mFileSize > 0) ? getChunkIndex(mFileSize - 1) + 1 : 0;
+	if (mRekeyNextChunk < chunkNumber) {
+		const size_t rawChunkSize = rawChunkSizeGet();
+		const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+		const uint32_t firstChunk = mRekeyNextChunk;
+		if (maxChunks == 0) {
+			maxChunks = std::max(rekeyBatchBytes / rawChunkSize, size_t(1));
+		}
+		const size_t chunkCount = std::min(maxChunks, static_cast<size_t>(chunkNumber - firstChunk));
+		const uint32_t lastChunk = firstChunk + static_cast<uint32_t>(chunkCount) - 1;
+		const bool interrupted = mRekeyPendingEnd > firstChunk; // a previous step on these chunks was interrupted
+		if (mRekeyRate > 0) {
+			std::this_thread::sleep_until(mRekeyNextStep);
+		}
+
+		mRekeyPendingEnd = std::max(mRekeyPendingEnd, lastChunk + 1);
+		journalChunks(firstChunk, lastChunk);
+		writeHeader(nullptr, mHeaderFileSize);
+
+		size_t rawDataSize = chunkCount * rawChunkSize;
+		if (mRawBuffer.size() < rawDataSize) {
+			mRawBuffer.resize(rawDataSize);
+		}
+		ssize_t readSize = rawRead(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+		if (readSize < 0 || static_cast<size_t>(readSize) <= (chunkCount - 1) * rawChunkSize + chunkHeaderSize) {
+			throw EVFS_EXCEPTION << "Encrypted FS: fail to read chunks to re-key in file " << mFilename;
+		}
+		rawDataSize = static_cast<size_t>(readSize);
+		std::vector<uint8_t> plainData(chunkCount * mChunkSize);
+		std::vector<bool> holes(chunkCount);
+		mChunkJobs.clear();
+		for (size_t i = 0; i < chunkCount; i++) {
+			size_t chunkRawSize = std::min(rawChunkSize, rawDataSize - i * rawChunkSize);
+			const uint32_t chunkIndex = firstChunk + static_cast<uint32_t>(i);
+			holes[i] = isHole(chunkIndex, mRawBuffer.data() + i * rawChunkSize, chunkRawSize);
+			mChunkJobs.push_back(ChunkJob{chunkIndex, mRawBuffer.data() + i * rawChunkSize, chunkRawSize, nullptr,
+			                              plainData.data() + i * mChunkSize, chunkRawSize - chunkHeaderSize});
+		}
+		auto jobs = mChunkJobs;
+		try {
+			try {
+				runChunkJobs();
+			} catch (EvfsException const &) {
+				if (!interrupted) {
+					throw;
+				}
+				// some chunks were already re-keyed by the interrupted step
+				for (const auto &job : jobs) {
+					if (holes[job.chunkIndex - firstChunk]) continue;
+					VfsCounters::ModuleCall call(mCounters.get(), VfsCounters::chunksDecrypted, 1);
+					rekeyPendingDecrypt(job.chunkIndex, job.rawChunk, job.rawChunkSize, job.plainOut);
+				}
+			}
+			// encrypt them as new chunks with the new module, holes stay holes
+			mRekeyNextChunk = lastChunk + 1;
+			mChunkJobs.clear();
+			for (const auto &job : jobs) {
+				if (holes[job.chunkIndex - firstChunk]) continue;
+				mChunkJobs.push_back(ChunkJob{job.chunkIndex, job.rawChunk, 0, job.plainOut, nullptr, job.plainSize});
+			}
+			runChunkJobs();
+		} catch (...) {
+			mRekeyNextChunk = firstChunk;
+			bctbx_clean(plainData.data(), plainData.size());
+			throw;
+		}
+		bctbx_clean(plainData.data(), plainData.size());
+
+		ssize_t ret = rawWrite(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+		if (ret - rawDataSize != 0) { // compare signed and unsigned
+			mRekeyNextChunk = firstChunk;
+			throw EVFS_EXCEPTION << "Encrypted FS: fail to write re-keyed chunks to file " << mFilename;
+		}
+		integrityTreeUpdate(firstChunk, chunkCount, mRawBuffer.data());
+		if (mRekeyRate > 0) {
+			mRekeyNextStep = std::chrono::steady_clock::now() +
+			                 std::chrono::microseconds(static_cast<uint64_t>(rawDataSize) * 1000000 / mRekeyRate);
+		}
+	}
+
+	if (mRekeyNextChunk < chunkNumber) { // record the progress
+		writeHeader(nullptr, mHeaderFileSize);
+		return false;
+	}
+	// all chunks are re-keyed: the new module replaces the current one, it now authenticates the header
+	m_module = std::move(mRekeyModule);
+	mRekeyModuleHeader.clear();
+	mRekeyNextChunk = 0;
+	mRekeyPendingEnd = 0;
+	writeHeader(nullptr, mHeaderFileSize);
+	return true;
+}
+
+/**
+ * Remove from the plain chunk cache the chunks with index in [firstChunk, lastChunk]
+ */
+void VfsEncryption::plainChunkCacheErase(uint32_t firstChunk, uint32_t lastChunk) const {
+	mPlainChunkCache->eraseIf([firstChunk, lastChunk](const uint32_t &chunkIndex) {
+		return chunkIndex >= firstChunk && chunkIndex <= lastChunk;
+	});
+}
+
+void VfsEncryption::plainChunkCacheSizeSet(const size_t size) {
+	mPlainChunkCache->capacitySet(size);
+}
+
+size_t VfsEncryption::plainChunkCacheSizeGet() const noexcept {
+	return mPlainChunkCache->capacityGet();
+}
+
+void VfsEncryption::readAheadWindowSet(const size_t chunks) {
+	mReadAhead->windowSet(chunks);
+}
+
+size_t VfsEncryption::readAheadWindowGet() const noexcept {
+	return mReadAhead->windowGet();
+}
+
+void VfsEncryption::sparseExtensionSet(const bool sparse) noexcept {
+	mSparseExtension = sparse;
+}
+
+bool VfsEncryption::sparseExtensionGet() const noexcept {
+	return mSparseExtension;
+}
+
+bool VfsEncryption::isHole(uint32_t chunkIndex, const uint8_t *rawChunk, size_t rawChunkSize) const noexcept {
+	// a chunk written but still in a range, when the header was not updated yet, is decrypted as any other one
+	return std::any_of(mHoleRanges.cbegin(), mHoleRanges.cend(),
+	                   [chunkIndex](const std::pair<uint32_t, uint32_t> &range) {
+		                   return chunkIndex >= range.first && chunkIndex <= range.second;
+	                   }) &&
+	       std::all_of(rawChunk, rawChunk + rawChunkSize, [](uint8_t b) { return b == 0; });
+}
+
+size_t VfsEncryption::holeRangesMax() const noexcept {
+	// the size journal, integrity tree and re-keying records can all be added after the holes
+	const size_t reserved = 4 * headerRecordBaseLength + sizeJournalRecordLength + integrityTreeRecordLength +
+	                        rekeyRecordBaseLength + m_module->getModuleFileHeaderSize();
+	return (mHeaderExtensionSize > reserved) ? (mHeaderExtensionSize - reserved) / holeRangeLength : 0;
+}
+
+bool VfsEncryption::holesWritten(uint32_t firstChunk, uint32_t lastChunk) {
+	if (mHoleRanges.empty()) {
+		return false;
+	}
+	std::vector<std::pair<uint32_t, uint32_t>> ranges{};
+	bool modified = false;
+	for (auto range : mHoleRanges) {
+		if (range.second < firstChunk || range.first > lastChunk) {
+			ranges.push_back(range);
+			continue;
+		}
+		modified = true;
+		if (range.first < firstChunk && range.second > lastChunk && mHoleRanges.size() >= holeRangesMax()) {
+			// no room to split it in two: encrypt the zeros of its smaller side
+			if (firstChunk - range.first <= range.second - lastChunk) {
+				holesFill(range.first, firstChunk - 1);
+				range.first = firstChunk;
+			} else {
+				holesFill(lastChunk + 1, range.second);
+				range.second = lastChunk;
+			}
+		}
+		if (range.first < firstChunk) {
+			ranges.emplace_back(range.first, firstChunk - 1);
+		}
+		if (range.second > lastChunk) {
+			ranges.emplace_back(lastChunk + 1, range.second);
+		}
+	}
+	mHoleRanges = std::move(ranges);
+	return modified;
+}
+
+void VfsEncryption::holesFill(uint32_t firstChunk, uint32_t lastChunk) {
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	const size_t batchChunks = std::max(extensionBatchBytes / mChunkSize, size_t(1));
+	const std::vector<uint8_t> zeros(mChunkSize, 0);
+	std::vector<uint8_t> rawData(std::min(batchChunks, static_cast<size_t>(lastChunk - firstChunk) + 1) * rawChunkSize);
+	journalChunks(firstChunk, lastChunk);
+	uint64_t chunkStart = static_cast<uint64_t>(firstChunk) * mChunkSize;
+	for (uint64_t batchStart = firstChunk; batchStart <= lastChunk; batchStart += batchChunks) {
+		const uint64_t batchEnd = std::min(batchStart + batchChunks - 1, static_cast<uint64_t>(lastChunk));
+		size_t rawDataSize = 0;
+		mChunkJobs.clear();
+		for (uint64_t chunkIndex = batchStart; chunkIndex <= batchEnd; chunkIndex++, chunkStart += mChunkSize) {
+			// the last chunk of the file may be incomplete
+			size_t plainSize = static_cast<size_t>(std::min<uint64_t>(mChunkSize, mFileSize - chunkStart));
+			mChunkJobs.push_back(ChunkJob{static_cast<uint32_t>(chunkIndex), rawData.data() + rawDataSize, 0,
+			                              zeros.data(), nullptr, plainSize});
+			rawDataSize += (chunkIndex < batchEnd) ? rawChunkSize : chunkHeaderSize + plainSize;
+		}
+		runChunkJobs();
+		ssize_t ret = rawWrite(rawData.data(), rawDataSize, getChunkOffset(static_cast<uint32_t>(batchStart)));
+		if (ret - rawDataSize != 0) { // compare signed and unsigned
+			throw EVFS_EXCEPTION << "fail to write holes to physical file " << mFilename << " file_write " << ret;
+		}
+		integrityTreeUpdate(static_cast<uint32_t>(batchStart), static_cast<size_t>(batchEnd - batchStart + 1),
+		                    rawData.data());
+	}
+}
+
+void VfsEncryption::chunkDecrypt(uint32_t chunkIndex,
+                                 const uint8_t *rawChunk,
+                                 size_t rawChunkSize,
+                                 uint8_t *plainChunk) const {
+	if (isHole(chunkIndex, rawChunk, rawChunkSize)) {
+		memset(plainChunk, 0, rawChunkSize - m_module->getChunkHeaderSize());
+	} else {
+		VfsCounters::ModuleCall call(mCounters.get(), VfsCounters::chunksDecrypted, 1);
+		if (rekeyPending(chunkIndex)) {
+			rekeyPendingDecrypt(chunkIndex, rawChunk, rawChunkSize, plainChunk);
+		} else {
+			chunkModule(chunkIndex).decryptChunk(chunkIndex, rawChunk, rawChunkSize, plainChunk);
+		}
+	}
+}
+
+VfsEncryptionModule &VfsEncryption::chunkModule(uint32_t chunkIndex) const noexcept {
+	return (mRekeyModule != nullptr && chunkIndex < mRekeyNextChunk) ? *mRekeyModule : *m_module;
+}
 
-	if (stdFp == NULL) throw EVFS_EXCEPTION << "Cannot create a vfs encrytion object, vfs pointer is null";
+bool VfsEncryption::rekeyPending(uint32_t chunkIndex) const noexcept {
+	// a file opened for writing completes the interrupted step at opening, and re-keys its chunks in rekeyStep
+	return mAccessMode == O_RDONLY && mRekeyModule != nullptr && chunkIndex >= mRekeyNextChunk &&
+	       chunkIndex < mRekeyPendingEnd;
+}
 
-	// If the file exists, read the header to check it is an encrypted file and gets its encrypted policy
-	// if the file is plain, set the mFileSize so then we now we already have a file but it is plain
-	bool createFile = true;
-	if (bctbx_file_size(stdFp) > 0) {
-		parseHeader();
-		createFile = false;
+void VfsEncryption::rekeyPendingDecrypt(uint32_t chunkIndex,
+                                        const uint8_t *rawChunk,
+                                        size_t rawChunkSize,
+                                        uint8_t *plainChunk) const {
+	try {
+		m_module->decryptChunk(chunkIndex, rawChunk, rawChunkSize, plainChunk);
+	} catch (EvfsException const &) {
+		mRekeyModule->decryptChunk(chunkIndex, rawChunk, rawChunkSize, plainChunk);
 	}
+}
 
-	/* if the static callback is set, call it */
-	if (VfsEncryption::openCallbackGet() != nullptr) {
-		(VfsEncryption::openCallbackGet())(*this);
-	} else {
-		throw EVFS_EXCEPTION << "Encrypted VFS: must provide a callback to setup key material";
+/**
+ * Complete the current last chunk with zeros, then add the whole chunks of zeros: as holes in the raw file if sparse
+ * extension is enabled, otherwise encrypted by batches so the zeros are never all in memory
+ */
+void VfsEncryption::extend(uint64_t newSize) {
+	if (newSize <= mFileSize) {
+		return;
+	}
+	// holes are recorded in the header extension, files without one get their zeros encrypted
+	const bool sparse = mSparseExtension && mHeaderExtensionSize > 0;
+	uint32_t lastChunk = getChunkIndex(mFileSize);
+	// an incomplete last chunk which is a hole stays one: the raw file extension completes it with zeros
+	bool lastChunkHole = false;
+	if (sparse && mFileSize % mChunkSize != 0 && mDirtyChunks.count(lastChunk) == 0) {
+		std::vector<uint8_t> rawChunk(m_module->getChunkHeaderSize() + mFileSize % mChunkSize);
+		lastChunkHole = rawRead(rawChunk.data(), rawChunk.size(), getChunkOffset(lastChunk)) - rawChunk.size() == 0 &&
+		                isHole(lastChunk, rawChunk.data(), rawChunk.size());
+	}
+	uint64_t lastChunkEnd = std::min(newSize, static_cast<uint64_t>(lastChunk + 1) * mChunkSize);
+	if (mFileSize % mChunkSize != 0 && !lastChunkHole) {
+		write(std::vector<uint8_t>{}, static_cast<size_t>(lastChunkEnd)); // the gap is filled with 0 by write
+		if (newSize <= mFileSize) {
+			return;
+		}
 	}
 
-	if (m_module == nullptr) { // this is a plain file and we want to keep it this way
+	// a new range of holes is recorded only if there is room left for it
+	const uint32_t firstHole = getChunkIndex(mFileSize);
+	const uint32_t lastHole = getChunkIndex(newSize - 1);
+	const bool contiguous = !mHoleRanges.empty() && mHoleRanges.back().second + 1 >= firstHole;
+	if (sparse && (contiguous || mHoleRanges.size() < holeRangesMax())) {
+		// the header must record the holes before there are any
+		if (contiguous) {
+			mHoleRanges.back().second = lastHole;
+		} else {
+			mHoleRanges.emplace_back(firstHole, lastHole);
+		}
+		mPendingHeaderUpdates++;
+		headerFlush();
+		journalChunks(firstHole, lastHole);
+		mFileSize = newSize;
+		if (bctbx_file_truncate(pFileStd, rawFileSizeGet()) < 0) {
+			throw EVFS_EXCEPTION << "Cannot extend file " << mFilename;
+		}
+		headerUpdate();
 		return;
 	}
 
-	/* check we have a valid chunk size */
-	if (mChunkSize == 0) {             // this is a file creation and the callback didn't set it
-		mChunkSize = defaultChunkSize; // assign the default one
+	// mFileSize is now on a chunk boundary: each batch is made of whole chunks, encrypted as new chunks
+	const uint64_t batchSize = std::max(extensionBatchBytes / mChunkSize, size_t(1)) * mChunkSize;
+	const std::vector<uint8_t> zeros(static_cast<size_t>(std::min(batchSize, newSize - mFileSize)), 0);
+	while (mFileSize < newSize) {
+		size_t size = static_cast<size_t>(std::min(static_cast<uint64_t>(zeros.size()), newSize - mFileSize));
+		write(zeros.data(), size, static_cast<size_t>(mFileSize));
 	}
+}
 
-	if (mEncryptExistingPlainFile == true) { // we have a plain file to encrypt
-		// create a temporary file
-		std::string tmpFilename(mFilename);
-		tmpFilename.append(".evfs_tmp");
-		// make sure this file does not exists
-		std::remove(tmpFilename.data());
-		auto stdFdTmp = bctbx_file_open2(bctbx_vfs_get_standard(), tmpFilename.data(), O_WRONLY | O_CREAT);
-		// read the whole file chunk by chunk and write their ciphertext to the temp file
-		char *readBuf = static_cast<char *>(bctbx_malloc(mChunkSize));
-		uint64_t index = 0;
-
-		uint32_t currentChunkIndex = 0;
-		do {
-			// read
-			auto readSize = bctbx_file_read(pFileStd, readBuf, mChunkSize, static_cast<off_t>(index));
-			if (readSize < 0) {
-				bctbx_file_close(stdFdTmp);
-				bctbx_free(readBuf);
-				throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not read file";
-			}
-			index += readSize;
-			// encrypt
-			auto rawChunk =
-			    m_module->encryptChunk(currentChunkIndex, std::vector<uint8_t>(readBuf, readBuf + readSize));
-			// write
-			if (bctbx_file_write(stdFdTmp, rawChunk.data(), rawChunk.size(), (off_t)getChunkOffset(currentChunkIndex)) -
-			        rawChunk.size() !=
-			    0) {
-				bctbx_file_close(stdFdTmp);
-				bctbx_free(readBuf);
-				throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename
-				                     << ". Could not write to temporary file " << tmpFilename;
+void VfsEncryption::writeBackBufferSizeSet(const size_t size) {
+	mWriteBackBufferSize = size;
+	if (mWriteBackBufferSize == 0 || mDirtyBytes > mWriteBackBufferSize) {
+		dirtyChunksFlush();
+	}
+}
+
+size_t VfsEncryption::writeBackBufferSizeGet() const noexcept {
+	return mWriteBackBufferSize;
+}
+
+void VfsEncryption::writeBack(const uint8_t *plainData, size_t count, size_t offset) {
+	// Are we writing after the end of the file, if yes, the gap is filled with zeros
+	uint64_t writeStart = std::min(static_cast<uint64_t>(offset), mFileSize);
+	uint64_t writeEnd = static_cast<uint64_t>(offset) + count;
+	uint64_t finalFileSize = std::max(mFileSize, writeEnd);
+	uint32_t firstChunk = getChunkIndex(writeStart);
+	uint32_t lastChunk = getChunkIndex(writeEnd - 1);
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+
+	uint64_t chunkStart = static_cast<uint64_t>(firstChunk) * mChunkSize; // plain offset of the current chunk
+	for (uint32_t chunkIndex = firstChunk; chunkIndex <= lastChunk; chunkIndex++, chunkStart += mChunkSize) {
+		size_t existingPlainSize =
+		    (chunkStart < mFileSize) ? static_cast<size_t>(std::min<uint64_t>(mChunkSize, mFileSize - chunkStart)) : 0;
+		size_t chunkPlainSize = static_cast<size_t>(std::min<uint64_t>(mChunkSize, finalFileSize - chunkStart));
+		uint64_t copyStart = std::max(chunkStart, static_cast<uint64_t>(offset));
+		uint64_t copyEnd = std::min(chunkStart + chunkPlainSize, writeEnd);
+
+		auto dirtyChunk = mDirtyChunks.find(chunkIndex);
+		if (dirtyChunk == mDirtyChunks.end()) {
+			std::vector<uint8_t> chunk{};
+			chunk.reserve(mChunkSize);
+			// get the existing content unless it is fully overwritten: chunks not dirty are on disk or in cache
+			if (existingPlainSize > 0 && !(copyStart == chunkStart && copyEnd >= chunkStart + existingPlainSize)) {
+				auto cachedChunk = mPlainChunkCache->get(chunkIndex);
+				if (cachedChunk != nullptr) {
+					chunk = *cachedChunk;
+				} else {
+					size_t rawSize = chunkHeaderSize + existingPlainSize;
+					if (mRawBuffer.size() < rawSize) {
+						mRawBuffer.resize(rawSize);
+					}
+					ssize_t readSize = rawRead(mRawBuffer.data(), rawSize, getChunkOffset(chunkIndex));
+					if (readSize - rawSize != 0) { // compare signed and unsigned
+						throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+					}
+					chunk.resize(existingPlainSize);
+					chunkDecrypt(chunkIndex, mRawBuffer.data(), rawSize, chunk.data());
+				}
 			}
-			currentChunkIndex++;
-		} while (index < mFileSize);
-		bctbx_free(readBuf);
+			mDirtyBytes += chunkPlainSize;
+			dirtyChunk = mDirtyChunks.emplace(chunkIndex, std::move(chunk)).first;
+		} else {
+			mDirtyBytes += chunkPlainSize - dirtyChunk->second.size();
+		}
+		// the dirty chunk is now the reference: drop the cached one
+		mPlainChunkCache->erase(chunkIndex);
+
+		// pad with zeros whatever was not part of the file then copy the part of the input in this chunk
+		dirtyChunk->second.resize(chunkPlainSize, 0);
+		if (copyStart < copyEnd) {
+			memcpy(dirtyChunk->second.data() + (copyStart - chunkStart), plainData + (copyStart - offset),
+			       static_cast<size_t>(copyEnd - copyStart));
+		}
+	}
 
-		// write header and close
-		writeHeader(stdFdTmp);
-		bctbx_file_close(stdFdTmp);
+	if (mDirtyBytes > mWriteBackBufferSize) {
+		dirtyChunksFlush();
+	}
+	if (mFileSize != finalFileSize) {
+		mFileSize = finalFileSize;
+		mPendingHeaderUpdates++;
+	}
+	// write the header updates held back while the chunks were dirty
+	if (mHeaderUpdateInterval != 0 && mPendingHeaderUpdates >= mHeaderUpdateInterval && mDirtyChunks.empty()) {
+		headerFlush();
+	}
+}
 
-		// delete the original file
-		bctbx_file_close(pFileStd);
-		std::remove(mFilename.data());
+/**
+ * Dirty chunks below the plain file size are the only ones which may not be on disk: each contiguous run of dirty
+ * chunks is read, re-encrypted and written at once
+ */
+void VfsEncryption::dirtyChunksFlush() {
+	if (mDirtyChunks.empty()) {
+		return;
+	}
+	mReadAhead->cancel();
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	const bool useCache = mPlainChunkCache->capacityGet() > 0;
+	journalChunks(mDirtyChunks.cbegin()->first, mDirtyChunks.crbegin()->first);
+
+	bool holesModified = false;
+	while (!mDirtyChunks.empty()) {
+		// find the run of contiguous dirty chunks starting at the first one
+		auto runBegin = mDirtyChunks.begin();
+		auto runEnd = std::next(runBegin);
+		while (runEnd != mDirtyChunks.end() && runEnd->first == std::prev(runEnd)->first + 1) {
+			runEnd++;
+		}
+		uint32_t firstChunk = runBegin->first;
+		size_t chunkCount = static_cast<size_t>(std::distance(runBegin, runEnd));
+		size_t rawDataSize = chunkCount * rawChunkSize;
+		if (mRawBuffer.size() < rawDataSize) {
+			mRawBuffer.resize(rawDataSize);
+		}
 
-		// rename the temporary one
-		std::rename(tmpFilename.data(), mFilename.data());
-		mEncryptExistingPlainFile = false;
+		// read the existing chunks of the run, they are re-encrypted in place
+		ssize_t readSize = rawRead(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+		}
 
-		// and reopen it with the standard vfs
-		pFileStd = bctbx_file_open2(bctbx_vfs_get_standard(), mFilename.data(), openFlags);
+		size_t rawIndex = 0;
+		mChunkJobs.clear();
+		for (auto chunk = runBegin; chunk != runEnd; chunk++, rawIndex += rawChunkSize) {
+			size_t existingRawSize = 0;
+			if (static_cast<size_t>(readSize) > rawIndex + chunkHeaderSize) {
+				existingRawSize = std::min(rawChunkSize, static_cast<size_t>(readSize) - rawIndex);
+			}
+			mChunkJobs.push_back(ChunkJob{chunk->first, mRawBuffer.data() + rawIndex, existingRawSize,
+			                              chunk->second.data(), nullptr, chunk->second.size()});
+		}
+		runChunkJobs();
+		rawDataSize = rawIndex - rawChunkSize + chunkHeaderSize + std::prev(runEnd)->second.size();
 
-	} else { // no migration but now we shall have all the material (settings and keys ) to check the file integrity
-		if (mFileSize > 0) { // this is not a file creation
-			if (m_module->checkIntegrity(*this) != true) {
-				throw EVFS_EXCEPTION << "Integrity check fail while opening file " << mFilename;
-			} else {                               // header integrity is Ok
-				if (mIntegrityFullCheck == true) { // file size in header is wrong, check each chunk and update header
-					for (auto chunkIndex = getChunkIndex(mFileSize); chunkIndex > 0;
-					     chunkIndex--) { // start from last chunk
-						std::vector<uint8_t> rawData(rawChunkSizeGet());
-						ssize_t readSize = bctbx_file_read(pFileStd, rawData.data(), rawData.size(),
-						                                   (off_t)getChunkOffset(chunkIndex));
-						if (readSize >= 0) {
-							rawData.resize(readSize);
-						} else {
-							throw EVFS_EXCEPTION
-							    << "fail to read file while trying to check the full integrity, file_read returned "
-							    << readSize;
-						}
-
-						std::vector<uint8_t> plainData(mChunkSize);
-
-						// decrypt the chunk, if it fails it will generate an exception, let it flow up
-						m_module->decryptChunk(chunkIndex, rawData);
-					}
-					// all clear, update header
-					writeHeader();
-					BCTBX_SLOGW
-					    << "Encrypted FS: Whole file integrity check successfull, update header with correct file size";
-				}
+		ssize_t ret = rawWrite(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+		if (ret - rawDataSize != 0) { // compare signed and unsigned
+			throw EVFS_EXCEPTION << "fail to write to physical file " << mFilename << " file_write " << ret;
+		}
+		integrityTreeUpdate(firstChunk, chunkCount, mRawBuffer.data());
+		holesModified |= holesWritten(firstChunk, firstChunk + static_cast<uint32_t>(chunkCount) - 1);
+
+		// the written chunks move to the plain chunk cache, or are wiped
+		for (auto chunk = runBegin; chunk != runEnd; chunk++) {
+			mDirtyBytes -= chunk->second.size();
+			if (useCache) {
+				auto chunkSize = chunk->second.size();
+				mPlainChunkCache->insert(chunk->first, std::move(chunk->second), chunkSize);
+			} else {
+				cleanPlainChunk(chunk->second);
 			}
 		}
+		mDirtyChunks.erase(runBegin, runEnd);
 	}
-
-	if (createFile) {
-		writeHeader();
+	// the header holds the new tree root and hole ranges, called by headerFlush: mark the update as pending without
+	// flushing again
+	if (mTree != nullptr || holesModified) {
+		mPendingHeaderUpdates++;
 	}
 }
 
 VfsEncryption::~VfsEncryption() {
+	// the read ahead must not access the file anymore
+	mReadAhead->cancel();
+	// write the header if an update is still pending, bcClose already tried so this should not happen
+	try {
+		headerFlush();
+	} catch (EvfsException const &e) {
+		BCTBX_SLOGE << "Encrypted VFS: unable to update header of file " << mFilename << " at closing: " << e;
+	} catch (std::exception const &e) {
+		BCTBX_SLOGE << "Encrypted VFS: unable to update header of file " << mFilename << " at closing: " << e.what();
+	}
+	// the chunk buffers and the dirty chunks not written may hold some plain data
+	bctbx_clean(mPlainChunkBuffer.data(), mPlainChunkBuffer.size());
+	lineChunkDrop();
+	for (auto &chunk : mDirtyChunks) {
+		cleanPlainChunk(chunk.second);
+	}
+	bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+	if (mMigrationTask != nullptr) {
+		mMigrationTask->release();
+	}
 	if (pFileStd != nullptr) {
 		bctbx_file_close(pFileStd);
 	}
@@ -291,6 +1763,20 @@ void VfsEncryption::chunkSizeSet(const size_t size) {
 	}
 }
 
+void VfsEncryption::chunkKeyCacheSizeSet(const size_t size) {
+	mChunkKeyCacheSize = size;
+	if (m_module != nullptr) {
+		m_module->chunkKeyCacheSizeSet(size);
+	}
+	if (mRekeyModule != nullptr) {
+		mRekeyModule->chunkKeyCacheSizeSet(size);
+	}
+}
+
+size_t VfsEncryption::chunkKeyCacheSizeGet() const noexcept {
+	return mChunkKeyCacheSize;
+}
+
 /**
  * Set a callback called during file opening to get the encryption material and suite
  */
@@ -321,6 +1807,9 @@ void VfsEncryption::secretMaterialSet(const std::vector<uint8_t> &secretMaterial
 		}
 	}
 	m_module->setModuleSecretMaterial(secretMaterial);
+	if (mEncryptExistingPlainFile) { // a background migration needs it to resume a previous one
+		mSecretMaterial = secretMaterial;
+	}
 }
 
 /**
@@ -329,6 +1818,9 @@ void VfsEncryption::secretMaterialSet(const std::vector<uint8_t> &secretMaterial
 void VfsEncryption::encryptionSuiteSet(const EncryptionSuite suite) {
 	if (m_module == nullptr && mFileSize == 0) { // file creation
 		m_module = make_VfsEncryptionModule(suite);
+		if (m_module != nullptr) {
+			m_module->countersSet(mCounters);
+		}
 	} else { // file already exists (if m_filesize!=0 and m_module is nullptr, it is an existing plain file, the
 		     // encryptionSuiteGet would return plain)
 		if (encryptionSuiteGet() != suite) {
@@ -337,6 +1829,7 @@ void VfsEncryption::encryptionSuiteSet(const EncryptionSuite suite) {
 				if (mAccessMode != O_RDONLY) {       // Do not migrate read-only file
 					mEncryptExistingPlainFile = true;
 					m_module = make_VfsEncryptionModule(suite);
+					m_module->countersSet(mCounters);
 				} else {
 					BCTBX_SLOGW << "Encrypted VFS access a plain file " << mFilename << " as read only. Kept it plain";
 				}
@@ -397,7 +1890,7 @@ const std::vector<uint8_t> &VfsEncryption::rawHeaderGet() const noexcept {
  *    - Header extension size: 2 bytes. Flexibility on header size - this version of parser may be able to read newer
  * future versions
  *    - size: clear text file size : 8 bytes.
- *    - [Optionnal Header Extension - future versions of the vfs encryption]
+ *    - [Optionnal Header Extension - records, from version 1.01]
  *    - [Optionnal Encryption module data - size is given by the encryption suite selected]
  *
  *
@@ -416,7 +1909,7 @@ void VfsEncryption::parseHeader() {
 	// read the header
 	r_header = std::vector<uint8_t>(baseFileHeaderSize);
 	size_t index = 0;
-	if (bctbx_file_read(pFileStd, r_header.data(), baseFileHeaderSize, 0) != baseFileHeaderSize)
+	if (rawRead(r_header.data(), baseFileHeaderSize, 0) != baseFileHeaderSize)
 		throw EVFS_EXCEPTION << "parseHeader: unable to read encrypted vfs header";
 
 	// check it starts with the magic number
@@ -430,9 +1923,9 @@ void VfsEncryption::parseHeader() {
 
 	// check the version number
 	mVersionNumber = r_header[index] << 8 | r_header[index + 1];
-	if (mVersionNumber != BcEncFS_v0100) {
+	if (mVersionNumber > BcEncFS_v0101) {
 		BCTBX_SLOGW << "Encrypted FS trying to open a file version " << mVersionNumber << " but supports up to "
-		            << BcEncFS_v0100 << ", this may not work, proceed anyway";
+		            << BcEncFS_v0101 << ", this may not work, proceed anyway";
 	}
 	index += 2;
 
@@ -454,6 +1947,18 @@ void VfsEncryption::parseHeader() {
 	    (static_cast<uint64_t>(r_header[index + 2]) << 40) | (static_cast<uint64_t>(r_header[index + 3]) << 32) |
 	    (static_cast<uint64_t>(r_header[index + 4]) << 24) | (static_cast<uint64_t>(r_header[index + 5]) << 16) |
 	    (static_cast<uint64_t>(r_header[index + 6]) << 8) | static_cast<uint64_t>(r_header[index + 7]);
+	mHeaderFileSize = mFileSize;
+
+	// the header extension is part of the raw header, authenticated with it
+	if (mHeaderExtensionSize > 0) {
+		r_header.resize(baseFileHeaderSize + mHeaderExtensionSize);
+		if (rawRead(r_header.data() + baseFileHeaderSize, mHeaderExtensionSize, baseFileHeaderSize) -
+		        mHeaderExtensionSize !=
+		    0) {
+			throw EVFS_EXCEPTION << "Encrypted FS: unable to read header extension";
+		}
+		parseHeaderExtension(r_header.data() + baseFileHeaderSize, mHeaderExtensionSize);
+	}
 
 	// get the optional encryption scheme data if needed
 	size_t encryptionModuleDataSize = moduleFileHeaderSize(encryptionSuite);
@@ -461,8 +1966,7 @@ void VfsEncryption::parseHeader() {
 	// read the data, the are at offset baseFileHeaderSize + mHeaderExtensionSize
 	auto encryptionSuiteData = std::vector<uint8_t>(encryptionModuleDataSize);
 	if (encryptionModuleDataSize != 0) {
-		if (bctbx_file_read(pFileStd, encryptionSuiteData.data(), encryptionModuleDataSize,
-		                    (off_t)(baseFileHeaderSize + mHeaderExtensionSize)) -
+		if (rawRead(encryptionSuiteData.data(), encryptionModuleDataSize, baseFileHeaderSize + mHeaderExtensionSize) -
 		        encryptionModuleDataSize !=
 		    0) {
 			throw EVFS_EXCEPTION << "Encrypted FS: unable to read encryption scheme data in file header";
@@ -471,13 +1975,14 @@ void VfsEncryption::parseHeader() {
 
 	// instanciate the encryption module
 	m_module = make_VfsEncryptionModule(encryptionSuite, encryptionSuiteData);
+	m_module->countersSet(mCounters);
 
 	// check file size match what we have :
 	// If they do not match, check all chunks integrity and update the header. Recovery from failure between write and
 	// header update at last write/truncate
 	if (rawFileSizeGet() != fileSize) {
 		BCTBX_SLOGW << "Encrypted FS: meta data file size " << mFileSize << " and actual raw filesize " << fileSize
-		            << " do not match this value. Whole file integrity check";
+		            << " do not match this value. Chunks integrity check";
 		mIntegrityFullCheck = true;
 		// update file size to what it is supposed to be
 		mFileSize = fileSize - (baseFileHeaderSize + mHeaderExtensionSize +
@@ -492,12 +1997,29 @@ void VfsEncryption::parseHeader() {
 	}
 }
 
+/**
+ * Write the header holding the actual file size: the chunks written since the previous one are consistent with it so
+ * the size journal is narrowed to the chunks following the end of file
+ */
 void VfsEncryption::writeHeader(bctbx_vfs_file_t *fp) {
+	if (sizeJournalActive()) {
+		mJournalFirstChunk = getChunkIndex(mFileSize);
+		mJournalLastChunk = mJournalFirstChunk + sizeJournalWindowChunks;
+		mJournalWidened = false;
+	}
+	writeHeader(fp, mFileSize);
+}
+
+void VfsEncryption::writeHeader(bctbx_vfs_file_t *fp, uint64_t fileSize) {
 	if (m_module == nullptr) {
 		throw EVFS_EXCEPTION << "Encrypted VFS: cannot write file Header when no encryption module is selected";
 	}
+	// the header holds the tree root: the nodes leading to it are written first
+	if (mTree != nullptr) {
+		mTree->flush();
+	}
 	std::vector<uint8_t> header(std::cbegin(BCENCRYPTEDFS), std::cend(BCENCRYPTEDFS)); // starts with the magic number
-	header.reserve(baseFileHeaderSize + m_module->getModuleFileHeaderSize());
+	header.reserve(baseFileHeaderSize + mHeaderExtensionSize);
 
 	// add version number
 	header.emplace_back(mVersionNumber >> 8);
@@ -512,34 +2034,153 @@ void VfsEncryption::writeHeader(bctbx_vfs_file_t *fp) {
 	header.emplace_back(static_cast<uint8_t>(((mChunkSize / 16) >> 8) & 0xFF));
 	header.emplace_back(static_cast<uint8_t>((mChunkSize / 16) & 0xFF));
 
-	// add header extension size: none for now
-	header.emplace_back(0x00);
-	header.emplace_back(0x00);
+	// add header extension size
+	header.emplace_back(static_cast<uint8_t>((mHeaderExtensionSize >> 8) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>(mHeaderExtensionSize & 0xFF));
 
 	// add file size
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 56) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 48) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 40) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 32) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 24) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 16) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>((mFileSize >> 8) & 0xFF));
-	header.emplace_back(static_cast<uint8_t>(mFileSize & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 56) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 48) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 40) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 32) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 24) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 16) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>((fileSize >> 8) & 0xFF));
+	header.emplace_back(static_cast<uint8_t>(fileSize & 0xFF));
+
+	// add the header extension
+	if (mHeaderExtensionSize > 0) {
+		auto extension = headerExtensionBuild();
+		header.insert(header.end(), extension.cbegin(), extension.cend());
+	}
 
 	// update header cache (do not cache the encryption module data)
 	// moduleFileHeader shall depends on the file header as it probably authentify it,
 	// so do this update before asking for the encryption module header
 	r_header = header;
 
-	// add encryption module data
+	// encryption module data follows
 	auto moduleFileHeader = m_module->getModuleFileHeader(*this);
-	header.insert(header.end(), moduleFileHeader.cbegin(), moduleFileHeader.cend());
 
 	// write header to file (to the object file pointer if none is given as parameter)
-	ssize_t ret = bctbx_file_write((fp == nullptr) ? pFileStd : fp, header.data(), header.size(), 0);
-	if (ret - header.size() != 0) { // cannot compare directly signed and unsigned...
-		throw EVFS_EXCEPTION << "Encrypted VFS: something went wrong while writing file header. file_write returns "
-		                     << ret << " but we expected " << header.size();
+	bctbx_vfs_iovec_t iov[2] = {{header.data(), header.size()}, {moduleFileHeader.data(), moduleFileHeader.size()}};
+	size_t headerSize = header.size() + moduleFileHeader.size();
+	ssize_t ret = rawWritev(iov, 2, 0, fp);
+	mCounters->add(VfsCounters::headerWrites, 1);
+	if (ret - headerSize != 0) { // cannot compare directly signed and unsigned...
+		throw EVFS_EXCEPTION << "Encrypted VFS: something went wrong while writing file header. file_writev returns "
+		                     << ret << " but we expected " << headerSize;
+	}
+	mHeaderFileSize = fileSize;
+	// the header holds the root: the previous tree nodes are not needed anymore
+	if (mTree != nullptr && fp == nullptr) {
+		mTree->commit();
+	}
+}
+
+void VfsEncryption::parseHeaderExtension(const uint8_t *extension, size_t size) {
+	size_t index = 0;
+	while (index + 4 <= size) {
+		uint16_t type = static_cast<uint16_t>(readBigEndian(extension + index, 2));
+		uint16_t length = static_cast<uint16_t>(readBigEndian(extension + index + 2, 2));
+		index += 4;
+		if (type == headerRecordEnd) {
+			return;
+		}
+		if (index + length > size) {
+			throw EVFS_EXCEPTION << "Encrypted FS: malformed header extension in file " << mFilename;
+		}
+		switch (type) {
+			case headerRecordSizeJournal:
+				if (length != sizeJournalRecordLength) {
+					throw EVFS_EXCEPTION << "Encrypted FS: malformed size journal in file " << mFilename;
+				}
+				mSizeJournal = true;
+				mJournalFirstChunk = static_cast<uint32_t>(readBigEndian(extension + index, 4));
+				mJournalLastChunk = static_cast<uint32_t>(readBigEndian(extension + index + 4, 4));
+				break;
+			case headerRecordIntegrityTree:
+				if (length != integrityTreeRecordLength) {
+					throw EVFS_EXCEPTION << "Encrypted FS: malformed integrity tree record in file " << mFilename;
+				}
+				mIntegrityTree = true;
+				mIntegrityTreeRecord.assign(extension + index, extension + index + length);
+				break;
+			case headerRecordRekey:
+				if (length <= rekeyRecordBaseLength) {
+					throw EVFS_EXCEPTION << "Encrypted FS: malformed re-keying record in file " << mFilename;
+				}
+				mRekeyNextChunk = static_cast<uint32_t>(readBigEndian(extension + index, 4));
+				mRekeyPendingEnd = static_cast<uint32_t>(readBigEndian(extension + index + 4, 4));
+				mRekeyModuleHeader.assign(extension + index + rekeyRecordBaseLength, extension + index + length);
+				break;
+			case headerRecordHoles:
+				if (length % holeRangeLength != 0) {
+					throw EVFS_EXCEPTION << "Encrypted FS: malformed holes record in file " << mFilename;
+				}
+				mHoleRanges.clear();
+				for (size_t range = index; range < index + length; range += holeRangeLength) {
+					uint32_t first = static_cast<uint32_t>(readBigEndian(extension + range, 4));
+					uint32_t last = static_cast<uint32_t>(readBigEndian(extension + range + 4, 4));
+					if (first > last || (!mHoleRanges.empty() && first <= mHoleRanges.back().second)) {
+						throw EVFS_EXCEPTION << "Encrypted FS: malformed holes record in file " << mFilename;
+					}
+					mHoleRanges.emplace_back(first, last);
+				}
+				break;
+			default: // written by a newer version, skip it
+				break;
+		}
+		index += length;
+	}
+}
+
+std::vector<uint8_t> VfsEncryption::headerExtensionBuild() const {
+	std::vector<uint8_t> extension{};
+	if (mSizeJournal) {
+		appendBigEndian(extension, headerRecordSizeJournal, 2);
+		appendBigEndian(extension, sizeJournalRecordLength, 2);
+		appendBigEndian(extension, mJournalFirstChunk, 4);
+		appendBigEndian(extension, mJournalLastChunk, 4);
+	}
+	// the tree root, or the one read from the header until the tree is opened
+	if (mTree != nullptr || (mIntegrityTree && !mIntegrityTreeRecord.empty())) {
+		appendBigEndian(extension, headerRecordIntegrityTree, 2);
+		appendBigEndian(extension, integrityTreeRecordLength, 2);
+		if (mTree != nullptr) {
+			extension.push_back(mTree->depthGet());
+			extension.insert(extension.end(), mTree->rootGet().cbegin(), mTree->rootGet().cend());
+		} else {
+			extension.insert(extension.end(), mIntegrityTreeRecord.cbegin(), mIntegrityTreeRecord.cend());
+		}
+	}
+	if (!mRekeyModuleHeader.empty()) {
+		appendBigEndian(extension, headerRecordRekey, 2);
+		appendBigEndian(extension, rekeyRecordBaseLength + mRekeyModuleHeader.size(), 2);
+		appendBigEndian(extension, mRekeyNextChunk, 4);
+		appendBigEndian(extension, mRekeyPendingEnd, 4);
+		extension.insert(extension.end(), mRekeyModuleHeader.cbegin(), mRekeyModuleHeader.cend());
+	}
+	if (!mHoleRanges.empty()) {
+		appendBigEndian(extension, headerRecordHoles, 2);
+		appendBigEndian(extension, mHoleRanges.size() * holeRangeLength, 2);
+		for (const auto &range : mHoleRanges) {
+			appendBigEndian(extension, range.first, 4);
+			appendBigEndian(extension, range.second, 4);
+		}
+	}
+	if (extension.size() > mHeaderExtensionSize) {
+		throw EVFS_EXCEPTION << "Encrypted FS: header extension of file " << mFilename << " is too small to hold "
+		                     << extension.size() << " bytes";
+	}
+	extension.resize(mHeaderExtensionSize, 0); // zeros: the end record, then padding
+	return extension;
+}
+
+void VfsEncryption::headerExtensionReserve() noexcept {
+	if (mSizeJournal || mIntegrityTree || mSparseExtension) {
+		mHeaderExtensionSize = headerExtensionSize;
+		mVersionNumber = BcEncFS_v0101;
 	}
 }
 
@@ -572,211 +2213,434 @@ size_t VfsEncryption::getChunkOffset(uint32_t index) const noexcept {
 }
 
 std::vector<uint8_t> VfsEncryption::read(size_t offset, size_t count) const {
+	std::vector<uint8_t> plainData(count);
+	plainData.resize(read(plainData.data(), count, offset));
+	return plainData;
+}
+
+size_t VfsEncryption::read(uint8_t *plainData, size_t count, size_t offset) const {
+	mCounters->add(VfsCounters::plainBytesRead, count);
 	// plain file?
 	if (m_module == nullptr) {
-		std::vector<uint8_t> plain(count);
-		auto readSize = bctbx_file_read(pFileStd, plain.data(), plain.size(), (off_t)offset);
-		plain.resize(readSize);
-		return plain;
+		auto readSize = rawRead(plainData, count, offset);
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "fail to read plain file " << mFilename << " file_read returned " << readSize;
+		}
+		return static_cast<size_t>(readSize);
 	}
 
+	// nothing to read after the end of file
+	if (count == 0 || offset >= mFileSize) {
+		return 0;
+	}
+	count = static_cast<size_t>(std::min(static_cast<uint64_t>(count), mFileSize - offset));
+	mReadAhead->collect(offset);
+
 	/* first compute how much of the actual file we must read */
 	uint32_t firstChunk = getChunkIndex(offset);
 	uint32_t lastChunk =
 	    getChunkIndex(offset + count - 1); // -1 as we read data from indexes offset to offset + count - 1
-	size_t offsetInFirstChunk = offset % mChunkSize;
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	const bool useCache = mPlainChunkCache->capacityGet() > 0;
+
+	// chunks available in the write back buffer, read ahead or in the plain chunk cache are not read: read only from
+	// the first to the last missing one
+	auto available = [this, useCache](uint32_t chunkIndex) {
+		return mDirtyChunks.count(chunkIndex) > 0 || mReadAhead->find(chunkIndex) != nullptr ||
+		       (useCache && mPlainChunkCache->contains(chunkIndex));
+	};
+	uint32_t firstMissingChunk = firstChunk;
+	uint32_t lastMissingChunk = lastChunk;
+	while (firstMissingChunk <= lastChunk && available(firstMissingChunk)) {
+		firstMissingChunk++;
+	}
+	while (lastMissingChunk > firstMissingChunk && available(lastMissingChunk)) {
+		lastMissingChunk--;
+	}
 
-	// allocate a vector large enough to store all the data to read : number of chunks * size of raw
-	// chunk(payload+header)
-	std::vector<uint8_t> rawData((lastChunk - firstChunk + 1) * rawChunkSizeGet());
+	// read all missing chunks from actual file in the raw buffer: number of chunks * size of raw chunk(payload+header)
+	size_t rawDataSize = 0;
+	if (firstMissingChunk <= lastMissingChunk) {
+		rawDataSize = (lastMissingChunk - firstMissingChunk + 1) * rawChunkSize;
+		if (mRawBuffer.size() < rawDataSize) {
+			mRawBuffer.resize(rawDataSize);
+		}
+		ssize_t readSize = rawRead(mRawBuffer.data(), rawDataSize, getChunkOffset(firstMissingChunk));
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+		}
+		rawDataSize = static_cast<size_t>(readSize); // last chunk may be incomplete
+	}
 
-	/* read all chunks from actual file */
-	ssize_t readSize = bctbx_file_read(pFileStd, rawData.data(), rawData.size(), (off_t)getChunkOffset(firstChunk));
+	// process chunk by chunk: copy from the cache or decrypt, straight into the caller's buffer when the chunk is fully
+	// requested
+	size_t plainSize = 0; // the amount of data actually delivered in plainData
+	std::vector<std::pair<uint32_t, std::vector<uint8_t>>> decryptedChunks{}; // chunks to store in cache
+	mChunkJobs.clear(); // fully requested chunks are decrypted once they are all collected, maybe on worker threads
+	uint64_t chunkStart = static_cast<uint64_t>(firstChunk) * mChunkSize; // plain offset of the chunk
+	for (uint32_t chunkIndex = firstChunk; chunkIndex <= lastChunk; chunkIndex++, chunkStart += mChunkSize) {
+		// requested part of this chunk is [begin, end[
+		size_t begin = (offset > chunkStart) ? static_cast<size_t>(offset - chunkStart) : 0;
+		size_t end = 0;
+
+		const std::vector<uint8_t> *cachedChunk = nullptr;
+		auto dirtyChunk = mDirtyChunks.find(chunkIndex);
+		if (dirtyChunk != mDirtyChunks.end()) {
+			cachedChunk = &dirtyChunk->second;
+		} else {
+			cachedChunk = mReadAhead->find(chunkIndex);
+		}
+		if (cachedChunk == nullptr && useCache) {
+			cachedChunk = mPlainChunkCache->get(chunkIndex);
+		}
+		if (cachedChunk != nullptr) {
+			end = static_cast<size_t>(
+			    std::min(static_cast<uint64_t>(cachedChunk->size()), offset + count - chunkStart));
+			if (begin >= end) {
+				break;
+			}
+			memcpy(plainData + (chunkStart + begin - offset), cachedChunk->data() + begin, end - begin);
+		} else {
+			size_t rawIndex = (chunkIndex - firstMissingChunk) * rawChunkSize;
+			if (rawIndex + chunkHeaderSize >= rawDataSize) {
+				break;
+			}
+			size_t chunkRawSize = std::min(rawChunkSize, rawDataSize - rawIndex);
+			size_t chunkPlainSize = chunkRawSize - chunkHeaderSize;
+			end = static_cast<size_t>(std::min(static_cast<uint64_t>(chunkPlainSize), offset + count - chunkStart));
+			if (begin >= end) {
+				break;
+			}
 
-	/* resize rawData to the actual content size - last chunk may be incomplete */
-	if (readSize >= 0) {
-		rawData.resize(readSize);
-	} else {
-		throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+			if (begin == 0 && end == chunkPlainSize) {
+				mChunkJobs.push_back(ChunkJob{chunkIndex, mRawBuffer.data() + rawIndex, chunkRawSize, nullptr,
+				                              plainData + (chunkStart - offset), chunkPlainSize});
+			} else { // partial chunk: decrypt it in the chunk buffer and copy only the requested part
+				if (mPlainChunkBuffer.size() < mChunkSize) {
+					mPlainChunkBuffer.resize(mChunkSize);
+				}
+				chunkDecrypt(chunkIndex, mRawBuffer.data() + rawIndex, chunkRawSize, mPlainChunkBuffer.data());
+				memcpy(plainData + (chunkStart + begin - offset), mPlainChunkBuffer.data() + begin, end - begin);
+				if (useCache) {
+					decryptedChunks.emplace_back(
+					    chunkIndex,
+					    std::vector<uint8_t>(mPlainChunkBuffer.cbegin(), mPlainChunkBuffer.cbegin() + chunkPlainSize));
+				}
+			}
+		}
+		plainSize = static_cast<size_t>(chunkStart + end - offset);
 	}
 
-	std::vector<uint8_t> plainData{};
-	plainData.reserve((lastChunk - firstChunk + 1) * mChunkSize);
+	runChunkJobs();
 
-	// decrypt everything we have chunk by chunk, use firstChunk as chunk index
-	while (rawData.size() > m_module->getChunkHeaderSize()) {
-		std::vector<uint8_t> plainChunk = m_module->decryptChunk(
-		    firstChunk++,
-		    std::vector<uint8_t>(rawData.cbegin(), rawData.cbegin() + std::min(rawChunkSizeGet(), rawData.size())));
-		plainData.insert(plainData.end(), plainChunk.cbegin(), plainChunk.cend());
-		// remove the decrypted chunk
-		rawData.erase(rawData.begin(), rawData.begin() + std::min(rawChunkSizeGet(), rawData.size()));
+	// store the decrypted chunks in cache only now: inserting may evict the cached chunks we needed
+	if (useCache) {
+		for (const auto &job : mChunkJobs) {
+			mPlainChunkCache->insert(job.chunkIndex, std::vector<uint8_t>(job.plainOut, job.plainOut + job.plainSize),
+			                         job.plainSize);
+		}
 	}
-
-	// return only the requested part
-	plainData.erase(plainData.begin(),
-	                plainData.begin() +
-	                    std::min(offsetInFirstChunk, plainData.size())); // remove unwanted chunk begining
-	if (count < plainData.size()) {                                      // if we have too much data, remove the end
-		plainData.erase(plainData.begin() + count, plainData.end());
+	for (auto &chunk : decryptedChunks) {
+		auto chunkSize = chunk.second.size();
+		mPlainChunkCache->insert(chunk.first, std::move(chunk.second), chunkSize);
 	}
-	return plainData;
+
+	mReadAhead->readDone(offset, plainSize);
+	return plainSize;
 }
 
 size_t VfsEncryption::write(const std::vector<uint8_t> &plainData, size_t offset) {
+	return write(plainData.data(), plainData.size(), offset);
+}
+
+size_t VfsEncryption::write(const uint8_t *plainData, size_t count, size_t offset) {
+	mCounters->add(VfsCounters::plainBytesWritten, count);
+	lineChunkDrop();
+	mReadAhead->cancel();
 	// plain file?
 	if (m_module == nullptr) {
-		ssize_t ret = bctbx_file_write(pFileStd, plainData.data(), plainData.size(), (off_t)offset);
-		if (ret - plainData.size() == 0) { // compare signed and unsigned
-			return plainData.size();
+		ssize_t ret = 0;
+		auto plainWrite = [&]() { ret = rawWrite(plainData, count, offset); };
+		if (mMigrationTask != nullptr) { // the migration must take this modification into account
+			mMigrationTask->modify(offset, plainWrite);
+		} else {
+			plainWrite();
+		}
+		if (ret - count == 0) { // compare signed and unsigned
+			return count;
 		} else {
 			throw EVFS_EXCEPTION << "plain file fail to write to physical file " << ret;
 		}
 	}
 
-	auto plain = plainData; // work on a local copy as we may modify it
-	uint64_t finalFileSize = std::max(
-	    mFileSize, static_cast<decltype(mFileSize)>(plain.size() + offset)); // we might need to increase the file size
+	// Are we writing after the end of the file, if yes, the gap is filled with zeros
+	uint64_t writeStart = std::min(static_cast<uint64_t>(offset), mFileSize);
+	uint64_t writeEnd = static_cast<uint64_t>(offset) + count;
+	if (writeEnd <= writeStart) { // nothing to write, nor to pad
+		return count;
+	}
+	// a gap holding whole chunks after the current last one is filled first, by batches or leaving holes
+	if (offset > mFileSize && getChunkIndex(offset) > getChunkIndex(mFileSize + mChunkSize - 1)) {
+		extend(offset);
+		writeStart = offset;
+		if (writeEnd <= writeStart) { // nothing more to write
+			return count;
+		}
+	}
+	if (mWriteBackBufferSize > 0) {
+		writeBack(plainData, count, offset);
+		return count;
+	}
+	uint64_t finalFileSize = std::max(mFileSize, writeEnd); // we might need to increase the file size
+
+	uint32_t firstChunk = getChunkIndex(writeStart);
+	uint32_t lastChunk = getChunkIndex(writeEnd - 1); // -1 as we write data from indexes writeStart to writeEnd - 1
+	const size_t rawChunkSize = rawChunkSizeGet();
+	const size_t chunkHeaderSize = m_module->getChunkHeaderSize();
+	const bool useCache = mPlainChunkCache->capacityGet() > 0;
+	journalChunks(firstChunk, lastChunk);
+	// maximum size used, last chunk might be incomplete
+	size_t rawDataSize = (lastChunk - firstChunk + 1) * rawChunkSize;
+	if (mRawBuffer.size() < rawDataSize) {
+		mRawBuffer.resize(rawDataSize);
+	}
 
-	// Are we writing after the end of the file, if yes, prepend with zeros
-	if (offset > mFileSize) {
-		plain.insert(plain.begin(), offset - static_cast<size_t>(mFileSize), 0);
-		offset = static_cast<size_t>(mFileSize);
+	// Are we overwritting some chunks? If yes read them all at once in the output buffer, they are re-encrypted in
+	// place
+	uint64_t chunkStart = static_cast<uint64_t>(firstChunk) * mChunkSize; // plain offset of the current chunk
+	if (chunkStart < mFileSize) {
+		ssize_t readSize = rawRead(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "fail to read file " << mFilename << " file_read returned " << readSize;
+		}
 	}
 
-	uint32_t firstChunk = getChunkIndex(offset);
-	uint32_t lastChunk =
-	    getChunkIndex(offset + plain.size() - 1); // -1 as we write data from indexes offset to offset + data size - 1
-	size_t rawDataSize =
-	    (lastChunk - firstChunk + 1) * rawChunkSizeGet(); // maximum size used, last chunk might be incomplete
-	std::vector<uint8_t>
-	    rawData{}; // Store the existing encrypted chunks with header that are overwritten by this operation
-
-	// Are we overwritting some chunks?
-	size_t readOffset = offset - offset % mChunkSize; // we must start read/write at the begining of a chunk
-
-	if (readOffset < mFileSize) { // Yes we are overwritting some data, read all the existing chunks we are overwritting
-		rawData.resize(rawDataSize);
-		ssize_t overwrittenSize =
-		    bctbx_file_read(pFileStd, rawData.data(), rawDataSize, (off_t)getChunkOffset(firstChunk));
-		rawData.resize(overwrittenSize);
-		rawData.shrink_to_fit();
-	}
-
-	// prepend the plain buffer if needed
-	if (readOffset < offset) { // we need to get the plain data from readOffset to offset
-		// decrypt the first chunk
-		auto plainChunk = m_module->decryptChunk(
-		    firstChunk,
-		    std::vector<uint8_t>(rawData.cbegin(), rawData.cbegin() + std::min(rawChunkSizeGet(), rawData.size())));
-		plain.insert(plain.begin(), plainChunk.cbegin(),
-		             plainChunk.cbegin() + (offset - readOffset)); // prepend the begining to our plain buffer
-	}
-
-	// append the plain buffer if needed:
-	if ((plain.size() % mChunkSize != 0) &&
-	    (plain.size() + readOffset < mFileSize)) { // We do not have an integer number of chunks to write and we have
-		                                           // data after our last written byte
-		auto plainChunk = m_module->decryptChunk(
-		    lastChunk,
-		    std::vector<uint8_t>(rawData.cbegin() + getChunkOffset(lastChunk) - getChunkOffset(firstChunk),
-		                         rawData.cbegin() + std::min(getChunkOffset(lastChunk + 1) - getChunkOffset(firstChunk),
-		                                                     rawData.size())));
-		plain.insert(plain.end(), plainChunk.cbegin() + (plain.size() % mChunkSize),
-		             plainChunk.cend()); // append what is over the part we will write.
-	}
-
-	// encrypt the overwritten chunks
-	std::vector<uint8_t> updatedRawData{};
-	updatedRawData.reserve(rawDataSize);
-	uint32_t currentChunkIndex = firstChunk;
-	while (rawData.size() > 0) {
-		// get a chunk to re-encrypt
-		std::vector<uint8_t> rawChunk(rawData.cbegin(), rawData.cbegin() + std::min(rawChunkSizeGet(), rawData.size()));
-		// delete it
-		rawData.erase(rawData.begin(), rawData.begin() + std::min(rawChunkSizeGet(), rawData.size()));
-		// re-encrypt
-		m_module->encryptChunk(
-		    currentChunkIndex++, rawChunk,
-		    std::vector<uint8_t>(plain.cbegin(), plain.cbegin() + std::min(mChunkSize, plain.size())));
-		// delete consumed plain
-		plain.erase(plain.begin(), plain.begin() + std::min(mChunkSize, plain.size()));
-		// store the result
-		updatedRawData.insert(updatedRawData.end(), rawChunk.cbegin(), rawChunk.cend());
-	}
-
-	// add new chunks if some data remains in the plain buffer
-	while (plain.size() > 0) {
-		auto rawChunk = m_module->encryptChunk(
-		    currentChunkIndex++,
-		    std::vector<uint8_t>(plain.cbegin(), plain.cbegin() + std::min(mChunkSize, plain.size())));
-		// delete consumed plain
-		plain.erase(plain.begin(), plain.begin() + std::min(mChunkSize, plain.size()));
-		// store the result
-		updatedRawData.insert(updatedRawData.end(), rawChunk.cbegin(), rawChunk.cend());
+	// walk the chunks: the ones fully covered by the input are encrypted directly from it, partial ones are rebuilt in
+	// the chunk buffer using the existing content, zeros (if we write after the end of file) and the input
+	size_t rawIndex = 0;
+	size_t chunkPlainSize = 0; // plain size of the current chunk once written
+	mChunkJobs.clear(); // fully written chunks are encrypted once they are all collected, maybe on worker threads
+	try {
+		for (uint32_t chunkIndex = firstChunk; chunkIndex <= lastChunk;
+		     chunkIndex++, rawIndex += rawChunkSize, chunkStart += mChunkSize) {
+			size_t existingPlainSize = (chunkStart < mFileSize)
+			                               ? static_cast<size_t>(std::min<uint64_t>(mChunkSize, mFileSize - chunkStart))
+			                               : 0;
+			chunkPlainSize = static_cast<size_t>(std::min<uint64_t>(mChunkSize, finalFileSize - chunkStart));
+			uint8_t *rawChunk = mRawBuffer.data() + rawIndex;
+
+			const uint8_t *chunkPlain = nullptr;
+			if (offset <= chunkStart && chunkStart + chunkPlainSize <= writeEnd) {
+				chunkPlain = plainData + (chunkStart - offset);
+				mChunkJobs.push_back(ChunkJob{chunkIndex, rawChunk,
+				                              existingPlainSize > 0 ? chunkHeaderSize + existingPlainSize : 0,
+				                              chunkPlain, nullptr, chunkPlainSize});
+			} else {
+				if (mPlainChunkBuffer.size() < mChunkSize) {
+					mPlainChunkBuffer.resize(mChunkSize);
+				}
+				const bool hole =
+				    existingPlainSize > 0 && isHole(chunkIndex, rawChunk, chunkHeaderSize + existingPlainSize);
+				if (existingPlainSize > 0) {
+					auto cachedChunk = useCache ? mPlainChunkCache->get(chunkIndex) : nullptr;
+					if (cachedChunk != nullptr) {
+						memcpy(mPlainChunkBuffer.data(), cachedChunk->data(), existingPlainSize);
+					} else {
+						chunkDecrypt(chunkIndex, rawChunk, chunkHeaderSize + existingPlainSize,
+						             mPlainChunkBuffer.data());
+					}
+				}
+				// pad with zeros whatever was not part of the file
+				memset(mPlainChunkBuffer.data() + existingPlainSize, 0, chunkPlainSize - existingPlainSize);
+				// then copy the part of the input in this chunk
+				uint64_t copyStart = std::max(chunkStart, static_cast<uint64_t>(offset));
+				uint64_t copyEnd = std::min(chunkStart + chunkPlainSize, writeEnd);
+				if (copyStart < copyEnd) {
+					memcpy(mPlainChunkBuffer.data() + (copyStart - chunkStart), plainData + (copyStart - offset),
+					       static_cast<size_t>(copyEnd - copyStart));
+				}
+				chunkPlain = mPlainChunkBuffer.data();
+				VfsCounters::ModuleCall call(mCounters.get(), VfsCounters::chunksEncrypted, 1);
+				if (existingPlainSize > 0 && !hole) { // re-encrypt
+					chunkModule(chunkIndex).encryptChunk(chunkIndex, rawChunk, chunkHeaderSize + existingPlainSize,
+					                                     chunkPlain, chunkPlainSize);
+				} else { // new chunk
+					chunkModule(chunkIndex).encryptChunk(chunkIndex, chunkPlain, chunkPlainSize, rawChunk);
+				}
+			}
+
+			// keep the plain chunk cache up to date
+			if (useCache) {
+				mPlainChunkCache->insert(chunkIndex, std::vector<uint8_t>(chunkPlain, chunkPlain + chunkPlainSize),
+				                         chunkPlainSize);
+			}
+		}
+		runChunkJobs();
+	} catch (...) {
+		plainChunkCacheErase(firstChunk, lastChunk);
+		throw;
 	}
+	rawDataSize = rawIndex - rawChunkSize + chunkHeaderSize + chunkPlainSize; // the last chunk might be incomplete
 
 	// now actually write the rawData in the file
-	ssize_t ret =
-	    bctbx_file_write(pFileStd, updatedRawData.data(), updatedRawData.size(), (off_t)getChunkOffset(firstChunk));
-	if (ret - updatedRawData.size() == 0) { // compare signed and unsigned
-		mFileSize = finalFileSize;
-		writeHeader();
-		return plainData.size();
-	} else {
+	ssize_t ret = rawWrite(mRawBuffer.data(), rawDataSize, getChunkOffset(firstChunk));
+	if (ret - rawDataSize != 0) { // compare signed and unsigned
+		plainChunkCacheErase(firstChunk, lastChunk);
 		throw EVFS_EXCEPTION << "fail to write to physical file " << mFilename << " file_write " << ret;
 	}
+	integrityTreeUpdate(firstChunk, lastChunk - firstChunk + 1, mRawBuffer.data());
+	const bool holesModified = holesWritten(firstChunk, lastChunk);
+	// the header holds the file size, the integrity tree root and the hole ranges
+	if (mFileSize != finalFileSize || mTree != nullptr || holesModified) {
+		mFileSize = finalFileSize;
+		headerUpdate();
+	}
+	return count;
 }
 
 void VfsEncryption::truncate(const uint64_t newSize) {
+	lineChunkDrop();
+	mReadAhead->cancel();
 	// plain file?
 	if (m_module == nullptr) {
-		bctbx_file_truncate(pFileStd, newSize);
+		auto plainTruncate = [&]() { bctbx_file_truncate(pFileStd, newSize); };
+		if (mMigrationTask != nullptr) { // the migration must take this modification into account
+			uint64_t plainSize = static_cast<uint64_t>(std::max(bctbx_file_size(pFileStd), ssize_t(0)));
+			mMigrationTask->modify(std::min(newSize, plainSize), plainTruncate);
+		} else {
+			plainTruncate();
+		}
 		return;
 	}
 
-	// if current size is smaller, just write 0 at the end
+	// if current size is smaller, fill the gap with zeros
 	if (mFileSize < newSize) {
-		write(std::vector<uint8_t>{},
-		      static_cast<size_t>(newSize)); // write nothing at new size index, the gap is filled with 0 by write
+		extend(newSize);
 		return;
 	}
 
 	if (mFileSize > newSize) {
+		// truncate what is on disk
+		dirtyChunksFlush();
+		// drop from the plain chunk cache the chunks beyond the new size and the one holding the new end of file
+		uint32_t newLastChunk = getChunkIndex(newSize);
+		mPlainChunkCache->eraseIf([newLastChunk](const uint32_t &chunkIndex) { return chunkIndex >= newLastChunk; });
+		journalChunks(newLastChunk, getChunkIndex(mFileSize - 1));
+
 		// If the last chunk is modified, we must re-encrypt it
 		if (newSize % mChunkSize != 0) {
 			// allocate a vector large enough to store a complete chunk
 			std::vector<uint8_t> rawData(rawChunkSizeGet());
 
 			// read the future last chunk from actual file
-			ssize_t readSize = bctbx_file_read(pFileStd, rawData.data(), rawData.size(),
-			                                   (off_t)getChunkOffset(getChunkIndex(newSize)));
+			ssize_t readSize = rawRead(rawData.data(), rawData.size(), getChunkOffset(getChunkIndex(newSize)));
 			rawData.resize(readSize);
-			// decrypt it
-			auto plainLastChunk = m_module->decryptChunk(
-			    getChunkIndex(newSize),
-			    std::vector<uint8_t>(rawData.cbegin(), rawData.cbegin() + std::min(rawChunkSizeGet(), rawData.size())));
-			// truncate the part we don't need anymore
-			plainLastChunk.resize(newSize % mChunkSize);
-			// re-encrypt it
-			m_module->encryptChunk(getChunkIndex(newSize), rawData,
-			                       std::vector<uint8_t>(plainLastChunk.cbegin(), plainLastChunk.cend()));
-
-			/* write it to the actual file */
-			if (bctbx_file_write(pFileStd, rawData.data(), rawData.size(),
-			                     (off_t)getChunkOffset(getChunkIndex(newSize))) -
-			        rawData.size() !=
-			    0) {
-				throw EVFS_EXCEPTION << "Cannot write file " << mFilename << " during truncate";
+			// a truncated hole is still a hole
+			if (!isHole(getChunkIndex(newSize), rawData.data(), rawData.size())) {
+				// decrypt it
+				auto rawLastChunkEnd = rawData.cbegin() + std::min(rawChunkSizeGet(), rawData.size());
+				auto &module = chunkModule(getChunkIndex(newSize));
+				std::vector<uint8_t> plainLastChunk;
+				{
+					VfsCounters::ModuleCall call(mCounters.get(), VfsCounters::chunksDecrypted, 1);
+					plainLastChunk = module.decryptChunk(getChunkIndex(newSize),
+					                                     std::vector<uint8_t>(rawData.cbegin(), rawLastChunkEnd));
+				}
+				// truncate the part we don't need anymore
+				plainLastChunk.resize(newSize % mChunkSize);
+				// re-encrypt it
+				{
+					VfsCounters::ModuleCall call(mCounters.get(), VfsCounters::chunksEncrypted, 1);
+					module.encryptChunk(getChunkIndex(newSize), rawData, plainLastChunk);
+				}
+
+				/* write it to the actual file */
+				if (rawWrite(rawData.data(), rawData.size(), getChunkOffset(getChunkIndex(newSize))) -
+				        rawData.size() !=
+				    0) {
+					throw EVFS_EXCEPTION << "Cannot write file " << mFilename << " during truncate";
+				}
+				integrityTreeUpdate(getChunkIndex(newSize), 1, rawData.data());
 			}
 		}
+		// the removed chunks leave the integrity tree
+		uint32_t removedChunk = (newSize > 0) ? getChunkIndex(newSize - 1) + 1 : 0;
+		integrityTreeUpdate(removedChunk, getChunkIndex(mFileSize - 1) + 1 - removedChunk, nullptr);
+		// and the hole ranges
+		while (!mHoleRanges.empty() && mHoleRanges.back().first >= removedChunk) {
+			mHoleRanges.pop_back();
+		}
+		if (!mHoleRanges.empty() && mHoleRanges.back().second >= removedChunk) {
+			mHoleRanges.back().second = removedChunk - 1;
+		}
 		// update file size in meta data
 		mFileSize = newSize;
 		// truncate the actual file
 		bctbx_file_truncate(pFileStd, rawFileSizeGet());
 		// update the header
-		writeHeader();
+		headerUpdate();
+	}
+}
+
+/**
+ * Plain files have no chunk: they are read by pages of the default chunk size
+ */
+bool VfsEncryption::lineChunkLoad(uint64_t chunkIndex) {
+	if (!mLineChunk.empty() && mLineChunkIndex == chunkIndex) {
+		return true;
+	}
+	lineChunkDrop();
+	const size_t chunkSize = chunkSizeGet();
+	mLineChunk.resize(chunkSize);
+	mLineChunk.resize(read(mLineChunk.data(), chunkSize, static_cast<size_t>(chunkIndex * chunkSize)));
+	mLineChunkIndex = chunkIndex;
+	return !mLineChunk.empty();
+}
+
+void VfsEncryption::lineChunkDrop() noexcept {
+	bctbx_clean(mLineChunk.data(), mLineChunk.size());
+	mLineChunk.clear();
+}
+
+size_t VfsEncryption::getLine(char *line, size_t maxLen, uint64_t &offset) {
+	if (maxLen == 0) {
+		throw EVFS_EXCEPTION << "getLine on file " << mFilename << ": no room for the line";
 	}
+	const size_t chunkSize = chunkSizeGet();
+	size_t lineSize = 0; // size of the line copied so far
+	uint64_t position = offset;
+	while (lineSize < maxLen - 1 && lineChunkLoad(position / chunkSize)) {
+		size_t begin = static_cast<size_t>(position % chunkSize);
+		if (begin >= mLineChunk.size()) { // end of file in the last chunk
+			break;
+		}
+		size_t end = std::min(mLineChunk.size(), begin + (maxLen - 1 - lineSize));
+		auto first = mLineChunk.cbegin() + begin;
+		auto eol = std::find_if(first, mLineChunk.cbegin() + end, [](uint8_t c) { return c == '\r' || c == '\n'; });
+		size_t size = static_cast<size_t>(eol - first);
+		memcpy(line + lineSize, mLineChunk.data() + begin, size);
+		lineSize += size;
+		position += size;
+		if (eol != mLineChunk.cbegin() + end) { // end of line found, skip it
+			line[lineSize] = '\0';
+			position++;
+			if (*eol == '\r') { // take into account the \r\n case, even when they are in two chunks
+				if (lineChunkLoad(position / chunkSize) && position % chunkSize < mLineChunk.size() &&
+				    mLineChunk[static_cast<size_t>(position % chunkSize)] == '\n') {
+					position++;
+				}
+			}
+			offset = position;
+			return lineSize + 1;
+		}
+		if (mLineChunk.size() < chunkSize && end == mLineChunk.size()) { // end of file
+			break;
+		}
+	}
+	line[lineSize] = '\0';
+	offset = position;
+	return lineSize;
 }
 
 std::string VfsEncryption::filenameGet() const noexcept {
@@ -819,6 +2683,16 @@ static int bcClose(bctbx_vfs_file_t *pFile) {
 			BCTBX_SLOGI << "[EVFS] close " << filename;
 		}
 
+		try {
+			ctx->headerFlush(); // write any pending header update
+		} catch (EvfsException const &e) {
+			BCTBX_SLOGE << "[EVFS] close " << filename << ": unable to update header " << e;
+			ret = BCTBX_VFS_ERROR;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "[EVFS] close " << filename << ": unable to update header " << e.what();
+			ret = BCTBX_VFS_ERROR;
+		}
+
 		delete (ctx); // that will close the file
 		pFile->pUserData = NULL;
 	}
@@ -826,12 +2700,24 @@ static int bcClose(bctbx_vfs_file_t *pFile) {
 }
 
 /**
- * Simply sync the file contents given through the file handle
- * Just forward the request to underlying vfs
+ * Sync the file contents given through the file handle
+ * Write any pending header update and forward the request to underlying vfs
  */
 static int bcSync(bctbx_vfs_file_t *pFile) {
 	if (pFile && pFile->pUserData) {
 		VfsEncryption *ctx = static_cast<VfsEncryption *>(pFile->pUserData);
+		try {
+			ctx->headerFlush();
+			if (ctx->integrityTreeSync() != 0) {
+				return BCTBX_VFS_ERROR;
+			}
+		} catch (EvfsException const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: unable to update header during sync: " << e;
+			return BCTBX_VFS_ERROR;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: unable to update header during sync: " << e.what();
+			return BCTBX_VFS_ERROR;
+		}
 		return bctbx_file_sync(ctx->pFileStd);
 	}
 	return BCTBX_VFS_ERROR;
@@ -852,14 +2738,15 @@ static ssize_t bcRead(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t of
 	if (pFile && pFile->pUserData) {
 		VfsEncryption *ctx = static_cast<VfsEncryption *>(pFile->pUserData);
 
+		if (offset < 0) return BCTBX_VFS_ERROR;
 		try {
-			auto readBuffer = ctx->read(offset, count);
-
-			memcpy(buf, readBuffer.data(), readBuffer.size());
-			return (ssize_t)readBuffer.size();
+			return (ssize_t)ctx->read(static_cast<uint8_t *>(buf), count, static_cast<size_t>(offset));
 		} catch (EvfsException const &e) { // cannot let raise an exception to a C context
 			BCTBX_SLOGE << "Encrypted VFS: error while reading " << count << " bytes from file " << ctx->filenameGet()
 			            << " at offset " << offset << ". " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: error while reading " << count << " bytes from file " << ctx->filenameGet()
+			            << " at offset " << offset << ". " << e.what();
 		}
 	}
 	return BCTBX_VFS_ERROR;
@@ -879,9 +2766,15 @@ static ssize_t bcWrite(bctbx_vfs_file_t *pFile, const void *buf, size_t count, o
 	if (offset < 0) return BCTBX_VFS_ERROR;
 	if (pFile && pFile->pUserData) {
 		VfsEncryption *ctx = static_cast<VfsEncryption *>(pFile->pUserData);
-		return (ssize_t)ctx->write(std::vector<uint8_t>(reinterpret_cast<const uint8_t *>(buf),
-		                                                reinterpret_cast<const uint8_t *>(buf) + count),
-		                           offset);
+		try {
+			return (ssize_t)ctx->write(static_cast<const uint8_t *>(buf), count, static_cast<size_t>(offset));
+		} catch (EvfsException const &e) { // cannot let raise an exception to a C context
+			BCTBX_SLOGE << "Encrypted VFS: error while writing " << count << " bytes to file " << ctx->filenameGet()
+			            << " at offset " << offset << ". " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: error while writing " << count << " bytes to file " << ctx->filenameGet()
+			            << " at offset " << offset << ". " << e.what();
+		}
 	}
 	return BCTBX_VFS_ERROR;
 }
@@ -915,12 +2808,47 @@ static int bcTruncate(bctbx_vfs_file_t *pFile, int64_t new_size) {
 
 	if (pFile && pFile->pUserData) {
 		VfsEncryption *ctx = static_cast<VfsEncryption *>(pFile->pUserData);
-		ctx->truncate(new_size);
-		return 0;
+		try {
+			ctx->truncate(new_size);
+			return 0;
+		} catch (EvfsException const &e) { // cannot let raise an exception to a C context
+			BCTBX_SLOGE << "Encrypted VFS: error while truncating file " << ctx->filenameGet() << " to " << new_size
+			            << " bytes. " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: error while truncating file " << ctx->filenameGet() << " to " << new_size
+			            << " bytes. " << e.what();
+		}
 	}
 	return ret;
 }
 
+/**
+ * Gets the line starting at the file offset stored in pFile, the chunk holding the end of the line is kept decrypted
+ * so a sequential scan decrypts each chunk once.
+ * @param  pFile   File handle pointer.
+ * @param  s       Buffer where to store the line.
+ * @param  max_len Size of s.
+ * @return         size of line read, 0 at end of file, BCTBX_VFS_ERROR on error
+ */
+static int bcGetLine(bctbx_vfs_file_t *pFile, char *s, int max_len) {
+	if (pFile && pFile->pUserData && s != NULL && max_len > 0 && pFile->offset >= 0) {
+		VfsEncryption *ctx = static_cast<VfsEncryption *>(pFile->pUserData);
+		try {
+			uint64_t offset = static_cast<uint64_t>(pFile->offset);
+			int ret = static_cast<int>(ctx->getLine(s, static_cast<size_t>(max_len), offset));
+			pFile->offset = static_cast<off_t>(offset);
+			return ret;
+		} catch (EvfsException const &e) { // cannot let raise an exception to a C context
+			BCTBX_SLOGE << "Encrypted VFS: error while reading a line from file " << ctx->filenameGet()
+			            << " at offset " << pFile->offset << ". " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: error while reading a line from file " << ctx->filenameGet()
+			            << " at offset " << pFile->offset << ". " << e.what();
+		}
+	}
+	return BCTBX_VFS_ERROR;
+}
+
 /*
  ** is a file encrypted or plain
  * @param pFile File handle pointer.
@@ -940,8 +2868,10 @@ static const bctbx_io_methods_t bcio = {bcClose,    /* pFuncClose */
                                         bcTruncate, /* pFuncTruncate */
                                         bcFileSize, /* pFuncFileSize */
                                         bcSync,
-                                        NULL, // use the generic get next line function
-                                        bcIsEncrypted};
+                                        bcGetLine,  /* pFuncGetLineFromFd */
+                                        bcIsEncrypted,
+                                        nullptr, /* pFuncReadv: generic implementation */
+                                        nullptr  /* pFuncWritev: generic implementation */};
 
 static int bcOpen(BCTBX_UNUSED(bctbx_vfs_t *pVfs), bctbx_vfs_file_t *pFile, const char *fName, int openFlags) {
 	VfsEncryption *ctx = nullptr;
@@ -959,12 +2889,13 @@ static int bcOpen(BCTBX_UNUSED(bctbx_vfs_t *pVfs), bctbx_vfs_file_t *pFile, cons
 			openFlags |= O_RDWR;
 		}
 
+		std::string filename{fName};
 		stdFp = bctbx_file_open2(bctbx_vfs_get_standard(), fName, openFlags);
 		if (stdFp == NULL) return BCTBX_VFS_ERROR;
 
 		pFile->pMethods = &bcio;
 
-		std::string filename{fName};
+		// the encryption context owns the standard file, it closes it even when its construction fails
 		ctx = new VfsEncryption(stdFp, filename, openFlags, accessMode);
 
 		if ((filename.size() > 8) && (filename.compare(filename.size() - 8, 8, std::string{"-journal"}) == 0)) {
@@ -979,11 +2910,12 @@ static int bcOpen(BCTBX_UNUSED(bctbx_vfs_t *pVfs), bctbx_vfs_file_t *pFile, cons
 		return BCTBX_VFS_OK;
 
 	} catch (EvfsException const &e) { // caller is most likely a C file(vfs.c), so swallow all exceptions
-		if (stdFp != nullptr) {
-			bctbx_file_close(stdFp);
-		}
 		delete (ctx);
 		BCTBX_SLOGE << "Encrypted VFS can't open File " << fName << " : " << e;
 		return BCTBX_VFS_ERROR;
+	} catch (std::exception const &e) {
+		delete (ctx);
+		BCTBX_SLOGE << "Encrypted VFS can't open File " << fName << " : " << e.what();
+		return BCTBX_VFS_ERROR;
 	}
 }
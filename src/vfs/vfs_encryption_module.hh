@@ -20,7 +20,10 @@
 #ifndef BCTBX_VFS_ENCRYPTION_MODULE_HH
 #define BCTBX_VFS_ENCRYPTION_MODULE_HH
 
+#include "bctoolbox/defs.h"
 #include "bctoolbox/vfs_encrypted.hh"
+#include "vfs_counters.hh"
+#include <memory>
 
 namespace bctoolbox {
 /**
@@ -51,6 +54,13 @@ public:
 	 */
 	virtual void setModuleSecretMaterial(const std::vector<uint8_t> &secret) = 0;
 
+	/**
+	 * Set the maximum number of derived chunk keys kept in memory by the module, 0 disables the cache
+	 * Default implementation does nothing: modules not deriving per chunk keys have nothing to cache
+	 */
+	virtual void chunkKeyCacheSizeSet(BCTBX_UNUSED(const size_t size)) {
+	}
+
 	/**
 	 * Get the size of the secret material needed by this module
 	 */
@@ -63,6 +73,18 @@ public:
 	 */
 	virtual std::vector<uint8_t> decryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &rawChunk) = 0;
 
+	/**
+	 * Decrypt a data chunk into a caller provided buffer
+	 * @param[in]	chunkIndex		The chunk index
+	 * @param[in]	rawChunk		the raw data read from disk, chunk header included
+	 * @param[in]	rawChunkSize	size of rawChunk: chunkHeaderSize + at most chunkSize
+	 * @param[out]	plainData		buffer to store the decrypted data, must be at least rawChunkSize - chunkHeaderSize bytes
+	 */
+	virtual void decryptChunk(const uint32_t chunkIndex,
+	                          const uint8_t *rawChunk,
+	                          const size_t rawChunkSize,
+	                          uint8_t *plainData) = 0;
+
 	/**
 	 * ReEncrypt a data chunk
 	 * @param[in/out] rawChunk	The existing encrypted chunk
@@ -78,6 +100,82 @@ public:
 	 */
 	virtual std::vector<uint8_t> encryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &plainData) = 0;
 
+	/**
+	 * ReEncrypt a data chunk in place
+	 * @param[in]		chunkIndex		The chunk index
+	 * @param[in/out]	rawChunk		The existing encrypted chunk, replaced by the new one. Buffer must be at least
+	 * 									chunkHeaderSize + plainDataSize bytes
+	 * @param[in]		rawChunkSize	size of the existing encrypted chunk, chunk header included
+	 * @param[in]		plainData		The plain text to be encrypted
+	 * @param[in]		plainDataSize	size of plainData, at most chunkSize
+	 */
+	virtual void encryptChunk(const uint32_t chunkIndex,
+	                          uint8_t *rawChunk,
+	                          const size_t rawChunkSize,
+	                          const uint8_t *plainData,
+	                          const size_t plainDataSize) = 0;
+	/**
+	 * Encrypt a new data chunk into a caller provided buffer
+	 * @param[in]	chunkIndex		The chunk index
+	 * @param[in]	plainData		The plain text to be encrypted
+	 * @param[in]	plainDataSize	size of plainData, at most chunkSize
+	 * @param[out]	rawChunk		buffer to store the encrypted chunk, must be at least
+	 * 								chunkHeaderSize + plainDataSize bytes
+	 */
+	virtual void encryptChunk(const uint32_t chunkIndex,
+	                          const uint8_t *plainData,
+	                          const size_t plainDataSize,
+	                          uint8_t *rawChunk) = 0;
+
+	/**
+	 * Decrypt a run of consecutive chunks into a caller provided buffer
+	 * Raw chunks are chunkHeaderSize + chunkSize bytes, the last one may be shorter. Plain chunks are written every
+	 * chunkSize bytes in plainData.
+	 * Default implementation decrypts each chunk on its own, modules can override it to share work between chunks.
+	 * @param[in]	firstChunkIndex	index of the first chunk
+	 * @param[in]	rawData			the raw chunks read from disk, chunk headers included
+	 * @param[in]	rawDataSize		size of rawData
+	 * @param[in]	chunkSize		size of a chunk payload
+	 * @param[out]	plainData		buffer to store the decrypted data, must be at least rawDataSize minus the chunk
+	 * 								headers size
+	 */
+	virtual void decryptChunks(const uint32_t firstChunkIndex,
+	                           const uint8_t *rawData,
+	                           const size_t rawDataSize,
+	                           const size_t chunkSize,
+	                           uint8_t *plainData) {
+		const size_t rawChunkSize = getChunkHeaderSize() + chunkSize;
+		for (size_t i = 0; i * rawChunkSize < rawDataSize; i++) {
+			size_t remaining = rawDataSize - i * rawChunkSize;
+			decryptChunk(firstChunkIndex + static_cast<uint32_t>(i), rawData + i * rawChunkSize,
+			             remaining < rawChunkSize ? remaining : rawChunkSize, plainData + i * chunkSize);
+		}
+	}
+
+	/**
+	 * Encrypt a run of new consecutive chunks into a caller provided buffer
+	 * Plain chunks are read every chunkSize bytes in plainData, the last one may be shorter. Raw chunks are written
+	 * every chunkHeaderSize + chunkSize bytes in rawData.
+	 * Default implementation encrypts each chunk on its own, modules can override it to share work between chunks.
+	 * @param[in]	firstChunkIndex	index of the first chunk
+	 * @param[in]	plainData		the plain text to be encrypted
+	 * @param[in]	plainDataSize	size of plainData
+	 * @param[in]	chunkSize		size of a chunk payload
+	 * @param[out]	rawData			buffer to store the encrypted chunks, plainDataSize plus the chunk headers size
+	 */
+	virtual void encryptChunks(const uint32_t firstChunkIndex,
+	                           const uint8_t *plainData,
+	                           const size_t plainDataSize,
+	                           const size_t chunkSize,
+	                           uint8_t *rawData) {
+		const size_t rawChunkSize = getChunkHeaderSize() + chunkSize;
+		for (size_t i = 0; i * chunkSize < plainDataSize; i++) {
+			size_t remaining = plainDataSize - i * chunkSize;
+			encryptChunk(firstChunkIndex + static_cast<uint32_t>(i), plainData + i * chunkSize,
+			             remaining < chunkSize ? remaining : chunkSize, rawData + i * rawChunkSize);
+		}
+	}
+
 	/**
 	 * Check the integrity over the whole file
 	 * @param[in]	fileContext 	a way to access the file content
@@ -86,7 +184,24 @@ public:
 	 */
 	virtual bool checkIntegrity(const VfsEncryption &fileContext) = 0;
 
+	/**
+	 * Set the counters of the file using this module, they count its key derivations and authentication failures
+	 * Must be called before the secret material is set
+	 */
+	void countersSet(const std::shared_ptr<VfsCounters> &counters) noexcept {
+		mCounters = counters;
+	}
+
 	virtual ~VfsEncryptionModule(){};
+
+protected:
+	std::shared_ptr<VfsCounters> mCounters; /**< may be nullptr */
+
+	void count(VfsCounters::Counter counter, uint64_t value = 1) const noexcept {
+		if (mCounters != nullptr) {
+			mCounters->add(counter, value);
+		}
+	}
 };
 
 } // namespace bctoolbox
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_encryption_module_aes256gcm_filekey_sha256.hh"
+#include "bctoolbox/crypto.h" // bctbx_clean
+#include "bctoolbox/crypto.hh"
+#include "bctoolbox/defs.h"
+#include <algorithm>
+
+#include "bctoolbox/logging.h"
+#include "vfs_shared_crypto.hh"
+using namespace bctoolbox;
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+/**
+ * Constants associated to this encryption module
+ */
+
+/** Chunk Header in this module holds: Auth tag(16 bytes), IV : 12 bytes
+ */
+static constexpr size_t chunkAuthTagSize = AES256GCM128::tagSize();
+static constexpr size_t chunkIVSize = 12;
+static constexpr size_t chunkHeaderSize = chunkAuthTagSize + chunkIVSize;
+/** IV is random (12 bytes), associated data is the chunk index */
+static constexpr size_t chunkADSize = 4;
+/**
+ * File header holds: fileSalt (16 bytes), file header auth tag(32 bytes)
+ */
+static constexpr size_t fileSaltSize = 16;
+static constexpr size_t fileAuthTagSize = 32;
+static constexpr size_t fileHeaderSize = fileSaltSize + fileAuthTagSize;
+
+/**
+ * The master Key is expected to be 32 bytes
+ */
+static constexpr size_t masterKeySize = 32;
+
+/** write the chunk index, big endian, in a 4 bytes buffer */
+static void chunkIndexWrite(uint32_t chunkIndex, uint8_t *buffer) {
+	buffer[0] = (chunkIndex >> 24) & 0xFF;
+	buffer[1] = (chunkIndex >> 16) & 0xFF;
+	buffer[2] = (chunkIndex >> 8) & 0xFF;
+	buffer[3] = chunkIndex & 0xFF;
+}
+
+/** constructor called at file creation */
+VfsEM_AES256GCM_FileKey_SHA256::VfsEM_AES256GCM_FileKey_SHA256()
+    : mFileSalt(VfsSharedRNG::randomize(fileSaltSize)) // generate a random file Salt
+{
+}
+
+/** constructor called when opening an existing file */
+VfsEM_AES256GCM_FileKey_SHA256::VfsEM_AES256GCM_FileKey_SHA256(const std::vector<uint8_t> &fileHeader)
+    : mFileSalt(std::vector<uint8_t>(fileSaltSize)) {
+	if (fileHeader.size() != fileHeaderSize) {
+		throw EVFS_EXCEPTION << "The AES256GCM128-FileKey-SHA256 encryption module expect a fileHeader of size "
+		                     << fileHeaderSize << " bytes but " << fileHeader.size() << " are provided";
+	}
+	// File header Data is 32 bytes of integrity data, 16 bytes of global salt
+	std::copy(fileHeader.cbegin(), fileHeader.cbegin() + fileAuthTagSize, mFileHeaderIntegrity.begin());
+	std::copy(fileHeader.cbegin() + fileAuthTagSize, fileHeader.cend(), mFileSalt.begin());
+}
+
+/** destructor ensure proper cleaning of any key material **/
+VfsEM_AES256GCM_FileKey_SHA256::~VfsEM_AES256GCM_FileKey_SHA256() {
+	contextsClear();
+	bctbx_clean(sMasterKey.data(), sMasterKey.size());
+	bctbx_clean(sFileHeaderHMACKey.data(), sFileHeaderHMACKey.size());
+	bctbx_clean(sFileKey.data(), sFileKey.size());
+}
+
+bctbx_aes_gcm_keyed_context_t *VfsEM_AES256GCM_FileKey_SHA256::contextAcquire() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (!mContexts.empty()) {
+		auto context = mContexts.back();
+		mContexts.pop_back();
+		return context;
+	}
+	auto context = bctbx_aes_gcm_keyed_context_new(sFileKey.data(), sFileKey.size());
+	if (context == nullptr) {
+		throw EVFS_EXCEPTION << "The AES256GCM128-FileKey-SHA256 encryption module cannot create an AES-GCM context";
+	}
+	return context;
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::contextRelease(bctbx_aes_gcm_keyed_context_t *context) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mContexts.push_back(context);
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::contextsClear() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto context : mContexts) {
+		bctbx_aes_gcm_keyed_context_free(context);
+	}
+	mContexts.clear();
+}
+
+const std::vector<uint8_t> VfsEM_AES256GCM_FileKey_SHA256::getModuleFileHeader(const VfsEncryption &fileContext) const {
+	if (sFileHeaderHMACKey.empty()) {
+		throw EVFS_EXCEPTION
+		    << "The AES256GCM128-FileKey-SHA256 encryption module cannot generate its file header without master key";
+	}
+	// Only the actual file header is to authenticate, the module file header holds the global salt used to derive the
+	// key feed to HMAC authenticating the file header so it is useless to authenticate it
+	auto tag = HMAC<SHA256>(sFileHeaderHMACKey, fileContext.rawHeaderGet());
+
+	// Append the actual file salt value to the tag
+	auto ret = mFileSalt;
+	ret.insert(ret.begin(), tag.cbegin(), tag.cend());
+	return ret;
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::setModuleSecretMaterial(const std::vector<uint8_t> &secret) {
+	if (secret.size() != masterKeySize) {
+		throw EVFS_EXCEPTION << "The AES256GCM128-FileKey-SHA256 encryption module expect a secret material of size "
+		                     << masterKeySize << " bytes but " << secret.size() << " are provided";
+	}
+	sMasterKey = secret;
+	// contexts keyed with a previous file key are useless now
+	contextsClear();
+
+	// Now that we have a master key, we can derive the header authentication and file encryption ones
+	sFileHeaderHMACKey =
+	    VfsDerivedKeyCache::derive(mFileSalt, sMasterKey, "EVFS file Header", masterKeySize, mCounters.get());
+	bctbx_clean(sFileKey.data(), sFileKey.size());
+	sFileKey =
+	    VfsDerivedKeyCache::derive(mFileSalt, sMasterKey, "EVFS file key", AES256GCM128::keySize(), mCounters.get());
+}
+
+std::vector<uint8_t> VfsEM_AES256GCM_FileKey_SHA256::decryptChunk(const uint32_t chunkIndex,
+                                                                  const std::vector<uint8_t> &rawChunk) {
+	std::vector<uint8_t> plain(rawChunk.size() > chunkHeaderSize ? rawChunk.size() - chunkHeaderSize : 0);
+	decryptChunk(chunkIndex, rawChunk.data(), rawChunk.size(), plain.data());
+	return plain;
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::decryptChunk(const uint32_t chunkIndex,
+                                                  const uint8_t *rawChunk,
+                                                  const size_t rawChunkSize,
+                                                  uint8_t *plainData) {
+	decryptChunks(chunkIndex, rawChunk, rawChunkSize, rawChunkSize - std::min(rawChunkSize, chunkHeaderSize),
+	              plainData);
+}
+
+// This module does not reuse any part of its chunk header during encryption
+// So re-encryption is the same than initial encryption
+void VfsEM_AES256GCM_FileKey_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                                  std::vector<uint8_t> &rawChunk,
+                                                  const std::vector<uint8_t> &plainData) {
+
+	rawChunk = encryptChunk(chunkIndex, plainData);
+}
+
+std::vector<uint8_t> VfsEM_AES256GCM_FileKey_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                                                  const std::vector<uint8_t> &plainData) {
+	std::vector<uint8_t> rawChunk(chunkHeaderSize + plainData.size());
+	encryptChunk(chunkIndex, plainData.data(), plainData.size(), rawChunk.data());
+	return rawChunk;
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                                  uint8_t *rawChunk,
+                                                  BCTBX_UNUSED(const size_t rawChunkSize),
+                                                  const uint8_t *plainData,
+                                                  const size_t plainDataSize) {
+	encryptChunk(chunkIndex, plainData, plainDataSize, rawChunk);
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                                  const uint8_t *plainData,
+                                                  const size_t plainDataSize,
+                                                  uint8_t *rawChunk) {
+	// a chunk without data still gets its header
+	encryptChunks(chunkIndex, plainData, plainDataSize, std::max(plainDataSize, size_t(1)), rawChunk);
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::decryptChunks(const uint32_t firstChunkIndex,
+                                                   const uint8_t *rawData,
+                                                   const size_t rawDataSize,
+                                                   const size_t chunkSize,
+                                                   uint8_t *plainData) {
+	if (sFileKey.empty()) {
+		throw EVFS_EXCEPTION << "No encryption Master key set, cannot decrypt";
+	}
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	// a raw chunk holding only a header is valid: it is the encryption of an empty chunk
+	const size_t chunkCount = std::max((rawDataSize + rawChunkSize - 1) / rawChunkSize, size_t(1));
+	if ((rawDataSize - std::min(rawDataSize, (chunkCount - 1) * rawChunkSize)) < chunkHeaderSize) {
+		throw EVFS_EXCEPTION << "Cannot decrypt a chunk of " << (rawDataSize - (chunkCount - 1) * rawChunkSize)
+		                     << " bytes, chunk header alone is " << chunkHeaderSize << " bytes";
+	}
+
+	auto context = contextAcquire();
+	std::array<uint8_t, chunkADSize> AD;
+	int ret = 0;
+	size_t i = 0;
+	for (; i < chunkCount && ret == 0; i++) {
+		const uint8_t *rawChunk = rawData + i * rawChunkSize;
+		size_t size = std::min(rawChunkSize, rawDataSize - i * rawChunkSize) - chunkHeaderSize;
+		// IV is read from the chunk header: tag, IV
+		chunkIndexWrite(firstChunkIndex + static_cast<uint32_t>(i), AD.data());
+		ret = bctbx_aes_gcm_keyed_decrypt_and_auth(context, rawChunk + chunkHeaderSize, size, AD.data(), AD.size(),
+		                                           rawChunk + chunkAuthTagSize, chunkIVSize, rawChunk,
+		                                           chunkAuthTagSize, plainData + i * chunkSize);
+	}
+	contextRelease(context);
+
+	if (ret != 0) {
+		count(VfsCounters::integrityFailures);
+		throw EVFS_EXCEPTION << "Authentication failure during chunk decryption, chunk " << firstChunkIndex + i - 1;
+	}
+}
+
+void VfsEM_AES256GCM_FileKey_SHA256::encryptChunks(const uint32_t firstChunkIndex,
+                                                   const uint8_t *plainData,
+                                                   const size_t plainDataSize,
+                                                   const size_t chunkSize,
+                                                   uint8_t *rawData) {
+	if (sFileKey.empty()) {
+		throw EVFS_EXCEPTION << "No encryption Master key set, cannot encrypt";
+	}
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	const size_t chunkCount = std::max((plainDataSize + chunkSize - 1) / chunkSize, size_t(1));
+
+	// draw all the IVs at once
+	std::vector<uint8_t> IVs(chunkCount * chunkIVSize);
+	VfsSharedRNG::randomize(IVs.data(), IVs.size());
+
+	auto context = contextAcquire();
+	std::array<uint8_t, chunkADSize> AD;
+	int ret = 0;
+	for (size_t i = 0; i < chunkCount && ret == 0; i++) {
+		uint8_t *rawChunk = rawData + i * rawChunkSize;
+		size_t size = std::min(chunkSize, plainDataSize - std::min(plainDataSize, i * chunkSize));
+		// IV is stored in the chunk header: tag, IV
+		chunkIndexWrite(firstChunkIndex + static_cast<uint32_t>(i), AD.data());
+		std::copy(IVs.cbegin() + i * chunkIVSize, IVs.cbegin() + (i + 1) * chunkIVSize, rawChunk + chunkAuthTagSize);
+		ret = bctbx_aes_gcm_keyed_encrypt_and_tag(context, plainData + i * chunkSize, size, AD.data(), AD.size(),
+		                                          rawChunk + chunkAuthTagSize, chunkIVSize, rawChunk,
+		                                          chunkAuthTagSize, rawChunk + chunkHeaderSize);
+	}
+	contextRelease(context);
+
+	if (ret != 0) {
+		throw EVFS_EXCEPTION << "Chunk encryption failed: " << ret;
+	}
+}
+
+/**
+ * When this function is called, m_fileHeader holds the integrity tag read from file
+ * and sFileHeaderHMACKey holds the derived key for header authentication
+ * Compute the HMAC on the whole rawfileHeader + the module header
+ * Check it match what we have in the m_fileHeader
+ */
+bool VfsEM_AES256GCM_FileKey_SHA256::checkIntegrity(const VfsEncryption &fileContext) {
+	if (sFileHeaderHMACKey.empty()) {
+		throw EVFS_EXCEPTION
+		    << "The AES256GCM128-FileKey-SHA256 encryption module cannot check its file header without master key";
+	}
+	auto tag = HMAC<SHA256>(sFileHeaderHMACKey, fileContext.rawHeaderGet());
+
+	return (std::equal(tag.cbegin(), tag.cend(), mFileHeaderIntegrity.cbegin()));
+}
+/**
+ * This function exists as static and non static
+ */
+size_t VfsEM_AES256GCM_FileKey_SHA256::moduleFileHeaderSize() noexcept {
+	return fileHeaderSize;
+}
+
+/**
+ * @return the size in bytes of the chunk header
+ */
+size_t VfsEM_AES256GCM_FileKey_SHA256::getChunkHeaderSize() const noexcept {
+	return chunkHeaderSize;
+}
+/**
+ * @return the size in bytes of file header module data
+ */
+size_t VfsEM_AES256GCM_FileKey_SHA256::getModuleFileHeaderSize() const noexcept {
+	return fileHeaderSize;
+}
+
+/**
+ * @return the secret material size
+ */
+size_t VfsEM_AES256GCM_FileKey_SHA256::getSecretMaterialSize() const noexcept {
+	return masterKeySize;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_ENCRYPTION_MODULE_AES256GCM_FILEKEY_SHA256_HH
+#define BCTBX_VFS_ENCRYPTION_MODULE_AES256GCM_FILEKEY_SHA256_HH
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/crypto.hh"
+#include "bctoolbox/vfs_encrypted.hh"
+#include "vfs_encryption_module.hh"
+#include <array>
+#include <mutex>
+
+/*********** The AES256-GCM file key SHA256 module   ************************
+ * Key derivations:
+ *    - file Header HMAC key = HKDF(Mk, fileHeaderSalt, "EVFS file header")
+ *    - file encryption key = HKDF(Mk, fileHeaderSalt, "EVFS file key"), derived once when the master key is set
+ * File Header:
+ *    - 32 bytes auth tag: HMAC-sha256 on the file header
+ *    - 16 bytes salt: random generated at file creation : input of the HKDF keyed by the master key.
+ * Chunk Header:
+ *    - Authentication tag : 16 bytes
+ *    - IV: 12 bytes. A random updated at each encryption
+ * Chunk encryption:
+ *    - AES256-GCM with 128 bit auth tag using the file key, its key schedule is computed once for the whole file.
+ *    - IV is fully random (12 bytes), associated data is ChunkIndex (4 bytes, big endian) so a chunk cannot be moved
+ *    elsewhere in the file. As every chunk of the file uses the same key, the whole IV MUST be random: an attacker
+ *    having access to file system could restore an old version of the file and monitor further writing, and the 96
+ *    bits keep IV collisions unlikely over the 2^32 chunk encryptions allowed with one key.
+ */
+namespace bctoolbox {
+class VfsEM_AES256GCM_FileKey_SHA256 : public VfsEncryptionModule {
+private:
+	/**
+	 * File header
+	 */
+	std::vector<uint8_t> mFileSalt;
+	std::array<uint8_t, SHA256::ssize()> mFileHeaderIntegrity;
+
+	/** keys
+	 */
+	std::vector<uint8_t> sMasterKey;         // used to derive all keys
+	std::vector<uint8_t> sFileHeaderHMACKey; // used to feed HMAC integrity check on file header
+	std::vector<uint8_t> sFileKey;           // used to encrypt all chunks
+
+	/**
+	 * Chunks may be encrypted/decrypted concurrently on worker threads, protect the contexts list
+	 */
+	std::mutex mMutex;
+
+	/**
+	 * Keyed AES-GCM contexts not in use. A context serves one chunk at a time so there are as many as chunks processed
+	 * concurrently, usually one.
+	 */
+	std::vector<bctbx_aes_gcm_keyed_context_t *> mContexts;
+
+	/**
+	 * Get a keyed context from the free list, create one if needed
+	 */
+	bctbx_aes_gcm_keyed_context_t *contextAcquire();
+	/**
+	 * Give back a context to the free list
+	 */
+	void contextRelease(bctbx_aes_gcm_keyed_context_t *context);
+	/**
+	 * Free all the contexts
+	 */
+	void contextsClear();
+
+public:
+	/**
+	 * This function exists as static and non static
+	 */
+	static size_t moduleFileHeaderSize() noexcept;
+
+	/**
+	 * @return the size in bytes of the chunk header
+	 */
+	size_t getChunkHeaderSize() const noexcept override;
+
+	/**
+	 * @return the size in bytes of file header module data
+	 */
+	size_t getModuleFileHeaderSize() const noexcept override;
+
+	/**
+	 * @return the EncryptionSuite provided by this module
+	 */
+	EncryptionSuite getEncryptionSuite() const noexcept override {
+		return EncryptionSuite::aes256gcm128_filekey_sha256;
+	}
+
+	/**
+	 * @return the secret material size
+	 */
+	size_t getSecretMaterialSize() const noexcept override;
+
+	/**
+	 * Decrypt a chunk of data
+	 * @param[in] a vector which size shall be chunkHeaderSize + chunkSize holding the raw data read from disk
+	 * @return the decrypted data chunk
+	 */
+	std::vector<uint8_t> decryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &rawChunk) override;
+	void decryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  uint8_t *plainData) override;
+
+	void encryptChunk(const uint32_t chunkIndex,
+	                  std::vector<uint8_t> &rawChunk,
+	                  const std::vector<uint8_t> &plainData) override;
+	std::vector<uint8_t> encryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &plainData) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize,
+	                  uint8_t *rawChunk) override;
+
+	/**
+	 * Decrypt or encrypt consecutive chunks with the same keyed context, random IVs are drawn for all of them at once
+	 */
+	void decryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *rawData,
+	                   const size_t rawDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *plainData) override;
+	void encryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *plainData,
+	                   const size_t plainDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *rawData) override;
+
+	const std::vector<uint8_t> getModuleFileHeader(const VfsEncryption &fileContext) const override;
+
+	void setModuleSecretMaterial(const std::vector<uint8_t> &secret) override;
+
+	/**
+	 * Check the integrity over the whole file
+	 * @param[in]	fileContext 	a way to access the file content
+	 *
+	 * @return 	true if the integrity check successfully passed, false otherwise
+	 */
+	bool checkIntegrity(const VfsEncryption &fileContext) override;
+
+	/**
+	 * constructors
+	 */
+	// At file creation
+	VfsEM_AES256GCM_FileKey_SHA256();
+	// Opening an existing file
+	VfsEM_AES256GCM_FileKey_SHA256(const std::vector<uint8_t> &fileHeader);
+
+	~VfsEM_AES256GCM_FileKey_SHA256();
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_ENCRYPTION_MODULE_AES256GCM_FILEKEY_SHA256_HH
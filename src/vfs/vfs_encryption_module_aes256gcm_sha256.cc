@@ -20,11 +20,18 @@
 #include "vfs_encryption_module_aes256gcm_sha256.hh"
 #include "bctoolbox/crypto.h" // bctbx_clean
 #include "bctoolbox/crypto.hh"
+#include "bctoolbox/defs.h"
 #include <algorithm>
 #include <functional>
 
 #include "bctoolbox/logging.h"
+#include "vfs_shared_crypto.hh"
 using namespace bctoolbox;
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
 /**
  * Constants associated to this encryption module
  */
@@ -46,20 +53,24 @@ static constexpr size_t fileHeaderSize = fileSaltSize + fileAuthTagSize;
  */
 static constexpr size_t masterKeySize = 32;
 
+/** wipe a chunk key leaving the cache */
+static void cleanChunkKey(std::array<uint8_t, AES256GCM128::keySize()> &key) {
+	bctbx_clean(key.data(), key.size());
+}
+
 /** constructor called at file creation */
 VfsEM_AES256GCM_SHA256::VfsEM_AES256GCM_SHA256()
-    : mRNG(std::make_shared<bctoolbox::RNG>()), // start the local RNG
-      mFileSalt(mRNG->randomize(fileSaltSize))  // generate a random file Salt
+    : mFileSalt(VfsSharedRNG::randomize(fileSaltSize)), // generate a random file Salt
+      mChunkKeyCache(0, cleanChunkKey)                   // cache size is set by the VfsEncryption object
 {
 }
 
 /** constructor called when opening an existing file */
 VfsEM_AES256GCM_SHA256::VfsEM_AES256GCM_SHA256(const std::vector<uint8_t> &fileHeader)
-    : mRNG(std::make_shared<bctoolbox::RNG>()), // start the local RNG
-      mFileSalt(std::vector<uint8_t>(fileSaltSize)) {
+    : mFileSalt(std::vector<uint8_t>(fileSaltSize)), mChunkKeyCache(0, cleanChunkKey) {
 	if (fileHeader.size() != fileHeaderSize) {
-		throw EVFS_EXCEPTION << "The AES256GCM128-SHA256 encryption module expect a fileHeader of size "
-		                     << fileHeaderSize << " bytes but " << fileHeader.size() << " are provided";
+		throw EVFS_EXCEPTION << "The encryption module expect a fileHeader of size " << fileHeaderSize << " bytes but "
+		                     << fileHeader.size() << " are provided";
 	}
 	// File header Data is 32 bytes of integrity data, 16 bytes of global salt
 	std::copy(fileHeader.cbegin(), fileHeader.cbegin() + fileAuthTagSize, mFileHeaderIntegrity.begin());
@@ -70,12 +81,13 @@ VfsEM_AES256GCM_SHA256::VfsEM_AES256GCM_SHA256(const std::vector<uint8_t> &fileH
 VfsEM_AES256GCM_SHA256::~VfsEM_AES256GCM_SHA256() {
 	bctbx_clean(sMasterKey.data(), sMasterKey.size());
 	bctbx_clean(sFileHeaderHMACKey.data(), sFileHeaderHMACKey.size());
+	mChunkKeyCache.clear();
 }
 
 const std::vector<uint8_t> VfsEM_AES256GCM_SHA256::getModuleFileHeader(const VfsEncryption &fileContext) const {
 	if (sFileHeaderHMACKey.empty()) {
-		throw EVFS_EXCEPTION
-		    << "The AES256GCM128-SHA256 encryption module cannot generate its file header without master key";
+		throw EVFS_EXCEPTION << "The " << encryptionSuiteString(getEncryptionSuite())
+		                     << " encryption module cannot generate its file header without master key";
 	}
 	// Only the actual file header is to authenticate, the module file header holds the global salt used to derive the
 	// key feed to HMAC authenticating the file header so it is useless to authenticate it
@@ -89,60 +101,150 @@ const std::vector<uint8_t> VfsEM_AES256GCM_SHA256::getModuleFileHeader(const Vfs
 
 void VfsEM_AES256GCM_SHA256::setModuleSecretMaterial(const std::vector<uint8_t> &secret) {
 	if (secret.size() != masterKeySize) {
-		throw EVFS_EXCEPTION << "The AES256GCM128 SHA256 encryption module expect a secret material of size "
-		                     << masterKeySize << " bytes but " << secret.size() << " are provided";
+		throw EVFS_EXCEPTION << "The " << encryptionSuiteString(getEncryptionSuite())
+		                     << " encryption module expect a secret material of size " << masterKeySize << " bytes but "
+		                     << secret.size() << " are provided";
 	}
 	sMasterKey = secret;
+	// keys derived from a previous master key are useless now
+	mChunkKeyCache.clear();
 
 	// Now that we have a master key, we can derive the header authentication one
-	sFileHeaderHMACKey = bctoolbox::HKDF<SHA256>(mFileSalt, sMasterKey, "EVFS file Header", masterKeySize);
+	sFileHeaderHMACKey = VfsDerivedKeyCache::derive(mFileSalt, sMasterKey, "EVFS file Header", masterKeySize,
+	                                                mCounters.get());
 }
 
 /**
- * Derive the key from master key for the given chunkIndex:
+ * Derive the keys from master key for the given chunks:
  * HKDF(fileSalt || ChunkIndex, master Key, "EVFS chunk")
  *
- * @param[in]	chunkIndex	the chunk index used in key derivation
+ * @param[in]	firstChunkIndex	index of the first chunk
+ * @param[in]	chunkCount		number of consecutive chunks
+ * @param[out]	keys			the AES256-GCM128 keys, one after the other
+ */
+void VfsEM_AES256GCM_SHA256::deriveChunkKeys(uint32_t firstChunkIndex, size_t chunkCount, uint8_t *keys) {
+	static constexpr size_t keySize = AES256GCM128::keySize();
+	std::vector<bool> cached(chunkCount, false);
+	size_t missing = chunkCount;
+	{ // get all the keys we can from the cache at once
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mChunkKeyCache.capacityGet() > 0) {
+			for (size_t i = 0; i < chunkCount; i++) {
+				auto cachedKey = mChunkKeyCache.get(firstChunkIndex + static_cast<uint32_t>(i));
+				if (cachedKey != nullptr) {
+					std::copy(cachedKey->cbegin(), cachedKey->cend(), keys + i * keySize);
+					cached[i] = true;
+					missing--;
+				}
+			}
+		}
+	}
+	if (missing == 0) {
+		return;
+	}
+
+	std::array<uint8_t, fileSaltSize + 4> chunkSalt;
+	std::copy(mFileSalt.cbegin(), mFileSalt.cend(), chunkSalt.begin());
+	const std::string info = chunkKeyInfo();
+	for (size_t i = 0; i < chunkCount; i++) {
+		if (cached[i]) continue;
+		uint32_t chunkIndex = firstChunkIndex + static_cast<uint32_t>(i);
+		chunkSalt[fileSaltSize] = (chunkIndex >> 24) & 0xFF;
+		chunkSalt[fileSaltSize + 1] = (chunkIndex >> 16) & 0xFF;
+		chunkSalt[fileSaltSize + 2] = (chunkIndex >> 8) & 0xFF;
+		chunkSalt[fileSaltSize + 3] = chunkIndex & 0xFF;
+		bctoolbox::HKDF<SHA256>(chunkSalt.data(), chunkSalt.size(), sMasterKey.data(), sMasterKey.size(), info.data(),
+		                        info.size(), keys + i * keySize, keySize);
+	}
+	count(VfsCounters::keyDerivations, missing);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mChunkKeyCache.capacityGet() > 0) {
+		// insert at most the cache capacity, last ones are the most likely to be used again
+		for (size_t i = chunkCount - std::min(chunkCount, mChunkKeyCache.capacityGet()); i < chunkCount; i++) {
+			if (cached[i]) continue;
+			std::array<uint8_t, keySize> newKey;
+			std::copy(keys + i * keySize, keys + (i + 1) * keySize, newKey.begin());
+			mChunkKeyCache.insert(firstChunkIndex + static_cast<uint32_t>(i), std::move(newKey));
+			bctbx_clean(newKey.data(), newKey.size()); // array move is a copy
+		}
+	}
+}
+
+/**
+ * Derive the key from master key for the given chunkIndex
  *
- * @return	the AES256-GCM128 key
+ * @param[in]	chunkIndex	the chunk index used in key derivation
+ * @param[out]	key			the AES256-GCM128 key
  */
-std::vector<uint8_t> VfsEM_AES256GCM_SHA256::deriveChunkKey(uint32_t chunkIndex) {
-	std::vector<uint8_t> chunkSalt{mFileSalt};
-	chunkSalt.push_back((chunkIndex >> 24) & 0xFF);
-	chunkSalt.push_back((chunkIndex >> 16) & 0xFF);
-	chunkSalt.push_back((chunkIndex >> 8) & 0xFF);
-	chunkSalt.push_back(chunkIndex & 0xFF);
-	return bctoolbox::HKDF<SHA256>(chunkSalt, sMasterKey, "EVFS chunk", AES256GCM128::keySize());
+void VfsEM_AES256GCM_SHA256::deriveChunkKey(uint32_t chunkIndex, uint8_t *key) {
+	deriveChunkKeys(chunkIndex, 1, key);
+}
+
+std::string VfsEM_AES256GCM_SHA256::chunkKeyInfo() const {
+	return "EVFS chunk";
+}
+
+int VfsEM_AES256GCM_SHA256::chunkEncrypt(const uint8_t *key,
+                                         const uint8_t *IV,
+                                         const uint8_t *plain,
+                                         const size_t size,
+                                         uint8_t *tag,
+                                         uint8_t *cipher) const {
+	return bctbx_aes_gcm_encrypt_and_tag(key, AES256GCM128::keySize(), plain, size, nullptr, 0, IV, chunkIVSize, tag,
+	                                     chunkAuthTagSize, cipher);
+}
+
+int VfsEM_AES256GCM_SHA256::chunkDecrypt(const uint8_t *key,
+                                         const uint8_t *IV,
+                                         const uint8_t *cipher,
+                                         const size_t size,
+                                         const uint8_t *tag,
+                                         uint8_t *plain) const {
+	return bctbx_aes_gcm_decrypt_and_auth(key, AES256GCM128::keySize(), cipher, size, nullptr, 0, IV, chunkIVSize, tag,
+	                                      chunkAuthTagSize, plain);
+}
+
+void VfsEM_AES256GCM_SHA256::chunkKeyCacheSizeSet(const size_t size) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mChunkKeyCache.capacitySet(size);
 }
 
 std::vector<uint8_t> VfsEM_AES256GCM_SHA256::decryptChunk(const uint32_t chunkIndex,
                                                           const std::vector<uint8_t> &rawChunk) {
+	std::vector<uint8_t> plain(rawChunk.size() > chunkHeaderSize ? rawChunk.size() - chunkHeaderSize : 0);
+	decryptChunk(chunkIndex, rawChunk.data(), rawChunk.size(), plain.data());
+	return plain;
+}
+
+void VfsEM_AES256GCM_SHA256::decryptChunk(const uint32_t chunkIndex,
+                                          const uint8_t *rawChunk,
+                                          const size_t rawChunkSize,
+                                          uint8_t *plainData) {
 	if (sMasterKey.empty()) {
 		throw EVFS_EXCEPTION << "No encryption Master key set, cannot decrypt";
 	}
+	if (rawChunkSize < chunkHeaderSize) {
+		throw EVFS_EXCEPTION << "Cannot decrypt a chunk of " << rawChunkSize << " bytes, chunk header alone is "
+		                     << chunkHeaderSize << " bytes";
+	}
 
 	// derive the key : HKDF (fileHeaderSalt || Chunk Index, Master key, "EVFS chunk")
-	std::vector<uint8_t> key{deriveChunkKey(chunkIndex)};
-
-	// parse the header: tag, IV, encryption Counter
-	std::vector<uint8_t> tag(AES256GCM128::tagSize());
-	std::copy(rawChunk.cbegin(), rawChunk.cbegin() + chunkAuthTagSize, tag.begin());
-	std::vector<uint8_t> IV(rawChunk.cbegin() + chunkAuthTagSize, rawChunk.cbegin() + chunkAuthTagSize + chunkIVSize);
-	std::vector<uint8_t> AD{}; // No associated data
-
-	// extract cipher
-	std::vector<uint8_t> cipher(rawChunk.cbegin() + chunkHeaderSize, rawChunk.cend());
+	std::array<uint8_t, AES256GCM128::keySize()> key;
+	deriveChunkKey(chunkIndex, key.data());
 
-	// decrypt and auth
-	std::vector<uint8_t> plain;
-	if (AEADDecrypt<AES256GCM128>(key, IV, cipher, AD, tag, plain) == false) {
-		throw EVFS_EXCEPTION << "Authentication failure during chunk decryption";
-	}
+	// chunk header is: tag, IV. No associated data
+	// decrypt and auth directly from the raw chunk to the output buffer
+	int ret = chunkDecrypt(key.data(), rawChunk + chunkAuthTagSize, rawChunk + chunkHeaderSize,
+	                       rawChunkSize - chunkHeaderSize, rawChunk, plainData);
 
 	// cleaning
 	bctbx_clean(key.data(), key.size());
 
-	return plain;
+	if (ret != 0) {
+		count(VfsCounters::integrityFailures);
+		throw EVFS_EXCEPTION << "Authentication failure during chunk decryption";
+	}
 }
 
 // This module does not reuse any part of its chunk header during encryption
@@ -156,29 +258,122 @@ void VfsEM_AES256GCM_SHA256::encryptChunk(const uint32_t chunkIndex,
 
 std::vector<uint8_t> VfsEM_AES256GCM_SHA256::encryptChunk(const uint32_t chunkIndex,
                                                           const std::vector<uint8_t> &plainData) {
+	std::vector<uint8_t> rawChunk(chunkHeaderSize + plainData.size());
+	encryptChunk(chunkIndex, plainData.data(), plainData.size(), rawChunk.data());
+	return rawChunk;
+}
+
+void VfsEM_AES256GCM_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                          uint8_t *rawChunk,
+                                          BCTBX_UNUSED(const size_t rawChunkSize),
+                                          const uint8_t *plainData,
+                                          const size_t plainDataSize) {
+	encryptChunk(chunkIndex, plainData, plainDataSize, rawChunk);
+}
+
+void VfsEM_AES256GCM_SHA256::encryptChunk(const uint32_t chunkIndex,
+                                          const uint8_t *plainData,
+                                          const size_t plainDataSize,
+                                          uint8_t *rawChunk) {
 	if (sMasterKey.empty()) {
 		throw EVFS_EXCEPTION << "No encryption Master key set, cannot encrypt";
 	}
-	// generate a random IV
-	auto IV = mRNG->randomize(chunkIVSize);
+	// generate a random IV directly in the chunk header: tag, IV
+	VfsSharedRNG::randomize(rawChunk + chunkAuthTagSize, chunkIVSize);
 
 	// derive the key : HKDF (fileHeaderSalt || Chunk Index, Master key, "EVFS chunk")
-	std::vector<uint8_t> key{deriveChunkKey(chunkIndex)};
-
-	std::vector<uint8_t> AD{};
-	std::vector<uint8_t> tag(AES256GCM128::tagSize());
-	std::vector<uint8_t> rawChunk = AEADEncrypt<AES256GCM128>(key, IV, plainData, AD, tag);
+	std::array<uint8_t, AES256GCM128::keySize()> key;
+	deriveChunkKey(chunkIndex, key.data());
 
-	// insert header:
-	std::vector<uint8_t> chunkHeader(chunkHeaderSize, 0);
-	std::copy(tag.cbegin(), tag.cend(), chunkHeader.begin());
-	std::copy(IV.cbegin(), IV.cend(), chunkHeader.begin() + tag.size());
-	rawChunk.insert(rawChunk.begin(), chunkHeader.cbegin(), chunkHeader.cend());
+	// No associated data, the tag is written at the begining of the chunk header, cipher text after the header
+	int ret = chunkEncrypt(key.data(), rawChunk + chunkAuthTagSize, plainData, plainDataSize, rawChunk,
+	                       rawChunk + chunkHeaderSize);
 
 	// cleaning
 	bctbx_clean(key.data(), key.size());
 
-	return rawChunk;
+	if (ret != 0) {
+		throw EVFS_EXCEPTION << "Chunk encryption failed: " << ret;
+	}
+}
+
+void VfsEM_AES256GCM_SHA256::decryptChunks(const uint32_t firstChunkIndex,
+                                           const uint8_t *rawData,
+                                           const size_t rawDataSize,
+                                           const size_t chunkSize,
+                                           uint8_t *plainData) {
+	if (sMasterKey.empty()) {
+		throw EVFS_EXCEPTION << "No encryption Master key set, cannot decrypt";
+	}
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	const size_t chunkCount = (rawDataSize + rawChunkSize - 1) / rawChunkSize;
+	if (chunkCount == 0) {
+		return;
+	}
+	if ((rawDataSize - (chunkCount - 1) * rawChunkSize) < chunkHeaderSize) {
+		throw EVFS_EXCEPTION << "Cannot decrypt a chunk of " << (rawDataSize - (chunkCount - 1) * rawChunkSize)
+		                     << " bytes, chunk header alone is " << chunkHeaderSize << " bytes";
+	}
+
+	// derive all the keys at once
+	std::vector<uint8_t> keys(chunkCount * AES256GCM128::keySize());
+	deriveChunkKeys(firstChunkIndex, chunkCount, keys.data());
+
+	int ret = 0;
+	size_t i = 0;
+	for (; i < chunkCount && ret == 0; i++) {
+		const uint8_t *rawChunk = rawData + i * rawChunkSize;
+		size_t size = std::min(rawChunkSize, rawDataSize - i * rawChunkSize) - chunkHeaderSize;
+		ret = chunkDecrypt(keys.data() + i * AES256GCM128::keySize(), rawChunk + chunkAuthTagSize,
+		                   rawChunk + chunkHeaderSize, size, rawChunk, plainData + i * chunkSize);
+	}
+
+	// cleaning
+	bctbx_clean(keys.data(), keys.size());
+
+	if (ret != 0) {
+		count(VfsCounters::integrityFailures);
+		throw EVFS_EXCEPTION << "Authentication failure during chunk decryption, chunk " << firstChunkIndex + i - 1;
+	}
+}
+
+void VfsEM_AES256GCM_SHA256::encryptChunks(const uint32_t firstChunkIndex,
+                                           const uint8_t *plainData,
+                                           const size_t plainDataSize,
+                                           const size_t chunkSize,
+                                           uint8_t *rawData) {
+	if (sMasterKey.empty()) {
+		throw EVFS_EXCEPTION << "No encryption Master key set, cannot encrypt";
+	}
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	const size_t chunkCount = (plainDataSize + chunkSize - 1) / chunkSize;
+	if (chunkCount == 0) {
+		return;
+	}
+
+	// draw all the IVs at once
+	std::vector<uint8_t> IVs(chunkCount * chunkIVSize);
+	VfsSharedRNG::randomize(IVs.data(), IVs.size());
+	// derive all the keys at once
+	std::vector<uint8_t> keys(chunkCount * AES256GCM128::keySize());
+	deriveChunkKeys(firstChunkIndex, chunkCount, keys.data());
+
+	int ret = 0;
+	for (size_t i = 0; i < chunkCount && ret == 0; i++) {
+		uint8_t *rawChunk = rawData + i * rawChunkSize;
+		size_t size = std::min(chunkSize, plainDataSize - i * chunkSize);
+		// chunk header is: tag, IV
+		std::copy(IVs.cbegin() + i * chunkIVSize, IVs.cbegin() + (i + 1) * chunkIVSize, rawChunk + chunkAuthTagSize);
+		ret = chunkEncrypt(keys.data() + i * AES256GCM128::keySize(), rawChunk + chunkAuthTagSize,
+		                   plainData + i * chunkSize, size, rawChunk, rawChunk + chunkHeaderSize);
+	}
+
+	// cleaning
+	bctbx_clean(keys.data(), keys.size());
+
+	if (ret != 0) {
+		throw EVFS_EXCEPTION << "Chunk encryption failed: " << ret;
+	}
 }
 
 /**
@@ -189,8 +384,8 @@ std::vector<uint8_t> VfsEM_AES256GCM_SHA256::encryptChunk(const uint32_t chunkIn
  */
 bool VfsEM_AES256GCM_SHA256::checkIntegrity(const VfsEncryption &fileContext) {
 	if (sFileHeaderHMACKey.empty()) {
-		throw EVFS_EXCEPTION
-		    << "The AES256GCM128-SHA256 encryption module cannot generate its file header without master key";
+		throw EVFS_EXCEPTION << "The " << encryptionSuiteString(getEncryptionSuite())
+		                     << " encryption module cannot generate its file header without master key";
 	}
 	// Only the actual file header is to authenticate, the module file header holds the global salt used to derive the
 	// key feed to HMAC authenticating the file header so it is useless to authenticate it
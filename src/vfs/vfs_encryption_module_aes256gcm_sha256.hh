@@ -22,7 +22,9 @@
 #include "bctoolbox/crypto.hh"
 #include "bctoolbox/vfs_encrypted.hh"
 #include "vfs_encryption_module.hh"
+#include "vfs_lru_cache.hh"
 #include <array>
+#include <mutex>
 
 /*********** The AES256-GCM SHA256 module   ************************
  * Key derivations:
@@ -42,11 +44,6 @@
 namespace bctoolbox {
 class VfsEM_AES256GCM_SHA256 : public VfsEncryptionModule {
 private:
-	/**
-	 * The local RNG
-	 */
-	std::shared_ptr<bctoolbox::RNG> mRNG; // list it first so it is available in the constructor's init list
-
 	/**
 	 * File header
 	 */
@@ -58,15 +55,58 @@ private:
 	std::vector<uint8_t> sMasterKey;         // used to derive all keys
 	std::vector<uint8_t> sFileHeaderHMACKey; // used to feed HMAC integrity check on file header
 
+	/**
+	 * Chunks may be encrypted/decrypted concurrently on worker threads, protect the chunk key cache
+	 */
+	std::mutex mMutex;
+
+	/**
+	 * Derived chunk keys cache, indexed by chunk index. Keys are wiped when leaving the cache
+	 */
+	LruCache<uint32_t, std::array<uint8_t, AES256GCM128::keySize()>> mChunkKeyCache;
+
 	/**
 	 * Derive the key from master key for the given chunkIndex:
 	 * HKDF(fileSalt || ChunkIndex, master Key, "EVFS chunk")
+	 * The key is served from the chunk key cache when available
 	 *
 	 * @param[in]	chunkIndex	the chunk index used in key derivation
+	 * @param[out]	key			the AES256-GCM128 key, must be AES256GCM128::keySize() bytes
+	 */
+	void deriveChunkKey(uint32_t chunkIndex, uint8_t *key);
+	/**
+	 * Derive the keys of consecutive chunks, the cache is accessed once for all of them
+	 *
+	 * @param[in]	firstChunkIndex	index of the first chunk
+	 * @param[in]	chunkCount		number of chunks
+	 * @param[out]	keys			the AES256-GCM128 keys, must be chunkCount * AES256GCM128::keySize() bytes
+	 */
+	void deriveChunkKeys(uint32_t firstChunkIndex, size_t chunkCount, uint8_t *keys);
+
+protected:
+	/**
+	 * @return the info string used in chunk keys derivation
+	 */
+	virtual std::string chunkKeyInfo() const;
+
+	/**
+	 * Chunk encryption primitives: 32 bytes key, 12 bytes IV, 16 bytes tag and no associated data
+	 * Modules sharing this key schedule and file format with another cipher override them
 	 *
-	 * @return	the AES256-GCM128 key
+	 * @return 0 on success, crypto library error code otherwise
 	 */
-	std::vector<uint8_t> deriveChunkKey(uint32_t chunkIndex);
+	virtual int chunkEncrypt(const uint8_t *key,
+	                         const uint8_t *IV,
+	                         const uint8_t *plain,
+	                         const size_t size,
+	                         uint8_t *tag,
+	                         uint8_t *cipher) const;
+	virtual int chunkDecrypt(const uint8_t *key,
+	                         const uint8_t *IV,
+	                         const uint8_t *cipher,
+	                         const size_t size,
+	                         const uint8_t *tag,
+	                         uint8_t *plain) const;
 
 public:
 	/**
@@ -96,17 +136,49 @@ public:
 	 */
 	size_t getSecretMaterialSize() const noexcept override;
 
+	/**
+	 * Set the maximum number of derived chunk keys kept in cache, 0 disables the cache
+	 */
+	void chunkKeyCacheSizeSet(const size_t size) override;
+
 	/**
 	 * Decrypt a chunk of data
 	 * @param[in] a vector which size shall be chunkHeaderSize + chunkSize holding the raw data read from disk
 	 * @return the decrypted data chunk
 	 */
 	std::vector<uint8_t> decryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &rawChunk) override;
+	void decryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  uint8_t *plainData) override;
 
 	void encryptChunk(const uint32_t chunkIndex,
 	                  std::vector<uint8_t> &rawChunk,
 	                  const std::vector<uint8_t> &plainData) override;
 	std::vector<uint8_t> encryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &plainData) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize,
+	                  uint8_t *rawChunk) override;
+
+	/**
+	 * Decrypt or encrypt consecutive chunks: chunk keys are derived and random IVs drawn for all of them at once
+	 */
+	void decryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *rawData,
+	                   const size_t rawDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *plainData) override;
+	void encryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *plainData,
+	                   const size_t plainDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *rawData) override;
 
 	const std::vector<uint8_t> getModuleFileHeader(const VfsEncryption &fileContext) const override;
 
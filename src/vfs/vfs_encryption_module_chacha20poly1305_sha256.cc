@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_encryption_module_chacha20poly1305_sha256.hh"
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/crypto.hh"
+
+using namespace bctoolbox;
+
+// The chunk key cache, header layout and key derivation are shared with the AES256-GCM module
+static_assert(CHACHA20POLY1305::keySize() == AES256GCM128::keySize(), "Chunk keys must have the same size");
+static_assert(CHACHA20POLY1305::tagSize() == AES256GCM128::tagSize(), "Chunk tags must have the same size");
+
+std::string VfsEM_CHACHA20POLY1305_SHA256::chunkKeyInfo() const {
+	return "EVFS chunk ChaCha20-Poly1305";
+}
+
+int VfsEM_CHACHA20POLY1305_SHA256::chunkEncrypt(const uint8_t *key,
+                                                const uint8_t *IV,
+                                                const uint8_t *plain,
+                                                const size_t size,
+                                                uint8_t *tag,
+                                                uint8_t *cipher) const {
+	return bctbx_chacha20_poly1305_encrypt_and_tag(key, plain, size, nullptr, 0, IV, tag, cipher);
+}
+
+int VfsEM_CHACHA20POLY1305_SHA256::chunkDecrypt(const uint8_t *key,
+                                                const uint8_t *IV,
+                                                const uint8_t *cipher,
+                                                const size_t size,
+                                                const uint8_t *tag,
+                                                uint8_t *plain) const {
+	return bctbx_chacha20_poly1305_decrypt_and_auth(key, cipher, size, nullptr, 0, IV, tag, plain);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_ENCRYPTION_MODULE_CHACHA20POLY1305_SHA256_HH
+#define BCTBX_VFS_ENCRYPTION_MODULE_CHACHA20POLY1305_SHA256_HH
+#include "vfs_encryption_module_aes256gcm_sha256.hh"
+
+/*********** The ChaCha20-Poly1305 SHA256 module   ************************
+ * Same key schedule and file format than the AES256-GCM SHA256 module, only the chunk cipher differs:
+ * it is faster than AES on platforms without AES hardware support.
+ * Key derivations:
+ *    - file Header HMAC key = HKDF(Mk, fileHeaderSalt, "EVFS file header")
+ *    - chunk encryption key = HKDF(Mk, fileHeaderSalt || Chunk Index, "EVFS chunk ChaCha20-Poly1305")
+ * File Header:
+ *    - 32 bytes auth tag: HMAC-sha256 on the file header
+ *    - 16 bytes salt: random generated at file creation : input of the HKDF keyed by the master key.
+ * Chunk Header:
+ *    - Authentication tag : 16 bytes
+ *    - nonce: 12 bytes. A random updated at each encryption
+ * Chunk encryption:
+ *    - ChaCha20-Poly1305 (RFC 8439). No associated Data.
+ */
+namespace bctoolbox {
+class VfsEM_CHACHA20POLY1305_SHA256 : public VfsEM_AES256GCM_SHA256 {
+protected:
+	std::string chunkKeyInfo() const override;
+	int chunkEncrypt(const uint8_t *key,
+	                 const uint8_t *IV,
+	                 const uint8_t *plain,
+	                 const size_t size,
+	                 uint8_t *tag,
+	                 uint8_t *cipher) const override;
+	int chunkDecrypt(const uint8_t *key,
+	                 const uint8_t *IV,
+	                 const uint8_t *cipher,
+	                 const size_t size,
+	                 const uint8_t *tag,
+	                 uint8_t *plain) const override;
+
+public:
+	/**
+	 * @return the EncryptionSuite provided by this module
+	 */
+	EncryptionSuite getEncryptionSuite() const noexcept override {
+		return EncryptionSuite::chacha20poly1305_sha256;
+	}
+
+	/**
+	 * constructors
+	 */
+	// At file creation
+	VfsEM_CHACHA20POLY1305_SHA256() = default;
+	// Opening an existing file
+	VfsEM_CHACHA20POLY1305_SHA256(const std::vector<uint8_t> &fileHeader) : VfsEM_AES256GCM_SHA256(fileHeader){};
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_ENCRYPTION_MODULE_CHACHA20POLY1305_SHA256_HH
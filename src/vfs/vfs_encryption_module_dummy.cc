@@ -70,6 +70,9 @@ static std::string getHex(const std::vector<uint8_t> &v) {
 
 // chunk index is in chunk 8,9,10,11
 uint32_t VfsEncryptionModuleDummy::getChunkIndex(const std::vector<uint8_t> &chunk) const {
+	return getChunkIndex(chunk.data());
+}
+uint32_t VfsEncryptionModuleDummy::getChunkIndex(const uint8_t *chunk) const {
 	return chunk[8] << 24 | chunk[9] << 16 | chunk[10] << 8 | chunk[11];
 }
 
@@ -132,54 +135,86 @@ void VfsEncryptionModuleDummy::setModuleSecretMaterial(const std::vector<uint8_t
 
 std::vector<uint8_t> VfsEncryptionModuleDummy::decryptChunk(const uint32_t chunkIndex,
                                                             const std::vector<uint8_t> &rawChunk) {
+	std::vector<uint8_t> plainData(rawChunk.size() - std::min(rawChunk.size(), chunkHeaderSize));
+	decryptChunk(chunkIndex, rawChunk.data(), rawChunk.size(), plainData.data());
+	return plainData;
+}
+
+void VfsEncryptionModuleDummy::decryptChunk(const uint32_t chunkIndex,
+                                            const uint8_t *rawChunk,
+                                            const size_t rawChunkSize,
+                                            uint8_t *plainData) {
+	if (rawChunkSize < chunkHeaderSize) {
+		throw EVFS_EXCEPTION << "Integrity check failure while decrypting: chunk is only " << rawChunkSize << " bytes";
+	}
 	// First check the integrity of the block. In the dummy module, integrity is 8 bytes of HMAC SHA256 keyed with the
 	// master key
-	std::vector<uint8_t> computedIntegrity = chunkIntegrityTag(rawChunk);
-	if (!std::equal(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk.cbegin())) {
+	std::vector<uint8_t> computedIntegrity = chunkIntegrityTag(rawChunk, rawChunkSize);
+	if (!std::equal(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk)) {
+		count(VfsCounters::integrityFailures);
 		throw EVFS_EXCEPTION << "Integrity check failure while decrypting";
 	}
 
 	// Check the given chunk index is matching the one found in block - avoid attacker moving blocks in the file
 	if (chunkIndex != getChunkIndex(rawChunk)) {
+		count(VfsCounters::integrityFailures);
 		throw EVFS_EXCEPTION << "Integrity check: unmatching chunk index";
 	}
 
-	std::vector<uint8_t> plainData(rawChunk.cbegin() + chunkHeaderSize, rawChunk.cend());
+	size_t plainSize = rawChunkSize - chunkHeaderSize;
 	// The dummy decryption is a simple XOR on 16 bytes blocks with fileHeaderMaterial(8 bytes)||chunkHeaderMaterial(8
 	// bytes) The 16 bytes result is then xor with the secret material
-	std::vector<uint8_t> XORkey(globalIV()); // Xor key is file header material
-	XORkey.insert(XORkey.end(), rawChunk.cbegin() + 8, rawChunk.cbegin() + chunkHeaderSize); // and chunkHeaderMaterial
+	std::vector<uint8_t> XORkey(globalIV());                               // Xor key is file header material
+	XORkey.insert(XORkey.end(), rawChunk + 8, rawChunk + chunkHeaderSize); // and chunkHeaderMaterial
 	std::transform(XORkey.begin(), XORkey.end(), mSecret.cbegin(), XORkey.begin(), std::bit_xor<uint8_t>());
 
 	BCTBX_SLOGD << "decryptChunk :" << std::endl
-	            << "   chunk is " << getHex(plainData) << std::endl
+	            << "   chunk is " << getHex(std::vector<uint8_t>(rawChunk + chunkHeaderSize, rawChunk + rawChunkSize))
+	            << std::endl
 	            << "   key is " << getHex(XORkey);
 	// Xor it all, 16 bytes at a time
-	for (size_t i = 0; i < plainData.size(); i += 16) {
-		std::transform(plainData.begin() + i, plainData.begin() + std::min(i + 16, plainData.size()), XORkey.cbegin(),
-		               plainData.begin() + i, std::bit_xor<uint8_t>());
+	for (size_t i = 0; i < plainSize; i += 16) {
+		std::transform(rawChunk + chunkHeaderSize + i, rawChunk + chunkHeaderSize + std::min(i + 16, plainSize),
+		               XORkey.cbegin(), plainData + i, std::bit_xor<uint8_t>());
 	}
-	BCTBX_SLOGD << "decryptChunk :" << std::endl << "   output is " << getHex(plainData);
-
-	return plainData;
+	BCTBX_SLOGD << "decryptChunk :" << std::endl
+	            << "   output is " << getHex(std::vector<uint8_t>(plainData, plainData + plainSize));
 }
 
 void VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunkIndex,
                                             std::vector<uint8_t> &rawChunk,
                                             const std::vector<uint8_t> &plainData) {
+	size_t rawChunkSize = rawChunk.size();
+	// resize encrypted buffer
+	rawChunk.resize(std::max(rawChunkSize, chunkHeaderSize + plainData.size()));
+	encryptChunk(chunkIndex, rawChunk.data(), rawChunkSize, plainData.data(), plainData.size());
+	rawChunk.resize(chunkHeaderSize + plainData.size());
+}
+
+void VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunkIndex,
+                                            uint8_t *rawChunk,
+                                            const size_t rawChunkSize,
+                                            const uint8_t *plainData,
+                                            const size_t plainDataSize) {
 	BCTBX_SLOGD << "encryptChunk re :" << std::endl
-	            << "   plain is " << plainData.size() << std::endl
-	            << "    plain: " << getHex(plainData);
-	BCTBX_SLOGD << "    in cipher: " << getHex(rawChunk);
+	            << "   plain is " << plainDataSize << std::endl
+	            << "    plain: " << getHex(std::vector<uint8_t>(plainData, plainData + plainDataSize));
+	BCTBX_SLOGD << "    in cipher: " << getHex(std::vector<uint8_t>(rawChunk, rawChunk + rawChunkSize));
 
+	if (rawChunkSize < chunkHeaderSize) {
+		throw EVFS_EXCEPTION << "Integrity check failure while re-encrypting: chunk is only " << rawChunkSize
+		                     << " bytes";
+	}
 	// Check integrity on the whole block. Actual module shall optimize it and be able to check only the header
 	// integrity, we just want to make sure the data we intend to use - header meta data - are valid
-	std::vector<uint8_t> computedIntegrity = chunkIntegrityTag(rawChunk);
-	if (!std::equal(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk.cbegin())) {
+	std::vector<uint8_t> computedIntegrity = chunkIntegrityTag(rawChunk, rawChunkSize);
+	if (!std::equal(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk)) {
+		count(VfsCounters::integrityFailures);
 		throw EVFS_EXCEPTION << "Integrity check failure while re-encrypting chunk";
 	}
 	// Check the given chunk index is matching the one found in block - avoid attacker moving blocks in the file
 	if (chunkIndex != getChunkIndex(rawChunk)) {
+		count(VfsCounters::integrityFailures);
 		throw EVFS_EXCEPTION << "Integrity check: unmatching chunk index";
 	}
 
@@ -191,35 +226,28 @@ void VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunkIndex,
 	rawChunk[14] = (encryptionCount >> 8) & 0xFF;
 	rawChunk[15] = (encryptionCount & 0xFF);
 
-	// resize encrypted buffer
-	rawChunk.resize(chunkHeaderSize + plainData.size());
-
-	// The dummy encryption is a simple XOR on 16 bytes blocks with fileHeaderMaterial(8 bytes)||chunkHeaderMaterial(8
-	// bytes, the part after the integrity tag) The 16 bytes result is then xor with the secret material
-	std::vector<uint8_t> XORkey(globalIV()); // Xor key is file header material
-	XORkey.insert(XORkey.end(), rawChunk.cbegin() + 8, rawChunk.cbegin() + chunkHeaderSize); // and chunkHeaderMaterial
-	std::transform(XORkey.begin(), XORkey.end(), mSecret.cbegin(), XORkey.begin(), std::bit_xor<uint8_t>());
-
-	// Xor it all, 16 bytes at a time
-	for (size_t i = 0; i < plainData.size(); i += 16) {
-		std::transform(plainData.begin() + i, plainData.begin() + std::min(i + 16, plainData.size()), XORkey.cbegin(),
-		               rawChunk.begin() + chunkHeaderSize + i, std::bit_xor<uint8_t>());
-	}
+	xorChunk(rawChunk, plainData, plainDataSize);
 
-	// Update integrity
-	computedIntegrity = chunkIntegrityTag(rawChunk);
-	std::copy(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk.begin());
-
-	BCTBX_SLOGD << "   out cipher: " << getHex(rawChunk);
+	BCTBX_SLOGD << "   out cipher: "
+	            << getHex(std::vector<uint8_t>(rawChunk, rawChunk + chunkHeaderSize + plainDataSize));
 }
 
 std::vector<uint8_t> VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunkIndex,
                                                             const std::vector<uint8_t> &plainData) {
+	std::vector<uint8_t> rawChunk(chunkHeaderSize + plainData.size());
+	encryptChunk(chunkIndex, plainData.data(), plainData.size(), rawChunk.data());
+	return rawChunk;
+}
+
+void VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunkIndex,
+                                            const uint8_t *plainData,
+                                            const size_t plainDataSize,
+                                            uint8_t *rawChunk) {
 	BCTBX_SLOGD << "encryptChunk new :" << std::endl
-	            << "   plain is " << plainData.size() << " index is " << chunkIndex << std::endl
-	            << "    plain: " << getHex(plainData);
-	// create a vector of the appropriate size, init to 0
-	std::vector<uint8_t> rawChunk(chunkHeaderSize + plainData.size(), 0);
+	            << "   plain is " << plainDataSize << " index is " << chunkIndex << std::endl
+	            << "    plain: " << getHex(std::vector<uint8_t>(plainData, plainData + plainDataSize));
+	// init the chunk header to 0
+	std::fill(rawChunk, rawChunk + chunkHeaderSize, 0);
 
 	// set in the chunk Index
 	rawChunk[8] = (chunkIndex >> 24) & 0xFF;
@@ -228,25 +256,58 @@ std::vector<uint8_t> VfsEncryptionModuleDummy::encryptChunk(const uint32_t chunk
 	rawChunk[11] = (chunkIndex & 0xFF);
 	// rawChunk 12 to 15 is the encryptionCount, 0 is fine
 
+	xorChunk(rawChunk, plainData, plainDataSize);
+
+	BCTBX_SLOGD << "    cipher: " << getHex(std::vector<uint8_t>(rawChunk, rawChunk + chunkHeaderSize + plainDataSize));
+}
+
+void VfsEncryptionModuleDummy::decryptChunks(const uint32_t firstChunkIndex,
+                                             const uint8_t *rawData,
+                                             const size_t rawDataSize,
+                                             const size_t chunkSize,
+                                             uint8_t *plainData) {
+	BCTBX_SLOGD << "decryptChunks : " << rawDataSize << " bytes from chunk " << firstChunkIndex;
+	// Nothing to share between chunks in this module: just process them one by one
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	for (size_t i = 0; i * rawChunkSize < rawDataSize; i++) {
+		decryptChunk(firstChunkIndex + static_cast<uint32_t>(i), rawData + i * rawChunkSize,
+		             std::min(rawChunkSize, rawDataSize - i * rawChunkSize), plainData + i * chunkSize);
+	}
+}
+
+void VfsEncryptionModuleDummy::encryptChunks(const uint32_t firstChunkIndex,
+                                             const uint8_t *plainData,
+                                             const size_t plainDataSize,
+                                             const size_t chunkSize,
+                                             uint8_t *rawData) {
+	BCTBX_SLOGD << "encryptChunks : " << plainDataSize << " bytes from chunk " << firstChunkIndex;
+	const size_t rawChunkSize = chunkHeaderSize + chunkSize;
+	for (size_t i = 0; i * chunkSize < plainDataSize; i++) {
+		encryptChunk(firstChunkIndex + static_cast<uint32_t>(i), plainData + i * chunkSize,
+		             std::min(chunkSize, plainDataSize - i * chunkSize), rawData + i * rawChunkSize);
+	}
+}
+
+/**
+ * Encrypt plainData in rawChunk which already holds its chunk header(index and encryption counter) and update the
+ * integrity tag
+ */
+void VfsEncryptionModuleDummy::xorChunk(uint8_t *rawChunk, const uint8_t *plainData, const size_t plainDataSize) const {
 	// The dummy encryption is a simple XOR on 16 bytes blocks with fileHeaderMaterial(8 bytes)||chunkHeaderMaterial(8
 	// bytes, the part after the integrity tag) The 16 bytes result is then xor with the secret material
-	std::vector<uint8_t> XORkey(globalIV()); // Xor key is file header material
-	XORkey.insert(XORkey.end(), rawChunk.cbegin() + 8, rawChunk.cbegin() + chunkHeaderSize); // and chunkHeaderMaterial
+	std::vector<uint8_t> XORkey(globalIV());                                 // Xor key is file header material
+	XORkey.insert(XORkey.end(), rawChunk + 8, rawChunk + chunkHeaderSize); // and chunkHeaderMaterial
 	std::transform(XORkey.begin(), XORkey.end(), mSecret.cbegin(), XORkey.begin(), std::bit_xor<uint8_t>());
 
 	// Xor it all, 16 bytes at a time
-	for (size_t i = 0; i < plainData.size(); i += 16) {
-		std::transform(plainData.begin() + i, plainData.begin() + std::min(i + 16, plainData.size()), XORkey.cbegin(),
-		               rawChunk.begin() + chunkHeaderSize + i, std::bit_xor<uint8_t>());
+	for (size_t i = 0; i < plainDataSize; i += 16) {
+		std::transform(plainData + i, plainData + std::min(i + 16, plainDataSize), XORkey.cbegin(),
+		               rawChunk + chunkHeaderSize + i, std::bit_xor<uint8_t>());
 	}
 
 	// Update integrity
-	auto computedIntegrity = chunkIntegrityTag(rawChunk);
-	std::copy(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk.begin());
-
-	BCTBX_SLOGD << "    cipher: " << getHex(rawChunk);
-
-	return rawChunk;
+	auto computedIntegrity = chunkIntegrityTag(rawChunk, chunkHeaderSize + plainDataSize);
+	std::copy(computedIntegrity.cbegin(), computedIntegrity.cend(), rawChunk);
 }
 
 /**
@@ -273,12 +334,15 @@ bool VfsEncryptionModuleDummy::checkIntegrity(const VfsEncryption &fileContext)
 }
 
 std::vector<uint8_t> VfsEncryptionModuleDummy::chunkIntegrityTag(const std::vector<uint8_t> &chunk) const {
+	return chunkIntegrityTag(chunk.data(), chunk.size());
+}
+
+std::vector<uint8_t> VfsEncryptionModuleDummy::chunkIntegrityTag(const uint8_t *chunk, const size_t chunkSize) const {
 	std::vector<uint8_t> tag(8);
 	bctbx_hmacSha256(
 	    mSecret.data(), secretMaterialSize,
-	    chunk.data() +
-	        8, // compute integrity on the whole block (header included) but skip the integrity tag (8 first bytes)
-	    chunk.size() - 8,
+	    chunk + 8, // compute integrity on the whole block (header included) but skip the integrity tag (8 first bytes)
+	    chunkSize - 8,
 	    8, // get 8 bytes out of the HMAC
 	    tag.data());
 	return tag;
@@ -36,11 +36,13 @@ private:
 	 * Compute the integrity tag in the given chunk
 	 */
 	std::vector<uint8_t> chunkIntegrityTag(const std::vector<uint8_t> &chunk) const;
+	std::vector<uint8_t> chunkIntegrityTag(const uint8_t *chunk, const size_t chunkSize) const;
 
 	/**
 	 * Get the chunk index from the given chunk
 	 */
 	uint32_t getChunkIndex(const std::vector<uint8_t> &chunk) const;
+	uint32_t getChunkIndex(const uint8_t *chunk) const;
 
 	/**
 	 * Get global IV. Part of IV common to all chunks
@@ -48,6 +50,12 @@ private:
 	 */
 	std::vector<uint8_t> globalIV() const;
 
+	/**
+	 * XOR the plain data into the given raw chunk, its header must already hold the chunk index and encryption count
+	 * Update the chunk integrity tag
+	 */
+	void xorChunk(uint8_t *rawChunk, const uint8_t *plainData, const size_t plainDataSize) const;
+
 public:
 	/**
 	 * @return the size in bytes of file header module data
@@ -82,11 +90,35 @@ public:
 	 * @return the decrypted data chunk
 	 */
 	std::vector<uint8_t> decryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &rawChunk) override;
+	void decryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  uint8_t *plainData) override;
 
 	void encryptChunk(const uint32_t chunkIndex,
 	                  std::vector<uint8_t> &rawChunk,
 	                  const std::vector<uint8_t> &plainData) override;
 	std::vector<uint8_t> encryptChunk(const uint32_t chunkIndex, const std::vector<uint8_t> &plainData) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  uint8_t *rawChunk,
+	                  const size_t rawChunkSize,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize) override;
+	void encryptChunk(const uint32_t chunkIndex,
+	                  const uint8_t *plainData,
+	                  const size_t plainDataSize,
+	                  uint8_t *rawChunk) override;
+
+	void decryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *rawData,
+	                   const size_t rawDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *plainData) override;
+	void encryptChunks(const uint32_t firstChunkIndex,
+	                   const uint8_t *plainData,
+	                   const size_t plainDataSize,
+	                   const size_t chunkSize,
+	                   uint8_t *rawData) override;
 
 	const std::vector<uint8_t> getModuleFileHeader(const VfsEncryption &fileContext) const override;
 
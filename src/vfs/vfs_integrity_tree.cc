@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_integrity_tree.hh"
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/logging.h"
+#include "bctoolbox/vfs_encrypted.hh" // EVFS_EXCEPTION
+#include "vfs_counters.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+using namespace bctoolbox;
+
+static constexpr size_t hashSize = VfsIntegrityTree::hashSize;
+static constexpr size_t nodeCacheSize = 1024;  // number of nodes kept in memory as they are in the file
+static constexpr size_t dirtyNodesMax = 1024;  // number of updated nodes kept in memory before they are written
+static constexpr size_t undoEntrySize = 8 + hashSize; // undo log entry: node index, 8 bytes big endian, then the node
+
+static bool isZero(const uint8_t *hash) {
+	return std::all_of(hash, hash + hashSize, [](uint8_t b) { return b == 0; });
+}
+
+/* a parent node: the hash of its two children, zeros if both of them are */
+static void nodeHash(const uint8_t *left, const uint8_t *right, uint8_t *parent) {
+	if (isZero(left) && isZero(right)) {
+		memset(parent, 0, hashSize);
+		return;
+	}
+	uint8_t children[2 * hashSize];
+	memcpy(children, left, hashSize);
+	memcpy(children + hashSize, right, hashSize);
+	bctbx_sha256(children, sizeof(children), hashSize, parent);
+}
+
+/* hash the nodes two by two: the nodes are replaced by their parents */
+static void pairUp(std::vector<uint8_t> &nodes) {
+	std::vector<uint8_t> parents(nodes.size() / 2);
+	for (size_t i = 0; i < parents.size(); i += hashSize) {
+		nodeHash(nodes.data() + 2 * i, nodes.data() + 2 * i + hashSize, parents.data() + i);
+	}
+	nodes = std::move(parents);
+}
+
+VfsIntegrityTree::VfsIntegrityTree(const std::string &filename, VfsCounters *counters)
+    : mFilename(filename), mCounters(counters), mUndoFilename(filename + undoSuffix), mFp(nullptr), mUndoFp(nullptr),
+      mUndoSize(0), mReadOnly(true), mValid(false), mDepth(0), mRoot(hashSize, 0), mNodeCache(nodeCacheSize) {
+}
+
+VfsIntegrityTree::~VfsIntegrityTree() {
+	if (mFp != nullptr) {
+		try {
+			flush();
+		} catch (EvfsException const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: unable to write integrity tree file " << mFilename << ": " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGE << "Encrypted VFS: unable to write integrity tree file " << mFilename << ": " << e.what();
+		}
+		bctbx_file_close(mFp);
+	}
+	if (mUndoFp != nullptr) {
+		bctbx_file_close(mUndoFp);
+		// nothing to undo: the root was committed
+		if (mUndoSize == 0) {
+			std::remove(mUndoFilename.data());
+		}
+	}
+}
+
+bool VfsIntegrityTree::open(bool readOnly, uint8_t depth, const std::vector<uint8_t> &root) {
+	if (mFp != nullptr) {
+		bctbx_file_close(mFp);
+	}
+	if (mUndoFp != nullptr) {
+		bctbx_file_close(mUndoFp);
+		mUndoFp = nullptr;
+	}
+	mReadOnly = readOnly;
+	mValid = false;
+	mDirtyNodes.clear();
+	mNodeCache.clear();
+	mUndoNodes.clear();
+	mUndoSize = 0;
+	mFp = bctbx_file_open2(bctbx_vfs_get_standard(), mFilename.data(), readOnly ? O_RDONLY : O_RDWR | O_CREAT);
+	if (mFp == nullptr) {
+		throw EVFS_EXCEPTION << "Cannot open integrity tree file " << mFilename;
+	}
+	mDepth = depth;
+	mRoot = root;
+	mValid = (mRoot.size() == hashSize && readNodes(1, 1) == mRoot);
+	// the process writing the tree may have stopped before writing the root in the file header
+	if (!mValid && mRoot.size() == hashSize && undoRestore()) {
+		mValid = (readNodes(1, 1) == mRoot);
+	}
+	return mValid;
+}
+
+bool VfsIntegrityTree::undoRestore() {
+	// it is usually missing: do not go through the standard vfs which logs an error then
+	std::FILE *undoFp = std::fopen(mUndoFilename.data(), "rb");
+	if (undoFp == nullptr) {
+		return false;
+	}
+	std::vector<uint8_t> undo{};
+	uint8_t entry[undoEntrySize];
+	while (std::fread(entry, 1, undoEntrySize, undoFp) == undoEntrySize) { // an incomplete last entry is ignored
+		undo.insert(undo.end(), entry, entry + undoEntrySize);
+	}
+	std::fclose(undoFp);
+	if (undo.empty()) {
+		return false;
+	}
+	if (mCounters != nullptr) {
+		mCounters->add(VfsCounters::rawBytesRead, undo.size());
+	}
+	BCTBX_SLOGW << "Encrypted VFS: restore " << undo.size() / undoEntrySize << " nodes of integrity tree file "
+	            << mFilename;
+	mNodeCache.clear();
+	for (size_t entry = 0; entry < undo.size(); entry += undoEntrySize) {
+		size_t node = 0;
+		for (size_t i = 0; i < 8; i++) {
+			node = (node << 8) | undo[entry + i];
+		}
+		mDirtyNodes[node].assign(undo.cbegin() + entry + 8, undo.cbegin() + entry + undoEntrySize);
+	}
+	// a read only tree keeps them in memory
+	if (!mReadOnly) {
+		flushNodes(false);
+		std::remove(mUndoFilename.data());
+	}
+	return true;
+}
+
+void VfsIntegrityTree::undoLog(size_t firstNode, size_t count) {
+	auto logged = std::distance(mUndoNodes.lower_bound(firstNode), mUndoNodes.lower_bound(firstNode + count));
+	if (static_cast<size_t>(logged) == count) {
+		return;
+	}
+	// the nodes after the end of the file are zeros
+	std::vector<uint8_t> nodes(count * hashSize, 0);
+	ssize_t readSize = bctbx_file_read(mFp, nodes.data(), nodes.size(), (off_t)(firstNode * hashSize));
+	if (readSize < 0) {
+		throw EVFS_EXCEPTION << "Cannot read integrity tree file " << mFilename;
+	}
+	if (mCounters != nullptr) {
+		mCounters->add(VfsCounters::rawBytesRead, static_cast<uint64_t>(readSize));
+	}
+	std::vector<uint8_t> entries{};
+	for (size_t i = 0; i < count; i++) {
+		if (!mUndoNodes.insert(firstNode + i).second) {
+			continue;
+		}
+		for (size_t byte = 8; byte > 0; byte--) {
+			entries.push_back(static_cast<uint8_t>(((firstNode + i) >> (8 * (byte - 1))) & 0xFF));
+		}
+		entries.insert(entries.end(), nodes.cbegin() + i * hashSize, nodes.cbegin() + (i + 1) * hashSize);
+	}
+	if (mUndoFp == nullptr) {
+		mUndoFp = bctbx_file_open2(bctbx_vfs_get_standard(), mUndoFilename.data(), O_RDWR | O_CREAT);
+		// what it may hold was committed
+		if (mUndoFp == nullptr || bctbx_file_truncate(mUndoFp, 0) < 0) {
+			throw EVFS_EXCEPTION << "Cannot open integrity tree undo log " << mUndoFilename;
+		}
+		mUndoSize = 0;
+	}
+	if (bctbx_file_write(mUndoFp, entries.data(), entries.size(), (off_t)mUndoSize) != (ssize_t)entries.size()) {
+		throw EVFS_EXCEPTION << "Cannot write integrity tree undo log " << mUndoFilename;
+	}
+	mUndoSize += entries.size();
+	if (mCounters != nullptr) {
+		mCounters->add(VfsCounters::rawBytesWritten, entries.size());
+	}
+}
+
+void VfsIntegrityTree::commit() {
+	if (mUndoSize == 0) {
+		mUndoNodes.clear();
+		return;
+	}
+	if (bctbx_file_truncate(mUndoFp, 0) < 0) {
+		throw EVFS_EXCEPTION << "Cannot truncate integrity tree undo log " << mUndoFilename;
+	}
+	mUndoSize = 0;
+	mUndoNodes.clear();
+}
+
+std::vector<uint8_t> VfsIntegrityTree::readNodes(size_t firstNode, size_t count) const {
+	// single nodes are the siblings read while climbing the tree: look for them in memory first
+	if (count == 1) {
+		auto dirtyNode = mDirtyNodes.find(firstNode);
+		if (dirtyNode != mDirtyNodes.end()) {
+			return dirtyNode->second;
+		}
+		auto cachedNode = mNodeCache.get(firstNode);
+		if (cachedNode != nullptr) {
+			return *cachedNode;
+		}
+	}
+	std::vector<uint8_t> nodes(count * hashSize, 0);
+	ssize_t readSize = bctbx_file_read(mFp, nodes.data(), nodes.size(), (off_t)(firstNode * hashSize));
+	if (readSize < 0) {
+		throw EVFS_EXCEPTION << "Cannot read integrity tree file " << mFilename;
+	}
+	if (mCounters != nullptr) {
+		mCounters->add(VfsCounters::rawBytesRead, static_cast<uint64_t>(readSize));
+	}
+	if (count == 1) {
+		mNodeCache.insert(firstNode, std::vector<uint8_t>(nodes));
+	}
+	// the updated nodes replace the ones in the file
+	for (auto it = mDirtyNodes.lower_bound(firstNode); it != mDirtyNodes.end() && it->first < firstNode + count;
+	     it++) {
+		std::copy(it->second.cbegin(), it->second.cend(), nodes.begin() + (it->first - firstNode) * hashSize);
+	}
+	return nodes;
+}
+
+void VfsIntegrityTree::writeNodes(size_t firstNode, const uint8_t *nodes, size_t count) {
+	if (mReadOnly) {
+		throw EVFS_EXCEPTION << "Cannot modify integrity tree of a file opened in read only mode " << mFilename;
+	}
+	if (bctbx_file_write(mFp, nodes, count * hashSize, (off_t)(firstNode * hashSize)) != (ssize_t)(count * hashSize)) {
+		throw EVFS_EXCEPTION << "Cannot write integrity tree file " << mFilename;
+	}
+	if (mCounters != nullptr) {
+		mCounters->add(VfsCounters::rawBytesWritten, count * hashSize);
+	}
+}
+
+void VfsIntegrityTree::storeNodes(size_t firstNode, const uint8_t *nodes, size_t count) {
+	if (mReadOnly) {
+		throw EVFS_EXCEPTION << "Cannot modify integrity tree of a file opened in read only mode " << mFilename;
+	}
+	for (size_t i = 0; i < count; i++) {
+		mNodeCache.erase(firstNode + i);
+		mDirtyNodes[firstNode + i].assign(nodes + i * hashSize, nodes + (i + 1) * hashSize);
+	}
+	if (mDirtyNodes.size() > dirtyNodesMax) {
+		flush();
+	}
+}
+
+void VfsIntegrityTree::flush() {
+	// a read only tree holds only the nodes restored from the undo log
+	if (mReadOnly) {
+		return;
+	}
+	flushNodes(true);
+}
+
+void VfsIntegrityTree::flushNodes(bool logged) {
+	std::vector<uint8_t> run{};
+	size_t runStart = 0;
+	auto writeRun = [&]() {
+		if (logged) {
+			undoLog(runStart, run.size() / hashSize);
+		}
+		writeNodes(runStart, run.data(), run.size() / hashSize);
+		run.clear();
+	};
+	for (auto &node : mDirtyNodes) {
+		if (!run.empty() && node.first != runStart + run.size() / hashSize) {
+			writeRun();
+		}
+		if (run.empty()) {
+			runStart = node.first;
+		}
+		run.insert(run.end(), node.second.cbegin(), node.second.cend());
+	}
+	if (!run.empty()) {
+		writeRun();
+	}
+	for (auto &node : mDirtyNodes) {
+		mNodeCache.insert(node.first, std::move(node.second));
+	}
+	mDirtyNodes.clear();
+}
+
+void VfsIntegrityTree::build(const std::vector<uint8_t> &leaves) {
+	uint8_t depth = 0;
+	while ((size_t(1) << depth) * hashSize < leaves.size()) {
+		depth++;
+	}
+	mDirtyNodes.clear();
+	mNodeCache.clear();
+	// the whole tree is replaced, there is no previous root to go back to
+	commit();
+	bctbx_file_truncate(mFp, 0);
+	// compute and write the levels, from the leaves up to the root
+	std::vector<uint8_t> level(leaves);
+	level.resize((size_t(1) << depth) * hashSize, 0);
+	for (size_t d = depth;; d--) {
+		writeNodes(size_t(1) << d, level.data(), level.size() / hashSize);
+		if (d == 0) {
+			break;
+		}
+		pairUp(level);
+	}
+	mDepth = depth;
+	mRoot = std::move(level);
+	mValid = true;
+}
+
+void VfsIntegrityTree::grow() {
+	// each level d moves from [2^d, 2^(d+1)) to [2^(d+1), 2^(d+1) + 2^d), the right half of the new level holds only
+	// empty subtrees. Start from the leaves so a level is overwritten only once it was moved.
+	flush();
+	mNodeCache.clear();
+	for (size_t d = mDepth + 1; d-- > 0;) {
+		const size_t count = size_t(1) << d;
+		auto level = readNodes(count, count);
+		undoLog(2 * count, 2 * count);
+		writeNodes(2 * count, level.data(), count);
+		std::vector<uint8_t> zeros(count * hashSize, 0);
+		writeNodes(3 * count, zeros.data(), count);
+	}
+	std::vector<uint8_t> root(hashSize);
+	std::vector<uint8_t> zeros(hashSize, 0);
+	nodeHash(mRoot.data(), zeros.data(), root.data());
+	undoLog(1, 1);
+	writeNodes(1, root.data(), 1);
+	mRoot = std::move(root);
+	mDepth++;
+}
+
+std::vector<uint8_t>
+VfsIntegrityTree::climb(size_t firstLeaf, std::vector<uint8_t> leaves, std::vector<uint8_t> *previousLeaves) {
+	size_t first = firstLeaf;
+	size_t last = firstLeaf + leaves.size() / hashSize - 1;
+	for (size_t d = mDepth; d > 0; d--) {
+		const size_t levelStart = size_t(1) << d;
+		if (previousLeaves != nullptr) {
+			storeNodes(levelStart + first, leaves.data(), last - first + 1);
+		}
+		// complete the pairs at both ends with the siblings stored in the file, they are not modified
+		std::vector<uint8_t> left{};
+		std::vector<uint8_t> right{};
+		if (first % 2 == 1) {
+			left = readNodes(levelStart + first - 1, 1);
+		}
+		if (last % 2 == 0) {
+			right = readNodes(levelStart + last + 1, 1);
+		}
+		for (auto nodes : {&leaves, previousLeaves}) {
+			if (nodes == nullptr) {
+				continue;
+			}
+			nodes->insert(nodes->begin(), left.cbegin(), left.cend());
+			nodes->insert(nodes->end(), right.cbegin(), right.cend());
+			pairUp(*nodes);
+		}
+		first /= 2;
+		last /= 2;
+	}
+	if (previousLeaves != nullptr) {
+		storeNodes(1, leaves.data(), 1);
+	}
+	return leaves;
+}
+
+bool VfsIntegrityTree::update(size_t firstLeaf, const std::vector<uint8_t> &leaves) {
+	const size_t count = leaves.size() / hashSize;
+	if (!mValid || count == 0) {
+		return mValid;
+	}
+	while (firstLeaf + count > (size_t(1) << mDepth)) {
+		grow();
+	}
+	auto previous = readNodes((size_t(1) << mDepth) + firstLeaf, count);
+	auto root = climb(firstLeaf, leaves, &previous);
+	if (previous != mRoot) {
+		mValid = false;
+		return false;
+	}
+	mRoot = std::move(root);
+	return true;
+}
+
+bool VfsIntegrityTree::verify(size_t firstLeaf, std::vector<uint8_t> leaves) {
+	if (!mValid || leaves.empty()) {
+		return mValid;
+	}
+	// leaves after the last one of the tree were never set
+	const size_t capacity = size_t(1) << mDepth;
+	const size_t inTree = (firstLeaf < capacity) ? std::min(capacity - firstLeaf, leaves.size() / hashSize) : 0;
+	if (!std::all_of(leaves.cbegin() + inTree * hashSize, leaves.cend(), [](uint8_t b) { return b == 0; })) {
+		return false;
+	}
+	if (inTree == 0) {
+		return true;
+	}
+	leaves.resize(inTree * hashSize);
+	return climb(firstLeaf, std::move(leaves), nullptr) == mRoot;
+}
+
+int VfsIntegrityTree::sync() {
+	if (mFp == nullptr || mReadOnly) {
+		return 0;
+	}
+	flush();
+	return bctbx_file_sync(mFp);
+}
+
+bool VfsIntegrityTree::valid() const noexcept {
+	return mValid;
+}
+
+uint8_t VfsIntegrityTree::depthGet() const noexcept {
+	return mDepth;
+}
+
+const std::vector<uint8_t> &VfsIntegrityTree::rootGet() const noexcept {
+	return mRoot;
+}
+
+void VfsIntegrityTree::leafHash(uint32_t chunkIndex,
+                                const uint8_t *chunkHeader,
+                                size_t chunkHeaderSize,
+                                uint8_t *leaf) {
+	if (std::all_of(chunkHeader, chunkHeader + chunkHeaderSize, [](uint8_t b) { return b == 0; })) {
+		memset(leaf, 0, hashSize);
+		return;
+	}
+	std::vector<uint8_t> input{static_cast<uint8_t>(chunkIndex >> 24), static_cast<uint8_t>(chunkIndex >> 16),
+	                           static_cast<uint8_t>(chunkIndex >> 8), static_cast<uint8_t>(chunkIndex)};
+	input.insert(input.end(), chunkHeader, chunkHeader + chunkHeaderSize);
+	bctbx_sha256(input.data(), input.size(), hashSize, leaf);
+}
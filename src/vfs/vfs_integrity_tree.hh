@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_INTEGRITY_TREE_HH
+#define BCTBX_VFS_INTEGRITY_TREE_HH
+
+#include "bctoolbox/vfs.h"
+#include "vfs_lru_cache.hh"
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace bctoolbox {
+
+class VfsCounters;
+
+/**
+ * Merkle tree over the chunks of an encrypted file.
+ *
+ * A leaf is the hash of a chunk index and of its chunk header: it holds the chunk authentication tag so it changes
+ * each time the chunk is written. Leaves of missing chunks, and of holes, are zeros. A node is the hash of its two
+ * children, or zeros if both of them are.
+ * The tree is complete, with 2^depth leaves. Its nodes are stored in a file, in heap order: the root at index 1 and
+ * the children of node i at 2i and 2i+1, node i at offset i * hashSize. Only the root and the depth are kept in
+ * memory, by the owner of the tree in the authenticated file header: any other node read from the file is checked
+ * against the root before being trusted.
+ * Updated nodes are kept in memory and written by flush(), each run of consecutive nodes at once: the nodes updated on
+ * a level usually are consecutive. The nodes read or written recently are kept in memory too, so the siblings read
+ * while climbing the tree, often the same ones near the root, seldom cost a file read.
+ * Before a node is overwritten in the file, its previous value is appended to an undo log, the file suffixed by
+ * undoSuffix, until the owner commits the root written in its header. When the root found at opening is not the
+ * given one, the nodes of the undo log are restored first: a process stopping between the nodes and the header writes
+ * leaves the tree matching the previous root.
+ */
+class VfsIntegrityTree {
+public:
+	static constexpr size_t hashSize = 32;
+	static constexpr const char *undoSuffix = "_undo";
+
+	/**
+	 * @param[in]	filename	the file holding the tree nodes
+	 * @param[in]	counters	counts the bytes read from and written to this file, may be nullptr
+	 */
+	VfsIntegrityTree(const std::string &filename, VfsCounters *counters);
+	~VfsIntegrityTree();
+	VfsIntegrityTree(const VfsIntegrityTree &) = delete;
+	VfsIntegrityTree &operator=(const VfsIntegrityTree &) = delete;
+
+	/**
+	 * Open the file holding the tree nodes
+	 * @param[in]	readOnly	the tree cannot be modified
+	 * @param[in]	depth		the depth given by the file header
+	 * @param[in]	root		the root given by the file header
+	 * @return true if the root stored in the file, once the undo log is restored if needed, matches the given one.
+	 * Otherwise the tree is not valid.
+	 *
+	 * @throw a EvfsException if the file cannot be opened, the tree is then not valid
+	 */
+	bool open(bool readOnly, uint8_t depth, const std::vector<uint8_t> &root);
+	/**
+	 * Replace the whole tree by one built from the given leaves
+	 * @param[in]	leaves	hashSize bytes per leaf
+	 */
+	void build(const std::vector<uint8_t> &leaves);
+	/**
+	 * Replace leaves, grow the tree if needed
+	 * @param[in]	firstLeaf	index of the first leaf to replace
+	 * @param[in]	leaves		hashSize bytes per leaf
+	 * @return false if the previous leaves, or the nodes read to update the tree, do not match the root: the tree is
+	 * not valid anymore
+	 */
+	bool update(size_t firstLeaf, const std::vector<uint8_t> &leaves);
+	/**
+	 * @param[in]	firstLeaf	index of the first leaf to check
+	 * @param[in]	leaves		hashSize bytes per leaf, the ones after the last leaf of the tree must be zeros
+	 * @return true if the tree is valid and the given leaves are the ones the root was computed from
+	 */
+	bool verify(size_t firstLeaf, std::vector<uint8_t> leaves);
+	/**
+	 * Write the updated nodes to the file, to be called before the root is written in the file header
+	 *
+	 * @throw a EvfsException if the file cannot be written
+	 */
+	void flush();
+	/**
+	 * Drop the undo log, to be called once the root is written in the file header
+	 *
+	 * @throw a EvfsException if the undo log cannot be truncated
+	 */
+	void commit();
+	/**
+	 * Write the updated nodes and sync the file holding the tree nodes
+	 * @return 0 on success, as bctbx_file_sync
+	 *
+	 * @throw a EvfsException if the file cannot be written
+	 */
+	int sync();
+
+	bool valid() const noexcept;
+	uint8_t depthGet() const noexcept;
+	const std::vector<uint8_t> &rootGet() const noexcept;
+
+	/**
+	 * Compute the leaf of a chunk
+	 * @param[in]	chunkIndex			index of the chunk
+	 * @param[in]	chunkHeader			the chunk header, as stored in the file
+	 * @param[in]	chunkHeaderSize		size of the chunk header
+	 * @param[out]	leaf				hashSize bytes
+	 */
+	static void leafHash(uint32_t chunkIndex, const uint8_t *chunkHeader, size_t chunkHeaderSize, uint8_t *leaf);
+
+private:
+	const std::string mFilename;
+	VfsCounters *mCounters;
+	const std::string mUndoFilename;
+	bctbx_vfs_file_t *mFp;
+	bctbx_vfs_file_t *mUndoFp;   /**< opened when the first node is logged */
+	size_t mUndoSize;            /**< size of the undo log */
+	std::set<size_t> mUndoNodes; /**< nodes logged since the last commit */
+	bool mReadOnly;
+	bool mValid;
+	uint8_t mDepth;
+	std::vector<uint8_t> mRoot;
+	std::map<size_t, std::vector<uint8_t>> mDirtyNodes;         /**< nodes updated but not written yet, by index */
+	mutable LruCache<size_t, std::vector<uint8_t>> mNodeCache; /**< nodes as they are in the file, by index */
+
+	/**
+	 * Read nodes, the ones after the end of the file are zeros
+	 */
+	std::vector<uint8_t> readNodes(size_t firstNode, size_t count) const;
+	/**
+	 * Write nodes directly in the file
+	 */
+	void writeNodes(size_t firstNode, const uint8_t *nodes, size_t count);
+	/**
+	 * Write the updated nodes, the nodes overwritten are logged first if logged is true
+	 */
+	void flushNodes(bool logged);
+	/**
+	 * Append to the undo log the nodes in the file not logged since the last commit
+	 */
+	void undoLog(size_t firstNode, size_t count);
+	/**
+	 * Restore the nodes from the undo log, in memory only if the tree is read only
+	 * @return false if there is no undo log
+	 */
+	bool undoRestore();
+	/**
+	 * Update nodes in memory, they are written by flush()
+	 */
+	void storeNodes(size_t firstNode, const uint8_t *nodes, size_t count);
+	/**
+	 * Double the number of leaves: the current tree becomes the left child of the new root
+	 */
+	void grow();
+	/**
+	 * Compute the root from consecutive leaves and the nodes read from the file
+	 * @param[in]		firstLeaf		index of the first leaf
+	 * @param[in]		leaves			the leaves to compute the root from
+	 * @param[in,out]	previousLeaves	nullptr or the leaves replaced by the given ones: the nodes computed from the
+	 * 									given leaves are then written to the file and previousLeaves is replaced by
+	 * 									the root computed from it
+	 * @return the root computed from the given leaves
+	 */
+	std::vector<uint8_t> climb(size_t firstLeaf, std::vector<uint8_t> leaves, std::vector<uint8_t> *previousLeaves);
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_INTEGRITY_TREE_HH
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_LRU_CACHE_HH
+#define BCTBX_VFS_LRU_CACHE_HH
+
+#include <functional>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+
+namespace bctoolbox {
+
+/**
+ * A bounded least recently used cache
+ * Each entry has a cost (default is 1), the sum of the costs of the stored entries never exceeds the capacity.
+ * A capacity of 0 disables the cache: nothing is ever stored.
+ * An optional wipe function is called on each value leaving the cache (eviction, erase, clear, destruction) so
+ * sensitive data can be cleaned.
+ *
+ * This class is not thread safe.
+ */
+template <typename Key, typename Value>
+class LruCache {
+public:
+	using WipeFunction = std::function<void(Value &)>;
+
+	LruCache(size_t capacity = 0, const WipeFunction &wipe = nullptr) : mCapacity(capacity), mCost(0), mWipe(wipe) {
+	}
+	~LruCache() {
+		clear();
+	}
+	LruCache(const LruCache &) = delete;
+	LruCache &operator=(const LruCache &) = delete;
+
+	/**
+	 * Look for an entry in the cache, on success it becomes the most recently used
+	 * @param[in]	key	the entry key
+	 * @return a pointer to the cached value, nullptr if not found. The pointer is valid until the next non const call
+	 */
+	Value *get(const Key &key) {
+		auto it = mIndex.find(key);
+		if (it == mIndex.end()) {
+			return nullptr;
+		}
+		mEntries.splice(mEntries.begin(), mEntries, it->second); // move it to front
+		return &(it->second->value);
+	}
+
+	/**
+	 * Check if an entry is in the cache, without modifying its position
+	 */
+	bool contains(const Key &key) const {
+		return mIndex.find(key) != mIndex.end();
+	}
+
+	/**
+	 * Insert or replace an entry, least recently used entries are evicted if needed
+	 * @param[in]	key		the entry key
+	 * @param[in]	value	the value to store
+	 * @param[in]	cost	the cost of this entry, an entry more expensive than the cache capacity is not stored
+	 * @return a pointer to the cached value, nullptr if it was not stored. The pointer is valid until the next non
+	 * const call
+	 */
+	Value *insert(const Key &key, Value &&value, size_t cost = 1) {
+		erase(key);
+		if (cost > mCapacity) {
+			if (mWipe) mWipe(value);
+			return nullptr;
+		}
+		shrink(mCapacity - cost);
+		mEntries.push_front(Entry{key, std::move(value), cost});
+		mIndex[key] = mEntries.begin();
+		mCost += cost;
+		return &(mEntries.front().value);
+	}
+
+	/**
+	 * Remove an entry from the cache, if present
+	 */
+	void erase(const Key &key) {
+		auto it = mIndex.find(key);
+		if (it != mIndex.end()) {
+			remove(it->second);
+			mIndex.erase(it);
+		}
+	}
+
+	/**
+	 * Remove all entries matching the given predicate
+	 * @param[in]	predicate	a function called on each key, return true to remove the entry
+	 */
+	void eraseIf(const std::function<bool(const Key &)> &predicate) {
+		for (auto it = mEntries.begin(); it != mEntries.end();) {
+			auto current = it++;
+			if (predicate(current->key)) {
+				mIndex.erase(current->key);
+				remove(current);
+			}
+		}
+	}
+
+	/**
+	 * Remove all entries
+	 */
+	void clear() {
+		shrink(0);
+	}
+
+	/**
+	 * Set the capacity, evict entries if needed. 0 disables the cache.
+	 */
+	void capacitySet(size_t capacity) {
+		mCapacity = capacity;
+		shrink(mCapacity);
+	}
+	size_t capacityGet() const noexcept {
+		return mCapacity;
+	}
+
+	/**
+	 * @return the sum of the costs of all stored entries
+	 */
+	size_t costGet() const noexcept {
+		return mCost;
+	}
+
+	/**
+	 * @return the number of stored entries
+	 */
+	size_t size() const noexcept {
+		return mEntries.size();
+	}
+
+private:
+	struct Entry {
+		Key key;
+		Value value;
+		size_t cost;
+	};
+	using EntryIterator = typename std::list<Entry>::iterator;
+
+	std::list<Entry> mEntries; /**< entries, the most recently used first */
+	std::unordered_map<Key, EntryIterator> mIndex;
+	size_t mCapacity;
+	size_t mCost; /**< sum of the cost of stored entries */
+	WipeFunction mWipe;
+
+	/* wipe and remove an entry from the list, the index must be updated by caller */
+	void remove(EntryIterator it) {
+		if (mWipe) mWipe(it->value);
+		mCost -= it->cost;
+		mEntries.erase(it);
+	}
+
+	/* evict least recently used entries until the total cost is at most the given one */
+	void shrink(size_t cost) {
+		while (mCost > cost && !mEntries.empty()) {
+			auto last = std::prev(mEntries.end());
+			mIndex.erase(last->key);
+			remove(last);
+		}
+	}
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_LRU_CACHE_HH
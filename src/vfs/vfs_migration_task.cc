@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_migration_task.hh"
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/logging.h"
+#include "bctoolbox/vfs_standard.h"
+#include "vfs_counters.hh"
+#include "vfs_encryption_module.hh"
+#include "vfs_worker_pool.hh"
+#include <algorithm>
+#include <map>
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+using namespace bctoolbox;
+
+namespace {
+struct Registry {
+	std::mutex mutex; /**< always locked before the mutex of a task */
+	std::map<std::string, std::shared_ptr<VfsMigrationTask>> tasks;
+};
+
+Registry &registry() {
+	// tasks use the worker pool, make sure it is created first so it is destroyed after them at exit
+	VfsWorkerPool::get();
+	static Registry registry;
+	return registry;
+}
+} // namespace
+
+std::shared_ptr<VfsMigrationTask> VfsMigrationTask::acquire(const std::string &filename,
+                                                            const std::shared_ptr<VfsEncryptionModule> &module,
+                                                            const std::vector<uint8_t> &secretMaterial,
+                                                            size_t chunkSize,
+                                                            bool sizeJournal,
+                                                            const EncryptedVfsMigrationProgressCb &progress) {
+	auto &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	auto it = reg.tasks.find(filename);
+	if (it == reg.tasks.end()) {
+		it = reg.tasks
+		         .emplace(filename, std::make_shared<VfsMigrationTask>(filename, module, secretMaterial, chunkSize,
+		                                                               sizeJournal, progress))
+		         .first;
+	} else if (progress != nullptr) {
+		std::lock_guard<std::mutex> taskLock(it->second->mMutex);
+		it->second->mProgress = progress;
+	}
+	auto task = it->second;
+	{
+		std::lock_guard<std::mutex> taskLock(task->mMutex);
+		task->mUsers++;
+	}
+	task->start();
+	return task;
+}
+
+std::string VfsMigrationTask::commit(const std::string &filename) {
+	auto &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	auto it = reg.tasks.find(filename);
+	if (it == reg.tasks.end()) {
+		return std::string{};
+	}
+	auto task = it->second;
+	{
+		std::lock_guard<std::mutex> taskLock(task->mMutex);
+		if (!task->mCompleted || task->mUsers > 0) {
+			return std::string{};
+		}
+	}
+	task->stop();
+	// close the files so the caller can rename them
+	task->mTarget.reset();
+	bctbx_file_close(task->mPlainFp);
+	task->mPlainFp = nullptr;
+	reg.tasks.erase(it);
+	return task->mTmpFilename;
+}
+
+bool VfsMigrationTask::wait(const std::string &filename) {
+	std::shared_ptr<VfsMigrationTask> task;
+	{
+		auto &reg = registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		auto it = reg.tasks.find(filename);
+		if (it == reg.tasks.end()) {
+			return false;
+		}
+		task = it->second;
+	}
+	std::unique_lock<std::mutex> lock(task->mMutex);
+	task->mCondition.wait(lock, [&task] { return task->mCompleted || task->mFailed || task->mStopping; });
+	return task->mCompleted;
+}
+
+void VfsMigrationTask::stopAll() {
+	auto &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	for (auto it = reg.tasks.begin(); it != reg.tasks.end();) {
+		auto current = it++;
+		current->second->stop();
+		std::unique_lock<std::mutex> taskLock(current->second->mMutex);
+		if (current->second->mUsers == 0) {
+			taskLock.unlock();
+			reg.tasks.erase(current);
+		}
+	}
+}
+
+VfsMigrationTask::VfsMigrationTask(const std::string &filename,
+                                   const std::shared_ptr<VfsEncryptionModule> &module,
+                                   const std::vector<uint8_t> &secretMaterial,
+                                   size_t chunkSize,
+                                   bool sizeJournal,
+                                   const EncryptedVfsMigrationProgressCb &progress)
+    : mFilename(filename), mTmpFilename(filename + ".evfs_tmp"), mProgress(progress), mSecretMaterial(secretMaterial),
+      mPlainFp(nullptr), mStopping(false), mCompleted(false), mFailed(false), mUsers(0), mMigratedChunks(0),
+      mMigratedSize(0) {
+	mPlainFp = bctbx_file_open2(bctbx_vfs_get_standard(), mFilename.data(), O_RDONLY);
+	if (mPlainFp == nullptr) {
+		throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not open it";
+	}
+	auto tmpFp = bctbx_file_open2(bctbx_vfs_get_standard(), mTmpFilename.data(), O_RDWR | O_CREAT);
+	if (tmpFp == nullptr) {
+		bctbx_file_close(mPlainFp);
+		throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not open temporary file "
+		                     << mTmpFilename;
+	}
+	mTarget = std::unique_ptr<VfsEncryption>(new VfsEncryption(tmpFp, mTmpFilename, module, chunkSize));
+	mTarget->sizeJournalSet(sizeJournal);
+	try {
+		// resume now, before the plain file can be modified
+		mMigratedChunks = mTarget->migrationResume(mSecretMaterial);
+		mMigratedSize = static_cast<uint64_t>(mMigratedChunks) * mTarget->mChunkSize;
+	} catch (...) {
+		mTarget.reset();
+		bctbx_file_close(mPlainFp);
+		bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+		throw;
+	}
+	if (mMigratedChunks > 0) {
+		BCTBX_SLOGI << "Encrypted VFS: resume migration of " << mFilename << " from offset " << mMigratedSize;
+	}
+}
+
+VfsMigrationTask::~VfsMigrationTask() {
+	stop();
+	mTarget.reset();
+	if (mPlainFp != nullptr) {
+		bctbx_file_close(mPlainFp);
+	}
+	bctbx_clean(mSecretMaterial.data(), mSecretMaterial.size());
+}
+
+void VfsMigrationTask::release() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mUsers > 0) mUsers--;
+}
+
+void VfsMigrationTask::modify(uint64_t offset, const std::function<void()> &modification) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	uint32_t chunk = mTarget->getChunkIndex(offset);
+	// batches already read from this chunk onward must not be used
+	for (auto &batch : mPendingBatches) {
+		if (batch.endChunk > chunk) {
+			batch.stale = true;
+		}
+	}
+	// discard the migrated data from this chunk, before the plain file is modified so a crash cannot leave in the
+	// temporary file any data not matching the plain file
+	if (offset < mMigratedSize) {
+		mMigratedChunks = std::min(mMigratedChunks, chunk);
+		mMigratedSize = static_cast<uint64_t>(mMigratedChunks) * mTarget->mChunkSize;
+		if (mTarget->pFileStd != nullptr) {
+			bctbx_file_truncate(mTarget->pFileStd, mTarget->getChunkOffset(mMigratedChunks));
+			bctbx_file_sync(mTarget->pFileStd);
+		}
+	}
+	mCompleted = false;
+	modification();
+	mCondition.notify_all();
+}
+
+void VfsMigrationTask::start() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mThread.joinable() && !mFailed && !mStopping) { // already running
+			return;
+		}
+	}
+	if (mThread.joinable()) { // the thread stopped or failed
+		mThread.join();
+	}
+	std::lock_guard<std::mutex> lock(mMutex);
+	mStopping = false;
+	mFailed = false;
+	mThread = std::thread(&VfsMigrationTask::run, this);
+}
+
+void VfsMigrationTask::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mCondition.notify_all();
+	if (mThread.joinable()) {
+		mThread.join();
+	}
+}
+
+void VfsMigrationTask::run() {
+	// any exception left escaping the thread would terminate the process: report them all as a failure
+	auto fail = [this]() {
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFailed = true;
+		mCondition.notify_all();
+	};
+	try {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				// once completed, wait for a modification of the plain file
+				mCondition.wait(lock, [this] { return mStopping || !mCompleted; });
+				if (mStopping) {
+					return;
+				}
+			}
+			if (migrate()) {
+				BCTBX_SLOGI << "Encrypted VFS: background migration of " << mFilename << " completed";
+			}
+		}
+	} catch (BctbxException const &e) {
+		BCTBX_SLOGE << "Encrypted VFS: background migration of " << mFilename << " failed: " << e;
+		fail();
+	} catch (std::exception const &e) {
+		BCTBX_SLOGE << "Encrypted VFS: background migration of " << mFilename << " failed: " << e.what();
+		fail();
+	} catch (...) {
+		BCTBX_SLOGE << "Encrypted VFS: background migration of " << mFilename << " failed: unknown exception";
+		fail();
+	}
+}
+
+/**
+ * Migrate from the first chunk not migrated yet until the end of the plain file
+ * @return true if the migration is completed
+ */
+bool VfsMigrationTask::migrate() {
+	uint32_t firstChunk;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		firstChunk = mMigratedChunks;
+		mPendingBatches.clear();
+	}
+
+	bool endReached = mTarget->migrateChunks(
+	    firstChunk,
+	    [this](uint8_t *buffer, size_t size, uint64_t offset) { return readPlain(buffer, size, offset); },
+	    [this](const uint8_t *buffer, size_t size, uint32_t chunk) { return writeRaw(buffer, size, chunk); },
+	    [this](uint64_t migrated) {
+		    EncryptedVfsMigrationProgressCb progress;
+		    uint64_t total;
+		    {
+			    std::lock_guard<std::mutex> lock(mMutex);
+			    progress = mProgress;
+			    total = static_cast<uint64_t>(std::max(bctbx_file_size(mPlainFp), ssize_t(0)));
+		    }
+		    if (progress) progress(mFilename, std::min(migrated, total), total);
+	    });
+	if (!endReached) { // stopped or the plain file was modified
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto plainSize = bctbx_file_size(mPlainFp);
+	if (mStopping || plainSize < 0 || mMigratedSize != static_cast<uint64_t>(plainSize)) {
+		return false; // the plain file was modified since it was read, go on
+	}
+	// write the header with the final file size and drop anything after the last chunk
+	mTarget->mFileSize = mMigratedSize;
+	mTarget->writeHeader();
+	bctbx_file_truncate(mTarget->pFileStd, static_cast<int64_t>(mTarget->rawFileSizeGet()));
+	bctbx_file_sync(mTarget->pFileStd);
+	mCompleted = true;
+	mCondition.notify_all();
+	return true;
+}
+
+ssize_t VfsMigrationTask::readPlain(uint8_t *buffer, size_t size, uint64_t offset) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mStopping) {
+		return 0;
+	}
+	auto readSize = bctbx_file_read(mPlainFp, buffer, size, static_cast<off_t>(offset));
+	if (readSize >= 0) {
+		mTarget->mCounters->add(VfsCounters::rawBytesRead, static_cast<uint64_t>(readSize));
+		uint32_t firstChunk = mTarget->getChunkIndex(offset);
+		uint32_t endChunk =
+		    mTarget->getChunkIndex(offset + static_cast<uint64_t>(readSize) + mTarget->mChunkSize - 1);
+		mPendingBatches.push_back(PendingBatch{firstChunk, endChunk, false});
+	}
+	return readSize;
+}
+
+bool VfsMigrationTask::writeRaw(const uint8_t *buffer, size_t size, uint32_t firstChunk) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mStopping || mPendingBatches.empty()) {
+		return false;
+	}
+	auto batch = mPendingBatches.front();
+	mPendingBatches.pop_front();
+	if (batch.stale || batch.firstChunk != firstChunk || firstChunk != mMigratedChunks) {
+		return false; // the plain file was modified in the meantime
+	}
+
+	if (mTarget->rawWrite(buffer, size, mTarget->getChunkOffset(firstChunk)) - size != 0) {
+		throw EVFS_EXCEPTION << "Unable to migrate plain file " << mFilename << ". Could not write to temporary file "
+		                     << mTmpFilename;
+	}
+	// make sure everything but this batch is on disk if we resume after a crash
+	bctbx_file_sync(mTarget->pFileStd);
+
+	const size_t rawChunkSize = mTarget->rawChunkSizeGet();
+	const size_t completeChunks = size / rawChunkSize;
+	const size_t tailSize = size % rawChunkSize; // the last chunk of the plain file may be incomplete
+	mMigratedChunks = firstChunk + static_cast<uint32_t>(completeChunks);
+	mMigratedSize = static_cast<uint64_t>(mMigratedChunks) * mTarget->mChunkSize +
+	                ((tailSize > 0) ? tailSize - mTarget->m_module->getChunkHeaderSize() : 0);
+	return true;
+}
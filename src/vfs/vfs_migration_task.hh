@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_MIGRATION_TASK_HH
+#define BCTBX_VFS_MIGRATION_TASK_HH
+
+#include "bctoolbox/vfs_encrypted.hh"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace bctoolbox {
+
+/**
+ * Background migration of a plain file to an encrypted one.
+ *
+ * A thread encrypts the plain file into a temporary file (filename suffixed by .evfs_tmp) while the plain file is still
+ * used. Modifications of the plain file must go through modify() so the already migrated part they touch is
+ * discarded and migrated again. The temporary file is synced after each batch so an interrupted migration is resumed
+ * from it, even by another process.
+ * Once completed and when no handle on the plain file is open, commit() gives the temporary file to the caller which
+ * replaces the plain file with it.
+ *
+ * Tasks are registered by filename: there is at most one task per file in the process.
+ */
+class VfsMigrationTask {
+public:
+	/**
+	 * Get the task migrating a file, create it or restart it if needed, and register the caller as a user of the plain
+	 * file. The caller must call release() when it closes the plain file.
+	 *
+	 * @param[in]	filename		the plain file
+	 * @param[in]	module			the encryption module to use when starting a new migration, secret material set
+	 * @param[in]	secretMaterial	the secret material, used to resume a previous migration
+	 * @param[in]	chunkSize		chunk size of the encrypted file
+	 * @param[in]	sizeJournal		give a size journal to the encrypted file, see VfsEncryption::sizeJournalSet()
+	 * @param[in]	progress		progress callback, called from the task thread, may be nullptr
+	 *
+	 * @throw a EvfsException if the temporary file cannot be opened
+	 */
+	static std::shared_ptr<VfsMigrationTask> acquire(const std::string &filename,
+	                                                 const std::shared_ptr<VfsEncryptionModule> &module,
+	                                                 const std::vector<uint8_t> &secretMaterial,
+	                                                 size_t chunkSize,
+	                                                 bool sizeJournal,
+	                                                 const EncryptedVfsMigrationProgressCb &progress);
+
+	/**
+	 * If the migration of this file is completed and nobody uses the plain file, stop and unregister the task.
+	 * The caller must then replace the plain file with the temporary one.
+	 * @return the temporary file name, an empty string if the migration cannot be committed
+	 */
+	static std::string commit(const std::string &filename);
+
+	/**
+	 * Wait for the migration of a file to be completed
+	 * @return false if there is no migration for this file, or it failed
+	 */
+	static bool wait(const std::string &filename);
+
+	/**
+	 * Stop all tasks, the ones with no user are unregistered
+	 */
+	static void stopAll();
+
+	/**
+	 * The caller does not use the plain file anymore
+	 */
+	void release();
+
+	/**
+	 * Run a modification of the plain file starting at the given offset
+	 * The migrated part of the file from this offset is discarded before running the modification
+	 */
+	void modify(uint64_t offset, const std::function<void()> &modification);
+
+	VfsMigrationTask(const std::string &filename,
+	                 const std::shared_ptr<VfsEncryptionModule> &module,
+	                 const std::vector<uint8_t> &secretMaterial,
+	                 size_t chunkSize,
+	                 bool sizeJournal,
+	                 const EncryptedVfsMigrationProgressCb &progress);
+	~VfsMigrationTask();
+	VfsMigrationTask(const VfsMigrationTask &) = delete;
+	VfsMigrationTask &operator=(const VfsMigrationTask &) = delete;
+
+private:
+	/** a batch of plain data read but not written yet in the temporary file */
+	struct PendingBatch {
+		uint32_t firstChunk;
+		uint32_t endChunk; /**< index of the chunk following this batch */
+		bool stale;        /**< the plain file was modified in this batch range after it was read */
+	};
+
+	const std::string mFilename;
+	const std::string mTmpFilename;
+	EncryptedVfsMigrationProgressCb mProgress;
+	std::vector<uint8_t> mSecretMaterial;
+	bctbx_vfs_file_t *mPlainFp;             /**< the plain file, opened read only */
+	std::unique_ptr<VfsEncryption> mTarget; /**< the encrypted image, stored in the temporary file */
+
+	std::mutex mMutex; /**< protects all members below and any access to the plain and temporary files */
+	std::condition_variable mCondition;
+	std::thread mThread;
+	bool mStopping;                        /**< the thread shall stop */
+	bool mCompleted;                       /**< the temporary file holds the whole plain file */
+	bool mFailed;                          /**< the migration stopped on an error */
+	size_t mUsers;                         /**< number of open handles on the plain file */
+	uint32_t mMigratedChunks;              /**< number of complete chunks in the temporary file */
+	uint64_t mMigratedSize;                /**< size of plain data already in the temporary file */
+	std::deque<PendingBatch> mPendingBatches; /**< batches read from the plain file, not written yet */
+
+	void start();
+	void stop();
+	void run();
+	bool migrate();
+	ssize_t readPlain(uint8_t *buffer, size_t size, uint64_t offset);
+	bool writeRaw(const uint8_t *buffer, size_t size, uint32_t firstChunk);
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_MIGRATION_TASK_HH
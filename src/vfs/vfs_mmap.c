@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bctoolbox/vfs_mmap.h"
+#include "bctoolbox/defs.h"
+#include "bctoolbox/logging.h"
+#include "bctoolbox/port.h"
+#include "bctoolbox/vfs.h"
+#include "bctoolbox/vfs_standard.h"
+#include "vfs_mmap_private.h"
+#include <errno.h>
+#include <sys/types.h>
+
+/* the mapping is replaced when the file grows, what cannot be mapped is read at its offset */
+#if defined(HAVE_MMAP) && defined(HAVE_PREAD)
+#define BCTBX_VFS_MMAP 1
+#endif
+
+#ifdef BCTBX_VFS_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* User data for the files mapped by the mmap vfs */
+typedef struct bctbx_vfs_mmap_t bctbx_vfs_mmap_t;
+struct bctbx_vfs_mmap_t {
+	int fd;              /* File descriptor, kept to serve what is not mapped and to remap */
+	bctbx_mutex_t mutex; /* Protects the mapping */
+	uint8_t *map;        /* Start of the mapping, NULL if nothing is mapped */
+	size_t mapSize;      /* Size of the mapping, the file size when it was mapped */
+	int borrowed;        /* Number of views borrowed on the mapping: it cannot be replaced while this is not 0 */
+};
+
+/**
+ * Replace the mapping by one covering the whole file, when the file grew since it was mapped.
+ * Must be called with the mutex locked.
+ * @return 0 on success, even when the mapping could not be replaced, -errno if the file size cannot be read
+ */
+static int bcMapGrow(bctbx_vfs_mmap_t *ctx) {
+	struct stat sStat;
+	if (fstat(ctx->fd, &sStat) != 0) {
+		return -errno;
+	}
+	size_t size = (size_t)sStat.st_size;
+	if (size <= ctx->mapSize || ctx->borrowed > 0) { // borrowed views point into the current mapping, keep it
+		return 0;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+	if (map == MAP_FAILED) {
+		bctbx_warning("bctbx mmap vfs: cannot map %zu bytes, error %s", size, strerror(errno));
+		return 0;
+	}
+	if (ctx->map != NULL) {
+		munmap(ctx->map, ctx->mapSize);
+	}
+	ctx->map = (uint8_t *)map;
+	ctx->mapSize = size;
+	return 0;
+}
+
+/**
+ * Closes file by unmapping it and closing the associated file descriptor.
+ * @param  pFile 	bctbx_vfs_file_t File handle pointer.
+ * @return       	BCTBX_VFS_OK if successful, -errno otherwise.
+ */
+static int bcMmapClose(bctbx_vfs_file_t *pFile) {
+	int ret;
+	if (pFile == NULL || pFile->pUserData == NULL) return BCTBX_VFS_ERROR;
+	bctbx_vfs_mmap_t *ctx = (bctbx_vfs_mmap_t *)pFile->pUserData;
+	if (ctx->borrowed > 0) {
+		bctbx_warning("bctbx mmap vfs: file closed with %d views still borrowed", ctx->borrowed);
+	}
+	if (ctx->map != NULL) {
+		munmap(ctx->map, ctx->mapSize);
+	}
+	ret = close(ctx->fd);
+	if (!ret) {
+		ret = BCTBX_VFS_OK;
+	} else {
+		ret = -errno;
+	}
+	bctbx_mutex_destroy(&ctx->mutex);
+	bctbx_free(pFile->pUserData);
+	return ret;
+}
+
+/**
+ * Copy count bytes from the mapping, starting at offset.
+ * Reads ending after the mapping check if the file grew and remap it. What is still not mapped is read from the file.
+ * The copy is done without the lock, the mapping is pinned meanwhile as for a borrowed view.
+ * @param  pFile  File handle pointer.
+ * @param  buf    buffer to write the read bytes to.
+ * @param  count  number of bytes to read
+ * @param  offset file offset where to start reading
+ * @return -errno if erroneous read, number of bytes read on success, BCTBX_VFS_ERROR otherwise
+ */
+static ssize_t bcMmapRead(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t offset) {
+	size_t mapped = 0;
+	if (pFile == NULL || pFile->pUserData == NULL || offset < 0) return BCTBX_VFS_ERROR;
+	bctbx_vfs_mmap_t *ctx = (bctbx_vfs_mmap_t *)pFile->pUserData;
+
+	const uint8_t *map = NULL;
+	bctbx_mutex_lock(&ctx->mutex);
+	if ((uint64_t)offset + count > ctx->mapSize) {
+		int ret = bcMapGrow(ctx);
+		if (ret < 0) {
+			bctbx_mutex_unlock(&ctx->mutex);
+			return ret;
+		}
+	}
+	if ((uint64_t)offset < ctx->mapSize) {
+		mapped = ctx->mapSize - (size_t)offset;
+		if (mapped > count) mapped = count;
+		map = ctx->map;
+		ctx->borrowed++; // pin the mapping: it is not replaced while copying from it without the lock
+	}
+	bctbx_mutex_unlock(&ctx->mutex);
+
+	if (map != NULL) {
+		memcpy(buf, map + offset, mapped);
+		bctbx_mutex_lock(&ctx->mutex);
+		ctx->borrowed--;
+		bctbx_mutex_unlock(&ctx->mutex);
+	}
+
+	if (mapped == count) {
+		return (ssize_t)mapped;
+	}
+	// the mapping could not be replaced: read the rest from the file
+	ssize_t nRead = pread(ctx->fd, (uint8_t *)buf + mapped, count - mapped, offset + (off_t)mapped);
+	if (nRead < 0) {
+		return (mapped > 0) ? (ssize_t)mapped : -errno;
+	}
+	return (ssize_t)mapped + nRead;
+}
+
+/**
+ * Files opened by the mmap vfs are read only
+ * @return -EBADF
+ */
+static ssize_t bcMmapWrite(BCTBX_UNUSED(bctbx_vfs_file_t *pFile),
+                           BCTBX_UNUSED(const void *buf),
+                           BCTBX_UNUSED(size_t count),
+                           BCTBX_UNUSED(off_t offset)) {
+	return -EBADF;
+}
+
+/**
+ * Files opened by the mmap vfs are read only
+ * @return -EBADF
+ */
+static int bcMmapTruncate(BCTBX_UNUSED(bctbx_vfs_file_t *pFile), BCTBX_UNUSED(int64_t new_size)) {
+	return -EBADF;
+}
+
+/**
+ * Returns the file size associated with the file handle pFile.
+ * @param pFile File handle pointer.
+ * @return -errno if an error occurred, file size otherwise (can be 0).
+ */
+static ssize_t bcMmapFileSize(bctbx_vfs_file_t *pFile) {
+	struct stat sStat;
+	if (pFile == NULL || pFile->pUserData == NULL) return BCTBX_VFS_ERROR;
+	bctbx_vfs_mmap_t *ctx = (bctbx_vfs_mmap_t *)pFile->pUserData;
+
+	if (fstat(ctx->fd, &sStat) != 0) {
+		return -errno;
+	}
+	return (ssize_t)sStat.st_size;
+}
+
+/**
+ * Nothing to sync on a read only file
+ * @return BCTBX_VFS_OK
+ */
+static int bcMmapSync(BCTBX_UNUSED(bctbx_vfs_file_t *pFile)) {
+	return BCTBX_VFS_OK;
+}
+
+static const bctbx_io_methods_t bcMmapIo = {
+    bcMmapClose,      /* pFuncClose */
+    bcMmapRead,       /* pFuncRead */
+    bcMmapWrite,      /* pFuncWrite */
+    bcMmapTruncate,   /* pFuncTruncate */
+    bcMmapFileSize,   /* pFuncFileSize */
+    bcMmapSync, NULL, /* use the generic implementation of getnxt line */
+    NULL,             /* pFuncIsEncrypted -> no function so we will return false */
+    NULL,             /* pFuncReadv: generic implementation, one copy from the mapping per buffer */
+    NULL              /* pFuncWritev */
+};
+#endif /* BCTBX_VFS_MMAP */
+
+/**
+ * Opens the file fName: read only opens map the file, others are handed over to the standard vfs.
+ * @param  pVfs    		Pointer to bctx_vfs VFS.
+ * @param  pFile   		File handle pointer.
+ * @param  fName   		Absolute path filename.
+ * @param  openFlags    Flags to use when opening the file.
+ * @return         		-errno or BCTBX_VFS_ERROR if an error occurs, BCTBX_VFS_OK otherwise.
+ */
+static int bcMmapOpen(bctbx_vfs_t *pVfs, bctbx_vfs_file_t *pFile, const char *fName, int openFlags) {
+	if (pFile == NULL || fName == NULL) {
+		return BCTBX_VFS_ERROR;
+	}
+#ifdef BCTBX_VFS_MMAP
+	if ((openFlags & O_ACCMODE) == O_RDONLY) {
+		struct stat sStat;
+		bctbx_vfs_mmap_t *userData = (bctbx_vfs_mmap_t *)bctbx_malloc0(sizeof(bctbx_vfs_mmap_t));
+		userData->fd = open(fName, openFlags, S_IRUSR | S_IWUSR);
+		if (userData->fd == -1) {
+			bctbx_free(userData);
+			return -errno;
+		}
+		if (fstat(userData->fd, &sStat) != 0) {
+			int err = errno;
+			close(userData->fd);
+			bctbx_free(userData);
+			return -err;
+		}
+		// an empty file cannot be mapped: it will be on the first read after it grew
+		if (S_ISREG(sStat.st_mode) && sStat.st_size > 0) {
+			void *map = mmap(NULL, (size_t)sStat.st_size, PROT_READ, MAP_SHARED, userData->fd, 0);
+			if (map != MAP_FAILED) {
+				userData->map = (uint8_t *)map;
+				userData->mapSize = (size_t)sStat.st_size;
+			} else {
+				bctbx_warning("bctbx mmap vfs: cannot map file %s, error %s", fName, strerror(errno));
+			}
+		}
+		bctbx_mutex_init(&userData->mutex, NULL);
+
+		pFile->pMethods = &bcMmapIo;
+		pFile->pUserData = (void *)userData;
+		return BCTBX_VFS_OK;
+	}
+#endif
+	return bcStandardVfs.pFuncOpen(pVfs, pFile, fName, openFlags);
+}
+
+bctbx_vfs_t bcMmapVfs = {
+    "bctbx_mmap_vfs", /* vfsName */
+    bcMmapOpen,       /*xOpen */
+};
+
+ssize_t bctbx_file_view_borrow(bctbx_vfs_file_t *pFile, off_t offset, size_t count, const void **view) {
+#ifdef BCTBX_VFS_MMAP
+	if (pFile == NULL || view == NULL || offset < 0 || pFile->pMethods != &bcMmapIo || pFile->pUserData == NULL) {
+		return BCTBX_VFS_ERROR;
+	}
+	bctbx_vfs_mmap_t *ctx = (bctbx_vfs_mmap_t *)pFile->pUserData;
+
+	bctbx_mutex_lock(&ctx->mutex);
+	if ((uint64_t)offset + count > ctx->mapSize && bcMapGrow(ctx) < 0) {
+		bctbx_mutex_unlock(&ctx->mutex);
+		return BCTBX_VFS_ERROR;
+	}
+	size_t available = 0;
+	if ((uint64_t)offset < ctx->mapSize) {
+		available = ctx->mapSize - (size_t)offset;
+		if (available > count) available = count;
+	}
+	*view = (available > 0) ? ctx->map + offset : NULL;
+	if (available > 0) {
+		ctx->borrowed++;
+	}
+	bctbx_mutex_unlock(&ctx->mutex);
+	return (ssize_t)available;
+#else
+	(void)pFile;
+	(void)offset;
+	(void)count;
+	(void)view;
+	return BCTBX_VFS_ERROR;
+#endif
+}
+
+void bctbx_file_view_release(bctbx_vfs_file_t *pFile, const void *view) {
+#ifdef BCTBX_VFS_MMAP
+	if (pFile == NULL || view == NULL || pFile->pMethods != &bcMmapIo || pFile->pUserData == NULL) {
+		return;
+	}
+	bctbx_vfs_mmap_t *ctx = (bctbx_vfs_mmap_t *)pFile->pUserData;
+	bctbx_mutex_lock(&ctx->mutex);
+	if (ctx->borrowed > 0) {
+		ctx->borrowed--;
+	}
+	bctbx_mutex_unlock(&ctx->mutex);
+#else
+	(void)pFile;
+	(void)view;
+#endif
+}
+
+bool_t bctbx_vfs_mmap_is_mapped(bctbx_vfs_file_t *pFile) {
+#ifdef BCTBX_VFS_MMAP
+	return (pFile != NULL && pFile->pMethods == &bcMmapIo) ? TRUE : FALSE;
+#else
+	(void)pFile;
+	return FALSE;
+#endif
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_MMAP_PRIVATE_H
+#define BCTBX_VFS_MMAP_PRIVATE_H
+
+#include "bctoolbox/port.h"
+#include "bctoolbox/vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @param  pFile  bctbx_vfs_file_t File handle pointer.
+ * @return TRUE if the file was opened read only by the mmap VFS: its reads can then be issued concurrently.
+ */
+bool_t bctbx_vfs_mmap_is_mapped(bctbx_vfs_file_t *pFile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BCTBX_VFS_MMAP_PRIVATE_H */
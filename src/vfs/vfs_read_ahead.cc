@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_read_ahead.hh"
+#include "bctoolbox/crypto.h"
+#include "bctoolbox/logging.h"
+#include "vfs_encryption_module.hh"
+#include "vfs_worker_pool.hh"
+#include <algorithm>
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+using namespace bctoolbox;
+
+/* number of reads following each other before starting to read ahead */
+static constexpr size_t sequentialReadsThreshold = 2;
+
+static void cleanChunks(std::map<uint32_t, std::vector<uint8_t>> &chunks) {
+	for (auto &chunk : chunks) {
+		bctbx_clean(chunk.second.data(), chunk.second.size());
+	}
+	chunks.clear();
+}
+
+VfsReadAhead::VfsReadAhead(const VfsEncryption &file)
+    : mFile(file), mWindow(0), mSequentialEnd(0), mSequentialReads(0), mCancelled(false) {
+}
+
+VfsReadAhead::~VfsReadAhead() {
+	cancel();
+}
+
+void VfsReadAhead::windowSet(size_t chunks) {
+	mWindow = chunks;
+	if (mWindow == 0) {
+		cancel();
+	}
+}
+
+size_t VfsReadAhead::windowGet() const noexcept {
+	return mWindow;
+}
+
+/**
+ * Wait for the background read and keep the chunks it decrypted
+ */
+void VfsReadAhead::wait() {
+	if (!mPending.valid()) {
+		return;
+	}
+	auto chunks = mPending.get();
+	if (mCancelled) {
+		cleanChunks(chunks);
+		return;
+	}
+	for (auto &chunk : chunks) {
+		mChunks[chunk.first] = std::move(chunk.second);
+	}
+}
+
+/**
+ * Drop the chunks with index lower than firstKept
+ */
+void VfsReadAhead::drop(uint32_t firstKept) {
+	for (auto it = mChunks.begin(); it != mChunks.end() && it->first < firstKept;) {
+		bctbx_clean(it->second.data(), it->second.size());
+		it = mChunks.erase(it);
+	}
+}
+
+void VfsReadAhead::collect(uint64_t offset) {
+	if (offset != mSequentialEnd) { // seek: what was read ahead is of no use
+		cancel();
+		return;
+	}
+	wait();
+}
+
+const std::vector<uint8_t> *VfsReadAhead::find(uint32_t chunkIndex) const {
+	auto it = mChunks.find(chunkIndex);
+	return (it == mChunks.end()) ? nullptr : &it->second;
+}
+
+void VfsReadAhead::readDone(uint64_t offset, size_t size) {
+	if (mWindow == 0) {
+		return;
+	}
+	mSequentialReads = (offset == mSequentialEnd) ? mSequentialReads + 1 : 1;
+	mSequentialEnd = offset + size;
+
+	// chunks fully read are consumed
+	const size_t chunkSize = mFile.mChunkSize;
+	uint32_t firstKept = static_cast<uint32_t>(mSequentialEnd / chunkSize);
+	drop(firstKept);
+	// refill the window once half of it was consumed so each background read has a fair amount of chunks to process
+	if (mSequentialReads < sequentialReadsThreshold || mPending.valid() || mChunks.size() > mWindow / 2) {
+		return;
+	}
+
+	// read the chunks following the ones already available, up to the window
+	uint32_t firstChunk = mChunks.empty() ? firstKept : std::max(firstKept, mChunks.rbegin()->first + 1);
+	if (static_cast<uint64_t>(firstChunk) * chunkSize >= mFile.mFileSize) {
+		return;
+	}
+	size_t chunkCount = mWindow - mChunks.size();
+	mCancelled = false;
+	mPending = VfsWorkerPool::get().async([this, firstChunk, chunkCount]() {
+		Chunks chunks{};
+		if (mCancelled) { // deferred until the cancellation, without worker threads
+			return chunks;
+		}
+		try {
+			const size_t rawChunkSize = mFile.rawChunkSizeGet();
+			const size_t chunkHeaderSize = mFile.m_module->getChunkHeaderSize();
+			std::vector<uint8_t> rawData(chunkCount * rawChunkSize);
+			ssize_t readSize = mFile.rawRead(rawData.data(), rawData.size(), mFile.getChunkOffset(firstChunk));
+			for (size_t i = 0; i < chunkCount && !mCancelled; i++) {
+				size_t rawIndex = i * rawChunkSize;
+				if (readSize < 0 || rawIndex + chunkHeaderSize >= static_cast<size_t>(readSize)) {
+					break;
+				}
+				size_t chunkRawSize = std::min(rawChunkSize, static_cast<size_t>(readSize) - rawIndex);
+				std::vector<uint8_t> chunk(chunkRawSize - chunkHeaderSize);
+				mFile.chunkDecrypt(firstChunk + static_cast<uint32_t>(i), rawData.data() + rawIndex, chunkRawSize,
+				                   chunk.data());
+				chunks.emplace(firstChunk + static_cast<uint32_t>(i), std::move(chunk));
+			}
+		} catch (EvfsException const &e) {
+			// keep what was decrypted, the read of the failing chunk reports the error
+			BCTBX_SLOGD << "Encrypted VFS: read ahead of " << mFile.filenameGet() << " stopped: " << e;
+		} catch (std::exception const &e) {
+			BCTBX_SLOGD << "Encrypted VFS: read ahead of " << mFile.filenameGet() << " stopped: " << e.what();
+		}
+		return chunks;
+	});
+}
+
+void VfsReadAhead::cancel() {
+	mCancelled = true;
+	wait();
+	cleanChunks(mChunks);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_READ_AHEAD_HH
+#define BCTBX_VFS_READ_AHEAD_HH
+
+#include "bctoolbox/vfs_encrypted.hh"
+#include <atomic>
+#include <future>
+#include <map>
+
+namespace bctoolbox {
+
+/**
+ * Read ahead of an encrypted file accessed sequentially.
+ *
+ * Once a few reads followed each other, the chunks following the last read are read and decrypted in background while
+ * the caller processes the data it got. The next read collects them, a read elsewhere in the file cancels the read
+ * ahead and drops its chunks.
+ * The background read accesses the file: the owner must cancel or collect the read ahead before any access to it.
+ * It runs on the worker pool threads, without them it is deferred until the next read collects it.
+ */
+class VfsReadAhead {
+public:
+	explicit VfsReadAhead(const VfsEncryption &file);
+	~VfsReadAhead();
+	VfsReadAhead(const VfsReadAhead &) = delete;
+	VfsReadAhead &operator=(const VfsReadAhead &) = delete;
+
+	/**
+	 * Set the maximum number of chunks read ahead, 0 disables the read ahead
+	 */
+	void windowSet(size_t chunks);
+	size_t windowGet() const noexcept;
+
+	/**
+	 * Called before a read: wait for the background read if the read follows the previous one, cancel it otherwise
+	 * @param[in]	offset	plain offset of the read
+	 */
+	void collect(uint64_t offset);
+
+	/**
+	 * @return the plain chunk read ahead, nullptr if it is not available
+	 */
+	const std::vector<uint8_t> *find(uint32_t chunkIndex) const;
+
+	/**
+	 * Called after a read: detect sequential access and start reading the following chunks in background
+	 * @param[in]	offset		plain offset of the read
+	 * @param[in]	size		size actually read
+	 */
+	void readDone(uint64_t offset, size_t size);
+
+	/**
+	 * Stop the background read and drop all the chunks read ahead, called before the file is modified or accessed
+	 */
+	void cancel();
+
+private:
+	using Chunks = std::map<uint32_t, std::vector<uint8_t>>;
+
+	const VfsEncryption &mFile;
+	size_t mWindow;               /**< maximum number of chunks read ahead */
+	uint64_t mSequentialEnd;      /**< plain offset where the last read ended */
+	size_t mSequentialReads;      /**< number of reads following each other */
+	Chunks mChunks;               /**< plain chunks read ahead, indexed by chunk index */
+	std::future<Chunks> mPending; /**< the background read, invalid if there is none */
+	std::atomic<bool> mCancelled; /**< the background read shall stop */
+
+	void wait();
+	void drop(uint32_t firstKept);
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_READ_AHEAD_HH
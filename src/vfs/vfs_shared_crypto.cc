@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_shared_crypto.hh"
+#include "bctoolbox/crypto.h" // bctbx_clean
+#include "bctoolbox/crypto.hh"
+#include "vfs_counters.hh"
+#include "vfs_lru_cache.hh"
+#include <memory>
+#include <mutex>
+
+using namespace bctoolbox;
+
+/* number of requests served by the shared RNG before it is replaced by a freshly seeded one */
+static constexpr size_t rngReseedInterval = 1 << 16;
+
+namespace {
+struct SharedRNG {
+	std::mutex mutex;
+	std::unique_ptr<RNG> rng;
+	size_t requests = 0;
+};
+
+/* function local static: created after, and thus destroyed before, the crypto backend static contexts */
+SharedRNG &sharedRNG() {
+	static SharedRNG shared;
+	return shared;
+}
+
+struct DerivedKey {
+	std::vector<uint8_t> masterKey;
+	std::vector<uint8_t> key;
+};
+
+void cleanDerivedKey(DerivedKey &entry) {
+	bctbx_clean(entry.masterKey.data(), entry.masterKey.size());
+	bctbx_clean(entry.key.data(), entry.key.size());
+}
+
+struct DerivedKeyCache {
+	std::mutex mutex;
+	LruCache<std::string, DerivedKey> keys{0, cleanDerivedKey}; /**< indexed by info || salt || size */
+};
+
+DerivedKeyCache &derivedKeyCache() {
+	static DerivedKeyCache cache;
+	return cache;
+}
+
+/* compare in constant time */
+bool sameKey(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	uint8_t diff = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		diff |= a[i] ^ b[i];
+	}
+	return diff == 0;
+}
+} // namespace
+
+void VfsSharedRNG::randomize(uint8_t *buffer, size_t size) {
+	auto &shared = sharedRNG();
+	std::lock_guard<std::mutex> lock(shared.mutex);
+	if (shared.rng == nullptr || shared.requests >= rngReseedInterval) {
+		shared.rng = std::make_unique<RNG>();
+		shared.requests = 0;
+	}
+	shared.rng->randomize(buffer, size);
+	shared.requests++;
+}
+
+std::vector<uint8_t> VfsSharedRNG::randomize(size_t size) {
+	std::vector<uint8_t> buffer(size);
+	randomize(buffer.data(), buffer.size());
+	return buffer;
+}
+
+std::vector<uint8_t> VfsDerivedKeyCache::derive(const std::vector<uint8_t> &salt,
+                                                const std::vector<uint8_t> &masterKey,
+                                                const std::string &info,
+                                                size_t size,
+                                                VfsCounters *counters) {
+	auto &cache = derivedKeyCache();
+	std::string index{info};
+	index.append(salt.cbegin(), salt.cend()).append(std::to_string(size));
+	bool cached = true;
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		cached = cache.keys.capacityGet() > 0;
+		if (cached) {
+			auto entry = cache.keys.get(index);
+			if (entry != nullptr && sameKey(entry->masterKey, masterKey)) {
+				return entry->key;
+			}
+		}
+	}
+	// derive without holding the lock
+	auto key = HKDF<SHA256>(salt, masterKey, info, size);
+	if (counters != nullptr) {
+		counters->add(VfsCounters::keyDerivations, 1);
+	}
+	if (cached) {
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		cache.keys.insert(index, DerivedKey{masterKey, key});
+	}
+	return key;
+}
+
+void VfsDerivedKeyCache::capacitySet(size_t capacity) {
+	auto &cache = derivedKeyCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.keys.capacitySet(capacity);
+}
+
+size_t VfsDerivedKeyCache::capacityGet() {
+	auto &cache = derivedKeyCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	return cache.keys.capacityGet();
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_SHARED_CRYPTO_HH
+#define BCTBX_VFS_SHARED_CRYPTO_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bctoolbox {
+
+class VfsCounters;
+
+/**
+ * Random number generator shared by all the encryption modules.
+ * Seeding a generator from the entropy source is expensive: instead of one per opened file, all the modules draw from
+ * this one. It is thread safe and replaced by a freshly seeded one after a number of requests.
+ */
+class VfsSharedRNG {
+public:
+	/**
+	 * fill a buffer with random numbers
+	 * @param[out]	buffer	the buffer to fill
+	 * @param[in]	size	size in bytes of the buffer
+	 */
+	static void randomize(uint8_t *buffer, size_t size);
+	/**
+	 * @return a random vector of given size
+	 */
+	static std::vector<uint8_t> randomize(size_t size);
+};
+
+/**
+ * Process wide cache of the keys derived by the encryption modules at file opening, so opening again a recently opened
+ * file does not derive them again.
+ * An entry is found by the salt and info used to derive it and is used only if the master key matches the one it was
+ * derived from. The cache keeps copies of master keys: it is disabled by default. Entries are wiped when evicted.
+ */
+class VfsDerivedKeyCache {
+public:
+	/**
+	 * HKDF<SHA256>(salt, masterKey, info, size), from the cache if it holds it
+	 * @param[in]	counters	counts the actual derivations, may be nullptr
+	 */
+	static std::vector<uint8_t> derive(const std::vector<uint8_t> &salt,
+	                                   const std::vector<uint8_t> &masterKey,
+	                                   const std::string &info,
+	                                   size_t size,
+	                                   VfsCounters *counters = nullptr);
+
+	/**
+	 * Set the maximum number of keys kept, 0 disables and empties the cache
+	 */
+	static void capacitySet(size_t capacity);
+	static size_t capacityGet();
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_SHARED_CRYPTO_HH
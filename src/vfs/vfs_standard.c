@@ -25,9 +25,17 @@
 #include "bctoolbox/logging.h"
 #include "bctoolbox/port.h"
 #include "bctoolbox/vfs.h"
+#include "vfs_standard_private.h"
 #include <errno.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#if defined(HAVE_PREADV) || defined(HAVE_PWRITEV)
+#include <limits.h>
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* the minimum POSIX allows */
+#endif
+#endif
 
 /**
  * Opens the file with filename fName, associate it to the file handle pointed
@@ -41,10 +49,18 @@
  */
 static int bcOpen(bctbx_vfs_t *pVfs, bctbx_vfs_file_t *pFile, const char *fName, int openFlags);
 
+/* without positional I/O, a read or write is a seek followed by the access: the pair must not be interleaved */
+#if !defined(HAVE_PREAD) || !defined(HAVE_PWRITE)
+#define BCTBX_VFS_STANDARD_SEEK_LOCK 1
+#endif
+
 /* User data for the standard vfs */
 typedef struct bctbx_vfs_standard_t bctbx_vfs_standard_t;
 struct bctbx_vfs_standard_t {
 	int fd; /* File descriptor */
+#ifdef BCTBX_VFS_STANDARD_SEEK_LOCK
+	bctbx_mutex_t seekMutex; /* Serializes the seek and read or write pairs */
+#endif
 };
 
 bctbx_vfs_t bcStandardVfs = {
@@ -69,6 +85,9 @@ static int bcClose(bctbx_vfs_file_t *pFile) {
 	} else {
 		ret = -errno;
 	}
+#ifdef BCTBX_VFS_STANDARD_SEEK_LOCK
+	bctbx_mutex_destroy(&ctx->seekMutex);
+#endif
 	bctbx_free(pFile->pUserData);
 	return ret;
 }
@@ -94,8 +113,8 @@ static int bcSync(bctbx_vfs_file_t *pFile) {
 
 /**
  * Read count bytes from the open file given by pFile, starting at offset.
- * Sets the error errno in the argument pErrSrvd after allocating it
- * if an error occurrred.
+ * Uses pread when available: the file descriptor offset is neither used nor modified so concurrent calls on the same
+ * handle are safe. Otherwise the seek and the read are done under the handle lock.
  * @param  pFile  File handle pointer.
  * @param  buf    buffer to write the read bytes to.
  * @param  count  number of bytes to read
@@ -105,26 +124,34 @@ static int bcSync(bctbx_vfs_file_t *pFile) {
  */
 static ssize_t bcRead(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t offset) {
 	ssize_t nRead; /* Return value from read() */
+	int err;
 	if (pFile == NULL || pFile->pUserData == NULL) return BCTBX_VFS_ERROR;
 	bctbx_vfs_standard_t *ctx = (bctbx_vfs_standard_t *)pFile->pUserData;
 
+#ifdef HAVE_PREAD
+	nRead = pread(ctx->fd, buf, count, offset);
+	err = errno;
+#else
+	bctbx_mutex_lock(&ctx->seekMutex);
 	if (lseek(ctx->fd, offset, SEEK_SET) < 0) {
-		if (errno) return -errno;
+		nRead = -1;
 	} else {
 		nRead = bctbx_read(ctx->fd, buf, count);
-		/* Error while reading */
-		if (nRead < 0) {
-			if (errno) return -errno;
-		}
-		return nRead;
 	}
-	return BCTBX_VFS_ERROR;
+	err = errno;
+	bctbx_mutex_unlock(&ctx->seekMutex);
+#endif
+	/* Error while reading */
+	if (nRead < 0) {
+		return err ? -err : BCTBX_VFS_ERROR;
+	}
+	return nRead;
 }
 
 /**
  * Writes directly to the open file given through the pFile argument.
- * Sets the error errno in the argument pErrSrvd after allocating it
- * if an error occurrred.
+ * Uses pwrite when available, otherwise the seek and the write are done under the handle lock, see bcRead.
+ * Files opened with O_APPEND: pwrite may append whatever the offset is, as the write following a seek does.
  * @param  pFile       bctbx_vfs_file_t File handle pointer.
  * @param  buf     Buffer containing data to write
  * @param  count   Size of data to write in bytes
@@ -133,22 +160,112 @@ static ssize_t bcRead(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t of
  */
 static ssize_t bcWrite(bctbx_vfs_file_t *pFile, const void *buf, size_t count, off_t offset) {
 	ssize_t nWrite = 0; /* Return value from write() */
+	int err;
 
 	if (pFile == NULL || pFile->pUserData == NULL) return BCTBX_VFS_ERROR;
 	bctbx_vfs_standard_t *ctx = (bctbx_vfs_standard_t *)pFile->pUserData;
 
-	if ((lseek(ctx->fd, offset, SEEK_SET)) < 0) {
-		if (errno) return -errno;
+#ifdef HAVE_PWRITE
+	nWrite = pwrite(ctx->fd, buf, count, offset);
+	err = errno;
+#else
+	bctbx_mutex_lock(&ctx->seekMutex);
+	if (lseek(ctx->fd, offset, SEEK_SET) < 0) {
+		nWrite = -1;
 	} else {
 		nWrite = bctbx_write(ctx->fd, buf, count);
-		if (nWrite >= 0) return nWrite;
-		else if (nWrite == (ssize_t)-1) {
-			if (errno) return -errno;
-			return 0;
+	}
+	err = errno;
+	bctbx_mutex_unlock(&ctx->seekMutex);
+#endif
+	if (nWrite >= 0) return nWrite;
+	if (err) return -err;
+	return BCTBX_VFS_ERROR;
+}
+
+#if defined(HAVE_PREADV) || defined(HAVE_PWRITEV)
+/* number of buffers converted to struct iovec on the stack, more are allocated */
+#define BCTBX_VFS_STANDARD_STACK_IOV 16
+
+/**
+ * Reads or writes several buffers at offset, in a single system call unless there are more than IOV_MAX of them.
+ * @param  pFile   bctbx_vfs_file_t File handle pointer.
+ * @param  iov     Buffers to read into or to write
+ * @param  iovcnt  Number of buffers
+ * @param  offset  File offset where to start
+ * @param  isWrite TRUE to write the buffers, FALSE to read them, unused when only one of preadv and pwritev exists
+ * @return         number of bytes read or written, negative value errno if an error occurred.
+ */
+static ssize_t bcTransferv(bctbx_vfs_file_t *pFile,
+                           const bctbx_vfs_iovec_t *iov,
+                           int iovcnt,
+                           off_t offset,
+                           BCTBX_UNUSED(bool_t isWrite)) {
+	struct iovec stackIov[BCTBX_VFS_STANDARD_STACK_IOV];
+	struct iovec *sysIov = stackIov;
+	ssize_t total = 0;
+	bool_t failed = FALSE;
+	int err = 0;
+	int first;
+	int i;
+
+	if (pFile == NULL || pFile->pUserData == NULL || iovcnt < 0) return BCTBX_VFS_ERROR;
+	bctbx_vfs_standard_t *ctx = (bctbx_vfs_standard_t *)pFile->pUserData;
+
+	if (iovcnt > BCTBX_VFS_STANDARD_STACK_IOV) {
+		sysIov = (struct iovec *)bctbx_malloc((iovcnt < IOV_MAX ? iovcnt : IOV_MAX) * sizeof(struct iovec));
+	}
+	/* the system calls take at most IOV_MAX buffers: transfer them by groups, until one is incomplete */
+	for (first = 0; first < iovcnt; first += IOV_MAX) {
+		int count = (iovcnt - first < IOV_MAX) ? iovcnt - first : IOV_MAX;
+		size_t expected = 0;
+		ssize_t ret;
+		for (i = 0; i < count; i++) {
+			sysIov[i].iov_base = iov[first + i].base;
+			sysIov[i].iov_len = iov[first + i].len;
+			expected += iov[first + i].len;
 		}
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+		ret = isWrite ? pwritev(ctx->fd, sysIov, count, offset + (off_t)total)
+		              : preadv(ctx->fd, sysIov, count, offset + (off_t)total);
+#elif defined(HAVE_PWRITEV) /* bcReadv is NULL, only writes get here */
+		ret = pwritev(ctx->fd, sysIov, count, offset + (off_t)total);
+#else /* bcWritev is NULL, only reads get here */
+		ret = preadv(ctx->fd, sysIov, count, offset + (off_t)total);
+#endif
+		if (ret < 0) {
+			failed = TRUE;
+			err = errno;
+			break;
+		}
+		total += ret;
+		if ((size_t)ret < expected) break;
+	}
+	if (sysIov != stackIov) {
+		bctbx_free(sysIov);
 	}
+	/* what was transferred before an error is reported, as a short transfer */
+	if (total > 0 || !failed) return total;
+	if (err) return -err;
 	return BCTBX_VFS_ERROR;
 }
+#endif
+
+#ifdef HAVE_PREADV
+static ssize_t bcReadv(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	return bcTransferv(pFile, iov, iovcnt, offset, FALSE);
+}
+#else
+#define bcReadv NULL /* use the generic implementation, one read per buffer */
+#endif
+
+#ifdef HAVE_PWRITEV
+static ssize_t bcWritev(bctbx_vfs_file_t *pFile, const bctbx_vfs_iovec_t *iov, int iovcnt, off_t offset) {
+	return bcTransferv(pFile, iov, iovcnt, offset, TRUE);
+}
+#else
+#define bcWritev NULL /* use the generic implementation, one write per buffer */
+#endif
 
 /**
  * Returns the file size associated with the file handle pFile.
@@ -200,7 +317,9 @@ static const bctbx_io_methods_t bcio = {
     bcTruncate,       /* pFuncTruncate */
     bcFileSize,       /* pFuncFileSize */
     bcSync,     NULL, /* use the generic implementation of getnxt line */
-    NULL              /* pFuncIsEncrypted -> no function so we will return false */
+    NULL,             /* pFuncIsEncrypted -> no function so we will return false */
+    bcReadv,          /* pFuncReadv */
+    bcWritev          /* pFuncWritev */
 };
 
 static int bcOpen(BCTBX_UNUSED(bctbx_vfs_t *pVfs), bctbx_vfs_file_t *pFile, const char *fName, int openFlags) {
@@ -218,8 +337,18 @@ static int bcOpen(BCTBX_UNUSED(bctbx_vfs_t *pVfs), bctbx_vfs_file_t *pFile, cons
 		bctbx_free(userData);
 		return -errno;
 	}
+#ifdef BCTBX_VFS_STANDARD_SEEK_LOCK
+	bctbx_mutex_init(&userData->seekMutex, NULL);
+#endif
 
 	pFile->pMethods = &bcio;
 	pFile->pUserData = (void *)userData;
 	return BCTBX_VFS_OK;
 }
+
+int bctbx_vfs_standard_fd_get(bctbx_vfs_file_t *pFile) {
+	if (pFile == NULL || pFile->pMethods != &bcio || pFile->pUserData == NULL) {
+		return -1;
+	}
+	return ((bctbx_vfs_standard_t *)pFile->pUserData)->fd;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_STANDARD_PRIVATE_H
+#define BCTBX_VFS_STANDARD_PRIVATE_H
+
+#include "bctoolbox/vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Get the file descriptor of a file opened by the standard VFS, to submit system calls on it directly.
+ * @param  pFile  bctbx_vfs_file_t File handle pointer.
+ * @return the file descriptor, -1 if the file was not opened by the standard VFS.
+ */
+int bctbx_vfs_standard_fd_get(bctbx_vfs_file_t *pFile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BCTBX_VFS_STANDARD_PRIVATE_H */
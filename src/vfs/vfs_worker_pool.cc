@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs_worker_pool.hh"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+using namespace bctoolbox;
+
+namespace {
+/**
+ * State shared by the calling thread and the workers participating to a run() call.
+ * Held by shared pointers as tasks may still be queued when the run() call returns.
+ */
+struct RunState {
+	RunState(size_t jobCount, const std::function<void(size_t)> &jobFunction)
+	    : count(jobCount), job(jobFunction), next(0), failed(false), finished(false), activeHelpers(0) {
+	}
+
+	const size_t count;
+	const std::function<void(size_t)> &job; // valid until finished is set
+	std::atomic<size_t> next;               // next job to run
+	std::atomic<bool> failed;               // a job threw, stop running new ones
+	std::exception_ptr exception;           // the first exception thrown, protected by mutex
+	bool finished;                          // the calling thread is done: helpers must not start, protected by mutex
+	size_t activeHelpers;                   // number of workers currently running jobs, protected by mutex
+	std::mutex mutex;
+	std::condition_variable helpersDone;
+
+	/* claim and run jobs until there are none left */
+	void runJobs() {
+		for (size_t index = next++; index < count && !failed; index = next++) {
+			try {
+				job(index);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!failed) {
+					exception = std::current_exception();
+					failed = true;
+				}
+			}
+		}
+	}
+};
+} // namespace
+
+VfsWorkerPool &VfsWorkerPool::get() {
+	static VfsWorkerPool pool;
+	return pool;
+}
+
+VfsWorkerPool::~VfsWorkerPool() {
+	threadCountSet(0);
+}
+
+void VfsWorkerPool::threadCountSet(size_t count) {
+	std::vector<std::thread> threads;
+	{ // stop the current workers, they complete the queued tasks first
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+		threads.swap(mThreads);
+	}
+	mCondition.notify_all();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mStopping = false;
+	for (size_t i = 0; i < count; i++) {
+		mThreads.emplace_back(&VfsWorkerPool::workerLoop, this);
+	}
+}
+
+size_t VfsWorkerPool::threadCountGet() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mThreads.size();
+}
+
+void VfsWorkerPool::thresholdSet(size_t threshold) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mThreshold = threshold;
+}
+
+size_t VfsWorkerPool::thresholdGet() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mThreshold;
+}
+
+void VfsWorkerPool::workerLoop() {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mCondition.wait(lock, [this] { return mStopping || !mTasks.empty(); });
+			if (mTasks.empty()) { // stopping and nothing left to do
+				return;
+			}
+			task = std::move(mTasks.front());
+			mTasks.pop_front();
+		}
+		task();
+	}
+}
+
+size_t VfsWorkerPool::concurrencyGet(size_t weight) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return (weight >= std::max(mThreshold, size_t(2))) ? mThreads.size() + 1 : 1;
+}
+
+void VfsWorkerPool::run(size_t count, const std::function<void(size_t)> &job, size_t weight) {
+	if (weight == 0) weight = count;
+	size_t helpers = 0;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (count >= 2 && weight >= std::max(mThreshold, size_t(2))) {
+			helpers = std::min(mThreads.size(), count - 1); // the calling thread takes its share
+		}
+	}
+
+	if (helpers == 0) { // run it all here, in order
+		for (size_t index = 0; index < count; index++) {
+			job(index);
+		}
+		return;
+	}
+
+	auto state = std::make_shared<RunState>(count, job);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (size_t i = 0; i < helpers; i++) {
+			mTasks.emplace_back([state]() {
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (state->finished) return; // too late, everything is already done
+					state->activeHelpers++;
+				}
+				state->runJobs();
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->activeHelpers--;
+				state->helpersDone.notify_all();
+			});
+		}
+	}
+	mCondition.notify_all();
+
+	// work too, then wait for the helpers still running a job
+	state->runJobs();
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished = true;
+	state->helpersDone.wait(lock, [&state] { return state->activeHelpers == 0; });
+
+	if (state->exception) {
+		std::rethrow_exception(state->exception);
+	}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BCTBX_VFS_WORKER_POOL_HH
+#define BCTBX_VFS_WORKER_POOL_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bctoolbox {
+
+/**
+ * A pool of worker threads shared by all the encrypted files, used to spread chunks encryption/decryption over several
+ * cores. The pool holds no thread until a thread count is set.
+ */
+class VfsWorkerPool {
+public:
+	/**
+	 * @return the process wide pool
+	 */
+	static VfsWorkerPool &get();
+
+	/**
+	 * Set the number of worker threads, 0 stops all of them.
+	 * Running jobs are completed before the threads are stopped.
+	 */
+	void threadCountSet(size_t count);
+	size_t threadCountGet() const;
+
+	/**
+	 * Set the minimum number of jobs given to run() to actually spread them on the worker threads
+	 */
+	void thresholdSet(size_t threshold);
+	size_t thresholdGet() const;
+
+	/**
+	 * Run job(0) to job(count - 1) and return when they are all done.
+	 * If there are enough jobs and the pool has threads, jobs are run concurrently by the calling thread and the
+	 * workers, otherwise they are run in order by the calling thread. Each job must only write to its own output so
+	 * the result does not depend on the execution order.
+	 * If a job throws, jobs not started yet are skipped and the first exception is rethrown to the caller.
+	 *
+	 * @param[in]	count	number of jobs
+	 * @param[in]	job		the function to run, called with the job index
+	 * @param[in]	weight	amount of work compared to the threshold when jobs group several work units, 0 for count
+	 */
+	void run(size_t count, const std::function<void(size_t)> &job, size_t weight = 0);
+
+	/**
+	 * @param[in]	weight	amount of work to run, in the unit of the threshold
+	 * @return the number of threads, calling one included, which would share this work
+	 */
+	size_t concurrencyGet(size_t weight) const;
+
+	/**
+	 * Run a function in background on a worker thread.
+	 * Without worker threads, the function is deferred: it runs in the thread first calling get() or wait() on the
+	 * returned future. Unlike the ones returned by std::async, the future does not wait for the function when
+	 * destroyed: the caller must wait for it before releasing anything the function uses.
+	 *
+	 * @param[in]	function	the function to run, must not wait for other background functions
+	 * @return a future on the function result
+	 */
+	template <typename Function>
+	std::future<std::invoke_result_t<Function>> async(Function function) {
+		using Result = std::invoke_result_t<Function>;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (!mThreads.empty()) { // the workers complete the queued tasks before stopping
+				auto task = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+				auto future = task->get_future();
+				mTasks.emplace_back([task]() { (*task)(); });
+				lock.unlock();
+				mCondition.notify_one();
+				return future;
+			}
+		}
+		return std::async(std::launch::deferred, std::move(function));
+	}
+
+	~VfsWorkerPool();
+
+private:
+	VfsWorkerPool() = default;
+	void workerLoop();
+
+	mutable std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<std::function<void()>> mTasks;
+	std::vector<std::thread> mThreads;
+	bool mStopping = false;
+	size_t mThreshold = 16;
+};
+
+} // namespace bctoolbox
+#endif // BCTBX_VFS_WORKER_POOL_HH
@@ -1381,6 +1381,57 @@ static void AEAD(void) {
 	BC_ASSERT_TRUE(cInterfaceAESGCMTest(key, AD, IV, pattern_plain, pattern_cipher, pattern_tag) == 1);
 }
 
+static void chacha20_poly1305_test(void) {
+	/* Test vector from RFC 8439 section 2.8.2 */
+	std::vector<uint8_t> key{0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+	                         0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95,
+	                         0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f};
+	std::vector<uint8_t> IV{0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+	std::vector<uint8_t> AD{0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+	std::string plainString{"Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the "
+	                        "future, sunscreen would be it."};
+	std::vector<uint8_t> pattern_plain(plainString.cbegin(), plainString.cend());
+	std::vector<uint8_t> pattern_cipher{
+	    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2, 0xa4, 0xad,
+	    0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6, 0x3d, 0xbe, 0xa4, 0x5e,
+	    0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b, 0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06,
+	    0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36, 0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c,
+	    0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58, 0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85,
+	    0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc, 0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65,
+	    0x86, 0xce, 0xc6, 0x4b, 0x61, 0x16};
+	std::vector<uint8_t> pattern_tag{0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+	                                 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+	std::vector<uint8_t> tag{};
+	std::vector<uint8_t> plain{};
+
+	try {
+		auto cipher = AEADEncrypt<CHACHA20POLY1305>(key, IV, pattern_plain, AD, tag);
+		BC_ASSERT_TRUE(cipher == pattern_cipher);
+		BC_ASSERT_TRUE(tag == pattern_tag);
+		BC_ASSERT_TRUE(AEADDecrypt<CHACHA20POLY1305>(key, IV, pattern_cipher, AD, pattern_tag, plain));
+		BC_ASSERT_TRUE(plain == pattern_plain);
+	} catch (BctbxException const &e) {
+		BC_FAIL("Unexpected exception");
+		BCTBX_SLOGE << "Unexpected exception:" << e.str();
+	}
+
+	/* use the wrong tag in decryption, it must fail */
+	std::vector<uint8_t> wrong_pattern_tag = pattern_tag;
+	wrong_pattern_tag[15] ^= 0x01;
+	BC_ASSERT_EQUAL(bctbx_chacha20_poly1305_decrypt_and_auth(key.data(), pattern_cipher.data(), pattern_cipher.size(),
+	                                                         AD.data(), AD.size(), IV.data(), wrong_pattern_tag.data(),
+	                                                         plain.data()),
+	                BCTBX_ERROR_AUTHENTICATION_FAILED, int, "%d");
+	auto exceptionRaised = false;
+	try {
+		AEADDecrypt<CHACHA20POLY1305>(key, IV, pattern_cipher, AD, wrong_pattern_tag, plain);
+	} catch (BctbxException const &e) {
+		exceptionRaised = true;
+		BCTBX_SLOGI << "Expected exception:" << e.str();
+	}
+	BC_ASSERT_TRUE(exceptionRaised);
+}
+
 static void key_wrap_test() {
 	int ret;
 	std::vector<uint8_t> plaintext;
@@ -1456,6 +1507,7 @@ static test_t crypto_tests[] = {
     TEST_NO_TAG("Hash functions", hash_test),
     TEST_NO_TAG("RNG", rng_test),
     TEST_NO_TAG("AEAD", AEAD),
+    TEST_NO_TAG("ChaCha20-Poly1305", chacha20_poly1305_test),
     TEST_NO_TAG("Key wrap", key_wrap_test),
 };
 
@@ -21,6 +21,8 @@
 #include "bctoolbox/vfs_encrypted.hh"
 #include "bctoolbox/vfs_standard.h"
 #include "bctoolbox_tester.h"
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 
 using namespace bctoolbox;
@@ -41,11 +43,13 @@ static void set_plain_encryption_info(VfsEncryption &settings) {
 	settings.encryptionSuiteSet(EncryptionSuite::plain);
 };
 
-static void set_aes256_encryption_info(VfsEncryption &settings, size_t chunk_size) {
+static void set_aes256_encryption_info(VfsEncryption &settings,
+                                       size_t chunk_size,
+                                       EncryptionSuite suite = EncryptionSuite::aes256gcm128_sha256) {
 	const std::vector<uint8_t> keyMaterial{0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
 	                                       0x0c, 0x0d, 0x0e, 0x0f, 0xf0, 0x11, 0x12, 0x13, 0x54, 0x55, 0x56,
 	                                       0xa7, 0xa8, 0xa9, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0xef};
-	settings.encryptionSuiteSet(EncryptionSuite::aes256gcm128_sha256);
+	settings.encryptionSuiteSet(suite);
 	settings.secretMaterialSet(keyMaterial);
 	settings.chunkSizeSet(bctbx_vfs_tester_chunk_size);
 };
@@ -58,6 +62,14 @@ EncryptedVfsOpenCb set_encryption_info = [](VfsEncryption &settings) {
 	} else if (filename.find(bctoolbox::encryptionSuiteString(bctoolbox::EncryptionSuite::aes256gcm128_sha256)) !=
 	           std::string::npos) {
 		set_aes256_encryption_info(settings, bctbx_vfs_tester_chunk_size);
+	} else if (filename.find(bctoolbox::encryptionSuiteString(bctoolbox::EncryptionSuite::chacha20poly1305_sha256)) !=
+	           std::string::npos) {
+		// same master key size than the AES256 suite
+		set_aes256_encryption_info(settings, bctbx_vfs_tester_chunk_size, EncryptionSuite::chacha20poly1305_sha256);
+	} else if (filename.find(bctoolbox::encryptionSuiteString(
+	               bctoolbox::EncryptionSuite::aes256gcm128_filekey_sha256)) != std::string::npos) {
+		set_aes256_encryption_info(settings, bctbx_vfs_tester_chunk_size,
+		                           EncryptionSuite::aes256gcm128_filekey_sha256);
 	} else if (filename.find(bctoolbox::encryptionSuiteString(bctoolbox::EncryptionSuite::dummy)) !=
 	           std::string::npos) {
 		set_dummy_encryption_info(settings, bctbx_vfs_tester_chunk_size);
@@ -258,6 +270,10 @@ void basic_encryption_test() {
 	basic_encryption_test(EncryptionSuite::plain, true);
 	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, false);
 	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, true);
+	basic_encryption_test(EncryptionSuite::chacha20poly1305_sha256, false);
+	basic_encryption_test(EncryptionSuite::chacha20poly1305_sha256, true);
+	basic_encryption_test(EncryptionSuite::aes256gcm128_filekey_sha256, false);
+	basic_encryption_test(EncryptionSuite::aes256gcm128_filekey_sha256, true);
 
 	VfsEncryption::openCallbackSet(nullptr);
 }
@@ -327,6 +343,64 @@ void fprintf_encryption_test() {
 	bctbx_vfs_tester_chunk_size = 16; // reset it for the other tests
 }
 
+/**
+ * Read lines from an encrypted file and from a plain copy read by the generic get next line of the standard vfs, lines
+ * span several chunks and the \r\n end of line is split between two chunks. Then read a line by parts
+ */
+static void get_line_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("get_line.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	std::string plainPath{filePath + ".plain"};
+	remove(filePath.data());
+	remove(plainPath.data());
+	const std::string content{"first line\n\nsecond line\r\nthird!\r\n"
+	                          "this line is longer than several chunks\rfourth\r\n\n\nlast line without end of line"};
+
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	bctbx_vfs_file_t *plainFp = bctbx_file_open2(bctbx_vfs_get_standard(), plainPath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_write(plainFp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t,
+	                "%ld");
+	char line[256];
+	char plainLine[256];
+	int lineCount = 0;
+	int ret = 0;
+	do {
+		ret = bctbx_file_get_nxtline(fp, line, sizeof(line));
+		BC_ASSERT_EQUAL(ret, bctbx_file_get_nxtline(plainFp, plainLine, sizeof(plainLine)), int, "%d");
+		BC_ASSERT_STRING_EQUAL(line, plainLine);
+		lineCount++;
+	} while (ret > 0);
+	BC_ASSERT_EQUAL(lineCount, 10, int, "%d");
+
+	// a line longer than the buffer is returned in several parts, a write invalidates the chunk kept
+	bctbx_file_seek(fp, 33, SEEK_SET);
+	BC_ASSERT_EQUAL(bctbx_file_get_nxtline(fp, line, 16), 15, int, "%d");
+	BC_ASSERT_STRING_EQUAL(line, "this line is lo");
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, "LONG", 4, 48), 4, ssize_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_get_nxtline(fp, line, 16), 15, int, "%d");
+	BC_ASSERT_STRING_EQUAL(line, "LONG than sever");
+	BC_ASSERT_EQUAL(bctbx_file_get_nxtline(fp, line, 16), 10, int, "%d");
+	BC_ASSERT_STRING_EQUAL(line, "al chunks");
+	bctbx_file_close(fp);
+	bctbx_file_close(plainFp);
+
+	remove(filePath.data());
+	remove(plainPath.data());
+}
+
+static void get_line_test() {
+	VfsEncryption::openCallbackSet(set_encryption_info);
+
+	get_line_test(EncryptionSuite::dummy);
+	get_line_test(EncryptionSuite::plain);
+	get_line_test(EncryptionSuite::aes256gcm128_sha256);
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
 /**
  * create an encrypted file,
  * open it with regular API,
@@ -389,6 +463,61 @@ void auth_fail_test() {
 
 	auth_fail_test(EncryptionSuite::dummy);
 	auth_fail_test(EncryptionSuite::aes256gcm128_sha256);
+	auth_fail_test(EncryptionSuite::chacha20poly1305_sha256);
+	auth_fail_test(EncryptionSuite::aes256gcm128_filekey_sha256);
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/* swap two chunks directly in the file, the encryption suite must detect it */
+static void chunk_swap_test(bctoolbox::EncryptionSuite suite, size_t chunkHeaderSize) {
+	/* get the encrypted file path */
+	char *path = bc_tester_file("chunk_swap.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+
+	/* remove file if it was already there */
+	remove(filePath.data());
+
+	/* Write 4 chunks, chunk size is 16 */
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 64, 0), 64, ssize_t, "%ld");
+	bctbx_file_close(fp);
+
+	/* swap the first two chunks: file header is 29 + 48 bytes */
+	const size_t rawChunkSize = chunkHeaderSize + 16;
+	std::fstream file(filePath, std::ios::out | std::ios::in | std::ios::binary);
+	std::vector<char> chunks(2 * rawChunkSize);
+	file.seekg(29 + 48);
+	file.read(chunks.data(), chunks.size());
+	std::rotate(chunks.begin(), chunks.begin() + rawChunkSize, chunks.end());
+	file.seekp(29 + 48);
+	file.write(chunks.data(), chunks.size());
+	file.close();
+
+	/* the file opens as its size is unchanged but the swapped chunks cannot be read */
+	uint8_t readBuffer[64];
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		BC_ASSERT_TRUE(bctbx_file_read(fp, readBuffer, 16, 0) < 0);
+		BC_ASSERT_TRUE(bctbx_file_read(fp, readBuffer, 16, 16) < 0);
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 32, 32), 32, ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer, message + 32, 32) == 0);
+		bctbx_file_close(fp);
+	}
+
+	/* cleaning */
+	remove(filePath.data());
+}
+
+static void chunk_swap_test() {
+	/* set the encrypted vfs callback */
+	VfsEncryption::openCallbackSet(set_encryption_info);
+
+	chunk_swap_test(EncryptionSuite::aes256gcm128_sha256, 28);
+	chunk_swap_test(EncryptionSuite::chacha20poly1305_sha256, 28);
+	chunk_swap_test(EncryptionSuite::aes256gcm128_filekey_sha256, 28);
 
 	VfsEncryption::openCallbackSet(nullptr);
 }
@@ -459,6 +588,8 @@ void migration_test() {
 
 	migration_test(EncryptionSuite::dummy);
 	migration_test(EncryptionSuite::aes256gcm128_sha256);
+	migration_test(EncryptionSuite::chacha20poly1305_sha256);
+	migration_test(EncryptionSuite::aes256gcm128_filekey_sha256);
 
 	VfsEncryption::openCallbackSet(nullptr);
 }
@@ -492,7 +623,7 @@ void recovery_test(bctoolbox::EncryptionSuite suite) {
 	bctbx_file_close(fp);
 
 	// reopen it directly and read the header
-	// base header file is 29, dummy module adds 16 bytes, aes256gcm128 adds 48 bytes
+	// base header file is 29, dummy module adds 16 bytes, the other ones add 48 bytes
 	std::fstream file(filePath, std::ios::in | std::ios::binary);
 	char fileHeader[48 + 29];
 	auto fileHeaderSize = (suite == bctoolbox::EncryptionSuite::dummy) ? (29 + 16) : (29 + 48);
@@ -537,14 +668,1420 @@ void recovery_test() {
 
 	recovery_test(EncryptionSuite::dummy);
 	recovery_test(EncryptionSuite::aes256gcm128_sha256);
+	recovery_test(EncryptionSuite::chacha20poly1305_sha256);
+	recovery_test(EncryptionSuite::aes256gcm128_filekey_sha256);
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Read the plain file size stored in the header of an encrypted file, directly from disk
+ */
+static uint64_t header_file_size(const std::string &filePath) {
+	std::fstream file(filePath, std::ios::in | std::ios::binary);
+	uint8_t size[8];
+	file.seekg(21, std::ios::beg); // size is at offset 21 in the header
+	file.read(reinterpret_cast<char *>(size), 8);
+	file.close();
+	uint64_t ret = 0;
+	for (auto b : size) {
+		ret = (ret << 8) | b;
+	}
+	return ret;
+}
+
+static uint16_t header_extension_size(const std::string &filePath) {
+	std::fstream file(filePath, std::ios::in | std::ios::binary);
+	uint8_t size[2];
+	file.seekg(19, std::ios::beg); // header extension size is at offset 19 in the header
+	file.read(reinterpret_cast<char *>(size), 2);
+	file.close();
+	return static_cast<uint16_t>(size[0] << 8 | size[1]);
+}
+
+/**
+ * Delay the header update, check it is written at sync, after the given number of write and at close
+ * Copy the file while some header updates are still pending and check the copy is recovered
+ */
+static size_t bctbx_vfs_tester_header_update_interval = 1;
+void deferred_header_test(bctoolbox::EncryptionSuite suite) {
+	uint8_t readBuffer[256];
+
+	/* get the encrypted file path */
+	char *path = bc_tester_file("deferred_header.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	path = bc_tester_file("deferred_header_crash.");
+	std::string crashFilePath{path};
+	crashFilePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	remove(crashFilePath.data());
+
+	// header is updated only at sync or close
+	bctbx_vfs_tester_header_update_interval = 0;
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	for (size_t i = 0; i < 10; i++) {
+		bctbx_file_write(fp, message + 10 * i, 10, 10 * i);
+	}
+	BC_ASSERT_EQUAL(bctbx_file_size(fp), 100, int64_t, "%ld");
+	BC_ASSERT_EQUAL(header_file_size(filePath), 0, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(bctbx_file_sync(fp), 0, int, "%d");
+	BC_ASSERT_EQUAL(header_file_size(filePath), 100, uint64_t, "%lu");
+
+	// append more and copy the file while the header update is pending
+	bctbx_file_write(fp, message + 100, 50, 100);
+	{
+		std::ifstream src(filePath, std::ios::binary);
+		std::ofstream dst(crashFilePath, std::ios::binary);
+		dst << src.rdbuf();
+	}
+	BC_ASSERT_EQUAL(header_file_size(crashFilePath), 100, uint64_t, "%lu");
+	bctbx_file_close(fp);
+	BC_ASSERT_EQUAL(header_file_size(filePath), 150, uint64_t, "%lu");
+
+	// the copy recovers the actual file size
+	fp = bctbx_file_open2(&bcEncryptedVfs, crashFilePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	BC_ASSERT_EQUAL(bctbx_file_size(fp), 150, int64_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 256, 0), 150, ssize_t, "%ld");
+	BC_ASSERT_TRUE(memcmp(readBuffer, message, 150) == 0);
+	bctbx_file_close(fp);
+
+	// header is written every 4 writes modifying the file size, overwriting does not modify it
+	bctbx_vfs_tester_header_update_interval = 4;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	bctbx_file_write(fp, message, 10, 0);
+	for (size_t i = 0; i < 3; i++) {
+		bctbx_file_write(fp, message + 150 + 10 * i, 10, 150 + 10 * i);
+	}
+	BC_ASSERT_EQUAL(header_file_size(filePath), 150, uint64_t, "%lu");
+	bctbx_file_write(fp, message + 180, 10, 180);
+	BC_ASSERT_EQUAL(header_file_size(filePath), 190, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, 120), 0, int, "%d");
+	BC_ASSERT_EQUAL(header_file_size(filePath), 190, uint64_t, "%lu");
+	bctbx_file_close(fp);
+	BC_ASSERT_EQUAL(header_file_size(filePath), 120, uint64_t, "%lu");
+
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_size(fp), 120, int64_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 256, 0), 120, ssize_t, "%ld");
+	BC_ASSERT_TRUE(memcmp(readBuffer, message, 120) == 0);
+	bctbx_file_close(fp);
+
+	remove(filePath.data());
+	remove(crashFilePath.data());
+}
+
+void deferred_header_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.headerUpdateIntervalSet(bctbx_vfs_tester_header_update_interval);
+	});
+
+	deferred_header_test(EncryptionSuite::dummy);
+	deferred_header_test(EncryptionSuite::aes256gcm128_sha256);
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Copy a file, flipping one byte of the copy if an offset is given
+ */
+static void copy_file(const std::string &srcPath, const std::string &dstPath, int64_t flipOffset = -1) {
+	{
+		std::ifstream src(srcPath, std::ios::binary);
+		std::ofstream dst(dstPath, std::ios::binary);
+		dst << src.rdbuf();
+	}
+	if (flipOffset >= 0) {
+		std::fstream file(dstPath, std::ios::out | std::ios::in | std::ios::binary);
+		char byte;
+		file.seekg(flipOffset);
+		file.read(&byte, 1);
+		byte ^= 0xFF;
+		file.seekp(flipOffset);
+		file.write(&byte, 1);
+	}
+}
+
+/**
+ * Copy the file while the header holds a wrong file size, with a chunk corrupted before or after the size change.
+ * With the size journal, only the chunks written since the header update are checked at opening.
+ */
+static bool bctbx_vfs_tester_size_journal = false;
+void size_journal_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("size_journal.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	path = bc_tester_file("size_journal_crash.");
+	std::string crashFilePath{path};
+	crashFilePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	std::vector<uint8_t> content(3300);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 13 + i / 256);
+	}
+	std::vector<uint8_t> readBuffer(content.size());
+
+	// 200 chunks written and synced, then append a few more: the header update is pending
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 3200, 0), 3200, ssize_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_sync(fp), 0, int, "%d");
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data() + 3200, 100, 3200), 100, ssize_t, "%ld");
+	copy_file(filePath, crashFilePath);
+	BC_ASSERT_EQUAL(header_file_size(crashFilePath), 3200, uint64_t, "%lu");
+	int64_t rawSize = 0;
+	{
+		std::ifstream src(crashFilePath, std::ios::binary | std::ios::ate);
+		rawSize = static_cast<int64_t>(src.tellg());
+	}
+
+	// a corrupted chunk in the first tenth of the file is detected only by a whole file check
+	copy_file(filePath, crashFilePath, rawSize / 10);
+	auto crashFp = bctbx_file_open2(&bcEncryptedVfs, crashFilePath.data(), O_RDWR);
+	if (bctbx_vfs_tester_size_journal) {
+		BC_ASSERT_PTR_NOT_NULL(crashFp);
+		if (crashFp != NULL) {
+			BC_ASSERT_EQUAL(bctbx_file_size(crashFp), 3300, int64_t, "%ld");
+			BC_ASSERT_EQUAL(bctbx_file_read(crashFp, readBuffer.data(), 1000, 2300), 1000, ssize_t, "%ld");
+			BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data() + 2300, 1000) == 0);
+			bctbx_file_close(crashFp);
+		}
+	} else {
+		BC_ASSERT_PTR_NULL(crashFp);
+		if (crashFp != NULL) {
+			bctbx_file_close(crashFp);
+		}
+	}
+	// a corrupted chunk among the ones appended is always detected
+	copy_file(filePath, crashFilePath, rawSize - 5);
+	crashFp = bctbx_file_open2(&bcEncryptedVfs, crashFilePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(crashFp);
+	if (crashFp != NULL) {
+		bctbx_file_close(crashFp);
+	}
+
+	// shrink the file and recover the copy
+	BC_ASSERT_EQUAL(bctbx_file_sync(fp), 0, int, "%d");
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, 1000), 0, int, "%d");
+	copy_file(filePath, crashFilePath);
+	BC_ASSERT_EQUAL(header_file_size(crashFilePath), 3300, uint64_t, "%lu");
+	crashFp = bctbx_file_open2(&bcEncryptedVfs, crashFilePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(crashFp);
+	if (crashFp != NULL) {
+		BC_ASSERT_EQUAL(bctbx_file_size(crashFp), 1000, int64_t, "%ld");
+		BC_ASSERT_EQUAL(bctbx_file_read(crashFp, readBuffer.data(), readBuffer.size(), 0), 1000, ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data(), 1000) == 0);
+		bctbx_file_close(crashFp);
+	}
+	bctbx_file_close(fp);
+
+	// reopen the file, it keeps its journal and its content
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_EQUAL(bctbx_file_size(fp), 1000, int64_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), 1000, ssize_t, "%ld");
+	BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data(), 1000) == 0);
+	bctbx_file_close(fp);
+
+	remove(filePath.data());
+	remove(crashFilePath.data());
+}
+
+void size_journal_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.headerUpdateIntervalSet(bctbx_vfs_tester_header_update_interval);
+		if (settings.fileSizeGet() == 0) { // files created with a journal keep it
+			settings.sizeJournalSet(bctbx_vfs_tester_size_journal);
+			BC_ASSERT_EQUAL(settings.sizeJournalGet(), bctbx_vfs_tester_size_journal, bool, "%d");
+		}
+	});
+
+	bctbx_vfs_tester_header_update_interval = 0;
+	for (auto journal : {false, true}) {
+		bctbx_vfs_tester_size_journal = journal;
+		size_journal_test(EncryptionSuite::dummy);
+		size_journal_test(EncryptionSuite::aes256gcm128_sha256);
+		size_journal_test(EncryptionSuite::aes256gcm128_filekey_sha256);
+	}
+	// the deferred header test recovers a file with its journal
+	deferred_header_test(EncryptionSuite::dummy);
+	deferred_header_test(EncryptionSuite::aes256gcm128_sha256);
+
+	bctbx_vfs_tester_size_journal = false;
+	bctbx_vfs_tester_header_update_interval = 1;
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Read a whole file
+ */
+static std::vector<char> read_file(const std::string &path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Modify and truncate a file with an integrity tree, then roll back one of its chunks to a previous version: the
+ * chunk still decrypts correctly but does not match the tree anymore. The tree file follows the file when renamed or
+ * removed, a missing tree file leaves the tree invalid until rebuilt.
+ */
+static void integrity_tree_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("integrity_tree.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	std::string treePath{filePath + ".evfs_tree"};
+	remove(filePath.data());
+	remove(treePath.data());
+	std::vector<uint8_t> content(3000);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 7 + i / 256);
+	}
+
+	// grow the file by small writes so the tree grows several times, overwrite and truncate it
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(ctx->integrityTreeRootGet().size(), 32, size_t, "%zu");
+	for (size_t offset = 0; offset < content.size(); offset += 100) {
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data() + offset, 100, offset), 100, ssize_t, "%ld");
+	}
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 50, 1203), 50, ssize_t, "%ld");
+	memcpy(content.data() + 1203, content.data(), 50);
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, 2500), 0, int, "%d");
+	content.resize(2500);
+	BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+	BC_ASSERT_TRUE(ctx->integrityTreeVerify(1200, 60));
+	auto root = ctx->integrityTreeRootGet();
+	bctbx_file_close(fp);
+	auto previousFile = read_file(filePath);
+
+	// reopen: the tree matches the header
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_TRUE(ctx->integrityTreeRootGet() == root);
+	BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+	// overwrite the chunks holding [1600, 1616[
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 16, 1600), 16, ssize_t, "%ld");
+	BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+	bctbx_file_close(fp);
+
+	// roll back the chunks, keeping the current header: they come after the first 400 bytes of the file
+	auto currentFile = read_file(filePath);
+	BC_ASSERT_EQUAL(currentFile.size(), previousFile.size(), size_t, "%zu");
+	{
+		std::fstream file(filePath, std::ios::out | std::ios::in | std::ios::binary);
+		file.seekp(400);
+		file.write(previousFile.data() + 400, static_cast<std::streamsize>(previousFile.size() - 400));
+	}
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		// the rolled back chunk decrypts correctly, only the tree detects it
+		std::vector<uint8_t> readBuffer(16);
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 1600), 16, ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data() + 1600, 16) == 0);
+		BC_ASSERT_FALSE(ctx->integrityTreeVerify(1600, 16));
+		BC_ASSERT_FALSE(ctx->integrityTreeVerify());
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify(0, 1500));
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify(1700, 800));
+		bctbx_file_close(fp);
+	}
+
+	// a tree not matching the header is not valid until rebuilt
+	{
+		std::fstream file(treePath, std::ios::out | std::ios::in | std::ios::binary);
+		file.seekp(32);
+		file.write("evil", 4);
+	}
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_FALSE(ctx->integrityTreeVerify(0, 100));
+		ctx->integrityTreeRebuild();
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify(1600, 16));
+		bctbx_file_close(fp);
+	}
+
+	// rename the file with its tree
+	std::string renamedPath{filePath + ".renamed"};
+	std::string renamedTreePath{renamedPath + ".evfs_tree"};
+	BC_ASSERT_EQUAL(VfsEncryption::fileRename(filePath, renamedPath), 0, int, "%d");
+	BC_ASSERT_EQUAL(std::ifstream(treePath).good(), false, bool, "%d");
+	fp = bctbx_file_open2(&bcEncryptedVfs, renamedPath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+		bctbx_file_close(fp);
+	}
+
+	// without its tree file, the file opens with an invalid tree
+	remove(renamedTreePath.data());
+	fp = bctbx_file_open2(&bcEncryptedVfs, renamedPath.data(), O_RDONLY);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_FALSE(ctx->integrityTreeVerify(0, 100));
+		std::vector<uint8_t> readBuffer(16);
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 1600), 16, ssize_t, "%ld");
+		bctbx_file_close(fp);
+	}
+	fp = bctbx_file_open2(&bcEncryptedVfs, renamedPath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_FALSE(ctx->integrityTreeVerify(0, 100));
+		ctx->integrityTreeRebuild();
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+		bctbx_file_close(fp);
+	}
+
+	BC_ASSERT_EQUAL(VfsEncryption::fileRemove(renamedPath), 0, int, "%d");
+	BC_ASSERT_EQUAL(std::ifstream(renamedPath).good(), false, bool, "%d");
+	BC_ASSERT_EQUAL(std::ifstream(renamedTreePath).good(), false, bool, "%d");
+}
+
+/**
+ * Copy the files of a file with an integrity tree and a size journal while the tree grows and the header is not
+ * updated, as if the process stopped there: the copy opens with a valid tree, the tree nodes written are undone and
+ * the leaves of the chunks written are updated
+ */
+static void integrity_tree_crash_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("integrity_tree_crash.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	std::string crashPath{filePath + ".crash"};
+	const std::string treeSuffix{".evfs_tree"};
+	const std::string undoSuffix{treeSuffix + "_undo"};
+	VfsEncryption::fileRemove(filePath);
+	VfsEncryption::fileRemove(crashPath);
+	std::vector<uint8_t> content(300);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 7 + i / 256);
+	}
+
+	// 7 chunks: the tree has 8 leaves
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 100, 0), 100, ssize_t, "%ld");
+	bctbx_file_close(fp);
+
+	// the header is not updated by the writes, the tree grows to 32 leaves
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	ctx->headerUpdateIntervalSet(0);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data() + 100, 200, 100), 200, ssize_t, "%ld");
+	BC_ASSERT_TRUE(std::ifstream(filePath + undoSuffix).good());
+	copy_file(filePath, crashPath);
+	copy_file(filePath + treeSuffix, crashPath + treeSuffix);
+	copy_file(filePath + undoSuffix, crashPath + undoSuffix);
+	bctbx_file_close(fp);
+	// the header holds the root: the undo log is gone
+	BC_ASSERT_FALSE(std::ifstream(filePath + undoSuffix).good());
+
+	VfsEncryption::globalStatsReset();
+	fp = bctbx_file_open2(&bcEncryptedVfs, crashPath.data(), O_RDWR);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_EQUAL(bctbx_file_size(fp), (ssize_t)content.size(), ssize_t, "%ld");
+		BC_ASSERT_TRUE(ctx->integrityTreeVerify());
+		std::vector<uint8_t> readBuffer(content.size());
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), (ssize_t)content.size(),
+		                ssize_t, "%ld");
+		BC_ASSERT_TRUE(readBuffer == content);
+		BC_ASSERT_EQUAL(ctx->statsGet().integrityFailures, 0, uint64_t, "%lu");
+		bctbx_file_close(fp);
+	}
+	BC_ASSERT_FALSE(std::ifstream(crashPath + undoSuffix).good());
+
+	VfsEncryption::fileRemove(filePath);
+	VfsEncryption::fileRemove(crashPath);
+}
+
+static void integrity_tree_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.integrityTreeSet(true);
+	});
+
+	integrity_tree_test(EncryptionSuite::dummy);
+	integrity_tree_test(EncryptionSuite::aes256gcm128_sha256);
+	integrity_tree_test(EncryptionSuite::aes256gcm128_filekey_sha256);
+
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.integrityTreeSet(true);
+		settings.sizeJournalSet(true);
+	});
+	integrity_tree_crash_test(EncryptionSuite::dummy);
+	integrity_tree_crash_test(EncryptionSuite::aes256gcm128_sha256);
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Open the file and check it holds the given content
+ */
+static void check_rekeyed_file(const std::string &filePath, const std::vector<uint8_t> &content) {
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		std::vector<uint8_t> readBuffer(content.size() + 16);
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), (ssize_t)content.size(),
+		                ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data(), content.size()) == 0);
+		bctbx_file_close(fp);
+	}
+}
+
+/**
+ * Re-key a file by steps, modifying it and closing it in between, and interrupt one
+ */
+static EncryptionSuite bctbx_vfs_tester_rekey_suite = EncryptionSuite::dummy;
+static std::vector<uint8_t> bctbx_vfs_tester_rekey_current{};
+static std::vector<uint8_t> bctbx_vfs_tester_rekey_new{};
+static void rekey_test(bctoolbox::EncryptionSuite suite, size_t keySize, size_t chunkHeaderSize) {
+	char *path = bc_tester_file("rekey.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	const std::vector<uint8_t> oldKey(keySize, 0x11);
+	const std::vector<uint8_t> newKey(keySize, 0x22);
+	const std::vector<uint8_t> wrongKey(keySize, 0x33);
+	bctbx_vfs_tester_rekey_suite = suite;
+	bctbx_vfs_tester_rekey_current = oldKey;
+	bctbx_vfs_tester_rekey_new.clear();
+	std::vector<uint8_t> content(3000);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 11 + i / 256);
+	}
+
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t, "%ld");
+	bctbx_file_close(fp);
+
+	// re-key the first 50 chunks, then write on both sides of the re-keyed range end
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	ctx->rekeyStart(newKey);
+	BC_ASSERT_TRUE(ctx->rekeyInProgressGet());
+	BC_ASSERT_FALSE(ctx->rekeyStep(50));
+	BC_ASSERT_EQUAL(ctx->rekeyProgressGet(), 800, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 50, 780), 50, ssize_t, "%ld");
+	memcpy(content.data() + 780, content.data(), 50);
+	bctbx_file_close(fp);
+
+	// reopening requires the new secret material, and the right one
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	bctbx_vfs_tester_rekey_new = wrongKey;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	bctbx_vfs_tester_rekey_new = newKey;
+	check_rekeyed_file(filePath, content);
+
+	// interrupt a step on a copy: a corrupted chunk makes it fail once its range, chunks [50, 100[, is recorded in
+	// the header. Then put the chunk back and replace the first half of the range by chunks re-keyed by a complete step
+	const std::string steppedPath{filePath + ".stepped"};
+	const std::string interruptedPath{filePath + ".interrupted"};
+	const int64_t rawChunkSize = static_cast<int64_t>(chunkHeaderSize) + 16;
+	const int64_t rawSize = std::ifstream(filePath, std::ios::binary | std::ios::ate).tellg();
+	auto chunkOffset = [rawSize, rawChunkSize](int64_t chunkIndex) { // the last chunk, 187, holds 8 bytes
+		return rawSize - (rawChunkSize - 8) - (187 - chunkIndex) * rawChunkSize;
+	};
+	copy_file(filePath, steppedPath);
+	fp = bctbx_file_open2(&bcEncryptedVfs, steppedPath.data(), O_RDWR);
+	BC_ASSERT_FALSE(static_cast<VfsEncryption *>(fp->pUserData)->rekeyStep(50));
+	bctbx_file_close(fp);
+	copy_file(filePath, interruptedPath, chunkOffset(100) - 1);
+	fp = bctbx_file_open2(&bcEncryptedVfs, interruptedPath.data(), O_RDWR);
+	bool stepFailed = false;
+	try {
+		static_cast<VfsEncryption *>(fp->pUserData)->rekeyStep(50);
+	} catch (EvfsException const &) {
+		stepFailed = true;
+	}
+	BC_ASSERT_TRUE(stepFailed);
+	bctbx_file_close(fp);
+	{
+		std::ifstream original(filePath, std::ios::binary);
+		std::ifstream stepped(steppedPath, std::ios::binary);
+		std::fstream interrupted(interruptedPath, std::ios::out | std::ios::in | std::ios::binary);
+		std::vector<char> chunks(static_cast<size_t>(25 * rawChunkSize));
+		stepped.seekg(chunkOffset(50));
+		stepped.read(chunks.data(), chunks.size());
+		interrupted.seekp(chunkOffset(50));
+		interrupted.write(chunks.data(), chunks.size());
+		original.seekg(chunkOffset(99));
+		original.read(chunks.data(), rawChunkSize);
+		interrupted.seekp(chunkOffset(99));
+		interrupted.write(chunks.data(), rawChunkSize);
+	}
+	// opened in read only mode, the step is not completed: its chunks are decrypted with either secret material
+	check_rekeyed_file(interruptedPath, content);
+	fp = bctbx_file_open2(&bcEncryptedVfs, interruptedPath.data(), O_RDONLY);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		ctx = static_cast<VfsEncryption *>(fp->pUserData);
+		BC_ASSERT_EQUAL(ctx->rekeyProgressGet(), 800, uint64_t, "%lu");
+		uint8_t readBuffer[16];
+		for (uint64_t offset : {800, 1184, 1200, 1584}) { // first and last chunks of both halves
+			BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 16, offset), 16, ssize_t, "%ld");
+			BC_ASSERT_TRUE(memcmp(readBuffer, content.data() + offset, 16) == 0);
+		}
+		bctbx_file_close(fp);
+	}
+	// opened for writing, the step is completed
+	fp = bctbx_file_open2(&bcEncryptedVfs, interruptedPath.data(), O_RDWR);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		BC_ASSERT_EQUAL(static_cast<VfsEncryption *>(fp->pUserData)->rekeyProgressGet(), 1600, uint64_t, "%lu");
+		bctbx_file_close(fp);
+	}
+	check_rekeyed_file(interruptedPath, content);
+	remove(steppedPath.data());
+	remove(interruptedPath.data());
+
+	// go on with a throttled rate: 50 chunks are more than 1600 bytes, two steps take at least 100ms at 16000 bytes/s
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(ctx->rekeyProgressGet(), 800, uint64_t, "%lu");
+	ctx->rekeyRateSet(16000);
+	auto start = std::chrono::steady_clock::now();
+	BC_ASSERT_FALSE(ctx->rekeyStep(50));
+	BC_ASSERT_FALSE(ctx->rekeyStep(50));
+	BC_ASSERT_GREATER(
+	    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count(), 100,
+	    long, "%ld");
+	ctx->rekeyRateSet(0);
+	while (!ctx->rekeyStep()) {
+	}
+	BC_ASSERT_FALSE(ctx->rekeyInProgressGet());
+	bctbx_file_close(fp);
+
+	// only the new secret material opens the file now
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	bctbx_vfs_tester_rekey_current = newKey;
+	bctbx_vfs_tester_rekey_new.clear();
+	check_rekeyed_file(filePath, content);
+
+	// the new secret material is checked even before any chunk is re-keyed
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	static_cast<VfsEncryption *>(fp->pUserData)->rekeyStart(oldKey);
+	bctbx_file_close(fp);
+	bctbx_vfs_tester_rekey_new = wrongKey;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	bctbx_vfs_tester_rekey_new = oldKey;
+	check_rekeyed_file(filePath, content);
+
+	remove(filePath.data());
+}
+
+static void rekey_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		settings.encryptionSuiteSet(bctbx_vfs_tester_rekey_suite);
+		settings.chunkSizeSet(bctbx_vfs_tester_chunk_size);
+		settings.sizeJournalSet(true);
+		settings.secretMaterialSet(bctbx_vfs_tester_rekey_current);
+		if (settings.rekeyInProgressGet() && !bctbx_vfs_tester_rekey_new.empty()) {
+			settings.rekeySecretMaterialSet(bctbx_vfs_tester_rekey_new);
+		}
+	});
+
+	rekey_test(EncryptionSuite::dummy, 16, 16);
+	rekey_test(EncryptionSuite::aes256gcm128_sha256, 32, 28);
+	rekey_test(EncryptionSuite::aes256gcm128_filekey_sha256, 32, 28);
 
 	VfsEncryption::openCallbackSet(nullptr);
 }
 
+static void stats_test() {
+	VfsEncryption::openCallbackSet(set_encryption_info);
+	char *path = bc_tester_file("stats.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(EncryptionSuite::aes256gcm128_sha256)).append(".evfs");
+	std::string corruptedPath{path};
+	corruptedPath.append("corrupted.")
+	    .append(bctoolbox::encryptionSuiteString(EncryptionSuite::aes256gcm128_sha256))
+	    .append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	remove(corruptedPath.data());
+	VfsEncryption::globalStatsReset();
+
+	// 100 bytes are 7 chunks of 16 bytes
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 100, 0), 100, ssize_t, "%ld");
+	auto stats = ctx->statsGet();
+	BC_ASSERT_EQUAL(stats.plainBytesWritten, 100, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.chunksEncrypted, 7, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.chunksDecrypted, 0, uint64_t, "%lu");
+	BC_ASSERT_GREATER(stats.rawBytesWritten, 100 + 7 * 28, uint64_t, "%lu"); // chunks and their headers
+	BC_ASSERT_GREATER(stats.headerWrites, 1, uint64_t, "%lu");
+	BC_ASSERT_GREATER(stats.keyDerivations, 8, uint64_t, "%lu"); // header key and chunk keys
+	BC_ASSERT_GREATER_STRICT(stats.moduleTime, 0, uint64_t, "%lu");
+
+	uint8_t readBuffer[100];
+	ctx->statsReset();
+	BC_ASSERT_EQUAL(ctx->statsGet().chunksEncrypted, 0, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, sizeof(readBuffer), 0), 100, ssize_t, "%ld");
+	stats = ctx->statsGet();
+	BC_ASSERT_EQUAL(stats.plainBytesRead, 100, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.chunksDecrypted, 7, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.rawBytesRead, 100 + 7 * 28, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.keyDerivations, 0, uint64_t, "%lu"); // the chunk keys are cached
+	BC_ASSERT_EQUAL(stats.integrityFailures, 0, uint64_t, "%lu");
+	// the global counters hold the open files counters, a file reset does not change them
+	BC_ASSERT_EQUAL(VfsEncryption::globalStatsGet().chunksEncrypted, 7, uint64_t, "%lu");
+	bctbx_file_close(fp);
+
+	// a corrupted chunk fails its authentication
+	int64_t rawSize = std::ifstream(filePath, std::ios::binary | std::ios::ate).tellg();
+	copy_file(filePath, corruptedPath, rawSize - 1);
+	fp = bctbx_file_open2(&bcEncryptedVfs, corruptedPath.data(), O_RDONLY);
+	ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_TRUE(bctbx_file_read(fp, readBuffer, sizeof(readBuffer), 0) < 0);
+	BC_ASSERT_EQUAL(ctx->statsGet().integrityFailures, 1, uint64_t, "%lu");
+	bctbx_file_close(fp);
+
+	// the global counters hold the closed files counters
+	stats = VfsEncryption::globalStatsGet();
+	BC_ASSERT_EQUAL(stats.chunksEncrypted, 7, uint64_t, "%lu");
+	BC_ASSERT_GREATER(stats.chunksDecrypted, 7, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(stats.integrityFailures, 1, uint64_t, "%lu");
+	VfsEncryption::globalStatsReset();
+	BC_ASSERT_EQUAL(VfsEncryption::globalStatsGet().chunksDecrypted, 0, uint64_t, "%lu");
+
+	// writing or truncating inside the corrupted chunk decrypts it: both fail with an error, not an exception
+	fp = bctbx_file_open2(&bcEncryptedVfs, corruptedPath.data(), O_RDWR);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 1, 97), BCTBX_VFS_ERROR, ssize_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, 98), BCTBX_VFS_ERROR, int, "%d");
+	bctbx_file_close(fp);
+
+	remove(filePath.data());
+	remove(corruptedPath.data());
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Run the basic test with the chunk key cache disabled, then with a cache holding only one key so keys are
+ * constantly evicted
+ */
+static size_t bctbx_vfs_tester_chunk_key_cache_size = 0;
+void chunk_key_cache_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.chunkKeyCacheSizeSet(bctbx_vfs_tester_chunk_key_cache_size);
+		BC_ASSERT_EQUAL(settings.chunkKeyCacheSizeGet(), bctbx_vfs_tester_chunk_key_cache_size, size_t, "%zu");
+	});
+
+	bctbx_vfs_tester_chunk_key_cache_size = 0;
+	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, false);
+	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, true);
+	bctbx_vfs_tester_chunk_key_cache_size = 1;
+	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, false);
+	basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, true);
+
+	// count the chunk keys derived by reads of 16 bytes chunks: 4 chunks are written, the cache keeps the last 2 keys
+	char *path = bc_tester_file("chunk_key_cache.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(EncryptionSuite::aes256gcm128_sha256)).append(".evfs");
+	bctbx_free(path);
+	uint8_t readBuffer[16];
+	auto readChunk = [&readBuffer](bctbx_vfs_file_t *fp, VfsEncryption *ctx, uint32_t chunkIndex) {
+		auto derivations = ctx->statsGet().keyDerivations;
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, sizeof(readBuffer), chunkIndex * 16), 16, ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer, message + chunkIndex * 16, sizeof(readBuffer)) == 0);
+		return ctx->statsGet().keyDerivations - derivations;
+	};
+
+	bctbx_vfs_tester_chunk_key_cache_size = 2;
+	remove(filePath.data());
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 64, 0), 64, ssize_t, "%ld");
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 3), 0, uint64_t, "%lu"); // cached by the write
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 0), 1, uint64_t, "%lu"); // evicted by the write
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 0), 0, uint64_t, "%lu"); // cached by the previous read
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 1), 1, uint64_t, "%lu"); // evicts chunk 3, the least recently used
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 3), 1, uint64_t, "%lu");
+	bctbx_file_close(fp);
+
+	// without cache, every read derives its key
+	bctbx_vfs_tester_chunk_key_cache_size = 0;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 2), 1, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(readChunk(fp, ctx, 2), 1, uint64_t, "%lu");
+	bctbx_file_close(fp);
+	remove(filePath.data());
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Run the basic test with a plain chunk cache smaller than the file so chunks are evicted, and with one large enough to
+ * hold it all. Files are kept opened so the cache must stay coherent through writes and truncates
+ */
+static size_t bctbx_vfs_tester_plain_chunk_cache_size = 0;
+void plain_chunk_cache_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.plainChunkCacheSizeSet(bctbx_vfs_tester_plain_chunk_cache_size);
+	});
+
+	for (auto cacheSize : {64, 4096}) {
+		bctbx_vfs_tester_plain_chunk_cache_size = cacheSize;
+		basic_encryption_test(EncryptionSuite::dummy, false);
+		basic_encryption_test(EncryptionSuite::dummy, true);
+		basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, false);
+		basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, true);
+	}
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Create a plain file of the given size using the standard vfs, return its content
+ */
+static std::vector<uint8_t> create_plain_file(const std::string &filePath, size_t size) {
+	std::vector<uint8_t> content(size);
+	for (size_t i = 0; i < size; i++) {
+		content[i] = static_cast<uint8_t>(i * 7 + i / 251);
+	}
+	remove(filePath.data());
+	bctbx_vfs_file_t *fp = bctbx_file_open2(bctbx_vfs_get_standard(), filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)size, ssize_t, "%ld");
+	bctbx_file_close(fp);
+	return content;
+}
+
+/**
+ * Open a file with the encrypted vfs, check its content and if it is encrypted
+ */
+static void check_file_content(const std::string &filePath, const std::vector<uint8_t> &content, bool encrypted) {
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	if (!BC_ASSERT_PTR_NOT_NULL(fp)) return;
+	BC_ASSERT_EQUAL(bctbx_file_is_encrypted(fp), encrypted ? TRUE : FALSE, bool_t, "%d");
+	BC_ASSERT_EQUAL(bctbx_file_size(fp), (ssize_t)content.size(), ssize_t, "%ld");
+	std::vector<uint8_t> readBuffer(content.size());
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), (ssize_t)content.size(), ssize_t,
+	                "%ld");
+	BC_ASSERT_TRUE(readBuffer == content);
+	bctbx_file_close(fp);
+}
+
+/**
+ * Many small overlapping writes, some of them after the end of file, checked by reads while chunks are dirty, then
+ * after sync, truncate and reopening. The write back buffer holds a few chunks so its budget is exceeded sometimes
+ */
+static size_t bctbx_vfs_tester_write_back_buffer_size = 0;
+void write_back_buffer_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("write_back_buffer.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	std::vector<uint8_t> content{};
+	std::vector<uint8_t> readBuffer(512);
+
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	for (size_t i = 0; i < 64; i++) {
+		size_t offset = (i * 37) % 300;
+		size_t size = 5 + (i * 11) % 40;
+		if (content.size() < offset + size) {
+			content.resize(offset + size, 0);
+		}
+		memcpy(content.data() + offset, message + (i * 3) % 200, size);
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, message + (i * 3) % 200, size, offset), (ssize_t)size, ssize_t, "%ld");
+		if (i % 8 == 0) {
+			BC_ASSERT_EQUAL(bctbx_file_size(fp), (ssize_t)content.size(), ssize_t, "%ld");
+			BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), (ssize_t)content.size(),
+			                ssize_t, "%ld");
+			BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data(), content.size()) == 0);
+		}
+		if (i == 32) {
+			BC_ASSERT_EQUAL(bctbx_file_sync(fp), 0, int, "%d");
+		}
+	}
+	content.resize(content.size() - 21);
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size()), 0, int, "%d");
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 7, content.size() - 3), 7, ssize_t, "%ld");
+	content.resize(content.size() + 4);
+	memcpy(content.data() + content.size() - 7, message, 7);
+	bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+
+	remove(filePath.data());
+}
+
+/**
+ * Appending writes change the file size each time: with the default header update interval, the header must not flush
+ * the write back buffer, the chunks are encrypted once when the file is synced
+ */
+static void write_back_buffer_append_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.writeBackBufferSizeSet(4096);
+	});
+	char *path = bc_tester_file("write_back_buffer_append.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(EncryptionSuite::aes256gcm128_sha256)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+
+	// 16 writes of 4 bytes are 4 chunks of 16 bytes
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	auto ctx = static_cast<VfsEncryption *>(fp->pUserData);
+	BC_ASSERT_EQUAL(ctx->headerUpdateIntervalGet(), 1, size_t, "%zu");
+	auto encrypted = ctx->statsGet().chunksEncrypted;
+	for (size_t offset = 0; offset < 64; offset += 4) {
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, message + offset, 4, offset), 4, ssize_t, "%ld");
+	}
+	BC_ASSERT_EQUAL(ctx->statsGet().chunksEncrypted - encrypted, 0, uint64_t, "%lu");
+	BC_ASSERT_EQUAL(bctbx_file_sync(fp), 0, int, "%d");
+	BC_ASSERT_EQUAL(ctx->statsGet().chunksEncrypted - encrypted, 4, uint64_t, "%lu");
+	bctbx_file_close(fp);
+	check_file_content(filePath, std::vector<uint8_t>(message, message + 64), true);
+
+	VfsEncryption::openCallbackSet(nullptr);
+	remove(filePath.data());
+}
+
+void write_back_buffer_test() {
+	write_back_buffer_append_test();
+
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.headerUpdateIntervalSet(0);
+		settings.writeBackBufferSizeSet(bctbx_vfs_tester_write_back_buffer_size);
+		BC_ASSERT_EQUAL(settings.writeBackBufferSizeGet(), bctbx_vfs_tester_write_back_buffer_size, size_t, "%zu");
+	});
+
+	for (auto bufferSize : {64, 4096}) {
+		bctbx_vfs_tester_write_back_buffer_size = bufferSize;
+		write_back_buffer_test(EncryptionSuite::dummy);
+		write_back_buffer_test(EncryptionSuite::aes256gcm128_sha256);
+		basic_encryption_test(EncryptionSuite::dummy, false);
+		basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, false);
+		basic_encryption_test(EncryptionSuite::aes256gcm128_sha256, true);
+	}
+
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Migrate a plain file large enough to be processed in several batches:
+ * - at opening, with a progress callback
+ * - in background while the plain file is modified, the migrated file replaces the plain one at a later opening, even
+ *   when that opening fails
+ * - in background again, resuming from a partially migrated temporary file
+ * Migrated files get a size journal in their header extension
+ */
+static bool bctbx_vfs_tester_migration_in_background = false;
+static bool bctbx_vfs_tester_migration_wrong_key = false;
+static size_t bctbx_vfs_tester_migration_key_size = 0;
+static std::vector<uint64_t> bctbx_vfs_tester_migration_progress;
+void large_migration_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("large_migration.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	std::string tmpFilePath{filePath + ".evfs_tmp"};
+	const size_t fileSize = 2 * 1024 * 1024 + 1234; // 3 batches of 1MB
+	bctbx_vfs_tester_migration_key_size = (suite == EncryptionSuite::dummy) ? 16 : 32;
+	remove(tmpFilePath.data());
+
+	// migration at opening, progress is reported after each batch
+	auto content = create_plain_file(filePath, fileSize);
+	bctbx_vfs_tester_migration_in_background = false;
+	bctbx_vfs_tester_migration_progress.clear();
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_TRUE(bctbx_file_is_encrypted(fp));
+	bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+	BC_ASSERT_NOT_EQUAL(header_extension_size(filePath), 0, uint16_t, "%u");
+	BC_ASSERT_EQUAL(bctbx_vfs_tester_migration_progress.size(), 3, size_t, "%zu");
+	BC_ASSERT_TRUE(std::is_sorted(bctbx_vfs_tester_migration_progress.cbegin(),
+	                              bctbx_vfs_tester_migration_progress.cend()));
+	if (!bctbx_vfs_tester_migration_progress.empty()) {
+		BC_ASSERT_EQUAL(bctbx_vfs_tester_migration_progress.back(), fileSize, uint64_t, "%lu");
+	}
+
+	// background migration, the file is modified while it is migrated
+	content = create_plain_file(filePath, fileSize);
+	bctbx_vfs_tester_migration_in_background = true;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_FALSE(bctbx_file_is_encrypted(fp));
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, sizeof(message), 1000), (ssize_t)sizeof(message), ssize_t, "%ld");
+	std::copy(message, message + sizeof(message), content.begin() + 1000);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 42, fileSize), 42, ssize_t, "%ld");
+	content.insert(content.end(), message, message + 42);
+	BC_ASSERT_TRUE(VfsEncryption::migrationWait(filePath));
+	check_file_content(filePath, content, false); // still in use, it cannot be replaced
+	bctbx_file_close(fp);
+	// the migrated file replaces the plain one but the wrong key fails the opening: it does not leak nor double close
+	bctbx_vfs_tester_migration_wrong_key = true;
+	BC_ASSERT_PTR_NULL(bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR));
+	bctbx_vfs_tester_migration_wrong_key = false;
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR); // already replaced
+	BC_ASSERT_TRUE(bctbx_file_is_encrypted(fp));
+	bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+	BC_ASSERT_NOT_EQUAL(header_extension_size(filePath), 0, uint16_t, "%u");
+	BC_ASSERT_FALSE(VfsEncryption::migrationWait(filePath));
+
+	// background migration interrupted: cut the temporary file in the middle of its second batch and resume it
+	content = create_plain_file(filePath, fileSize);
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_TRUE(VfsEncryption::migrationWait(filePath));
+	bctbx_file_close(fp);
+	VfsEncryption::migrationStopAll();
+	fp = bctbx_file_open2(bctbx_vfs_get_standard(), tmpFilePath.data(), O_RDWR);
+	bctbx_file_truncate(fp, 1536 * 1024);
+	bctbx_file_close(fp);
+	bctbx_vfs_tester_migration_progress.clear();
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_FALSE(bctbx_file_is_encrypted(fp));
+	BC_ASSERT_TRUE(VfsEncryption::migrationWait(filePath));
+	bctbx_file_close(fp);
+	// resumed after the first 1.5MB, the rest is done in one batch
+	BC_ASSERT_EQUAL(bctbx_vfs_tester_migration_progress.size(), 1, size_t, "%zu");
+	check_file_content(filePath, content, false);
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_TRUE(bctbx_file_is_encrypted(fp));
+	bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+	BC_ASSERT_NOT_EQUAL(header_extension_size(filePath), 0, uint16_t, "%u");
+
+	// cleaning
+	std::remove(filePath.data());
+	BC_ASSERT_EQUAL(std::remove(tmpFilePath.data()), -1, int, "%d"); // temporary file is gone
+}
+void large_migration_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.sizeJournalSet(true);
+		if (bctbx_vfs_tester_migration_wrong_key) {
+			settings.secretMaterialSet(std::vector<uint8_t>(bctbx_vfs_tester_migration_key_size, 0x33));
+		}
+		settings.migrationInBackgroundSet(bctbx_vfs_tester_migration_in_background);
+		settings.migrationProgressCallbackSet([](const std::string &, uint64_t migrated, uint64_t) {
+			bctbx_vfs_tester_migration_progress.push_back(migrated);
+		});
+	});
+	bctbx_vfs_tester_chunk_size = 4096;
+
+	large_migration_test(EncryptionSuite::dummy);
+	large_migration_test(EncryptionSuite::aes256gcm128_sha256);
+
+	bctbx_vfs_tester_chunk_size = 16;
+	bctbx_vfs_tester_migration_in_background = false;
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Recover a file large enough to be checked in several batches, then corrupt one of its chunks and check the opening
+ * fails
+ */
+void large_recovery_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("large_recovery.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	std::vector<uint8_t> content(3 * 1024 * 1024 + 42);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 13 + i / 4093);
+	}
+	auto fileHeaderSize = (suite == bctoolbox::EncryptionSuite::dummy) ? (29 + 16) : (29 + 48);
+	std::vector<char> fileHeader(fileHeaderSize);
+
+	// create the file and save its header
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t, "%ld");
+	bctbx_file_close(fp);
+	std::fstream file(filePath, std::ios::in | std::ios::binary);
+	file.read(fileHeader.data(), fileHeaderSize);
+	file.close();
+
+	// shrink it and put back the old header: its size does not match anymore, the whole file is checked
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	content.resize(content.size() - 5000);
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size()), 0, int, "%d");
+	bctbx_file_close(fp);
+	file.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
+	file.write(fileHeader.data(), fileHeaderSize);
+	file.close();
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR); // recovery updates the header
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+
+	// once again but with a chunk in the middle of the file corrupted: the opening fails
+	file.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
+	file.read(fileHeader.data(), fileHeaderSize); // the header was updated by the recovery
+	file.seekp(2 * 1024 * 1024, std::ios::beg);
+	file.put(0x55);
+	file.close();
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size() - 5000), 0, int, "%d");
+	bctbx_file_close(fp);
+	file.open(filePath, std::ios::in | std::ios::out | std::ios::binary);
+	file.write(fileHeader.data(), fileHeaderSize);
+	file.close();
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	if (fp != NULL) bctbx_file_close(fp);
+
+	// cleaning
+	std::remove(filePath.data());
+}
+void large_recovery_test() {
+	VfsEncryption::openCallbackSet(set_encryption_info);
+	bctbx_vfs_tester_chunk_size = 4096;
+
+	large_recovery_test(EncryptionSuite::dummy);
+	large_recovery_test(EncryptionSuite::aes256gcm128_sha256);
+
+	bctbx_vfs_tester_chunk_size = 16;
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Grow a file by truncate and by writing after its end, with and without holes, write in the holes and truncate in
+ * them. The holes are recorded in the file header: they are read without sparse extension, and a chunk of zeros out of
+ * the recorded holes fails the authentication, in files with or without holes
+ */
+static bool bctbx_vfs_tester_sparse_extension = false;
+void sparse_extension_test(bctoolbox::EncryptionSuite suite, size_t chunkHeaderSize) {
+	char *path = bc_tester_file("sparse_extension.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+
+	for (bool sparse : {false, true}) {
+		bctbx_vfs_tester_sparse_extension = sparse;
+		remove(filePath.data());
+		std::vector<uint8_t> content(message, message + 10);
+		bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 10, 0), 10, ssize_t, "%ld");
+		content.resize(3 * 1024 * 1024 + 17, 0); // more than one batch of zeros
+		BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size()), 0, int, "%d");
+		BC_ASSERT_EQUAL(bctbx_file_size(fp), (ssize_t)content.size(), ssize_t, "%ld");
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 100, 10000), 100, ssize_t, "%ld");
+		memcpy(content.data() + 10000, message, 100);
+		BC_ASSERT_EQUAL(bctbx_file_write(fp, message + 100, 50, content.size() + 50000), 50, ssize_t, "%ld");
+		content.resize(content.size() + 50050, 0);
+		memcpy(content.data() + content.size() - 50, message + 100, 50);
+		BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size() - 30000), 0, int, "%d");
+		content.resize(content.size() - 30000);
+		bctbx_file_close(fp);
+		check_file_content(filePath, content, true);
+	}
+
+	// the file records its holes: they are read without sparse extension
+	bctbx_vfs_tester_sparse_extension = false;
+	uint8_t readBuffer[64];
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, 0), 64, ssize_t, "%ld");
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, 1024 * 1024), 64, ssize_t, "%ld");
+		BC_ASSERT_TRUE(std::all_of(readBuffer, readBuffer + 64, [](uint8_t b) { return b == 0; }));
+		bctbx_file_close(fp);
+	}
+
+	// 10 chunks, the last 9 are holes until the middle one is written: the aes suite header has room for one range of
+	// holes only, the chunks 1 to 4 get their zeros encrypted, the dummy one splits the range
+	bctbx_vfs_tester_sparse_extension = true;
+	remove(filePath.data());
+	std::vector<uint8_t> content(10 * 4096, 0);
+	std::fill(content.begin(), content.begin() + 4096, 0x5a);
+	std::fill(content.begin() + 5 * 4096, content.begin() + 6 * 4096, 0xa5);
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), 4096, 0), 4096, ssize_t, "%ld");
+	BC_ASSERT_EQUAL(bctbx_file_truncate(fp, content.size()), 0, int, "%d");
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data() + 5 * 4096, 4096, 5 * 4096), 4096, ssize_t, "%ld");
+	bctbx_file_close(fp);
+	check_file_content(filePath, content, true);
+	// zeroing the written chunks is detected, zeroing a hole is not a modification
+	std::vector<char> zeros(chunkHeaderSize + 4096, 0);
+	auto zeroChunk = [&](size_t chunkIndex) {
+		std::fstream file(filePath, std::ios::out | std::ios::in | std::ios::binary);
+		file.seekg(0, std::ios::end);
+		file.seekp(static_cast<std::streamoff>(file.tellg()) - (10 - chunkIndex) * zeros.size());
+		file.write(zeros.data(), zeros.size());
+	};
+	std::string backupPath{filePath + ".backup"};
+	copy_file(filePath, backupPath);
+	for (size_t chunkIndex : {0, 5}) {
+		zeroChunk(chunkIndex);
+		fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+		if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+			BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, chunkIndex * 4096), BCTBX_VFS_ERROR, ssize_t, "%ld");
+			bctbx_file_close(fp);
+		}
+		copy_file(backupPath, filePath);
+	}
+	zeroChunk(7);
+	check_file_content(filePath, content, true);
+	// the chunks 1 to 4 are holes only with the dummy suite
+	zeroChunk(2);
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		ssize_t expected = (suite == EncryptionSuite::dummy) ? 64 : BCTBX_VFS_ERROR;
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, 2 * 4096), expected, ssize_t, "%ld");
+		bctbx_file_close(fp);
+	}
+	remove(backupPath.data());
+
+	// a file created with sparse extension but never extended holds no hole: zeroing a chunk is detected
+	remove(filePath.data());
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	content.assign(3 * 4096, 0x5a);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t, "%ld");
+	bctbx_file_close(fp);
+	std::fstream file(filePath, std::ios::out | std::ios::in | std::ios::binary);
+	file.seekg(0, std::ios::end);
+	file.seekp(static_cast<std::streamoff>(file.tellg()) - 2 * zeros.size()); // the second of the 3 chunks
+	file.write(zeros.data(), zeros.size());
+	file.close();
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+	if (BC_ASSERT_PTR_NOT_NULL(fp)) {
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, 0), 64, ssize_t, "%ld");
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, 64, 4096), BCTBX_VFS_ERROR, ssize_t, "%ld");
+		bctbx_file_close(fp);
+	}
+
+	remove(filePath.data());
+}
+
+void sparse_extension_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.sparseExtensionSet(bctbx_vfs_tester_sparse_extension);
+		BC_ASSERT_EQUAL(settings.sparseExtensionGet(), bctbx_vfs_tester_sparse_extension, bool, "%d");
+	});
+	bctbx_vfs_tester_chunk_size = 4096;
+
+	sparse_extension_test(EncryptionSuite::dummy, 16);
+	sparse_extension_test(EncryptionSuite::aes256gcm128_sha256, 28);
+
+	bctbx_vfs_tester_chunk_size = 16;
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Read a file sequentially by small and large reads so the read ahead starts, with seeks and writes in between
+ */
+static size_t bctbx_vfs_tester_read_ahead_window = 0;
+void read_ahead_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("read_ahead.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+	std::vector<uint8_t> content(5000);
+	for (size_t i = 0; i < content.size(); i++) {
+		content[i] = static_cast<uint8_t>(i * 7 + i / 251);
+	}
+	std::vector<uint8_t> readBuffer(content.size());
+
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, content.data(), content.size(), 0), (ssize_t)content.size(), ssize_t, "%ld");
+	size_t offset = 0;
+	size_t step = 0;
+	while (offset < content.size()) {
+		size_t size = 3 + (step * 13) % 90;
+		if (step == 20) { // seek backward
+			offset -= 500;
+		}
+		if (step == 40) { // modify what was maybe read ahead
+			BC_ASSERT_EQUAL(bctbx_file_write(fp, message, 100, offset + 50), 100, ssize_t, "%ld");
+			memcpy(content.data() + offset + 50, message, 100);
+		}
+		if (step == 60) { // seek forward
+			offset += 700;
+		}
+		ssize_t expected = static_cast<ssize_t>(std::min(size, content.size() - offset));
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), size, offset), expected, ssize_t, "%ld");
+		BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data() + offset, expected) == 0);
+		offset += size;
+		step++;
+	}
+	// read the whole file at once
+	BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer.data(), readBuffer.size(), 0), (ssize_t)content.size(), ssize_t,
+	                "%ld");
+	BC_ASSERT_TRUE(memcmp(readBuffer.data(), content.data(), content.size()) == 0);
+	bctbx_file_close(fp);
+
+	remove(filePath.data());
+}
+
+void read_ahead_test() {
+	VfsEncryption::openCallbackSet([](VfsEncryption &settings) {
+		set_encryption_info(settings);
+		settings.readAheadWindowSet(bctbx_vfs_tester_read_ahead_window);
+		BC_ASSERT_EQUAL(settings.readAheadWindowGet(), bctbx_vfs_tester_read_ahead_window, size_t, "%zu");
+	});
+
+	// without worker threads the read ahead is deferred to the next read, with them it runs in background
+	for (size_t threads : {0, 2}) {
+		VfsEncryption::workerThreadsSet(threads);
+		for (auto window : {1, 8, 64}) {
+			bctbx_vfs_tester_read_ahead_window = window;
+			read_ahead_test(EncryptionSuite::dummy);
+			read_ahead_test(EncryptionSuite::aes256gcm128_sha256);
+		}
+	}
+
+	VfsEncryption::workerThreadsSet(0);
+	bctbx_vfs_tester_read_ahead_window = 0;
+	VfsEncryption::openCallbackSet(nullptr);
+}
+
+/**
+ * Open again a file which header key is in the derived key cache, but with another master key: it shall fail
+ */
+static void derived_key_cache_wrong_key_test(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("derived_key_cache.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+
+	VfsEncryption::openCallbackSet(set_encryption_info);
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, sizeof(message), 0), sizeof(message), ssize_t, "%ld");
+	bctbx_file_close(fp);
+	// open it again: the header key is now cached
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	if (fp != NULL) {
+		bctbx_file_close(fp);
+	}
+
+	VfsEncryption::openCallbackSet([suite](VfsEncryption &settings) {
+		std::vector<uint8_t> wrongKey(32, 0xA5);
+		settings.encryptionSuiteSet(suite);
+		settings.secretMaterialSet(wrongKey);
+		settings.chunkSizeSet(bctbx_vfs_tester_chunk_size);
+	});
+	fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR);
+	BC_ASSERT_PTR_NULL(fp);
+	if (fp != NULL) {
+		bctbx_file_close(fp);
+	}
+
+	VfsEncryption::openCallbackSet(nullptr);
+	remove(filePath.data());
+}
+
+/**
+ * Measure the number of open/read/close cycles per second on the same file, log it so it can be compared with and
+ * without the derived key cache
+ */
+static void open_benchmark(bctoolbox::EncryptionSuite suite) {
+	char *path = bc_tester_file("open_benchmark.");
+	std::string filePath{path};
+	filePath.append(bctoolbox::encryptionSuiteString(suite)).append(".evfs");
+	bctbx_free(path);
+	remove(filePath.data());
+
+	VfsEncryption::openCallbackSet(set_encryption_info);
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDWR | O_CREAT);
+	BC_ASSERT_EQUAL(bctbx_file_write(fp, message, sizeof(message), 0), sizeof(message), ssize_t, "%ld");
+	bctbx_file_close(fp);
+
+	constexpr size_t opens = 500;
+	uint8_t readBuffer[sizeof(message)];
+	uint64_t start = bctbx_get_cur_time_ms();
+	for (size_t i = 0; i < opens; i++) {
+		fp = bctbx_file_open2(&bcEncryptedVfs, filePath.data(), O_RDONLY);
+		if (!BC_ASSERT_PTR_NOT_NULL(fp)) {
+			break;
+		}
+		BC_ASSERT_EQUAL(bctbx_file_read(fp, readBuffer, sizeof(readBuffer), 0), sizeof(message), ssize_t, "%ld");
+		bctbx_file_close(fp);
+	}
+	uint64_t elapsed = std::max(bctbx_get_cur_time_ms() - start, static_cast<uint64_t>(1));
+	BCTBX_SLOGI << "Encrypted VFS: " << encryptionSuiteString(suite) << " derived key cache size "
+	            << VfsEncryption::derivedKeyCacheSizeGet() << ": " << (opens * 1000 / elapsed) << " opens/s";
+
+	VfsEncryption::openCallbackSet(nullptr);
+	remove(filePath.data());
+}
+
+void derived_key_cache_test() {
+	for (auto suite : {EncryptionSuite::aes256gcm128_sha256, EncryptionSuite::aes256gcm128_filekey_sha256}) {
+		open_benchmark(suite);
+	}
+
+	VfsEncryption::derivedKeyCacheSizeSet(8);
+	BC_ASSERT_EQUAL(VfsEncryption::derivedKeyCacheSizeGet(), 8, size_t, "%zu");
+
+	for (auto suite : {EncryptionSuite::aes256gcm128_sha256, EncryptionSuite::aes256gcm128_filekey_sha256}) {
+		open_benchmark(suite);
+		derived_key_cache_wrong_key_test(suite);
+	}
+	basic_encryption_test();
+	auth_fail_test();
+
+	VfsEncryption::derivedKeyCacheSizeSet(0);
+	BC_ASSERT_EQUAL(VfsEncryption::derivedKeyCacheSizeGet(), 0, size_t, "%zu");
+}
+
+/**
+ * Run the tests again with worker threads, use a low threshold so even small operations are spread on them
+ */
+void worker_threads_test() {
+	VfsEncryption::workerThreadsSet(3);
+	VfsEncryption::parallelChunkThresholdSet(2);
+	BC_ASSERT_EQUAL(VfsEncryption::workerThreadsGet(), 3, size_t, "%zu");
+	BC_ASSERT_EQUAL(VfsEncryption::parallelChunkThresholdGet(), 2, size_t, "%zu");
+
+	basic_encryption_test();
+	auth_fail_test();
+	migration_test();
+	recovery_test();
+	plain_chunk_cache_test();
+	large_migration_test();
+	large_recovery_test();
+
+	VfsEncryption::workerThreadsSet(0);
+	VfsEncryption::parallelChunkThresholdSet(16);
+	BC_ASSERT_EQUAL(VfsEncryption::workerThreadsGet(), 0, size_t, "%zu");
+}
+
 static test_t encrypted_vfs_tests[] = {TEST_NO_TAG("basic", basic_encryption_test),
                                        TEST_NO_TAG("Authentication failure", auth_fail_test),
+                                       TEST_NO_TAG("chunk swap", chunk_swap_test),
                                        TEST_NO_TAG("migration", migration_test), TEST_NO_TAG("recovery", recovery_test),
-                                       TEST_NO_TAG("fprintf", fprintf_encryption_test)};
+                                       TEST_NO_TAG("fprintf", fprintf_encryption_test),
+                                       TEST_NO_TAG("get line", get_line_test),
+                                       TEST_NO_TAG("chunk key cache", chunk_key_cache_test),
+                                       TEST_NO_TAG("plain chunk cache", plain_chunk_cache_test),
+                                       TEST_NO_TAG("deferred header", deferred_header_test),
+                                       TEST_NO_TAG("size journal", size_journal_test),
+                                       TEST_NO_TAG("integrity tree", integrity_tree_test),
+                                       TEST_NO_TAG("rekey", rekey_test), TEST_NO_TAG("stats", stats_test),
+                                       TEST_NO_TAG("write back buffer", write_back_buffer_test),
+                                       TEST_NO_TAG("sparse extension", sparse_extension_test),
+                                       TEST_NO_TAG("read ahead", read_ahead_test),
+                                       TEST_NO_TAG("derived key cache", derived_key_cache_test),
+                                       TEST_NO_TAG("large migration", large_migration_test),
+                                       TEST_NO_TAG("large recovery", large_recovery_test),
+                                       TEST_NO_TAG("worker threads", worker_threads_test)};
 
 test_suite_t encrypted_vfs_test_suite = {
     "Encrypted vfs",    NULL, NULL, NULL, NULL, sizeof(encrypted_vfs_tests) / sizeof(encrypted_vfs_tests[0]),
@@ -19,8 +19,11 @@
 
 #include "bctoolbox/vfs.h"
 #include "bctoolbox/logging.h"
+#include "bctoolbox/vfs_async.h"
+#include "bctoolbox/vfs_mmap.h"
 #include "bctoolbox/vfs_standard.h"
 #include "bctoolbox_tester.h"
+#include <sys/stat.h>
 
 static char *patterns[] = {
     "this is a small pattern",
@@ -284,9 +287,436 @@ void file_get_nxtline_test() {
 	bctbx_free(path);
 }
 
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_BLOCK_SIZE 4096
+#define CONCURRENT_BLOCKS 64
+
+typedef struct {
+	bctbx_vfs_file_t *fp;
+	int id;
+	int errors;
+} concurrent_io_ctx_t;
+
+/* each thread writes then reads back its own interleaved blocks: block i belongs to thread i % CONCURRENT_THREADS */
+static void *concurrent_io_thread(void *arg) {
+	concurrent_io_ctx_t *ctx = (concurrent_io_ctx_t *)arg;
+	uint8_t in_buf[CONCURRENT_BLOCK_SIZE];
+	uint8_t out_buf[CONCURRENT_BLOCK_SIZE];
+	int i;
+	for (i = ctx->id; i < CONCURRENT_BLOCKS; i += CONCURRENT_THREADS) {
+		memset(in_buf, i, CONCURRENT_BLOCK_SIZE);
+		if (bctbx_file_write(ctx->fp, in_buf, CONCURRENT_BLOCK_SIZE, (off_t)i * CONCURRENT_BLOCK_SIZE) !=
+		    CONCURRENT_BLOCK_SIZE) {
+			ctx->errors++;
+		}
+	}
+	for (i = ctx->id; i < CONCURRENT_BLOCKS; i += CONCURRENT_THREADS) {
+		memset(in_buf, i, CONCURRENT_BLOCK_SIZE);
+		if (bctbx_file_read(ctx->fp, out_buf, CONCURRENT_BLOCK_SIZE, (off_t)i * CONCURRENT_BLOCK_SIZE) !=
+		        CONCURRENT_BLOCK_SIZE ||
+		    memcmp(in_buf, out_buf, CONCURRENT_BLOCK_SIZE) != 0) {
+			ctx->errors++;
+		}
+	}
+	return NULL;
+}
+
+void file_concurrent_io_test() {
+	bctbx_thread_t threads[CONCURRENT_THREADS];
+	concurrent_io_ctx_t ctx[CONCURRENT_THREADS];
+	uint8_t out_buf[CONCURRENT_BLOCK_SIZE];
+	int i;
+
+	char *path = bc_tester_file("vfs_concurrent_io.bin");
+	remove(path);
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcStandardVfs, path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+
+	/* reads and writes at explicit offsets issued concurrently on the same handle */
+	for (i = 0; i < CONCURRENT_THREADS; i++) {
+		ctx[i].fp = fp;
+		ctx[i].id = i;
+		ctx[i].errors = 0;
+		bctbx_thread_create(&threads[i], NULL, concurrent_io_thread, &ctx[i]);
+	}
+	for (i = 0; i < CONCURRENT_THREADS; i++) {
+		bctbx_thread_join(threads[i], NULL);
+		BC_ASSERT_EQUAL(ctx[i].errors, 0, int, "%d");
+	}
+	BC_ASSERT_EQUAL((int)bctbx_file_size(fp), CONCURRENT_BLOCKS * CONCURRENT_BLOCK_SIZE, int, "%d");
+
+	/* each block holds the data of its writer */
+	for (i = 0; i < CONCURRENT_BLOCKS; i++) {
+		BC_ASSERT_EQUAL(
+		    (int)bctbx_file_read(fp, out_buf, CONCURRENT_BLOCK_SIZE, (off_t)i * CONCURRENT_BLOCK_SIZE),
+		    CONCURRENT_BLOCK_SIZE, int, "%d");
+		BC_ASSERT_EQUAL(out_buf[0], (uint8_t)i, uint8_t, "%d");
+		BC_ASSERT_EQUAL(out_buf[CONCURRENT_BLOCK_SIZE - 1], (uint8_t)i, uint8_t, "%d");
+	}
+
+	/* cleaning */
+	bctbx_file_close(fp);
+	remove(path);
+	bctbx_free(path);
+}
+
+static void file_vectored_io_check(bctbx_vfs_file_t *fp) {
+	uint8_t a[100], b[1000], c[10];
+	uint8_t out_a[100], out_b[1000], out_c[10];
+	uint8_t flat[1110];
+	bctbx_vfs_iovec_t in_iov[3] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+	bctbx_vfs_iovec_t out_iov[3] = {{out_a, sizeof(out_a)}, {out_b, sizeof(out_b)}, {out_c, sizeof(out_c)}};
+	memset(a, 'a', sizeof(a));
+	memset(b, 'b', sizeof(b));
+	memset(c, 'c', sizeof(c));
+
+	/* write the buffers one after the other at an offset, read them back at once */
+	BC_ASSERT_EQUAL((int)bctbx_file_writev(fp, in_iov, 3, 10), 1110, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_size(fp), 1120, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_read(fp, flat, sizeof(flat), 10), 1110, int, "%d");
+	BC_ASSERT_TRUE(memcmp(flat, a, sizeof(a)) == 0);
+	BC_ASSERT_TRUE(memcmp(flat + sizeof(a), b, sizeof(b)) == 0);
+	BC_ASSERT_TRUE(memcmp(flat + sizeof(a) + sizeof(b), c, sizeof(c)) == 0);
+
+	/* scatter a read */
+	BC_ASSERT_EQUAL((int)bctbx_file_readv(fp, out_iov, 3, 10), 1110, int, "%d");
+	BC_ASSERT_TRUE(memcmp(out_a, a, sizeof(a)) == 0);
+	BC_ASSERT_TRUE(memcmp(out_b, b, sizeof(b)) == 0);
+	BC_ASSERT_TRUE(memcmp(out_c, c, sizeof(c)) == 0);
+
+	/* a read reaching the end of file is short */
+	memset(out_c, 0, sizeof(out_c));
+	BC_ASSERT_EQUAL((int)bctbx_file_readv(fp, out_iov, 3, 20), 1100, int, "%d");
+	BC_ASSERT_TRUE(memcmp(out_b + 990, c, 10) == 0);
+	BC_ASSERT_EQUAL((int)bctbx_file_readv(fp, out_iov, 3, 2000), 0, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_readv(fp, out_iov, 0, 0), 0, int, "%d");
+
+	/* more buffers than a single system call accepts */
+	int many_count = 5000;
+	uint8_t *many_in = bctbx_malloc(many_count);
+	uint8_t *many_out = bctbx_malloc0(many_count);
+	bctbx_vfs_iovec_t *many_iov = bctbx_malloc(many_count * sizeof(bctbx_vfs_iovec_t));
+	for (int i = 0; i < many_count; i++) {
+		many_in[i] = (uint8_t)(i * 7);
+		many_iov[i].base = many_in + i;
+		many_iov[i].len = 1;
+	}
+	BC_ASSERT_EQUAL((int)bctbx_file_writev(fp, many_iov, many_count, 2000), many_count, int, "%d");
+	for (int i = 0; i < many_count; i++) {
+		many_iov[i].base = many_out + i;
+	}
+	BC_ASSERT_EQUAL((int)bctbx_file_readv(fp, many_iov, many_count, 2000), many_count, int, "%d");
+	BC_ASSERT_TRUE(memcmp(many_in, many_out, many_count) == 0);
+	bctbx_free(many_iov);
+	bctbx_free(many_out);
+	bctbx_free(many_in);
+}
+
+void file_vectored_io_test() {
+	char *path = bc_tester_file("vfs_vectored_io.bin");
+	remove(path);
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcStandardVfs, path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	file_vectored_io_check(fp);
+	bctbx_file_close(fp);
+	remove(path);
+
+	/* same operations on a VFS without vectored methods: one read or write per buffer */
+	fp = bctbx_file_open2(&bcStandardVfs, path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	const bctbx_io_methods_t *methods = fp->pMethods;
+	bctbx_io_methods_t emulated = *methods;
+	emulated.pFuncReadv = NULL;
+	emulated.pFuncWritev = NULL;
+	fp->pMethods = &emulated;
+	file_vectored_io_check(fp);
+	fp->pMethods = methods;
+
+	/* cleaning */
+	bctbx_file_close(fp);
+	remove(path);
+	bctbx_free(path);
+}
+
+void file_mmap_test() {
+	uint8_t in_buf[3000];
+	uint8_t out_buf[3000];
+	const void *view = NULL;
+	size_t i;
+	for (i = 0; i < sizeof(in_buf); i++) {
+		in_buf[i] = (uint8_t)(i * 7);
+	}
+
+	char *path = bc_tester_file("vfs_mmap.bin");
+	remove(path);
+	bctbx_vfs_file_t *writer = bctbx_file_open2(bctbx_vfs_get_standard(), path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(writer);
+	BC_ASSERT_EQUAL((int)bctbx_file_write(writer, in_buf, 1000, 0), 1000, int, "%d");
+
+	/* read only: served from the mapping */
+	bctbx_vfs_file_t *fp = bctbx_file_open2(bctbx_vfs_get_mmap(), path, O_RDONLY);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	BC_ASSERT_EQUAL((int)bctbx_file_size(fp), 1000, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_read(fp, out_buf, 100, 50), 100, int, "%d");
+	BC_ASSERT_TRUE(memcmp(out_buf, in_buf + 50, 100) == 0);
+	BC_ASSERT_EQUAL((int)bctbx_file_read(fp, out_buf, 1000, 900), 100, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_write(fp, in_buf, 10, 0), BCTBX_VFS_ERROR, int, "%d");
+
+	/* borrow a view on the content */
+	BC_ASSERT_EQUAL((int)bctbx_file_view_borrow(fp, 200, 300, &view), 300, int, "%d");
+	BC_ASSERT_PTR_NOT_NULL(view);
+	if (view != NULL) BC_ASSERT_TRUE(memcmp(view, in_buf + 200, 300) == 0);
+
+	/* the file grows while a view is borrowed: the new part is read from the file */
+	BC_ASSERT_EQUAL((int)bctbx_file_write(writer, in_buf + 1000, 1000, 1000), 1000, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_read(fp, out_buf, 200, 900), 200, int, "%d");
+	BC_ASSERT_TRUE(memcmp(out_buf, in_buf + 900, 200) == 0);
+	if (view != NULL) BC_ASSERT_TRUE(memcmp(view, in_buf + 200, 300) == 0);
+	const void *tail = NULL;
+	BC_ASSERT_EQUAL((int)bctbx_file_view_borrow(fp, 900, 200, &tail), 100, int, "%d");
+	bctbx_file_view_release(fp, tail);
+	bctbx_file_view_release(fp, view);
+
+	/* no view borrowed anymore: the file is mapped again */
+	BC_ASSERT_EQUAL((int)bctbx_file_write(writer, in_buf + 2000, 1000, 2000), 1000, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_view_borrow(fp, 0, 3000, &view), 3000, int, "%d");
+	if (view != NULL) BC_ASSERT_TRUE(memcmp(view, in_buf, 3000) == 0);
+	bctbx_file_view_release(fp, view);
+	BC_ASSERT_EQUAL((int)bctbx_file_view_borrow(fp, 3000, 10, &view), 0, int, "%d");
+	BC_ASSERT_PTR_NULL(view);
+	bctbx_file_close(fp);
+
+	/* writable opens are standard files */
+	fp = bctbx_file_open2(bctbx_vfs_get_mmap(), path, O_RDWR);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	BC_ASSERT_EQUAL((int)bctbx_file_write(fp, in_buf, 10, 3000), 10, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_view_borrow(fp, 0, 10, &view), BCTBX_VFS_ERROR, int, "%d");
+	bctbx_file_close(fp);
+
+	/* cleaning */
+	bctbx_file_close(writer);
+	remove(path);
+
+	/* a read only open creating the file gives it the standard VFS permissions */
+	fp = bctbx_file_open2(bctbx_vfs_get_mmap(), path, O_RDONLY | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	BC_ASSERT_EQUAL((int)bctbx_file_read(fp, out_buf, 10, 0), 0, int, "%d");
+	bctbx_file_close(fp);
+#ifndef _WIN32
+	struct stat st;
+	BC_ASSERT_EQUAL(stat(path, &st), 0, int, "%d");
+	BC_ASSERT_EQUAL((int)(st.st_mode & (S_IRUSR | S_IWUSR)), S_IRUSR | S_IWUSR, int, "%d");
+#endif
+	remove(path);
+	bctbx_free(path);
+}
+
+#define ASYNC_BLOCK_SIZE 4096
+#define ASYNC_BLOCKS 32
+
+typedef struct {
+	bctbx_mutex_t mutex;
+	int completed;
+	int errors;
+	ssize_t bytes;
+} async_io_ctx_t;
+
+static void async_io_done(void *userData, ssize_t result) {
+	async_io_ctx_t *ctx = (async_io_ctx_t *)userData;
+	bctbx_mutex_lock(&ctx->mutex);
+	ctx->completed++;
+	if (result < 0) {
+		ctx->errors++;
+	} else {
+		ctx->bytes += result;
+	}
+	bctbx_mutex_unlock(&ctx->mutex);
+}
+
+static void file_async_io_check(bctbx_vfs_async_queue_t *queue, bctbx_vfs_file_t *fp) {
+	static uint8_t in_buf[ASYNC_BLOCKS * ASYNC_BLOCK_SIZE];
+	static uint8_t out_buf[ASYNC_BLOCKS * ASYNC_BLOCK_SIZE];
+	async_io_ctx_t ctx;
+	int i;
+	memset(&ctx, 0, sizeof(ctx));
+	bctbx_mutex_init(&ctx.mutex, NULL);
+	for (i = 0; i < ASYNC_BLOCKS * ASYNC_BLOCK_SIZE; i++) {
+		in_buf[i] = (uint8_t)(i / ASYNC_BLOCK_SIZE + i);
+	}
+	memset(out_buf, 0, sizeof(out_buf));
+
+	/* write all the blocks, last one first, then sync */
+	for (i = ASYNC_BLOCKS - 1; i >= 0; i--) {
+		BC_ASSERT_EQUAL(bctbx_file_write_async(queue, fp, in_buf + i * ASYNC_BLOCK_SIZE, ASYNC_BLOCK_SIZE,
+		                                       (off_t)i * ASYNC_BLOCK_SIZE, async_io_done, &ctx),
+		                BCTBX_VFS_OK, int, "%d");
+	}
+	bctbx_vfs_async_queue_wait(queue);
+	BC_ASSERT_EQUAL(bctbx_file_sync_async(queue, fp, async_io_done, &ctx), BCTBX_VFS_OK, int, "%d");
+	bctbx_vfs_async_queue_wait(queue);
+	BC_ASSERT_EQUAL(ctx.completed, ASYNC_BLOCKS + 1, int, "%d");
+	BC_ASSERT_EQUAL(ctx.errors, 0, int, "%d");
+	BC_ASSERT_EQUAL((int)ctx.bytes, ASYNC_BLOCKS * ASYNC_BLOCK_SIZE, int, "%d");
+	BC_ASSERT_EQUAL((int)bctbx_file_size(fp), ASYNC_BLOCKS * ASYNC_BLOCK_SIZE, int, "%d");
+
+	/* read them back, the last read is short */
+	ctx.completed = 0;
+	ctx.bytes = 0;
+	for (i = 0; i < ASYNC_BLOCKS; i++) {
+		BC_ASSERT_EQUAL(bctbx_file_read_async(queue, fp, out_buf + i * ASYNC_BLOCK_SIZE,
+		                                      (i == ASYNC_BLOCKS - 1) ? 2 * ASYNC_BLOCK_SIZE : ASYNC_BLOCK_SIZE,
+		                                      (off_t)i * ASYNC_BLOCK_SIZE, async_io_done, &ctx),
+		                BCTBX_VFS_OK, int, "%d");
+	}
+	bctbx_vfs_async_queue_wait(queue);
+	BC_ASSERT_EQUAL(ctx.completed, ASYNC_BLOCKS, int, "%d");
+	BC_ASSERT_EQUAL(ctx.errors, 0, int, "%d");
+	BC_ASSERT_EQUAL((int)ctx.bytes, ASYNC_BLOCKS * ASYNC_BLOCK_SIZE, int, "%d");
+	BC_ASSERT_TRUE(memcmp(in_buf, out_buf, sizeof(in_buf)) == 0);
+
+	BC_ASSERT_EQUAL(bctbx_file_read_async(queue, fp, out_buf, 10, -1, async_io_done, &ctx), BCTBX_VFS_ERROR, int,
+	                "%d");
+	bctbx_mutex_destroy(&ctx.mutex);
+}
+
+/* methods of a VFS not supporting concurrent calls: check the queue calls them one at a time */
+static const bctbx_io_methods_t *serial_methods = NULL;
+static bctbx_mutex_t serial_mutex;
+static int serial_calls = 0;
+static int serial_overlaps = 0;
+
+static void serial_call_enter(void) {
+	bctbx_mutex_lock(&serial_mutex);
+	if (++serial_calls > 1) serial_overlaps++;
+	bctbx_mutex_unlock(&serial_mutex);
+	bctbx_sleep_ms(1);
+}
+
+static void serial_call_leave(void) {
+	bctbx_mutex_lock(&serial_mutex);
+	serial_calls--;
+	bctbx_mutex_unlock(&serial_mutex);
+}
+
+static ssize_t serial_read(bctbx_vfs_file_t *pFile, void *buf, size_t count, off_t offset) {
+	serial_call_enter();
+	ssize_t ret = serial_methods->pFuncRead(pFile, buf, count, offset);
+	serial_call_leave();
+	return ret;
+}
+
+static ssize_t serial_write(bctbx_vfs_file_t *pFile, const void *buf, size_t count, off_t offset) {
+	serial_call_enter();
+	ssize_t ret = serial_methods->pFuncWrite(pFile, buf, count, offset);
+	serial_call_leave();
+	return ret;
+}
+
+typedef struct {
+	async_io_ctx_t io;
+	bctbx_vfs_async_queue_t *queue;
+	bctbx_vfs_file_t *fp;
+	uint8_t buf[16];
+	int remaining;
+} async_chain_ctx_t;
+
+/* submit the next read of the chain from the callback */
+static void async_chain_done(void *userData, ssize_t result) {
+	async_chain_ctx_t *chain = (async_chain_ctx_t *)userData;
+	async_io_done(&chain->io, result);
+	if (chain->remaining > 0) {
+		chain->remaining--;
+		bctbx_sleep_ms(1); /* let a submitter waiting for a slot take the one freed by this request */
+		if (bctbx_file_read_async(chain->queue, chain->fp, chain->buf, sizeof(chain->buf), 0, async_chain_done,
+		                          chain) != BCTBX_VFS_OK) {
+			async_io_done(&chain->io, BCTBX_VFS_ERROR);
+		}
+	}
+}
+
+void file_async_io_test() {
+	char *path = bc_tester_file("vfs_async_io.bin");
+	remove(path);
+	bctbx_vfs_async_queue_t *queue = bctbx_vfs_async_queue_new(8, 2);
+	BC_ASSERT_PTR_NOT_NULL(queue);
+	bctbx_vfs_file_t *fp = bctbx_file_open2(&bcStandardVfs, path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	bctbx_message("asynchronous I/O on the standard VFS %s io_uring",
+	              bctbx_vfs_async_queue_uses_io_uring(queue) ? "using" : "not using");
+	file_async_io_check(queue, fp);
+	bctbx_file_close(fp);
+	remove(path);
+
+	/* same operations on a file of another VFS: run one at a time by the threads of the queue */
+	fp = bctbx_file_open2(&bcStandardVfs, path, O_RDWR | O_CREAT);
+	BC_ASSERT_PTR_NOT_NULL(fp);
+	const bctbx_io_methods_t *methods = fp->pMethods;
+	bctbx_io_methods_t other = *methods;
+	other.pFuncRead = serial_read;
+	other.pFuncWrite = serial_write;
+	serial_methods = methods;
+	bctbx_mutex_init(&serial_mutex, NULL);
+	fp->pMethods = &other;
+	file_async_io_check(queue, fp);
+	fp->pMethods = methods;
+	BC_ASSERT_EQUAL(serial_overlaps, 0, int, "%d");
+	bctbx_mutex_destroy(&serial_mutex);
+
+	/* callbacks submitting while the queue is full do not wait for a slot */
+	bctbx_vfs_async_queue_t *small_queue = bctbx_vfs_async_queue_new(1, 1);
+	async_chain_ctx_t chain;
+	uint8_t small_buf[16];
+	int i;
+	memset(&chain, 0, sizeof(chain));
+	bctbx_mutex_init(&chain.io.mutex, NULL);
+	chain.queue = small_queue;
+	chain.fp = fp;
+	chain.remaining = 32;
+	BC_ASSERT_EQUAL(bctbx_file_read_async(small_queue, fp, chain.buf, sizeof(chain.buf), 0, async_chain_done, &chain),
+	                BCTBX_VFS_OK, int, "%d");
+	for (i = 0; i < 32; i++) {
+		BC_ASSERT_EQUAL(bctbx_file_read_async(small_queue, fp, small_buf, sizeof(small_buf), 0, NULL, NULL),
+		                BCTBX_VFS_OK, int, "%d");
+	}
+	bctbx_vfs_async_queue_wait(small_queue);
+	BC_ASSERT_EQUAL(chain.io.completed, 33, int, "%d");
+	BC_ASSERT_EQUAL(chain.io.errors, 0, int, "%d");
+	bctbx_mutex_destroy(&chain.io.mutex);
+	bctbx_vfs_async_queue_destroy(small_queue);
+
+	/* errors are given to the callback */
+	bctbx_vfs_file_t *writeOnly = bctbx_file_open2(&bcStandardVfs, path, O_WRONLY);
+	BC_ASSERT_PTR_NOT_NULL(writeOnly);
+	async_io_ctx_t ctx;
+	uint8_t out_buf[10];
+	memset(&ctx, 0, sizeof(ctx));
+	bctbx_mutex_init(&ctx.mutex, NULL);
+	BC_ASSERT_EQUAL(bctbx_file_read_async(queue, writeOnly, out_buf, 10, 0, async_io_done, &ctx), BCTBX_VFS_OK, int,
+	                "%d");
+	bctbx_vfs_async_queue_wait(queue);
+	BC_ASSERT_EQUAL(ctx.completed, 1, int, "%d");
+	BC_ASSERT_EQUAL(ctx.errors, 1, int, "%d");
+	bctbx_mutex_destroy(&ctx.mutex);
+	bctbx_file_close(writeOnly);
+
+	/* pending fprintf output is refused */
+	BC_ASSERT_TRUE(bctbx_file_fprintf(fp, 0, "%s", patterns[0]) > 0);
+	BC_ASSERT_EQUAL(bctbx_file_sync_async(queue, fp, NULL, NULL), BCTBX_VFS_ERROR, int, "%d");
+
+	/* cleaning */
+	bctbx_vfs_async_queue_destroy(queue);
+	bctbx_file_close(fp);
+	remove(path);
+	bctbx_free(path);
+}
+
 static test_t vfs_tests[] = {TEST_NO_TAG("File fprint - simple", file_fprint_simple_test),
                              TEST_NO_TAG("File fprint and file_write mixed", file_fprint_and_write_test),
-                             TEST_NO_TAG("File get next line", file_get_nxtline_test)};
+                             TEST_NO_TAG("File get next line", file_get_nxtline_test),
+                             TEST_NO_TAG("File concurrent read and write", file_concurrent_io_test),
+                             TEST_NO_TAG("File vectored read and write", file_vectored_io_test),
+                             TEST_NO_TAG("File memory mapped", file_mmap_test),
+                             TEST_NO_TAG("File asynchronous read and write", file_async_io_test)};
 
 
 test_suite_t vfs_test_suite = {"vfs", NULL, NULL, NULL, NULL, sizeof(vfs_tests) / sizeof(vfs_tests[0]), vfs_tests, 0};
\ No newline at end of file
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2016-2020 Belledonne Communications SARL.
+ *
+ * This file is part of bctoolbox.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Command line tool working on files of the encrypted VFS, offline:
+ *  - stats: print the settings of files and their raw overhead
+ *  - verify: decrypt whole files, several at once, so every chunk is authenticated
+ *  - rewrite: copy a file to a new one with another chunk size, encryption suite or key
+ */
+
+#include "bctoolbox/logging.h"
+#include "bctoolbox/vfs.h"
+#include "bctoolbox/vfs_encrypted.hh"
+#include "bctoolbox/vfs_standard.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// someone does include the evil windef.h so we must undef the min and max macros to be able to use std::min and
+// std::max
+#undef min
+#undef max
+
+using namespace bctoolbox;
+
+namespace {
+
+constexpr size_t ioBlockBytes = 1 << 20; // size of the plain data read or written at once
+
+/* settings of a file created by the tool */
+struct NewFileSettings {
+	EncryptionSuite suite = EncryptionSuite::unset;
+	size_t chunkSize = 0;
+	std::vector<uint8_t> secretMaterial{};
+	bool sizeJournal = false;
+	bool integrityTree = false;
+};
+
+std::vector<uint8_t> secretMaterial{};              // secret material of the existing files
+std::map<std::string, NewFileSettings> createdFiles{}; // filled before the files are opened
+
+/* existing files get the secret material, plain ones are read as they are */
+void openCallback(VfsEncryption &settings) {
+	auto created = createdFiles.find(settings.filenameGet());
+	if (created != createdFiles.cend()) {
+		const auto &newFile = created->second;
+		settings.encryptionSuiteSet(newFile.suite);
+		settings.chunkSizeSet(newFile.chunkSize);
+		settings.sizeJournalSet(newFile.sizeJournal);
+		settings.integrityTreeSet(newFile.integrityTree);
+		settings.secretMaterialSet(newFile.secretMaterial);
+		settings.headerUpdateIntervalSet(0); // written once, at closing
+		return;
+	}
+	if (settings.encryptionSuiteGet() == EncryptionSuite::plain) {
+		return;
+	}
+	if (secretMaterial.empty()) {
+		throw EVFS_EXCEPTION << "file " << settings.filenameGet() << " is encrypted, a key file must be given";
+	}
+	settings.secretMaterialSet(secretMaterial);
+}
+
+void usage() {
+	std::cerr << "usage:" << std::endl
+	          << "  bctoolbox-evfs [-k <key file>] stats <file>..." << std::endl
+	          << "  bctoolbox-evfs [-k <key file>] [-j <threads>] verify <file>..." << std::endl
+	          << "  bctoolbox-evfs [-k <key file>] rewrite [--suite <suite>] [--chunk-size <bytes>] "
+	             "[--new-key <key file>] [--size-journal] [--integrity-tree] <source> [<destination>]"
+	          << std::endl
+	          << "Key files hold the raw secret material. Without destination, rewrite replaces the source."
+	          << std::endl
+	          << "Suites: dummy, AES256GCM_SHA256, CHACHA20POLY1305_SHA256, AES256GCM_FILEKEY_SHA256" << std::endl;
+}
+
+std::vector<uint8_t> readKeyFile(const std::string &path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		throw EVFS_EXCEPTION << "cannot read key file " << path;
+	}
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+EncryptionSuite parseSuite(const std::string &name) {
+	for (auto suite : {EncryptionSuite::dummy, EncryptionSuite::aes256gcm128_sha256,
+	                   EncryptionSuite::chacha20poly1305_sha256, EncryptionSuite::aes256gcm128_filekey_sha256}) {
+		if (encryptionSuiteString(suite) == name) {
+			return suite;
+		}
+	}
+	throw EVFS_EXCEPTION << "unknown encryption suite " << name;
+}
+
+bool fileExists(const std::string &path) {
+	return std::ifstream(path).good();
+}
+
+uint64_t rawFileSize(const std::string &path) {
+	auto fp = bctbx_file_open2(bctbx_vfs_get_standard(), path.data(), O_RDONLY);
+	if (fp == nullptr) {
+		return 0;
+	}
+	auto size = bctbx_file_size(fp);
+	bctbx_file_close(fp);
+	return static_cast<uint64_t>(std::max(size, ssize_t(0)));
+}
+
+/**
+ * Open a file with the encrypted VFS
+ * @return the file and its encryption context, nullptr if the file is plain
+ */
+std::pair<bctbx_vfs_file_t *, VfsEncryption *> openFile(const std::string &path, int flags) {
+	auto fp = bctbx_file_open2(&bcEncryptedVfs, path.data(), flags);
+	if (fp == nullptr) {
+		throw EVFS_EXCEPTION << "cannot open file " << path;
+	}
+	return {fp, static_cast<VfsEncryption *>(fp->pUserData)};
+}
+
+int stats(const std::vector<std::string> &files) {
+	int ret = 0;
+	for (const auto &path : files) {
+		try {
+			auto file = openFile(path, O_RDONLY);
+			auto ctx = file.second;
+			const uint64_t plainSize = static_cast<uint64_t>(ctx->fileSizeGet());
+			const uint64_t rawSize = rawFileSize(path);
+			const uint64_t overhead = rawSize - std::min(rawSize, plainSize);
+			std::cout << path << std::endl
+			          << "  suite:          " << encryptionSuiteString(ctx->encryptionSuiteGet()) << std::endl
+			          << "  chunk size:     " << ctx->chunkSizeGet() << std::endl
+			          << "  plain size:     " << plainSize << std::endl
+			          << "  raw size:       " << rawSize << std::endl
+			          << "  overhead:       " << overhead << " bytes ("
+			          << ((plainSize > 0) ? overhead * 100 / plainSize : 0) << "%)" << std::endl
+			          << "  size journal:   " << (ctx->sizeJournalGet() ? "yes" : "no") << std::endl
+			          << "  integrity tree: " << (ctx->integrityTreeRootGet().empty() ? "no" : "yes") << std::endl;
+			if (ctx->rekeyInProgressGet()) {
+				std::cout << "  re-keying:      " << ctx->rekeyProgressGet() << " bytes done" << std::endl;
+			}
+			bctbx_file_close(file.first);
+		} catch (std::exception const &e) {
+			std::cerr << path << ": " << e.what() << std::endl;
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Decrypt the whole file, then check it against its integrity tree if it has one
+ */
+void verifyFile(const std::string &path) {
+	auto file = openFile(path, O_RDONLY);
+	std::vector<uint8_t> buffer(ioBlockBytes);
+	const uint64_t size = static_cast<uint64_t>(bctbx_file_size(file.first));
+	try {
+		for (uint64_t offset = 0; offset < size; offset += buffer.size()) {
+			if (bctbx_file_read(file.first, buffer.data(), buffer.size(), (off_t)offset) < 0) {
+				throw EVFS_EXCEPTION << "read failed at offset " << offset;
+			}
+		}
+		if (!file.second->integrityTreeRootGet().empty() && !file.second->integrityTreeVerify()) {
+			throw EVFS_EXCEPTION << "chunks do not match the integrity tree";
+		}
+	} catch (...) {
+		bctbx_file_close(file.first);
+		throw;
+	}
+	bctbx_file_close(file.first);
+}
+
+int verify(const std::vector<std::string> &files, size_t threadCount) {
+	std::atomic<size_t> next{0};
+	std::atomic<int> ret{0};
+	std::mutex outputMutex;
+	auto worker = [&]() {
+		for (size_t i = next++; i < files.size(); i = next++) {
+			std::string result{"OK"};
+			try {
+				verifyFile(files[i]);
+			} catch (std::exception const &e) {
+				result = std::string{"FAILED "} + e.what();
+				ret = 1;
+			}
+			std::lock_guard<std::mutex> lock(outputMutex);
+			std::cout << files[i] << ": " << result << std::endl;
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < std::min(threadCount, files.size()); i++) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	return ret;
+}
+
+/**
+ * Copy the plain content of source to destination: the next block is read while the current one is written
+ */
+void copyContent(bctbx_vfs_file_t *source, bctbx_vfs_file_t *destination, size_t blockSize) {
+	const uint64_t size = static_cast<uint64_t>(bctbx_file_size(source));
+	std::array<std::vector<uint8_t>, 2> blocks{std::vector<uint8_t>(blockSize), std::vector<uint8_t>(blockSize)};
+	auto startRead = [&](size_t slot, uint64_t offset) {
+		return std::async(std::launch::async, bctbx_file_read, source, blocks[slot].data(),
+		                  static_cast<size_t>(std::min(static_cast<uint64_t>(blockSize), size - offset)),
+		                  (off_t)offset);
+	};
+	std::future<ssize_t> pendingRead;
+	size_t slot = 0;
+	if (size > 0) {
+		pendingRead = startRead(slot, 0);
+	}
+	for (uint64_t offset = 0; offset < size; offset += blockSize, slot ^= 1) {
+		ssize_t readSize = pendingRead.get();
+		if (readSize < 0) {
+			throw EVFS_EXCEPTION << "read failed at offset " << offset;
+		}
+		if (offset + blockSize < size) {
+			pendingRead = startRead(slot ^ 1, offset + blockSize);
+		}
+		if (bctbx_file_write(destination, blocks[slot].data(), static_cast<size_t>(readSize), (off_t)offset) !=
+		    readSize) {
+			if (pendingRead.valid()) pendingRead.wait();
+			throw EVFS_EXCEPTION << "write failed at offset " << offset;
+		}
+	}
+}
+
+int rewrite(const std::string &sourcePath, const std::string &destinationPath, NewFileSettings settings) {
+	const bool replace = destinationPath.empty();
+	const std::string targetPath = replace ? sourcePath + ".evfs_rewrite" : destinationPath;
+	if (fileExists(targetPath)) {
+		std::cerr << targetPath << " already exists" << std::endl;
+		return 1;
+	}
+	bctbx_vfs_file_t *source = nullptr;
+	bctbx_vfs_file_t *destination = nullptr;
+	try {
+		auto file = openFile(sourcePath, O_RDONLY);
+		source = file.first;
+		// what is not given is kept from the source
+		if (settings.suite == EncryptionSuite::unset) {
+			settings.suite = file.second->encryptionSuiteGet();
+			if (settings.suite == EncryptionSuite::plain) {
+				throw EVFS_EXCEPTION << sourcePath << " is plain, an encryption suite must be given";
+			}
+		}
+		if (settings.chunkSize == 0) {
+			settings.chunkSize = file.second->chunkSizeGet();
+		}
+		if (settings.secretMaterial.empty()) {
+			settings.secretMaterial = secretMaterial;
+		}
+		const size_t blockSize = std::max(ioBlockBytes / settings.chunkSize, size_t(1)) * settings.chunkSize;
+		createdFiles[targetPath] = settings;
+		destination = openFile(targetPath, O_RDWR | O_CREAT).first;
+		copyContent(source, destination, blockSize);
+		int syncRet = bctbx_file_sync(destination);
+		int closeRet = bctbx_file_close(destination);
+		destination = nullptr;
+		if (syncRet != BCTBX_VFS_OK || closeRet != BCTBX_VFS_OK) {
+			throw EVFS_EXCEPTION << "cannot write " << targetPath;
+		}
+		bctbx_file_close(source);
+		source = nullptr;
+	} catch (std::exception const &e) {
+		if (source != nullptr) bctbx_file_close(source);
+		if (destination != nullptr) bctbx_file_close(destination);
+		VfsEncryption::fileRemove(targetPath);
+		std::cerr << sourcePath << ": " << e.what() << std::endl;
+		return 1;
+	}
+
+	// the data file is renamed first, the source keeps its integrity tree file until it is replaced
+	if (replace && VfsEncryption::fileRename(targetPath, sourcePath) != 0) {
+		std::cerr << "cannot replace " << sourcePath << " by " << targetPath << std::endl;
+		return 1;
+	}
+	std::cout << sourcePath << ": rewritten as " << encryptionSuiteString(settings.suite) << " with "
+	          << settings.chunkSize << " bytes chunks" << std::endl;
+	return 0;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	bctbx_set_log_level(NULL, BCTBX_LOG_FATAL); // failures are reported by the tool itself
+	size_t threadCount = std::max(std::thread::hardware_concurrency(), 1U);
+	std::vector<std::string> args(argv + 1, argv + argc);
+	size_t i = 0;
+	try {
+		for (; i < args.size() && args[i][0] == '-'; i++) {
+			if (args[i] == "-k" && i + 1 < args.size()) {
+				secretMaterial = readKeyFile(args[++i]);
+			} else if (args[i] == "-j" && i + 1 < args.size()) {
+				threadCount = std::max(std::stoul(args[++i]), 1UL);
+			} else {
+				usage();
+				return 2;
+			}
+		}
+		if (i >= args.size()) {
+			usage();
+			return 2;
+		}
+		const std::string command = args[i++];
+		VfsEncryption::openCallbackSet(openCallback);
+
+		if (command == "stats" && i < args.size()) {
+			return stats(std::vector<std::string>(args.cbegin() + i, args.cend()));
+		}
+		if (command == "verify" && i < args.size()) {
+			return verify(std::vector<std::string>(args.cbegin() + i, args.cend()), threadCount);
+		}
+		if (command == "rewrite") {
+			NewFileSettings settings{};
+			for (; i < args.size() && args[i].compare(0, 2, "--") == 0; i++) {
+				if (args[i] == "--suite" && i + 1 < args.size()) {
+					settings.suite = parseSuite(args[++i]);
+				} else if (args[i] == "--chunk-size" && i + 1 < args.size()) {
+					settings.chunkSize = std::stoul(args[++i]);
+				} else if (args[i] == "--new-key" && i + 1 < args.size()) {
+					settings.secretMaterial = readKeyFile(args[++i]);
+				} else if (args[i] == "--size-journal") {
+					settings.sizeJournal = true;
+				} else if (args[i] == "--integrity-tree") {
+					settings.integrityTree = true;
+				} else {
+					usage();
+					return 2;
+				}
+			}
+			if (i + 1 == args.size() || i + 2 == args.size()) {
+				return rewrite(args[i], (i + 2 == args.size()) ? args[i + 1] : std::string{}, settings);
+			}
+		}
+	} catch (BctbxException const &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	} catch (std::logic_error const &) { // invalid number
+		usage();
+		return 2;
+	}
+	usage();
+	return 2;
+}